@@ -0,0 +1,345 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+/**
+ * Measures serialization and parsing of packets, which are sent over
+ * the network, at sizes they have in real traffic. Parsing goes the same
+ * way as for received datagram: parseCommPacket for communication
+ * packets, fromBuffer for data packets carried inside of them.
+ *
+ * Usage: codec_bench [iterations] [email packet size]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Logging.h"
+#include "Packet.h"
+
+namespace
+{
+
+using namespace pbote;
+
+/// Peers sent in one peer list, see MAX_PEERS_TO_SEND
+#define BENCH_PEERS 20
+#define BENCH_INDEX_ENTRIES 50
+#define BENCH_DELETION_ITEMS 20
+#define BENCH_HASHCASH_SIZE 64
+
+std::mt19937 rng (42);
+
+void
+random_bytes (uint8_t *buf, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+    buf[i] = (uint8_t)rng ();
+}
+
+std::vector<uint8_t>
+random_bytes (size_t len)
+{
+  std::vector<uint8_t> result (len);
+  random_bytes (result.data (), len);
+  return result;
+}
+
+/// Identity with NULL certificate, same as V4 peer list gives
+i2p::data::IdentityEx
+random_identity ()
+{
+  uint8_t buf[387] = {0};
+  random_bytes (buf, 384);
+
+  i2p::data::IdentityEx identity;
+  identity.FromBuffer (buf, sizeof (buf));
+  return identity;
+}
+
+template <typename packet_type>
+void
+fill_cid (packet_type &packet)
+{
+  random_bytes (packet.cid, 32);
+}
+
+double
+seconds_since (std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double> (std::chrono::steady_clock::now ()
+                                        - start)
+      .count ();
+}
+
+/**
+ * Runs toByte () and parse on the same packet
+ *
+ * @param parse Gets serialized packet as it comes from receiving thread,
+ *  returns false if it's not parsed
+ */
+template <typename packet_type, typename parse_type>
+void
+bench (const char *name, const packet_type &packet, parse_type parse,
+       size_t iterations)
+{
+  auto bytes = packet.toByte ();
+  if (!bytes)
+    {
+      printf ("%-22s broken packet, skipped\n", name);
+      return;
+    }
+
+  size_t size = bytes->size ();
+  auto queued = std::make_shared<PacketForQueue> (DEST_HANDLE_NONE,
+                                                  std::move (*bytes));
+  if (!parse (queued))
+    {
+      printf ("%-22s packet is not parsed, skipped\n", name);
+      return;
+    }
+
+  size_t total = 0;
+  auto start = std::chrono::steady_clock::now ();
+  for (size_t i = 0; i < iterations; i++)
+    {
+      auto result = packet.toByte ();
+      total += result ? result->size () : 0;
+      if (result)
+        util::recycle_buffer (std::move (*result));
+    }
+  double encode = seconds_since (start);
+
+  size_t failed = 0;
+  start = std::chrono::steady_clock::now ();
+  for (size_t i = 0; i < iterations; i++)
+    {
+      if (!parse (queued))
+        failed++;
+    }
+  double decode = seconds_since (start);
+
+  printf ("%-22s %6zu B  encode: %9.0f op/s %8.1f MB/s"
+          "  decode: %9.0f op/s %8.1f MB/s%s\n",
+          name, size, iterations / encode, total / encode / 1e6,
+          iterations / decode, iterations * size / decode / 1e6,
+          failed ? "  (parse failed)" : "");
+}
+
+/// Parses communication packet the way packet handler gets it
+template <typename packet_type, typename... Args>
+bool
+parse_comm (const sp_queue_pkt &queued, Args... args)
+{
+  auto comm = parseCommPacket (queued);
+  if (!comm)
+    return false;
+
+  packet_type packet;
+  return packet.from_comm_packet (*comm, args...);
+}
+
+template <typename packet_type>
+bool
+parse_buffer (const sp_queue_pkt &queued)
+{
+  packet_type packet;
+  return packet.fromBuffer (queued->payload.data (), queued->payload.size (),
+                            true);
+}
+
+EmailEncryptedPacket
+make_email (size_t size)
+{
+  EmailEncryptedPacket email;
+  email.stored_time = 1650000000;
+  random_bytes (email.delete_hash, 32);
+  email.alg = 2;
+  email.edata = random_bytes (size);
+  email.length = (uint16_t)email.edata.size ();
+
+  /// Key is hash of length[2] + data, parser checks it
+  std::vector<uint8_t> hashed (2 + email.edata.size ());
+  ByteWriter writer (hashed.data (), hashed.size ());
+  writer.u16 (email.length);
+  writer.bytes (email.edata);
+  SHA256 (hashed.data (), hashed.size (), email.key);
+
+  return email;
+}
+
+IndexPacket
+make_index ()
+{
+  IndexPacket index;
+  random_bytes (index.hash, 32);
+  for (size_t i = 0; i < BENCH_INDEX_ENTRIES; i++)
+    {
+      IndexPacket::Entry entry;
+      random_bytes (entry.key, 32);
+      random_bytes (entry.dv, 32);
+      entry.time = 1650000000 + (int32_t)i;
+      index.data.push_back (entry);
+    }
+  index.nump = (uint32_t)index.data.size ();
+  return index;
+}
+
+DeletionInfoPacket
+make_deletion_info ()
+{
+  DeletionInfoPacket deletion;
+  for (size_t i = 0; i < BENCH_DELETION_ITEMS; i++)
+    {
+      DeletionInfoPacket::item item;
+      random_bytes (item.key, 32);
+      random_bytes (item.DA, 32);
+      item.time = 1650000000 + (int32_t)i;
+      deletion.data.push_back (item);
+    }
+  deletion.count = (uint32_t)deletion.data.size ();
+  return deletion;
+}
+
+template <typename peer_list_type>
+peer_list_type
+make_peer_list ()
+{
+  peer_list_type peers;
+  for (size_t i = 0; i < BENCH_PEERS; i++)
+    peers.data.push_back (random_identity ());
+  peers.count = (uint16_t)peers.data.size ();
+  return peers;
+}
+
+ResponsePacket
+make_response (std::vector<uint8_t> payload)
+{
+  ResponsePacket response;
+  fill_cid (response);
+  response.status = StatusCode::OK;
+  response.length = (uint16_t)payload.size ();
+  response.data = SharedBuffer (std::move (payload));
+  return response;
+}
+
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  size_t iterations = argc > 1 ? std::strtoul (argv[1], nullptr, 10) : 20000;
+  size_t email_size = argc > 2 ? std::strtoul (argv[2], nullptr, 10) : 30000;
+
+  /// Parsers report every packet, it's not what is measured here
+  log::Logger ().SetLogLevel ("none");
+
+  printf ("iterations: %zu, email packet data: %zu B\n", iterations,
+          email_size);
+
+  auto email = make_email (email_size);
+  auto index = make_index ();
+  auto deletion = make_deletion_info ();
+  auto peers_v4 = make_peer_list<PeerListPacketV4> ();
+  auto peers_v5 = make_peer_list<PeerListPacketV5> ();
+
+  bench ("EmailEncryptedPacket", email, parse_buffer<EmailEncryptedPacket>,
+         iterations);
+  bench ("IndexPacket", index, parse_buffer<IndexPacket>, iterations);
+  bench ("DeletionInfoPacket", deletion, parse_buffer<DeletionInfoPacket>,
+         iterations);
+  bench ("PeerListPacketV4", peers_v4, parse_buffer<PeerListPacketV4>,
+         iterations);
+  bench ("PeerListPacketV5", peers_v5, parse_buffer<PeerListPacketV5>,
+         iterations);
+
+  StoreRequestPacket store;
+  fill_cid (store);
+  store.hashcash = SharedBuffer (random_bytes (BENCH_HASHCASH_SIZE));
+  store.hc_length = (uint16_t)store.hashcash.size ();
+  store.data = SharedBuffer (*email.toByte ());
+  store.length = (uint16_t)store.data.size ();
+  bench ("StoreRequestPacket", store,
+         [] (const sp_queue_pkt &queued)
+           { return parse_comm<StoreRequestPacket> (queued, true); },
+         iterations);
+
+  bench ("ResponsePacket (email)", make_response (*email.toByte ()),
+         [] (const sp_queue_pkt &queued)
+           { return parse_comm<ResponsePacket> (queued, true); },
+         iterations);
+  bench ("ResponsePacket (index)", make_response (*index.toByte ()),
+         [] (const sp_queue_pkt &queued)
+           { return parse_comm<ResponsePacket> (queued, true); },
+         iterations);
+  bench ("ResponsePacket (peers)", make_response (*peers_v5.toByte ()),
+         [] (const sp_queue_pkt &queued)
+           { return parse_comm<ResponsePacket> (queued, true); },
+         iterations);
+
+  RetrieveRequestPacket retrieve;
+  fill_cid (retrieve);
+  retrieve.data_type = DataE;
+  random_bytes (retrieve.key, 32);
+  bench ("RetrieveRequestPacket", retrieve,
+         [] (const sp_queue_pkt &queued)
+           { return parse_comm<RetrieveRequestPacket> (queued); },
+         iterations);
+
+  DeletionQueryPacket query;
+  fill_cid (query);
+  random_bytes (query.dht_key, 32);
+  bench ("DeletionQueryPacket", query,
+         [] (const sp_queue_pkt &queued)
+           { return parse_comm<DeletionQueryPacket> (queued); },
+         iterations);
+
+  EmailDeleteRequestPacket email_delete;
+  fill_cid (email_delete);
+  random_bytes (email_delete.key, 32);
+  random_bytes (email_delete.DA, 32);
+  bench ("EmailDeleteRequest", email_delete,
+         [] (const sp_queue_pkt &queued)
+           { return parse_comm<EmailDeleteRequestPacket> (queued); },
+         iterations);
+
+  IndexDeleteRequestPacket index_delete;
+  fill_cid (index_delete);
+  random_bytes (index_delete.dht_key, 32);
+  for (size_t i = 0; i < BENCH_DELETION_ITEMS; i++)
+    {
+      IndexDeleteRequestPacket::item item;
+      random_bytes (item.key, 32);
+      random_bytes (item.da, 32);
+      index_delete.data.push_back (item);
+    }
+  index_delete.count = (uint8_t)index_delete.data.size ();
+  bench ("IndexDeleteRequest", index_delete,
+         [] (const sp_queue_pkt &queued)
+           { return parse_comm<IndexDeleteRequestPacket> (queued); },
+         iterations);
+
+  PeerListRequestPacket peer_request;
+  fill_cid (peer_request);
+  bench ("PeerListRequestPacket", peer_request,
+         parse_buffer<PeerListRequestPacket>, iterations);
+
+  FindClosePeersRequestPacket find_close;
+  fill_cid (find_close);
+  random_bytes (find_close.key, 32);
+  bench ("FindClosePeersRequest", find_close,
+         [] (const sp_queue_pkt &queued)
+           { return parseCommPacket (queued) != nullptr; },
+         iterations);
+
+  return 0;
+}
@@ -0,0 +1,152 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+/**
+ * Compares lock-free ring queue with mutex and std::queue one, which was
+ * used before, on the same producers/consumers load.
+ *
+ * Usage: queue_bench [producers] [consumers] [elements per producer]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Queue.h"
+
+namespace
+{
+
+using element_type = std::shared_ptr<int>;
+
+/// Previous queue, kept here only for comparison
+class MutexQueue
+{
+public:
+  bool
+  Put (element_type e)
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+    m_queue.push (std::move (e));
+    m_non_empty.notify_one ();
+    return true;
+  }
+
+  element_type
+  GetNextWithTimeout (int msec)
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+    if (m_queue.empty ())
+      m_non_empty.wait_for (l, std::chrono::milliseconds (msec));
+    if (m_queue.empty ())
+      return nullptr;
+
+    auto e = std::move (m_queue.front ());
+    m_queue.pop ();
+    return e;
+  }
+
+  void
+  WakeUp ()
+  {
+    m_non_empty.notify_all ();
+  }
+
+private:
+  std::queue<element_type> m_queue;
+  std::mutex m_mutex;
+  std::condition_variable m_non_empty;
+};
+
+template <typename queue_type>
+double
+run (queue_type &queue, size_t producers, size_t consumers, size_t count)
+{
+  /// Elements are created before start, allocation is not measured
+  std::vector<std::vector<element_type> > elements (producers);
+  for (auto &list : elements)
+    for (size_t i = 0; i < count; i++)
+      list.push_back (std::make_shared<int> ((int)i));
+
+  const size_t total = producers * count;
+  std::atomic<size_t> consumed (0);
+  std::vector<std::thread> threads;
+
+  auto started = std::chrono::steady_clock::now ();
+
+  for (size_t c = 0; c < consumers; c++)
+    threads.emplace_back ([&] {
+      while (consumed.load (std::memory_order_relaxed) < total)
+        {
+          if (queue.GetNextWithTimeout (10))
+            consumed.fetch_add (1, std::memory_order_relaxed);
+        }
+      queue.WakeUp ();
+    });
+
+  for (size_t p = 0; p < producers; p++)
+    threads.emplace_back ([&, p] {
+      for (auto &e : elements[p])
+        queue.Put (std::move (e));
+    });
+
+  for (auto &thread : threads)
+    thread.join ();
+
+  auto elapsed = std::chrono::duration<double> (
+      std::chrono::steady_clock::now () - started);
+
+  return total / elapsed.count ();
+}
+
+size_t
+arg (int argc, char **argv, int i, size_t def)
+{
+  return argc > i ? std::strtoul (argv[i], nullptr, 10) : def;
+}
+
+} // namespace
+
+int
+main (int argc, char **argv)
+{
+  size_t producers = arg (argc, argv, 1, 4);
+  size_t consumers = arg (argc, argv, 2, 2);
+  size_t count = arg (argc, argv, 3, 250000);
+
+  if (producers == 0 || consumers == 0 || count == 0)
+    {
+      std::fprintf (stderr, "Usage: %s [producers] [consumers] [count]\n",
+                    argv[0]);
+      return 1;
+    }
+
+  std::printf ("producers: %zu, consumers: %zu, elements: %zu\n", producers,
+               consumers, producers * count);
+
+  MutexQueue mutex_queue;
+  double mutex_rate = run (mutex_queue, producers, consumers, count);
+  std::printf ("mutex queue: %12.0f elements/s\n", mutex_rate);
+
+  /// Blocking policy, so nothing is dropped and both queues move all
+  pbote::util::Queue<element_type> ring_queue (QUEUE_DEFAULT_CAPACITY,
+                                               pbote::util::eQueueBlock);
+  double ring_rate = run (ring_queue, producers, consumers, count);
+  std::printf ("ring queue:  %12.0f elements/s (%.2fx)\n", ring_rate,
+               ring_rate / mutex_rate);
+
+  return 0;
+}
@@ -0,0 +1,194 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+/**
+ * libFuzzer target for packet parsers. First byte of input selects
+ * parser, the rest is datagram or payload given to it. Parsed packet is
+ * serialized back, so writers get fuzzed values too.
+ *
+ * Usage: packet_fuzz [libFuzzer options] [corpus dir]
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Logging.h"
+#include "Packet.h"
+
+namespace
+{
+
+using namespace pbote;
+
+enum fuzz_target : uint8_t
+{
+  /// parseCommPacket and from_comm_packet of its type
+  FUZZ_COMM_PACKET,
+  FUZZ_EMAIL_ENCRYPTED,
+  FUZZ_INDEX,
+  FUZZ_DELETION_INFO,
+  FUZZ_PEER_LIST_V4,
+  FUZZ_PEER_LIST_V5,
+  FUZZ_RESPONSE,
+  FUZZ_PEER_LIST_REQUEST,
+  FUZZ_EMAIL_DELETE_REQUEST,
+  FUZZ_INDEX_DELETE_REQUEST,
+  FUZZ_TARGETS_COUNT
+};
+
+template <typename packet_type>
+void
+from_buffer (const uint8_t *data, size_t size)
+{
+  packet_type packet;
+  if (packet.fromBuffer (data, size, true))
+    packet.toByte ();
+}
+
+template <typename packet_type, typename... Args>
+void
+from_comm (const CommunicationPacket &comm, Args... args)
+{
+  packet_type packet;
+  if (packet.from_comm_packet (comm, args...))
+    packet.toByte ();
+}
+
+/// Data packet carried in response, picked by its type as requester does
+void
+from_response_data (const ResponsePacket &response)
+{
+  if (response.status != StatusCode::OK || response.data.size () < 2)
+    return;
+
+  const uint8_t *data = response.data.data ();
+  size_t size = response.data.size ();
+
+  switch (data[0])
+    {
+    case type::DataE:
+      from_buffer<EmailEncryptedPacket> (data, size);
+      break;
+    case type::DataI:
+      from_buffer<IndexPacket> (data, size);
+      break;
+    case type::DataT:
+      from_buffer<DeletionInfoPacket> (data, size);
+      break;
+    case type::DataL:
+      if (data[1] == version::V4)
+        from_buffer<PeerListPacketV4> (data, size);
+      else
+        from_buffer<PeerListPacketV5> (data, size);
+      break;
+    default:
+      break;
+    }
+}
+
+void
+comm_packet (const uint8_t *data, size_t size)
+{
+  auto queued = std::make_shared<PacketForQueue> (DEST_HANDLE_NONE, data,
+                                                  size);
+  auto comm = parseCommPacket (queued);
+  if (!comm)
+    return;
+
+  switch (comm->type)
+    {
+    case type::CommN:
+      {
+        ResponsePacket response;
+        if (response.from_comm_packet (*comm, true))
+          {
+            response.toByte ();
+            from_response_data (response);
+          }
+        break;
+      }
+    case type::CommQ:
+      from_comm<RetrieveRequestPacket> (*comm);
+      break;
+    case type::CommY:
+      from_comm<DeletionQueryPacket> (*comm);
+      break;
+    case type::CommS:
+      from_comm<StoreRequestPacket> (*comm, true);
+      break;
+    case type::CommD:
+      from_comm<EmailDeleteRequestPacket> (*comm);
+      break;
+    case type::CommX:
+      from_comm<IndexDeleteRequestPacket> (*comm);
+      break;
+    default:
+      break;
+    }
+}
+
+} // namespace
+
+extern "C" int
+LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+  static bool initialized = false;
+  if (!initialized)
+    {
+      /// Every rejected input is logged otherwise
+      log::Logger ().SetLogLevel ("none");
+      initialized = true;
+    }
+
+  if (size < 1)
+    return 0;
+
+  uint8_t target = data[0] % FUZZ_TARGETS_COUNT;
+  data++;
+  size--;
+
+  switch (target)
+    {
+    case FUZZ_COMM_PACKET:
+      comm_packet (data, size);
+      break;
+    case FUZZ_EMAIL_ENCRYPTED:
+      from_buffer<EmailEncryptedPacket> (data, size);
+      break;
+    case FUZZ_INDEX:
+      from_buffer<IndexPacket> (data, size);
+      break;
+    case FUZZ_DELETION_INFO:
+      from_buffer<DeletionInfoPacket> (data, size);
+      break;
+    case FUZZ_PEER_LIST_V4:
+      from_buffer<PeerListPacketV4> (data, size);
+      break;
+    case FUZZ_PEER_LIST_V5:
+      from_buffer<PeerListPacketV5> (data, size);
+      break;
+    case FUZZ_RESPONSE:
+      from_buffer<ResponsePacket> (data, size);
+      break;
+    case FUZZ_PEER_LIST_REQUEST:
+      from_buffer<PeerListRequestPacket> (data, size);
+      break;
+    case FUZZ_EMAIL_DELETE_REQUEST:
+      from_buffer<EmailDeleteRequestPacket> (data, size);
+      break;
+    case FUZZ_INDEX_DELETE_REQUEST:
+      from_buffer<IndexDeleteRequestPacket> (data, size);
+      break;
+    default:
+      break;
+    }
+
+  return 0;
+}
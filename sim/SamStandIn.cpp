@@ -0,0 +1,740 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+/**
+ * Loopback stand-in for I2P router SAM bridge, for runs of many pboted
+ * nodes on one host without I2P network. Only what DatagramSession
+ * needs is served:
+ *
+ *   TCP: HELLO VERSION, DEST GENERATE, SESSION CREATE STYLE=DATAGRAM,
+ *        NAMING LOOKUP, PING
+ *   UDP: "3.x <session ID> <destination>\n<payload>" from nodes,
+ *        "<sender destination>\n<payload>" to node's PORT/HOST
+ *
+ * Destinations are real I2P keys, so node stores them as usual. Without
+ * SIGNATURE_TYPE keys are EdDSA, as on live network. Session lives while
+ * its TCP connection is open.
+ *
+ * Datagrams between nodes go through emulated link: sender's uplink has
+ * limited bandwidth and queue, then datagram is delayed by latency with
+ * jitter or lost with given probability.
+ *
+ * Usage: sam_standin [--tcp 7656] [--udp 7655] [--latency 500]
+ *                    [--jitter 100] [--loss 0.01] [--bandwidth 0]
+ *                    [--queue 2000] [--stats 10] [--seed 1]
+ *                    [--sessions file]
+ *
+ *   latency, jitter, queue - msec; bandwidth - bytes/sec of every node
+ *   uplink, 0 is unlimited; loss - from 0 to 1; stats - period of stats
+ *   output in sec; sessions - file where "<ID> <destination>" of every
+ *   created session is appended.
+ */
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// libi2pd
+#include "Identity.h"
+
+namespace
+{
+
+#define STANDIN_MAX_EVENTS 64
+/// Max SAM datagram is 31744 bytes, with header it's a bit more
+#define STANDIN_MAX_DATAGRAM 65536
+/// Longest SAM command line we take, private key is below 1 KiB
+#define STANDIN_MAX_LINE 8192
+/// Socket buffers of datagram socket, so bursts from many nodes are not
+/// dropped by kernel before link emulation sees them
+#define STANDIN_UDP_BUFFER (8 * 1024 * 1024)
+
+using clock_type = std::chrono::steady_clock;
+
+struct link_config
+{
+  long latency_ms = 500;
+  long jitter_ms = 100;
+  double loss = 0.01;
+  /// Bytes per second of node uplink, 0 - unlimited
+  double bandwidth = 0;
+  /// Datagrams which would wait in uplink longer are dropped
+  long queue_ms = 2000;
+};
+
+struct link_stats
+{
+  uint64_t received = 0;
+  uint64_t delivered = 0;
+  uint64_t bytes = 0;
+  uint64_t lost = 0;
+  uint64_t congested = 0;
+  uint64_t unknown = 0;
+  uint64_t malformed = 0;
+};
+
+struct session
+{
+  std::string id;
+  std::string pub;
+  std::string priv;
+  /// Where datagrams for session are forwarded, port 0 - nowhere
+  struct sockaddr_in forward{};
+  int client_fd = -1;
+  /// Time when uplink finishes sending of queued datagrams
+  clock_type::time_point uplink_free;
+};
+
+struct delivery
+{
+  clock_type::time_point due;
+  uint64_t order;
+  struct sockaddr_in to;
+  std::string datagram;
+
+  bool
+  operator> (const delivery &other) const
+  {
+    return due != other.due ? due > other.due : order > other.order;
+  }
+};
+
+struct client
+{
+  std::string input;
+  struct sockaddr_in address{};
+  /// Session created by this connection
+  std::string session_id;
+};
+
+volatile sig_atomic_t stop_requested = 0;
+
+void
+on_signal (int)
+{
+  stop_requested = 1;
+}
+
+/// KEY=VALUE pairs after command words, value can be quoted
+std::map<std::string, std::string>
+parse_options (const std::string &line)
+{
+  std::map<std::string, std::string> options;
+  std::istringstream stream (line);
+  std::string token;
+
+  while (stream >> token)
+    {
+      size_t eq = token.find ('=');
+      if (eq == std::string::npos)
+        continue;
+
+      std::string value = token.substr (eq + 1);
+      if (value.size () >= 2 && value.front () == '"' && value.back () == '"')
+        value = value.substr (1, value.size () - 2);
+
+      options[token.substr (0, eq)] = value;
+    }
+
+  return options;
+}
+
+class StandIn
+{
+public:
+  StandIn (const link_config &config, uint32_t seed)
+    : m_config (config), m_rng (seed), m_epoll_fd (-1), m_tcp_fd (-1),
+      m_udp_fd (-1), m_sessions_file (nullptr), m_order (0)
+  {
+  }
+
+  ~StandIn ()
+  {
+    for (auto &entry : m_clients)
+      close (entry.first);
+
+    if (m_tcp_fd != -1)
+      close (m_tcp_fd);
+    if (m_udp_fd != -1)
+      close (m_udp_fd);
+    if (m_epoll_fd != -1)
+      close (m_epoll_fd);
+    if (m_sessions_file)
+      fclose (m_sessions_file);
+  }
+
+  bool
+  start (uint16_t tcp_port, uint16_t udp_port,
+         const std::string &sessions_path)
+  {
+    if (!sessions_path.empty ())
+      {
+        m_sessions_file = fopen (sessions_path.c_str (), "w");
+        if (!m_sessions_file)
+          {
+            fprintf (stderr, "Can't open %s: %s\n", sessions_path.c_str (),
+                     strerror (errno));
+            return false;
+          }
+      }
+
+    m_epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    m_tcp_fd = open_socket (SOCK_STREAM, tcp_port);
+    m_udp_fd = open_socket (SOCK_DGRAM, udp_port);
+
+    if (m_epoll_fd == -1 || m_tcp_fd == -1 || m_udp_fd == -1)
+      return false;
+
+    if (listen (m_tcp_fd, 128) == -1)
+      {
+        fprintf (stderr, "Listen error: %s\n", strerror (errno));
+        return false;
+      }
+
+    watch (m_tcp_fd);
+    watch (m_udp_fd);
+
+    printf ("SAM stand-in: TCP %u, UDP %u, latency %ld+-%ld ms, loss %.3f, "
+            "bandwidth %.0f B/s, queue %ld ms\n",
+            tcp_port, udp_port, m_config.latency_ms, m_config.jitter_ms,
+            m_config.loss, m_config.bandwidth, m_config.queue_ms);
+    fflush (stdout);
+    return true;
+  }
+
+  void
+  run (long stats_sec)
+  {
+    struct epoll_event events[STANDIN_MAX_EVENTS];
+    auto next_stats = clock_type::now () + std::chrono::seconds (stats_sec);
+
+    while (!stop_requested)
+      {
+        auto now = clock_type::now ();
+        auto wake = next_stats;
+        if (!m_pending.empty ())
+          wake = std::min (wake, m_pending.top ().due);
+
+        long timeout = std::chrono::duration_cast<std::chrono::milliseconds> (
+                           wake - now)
+                           .count ();
+        if (timeout < 0)
+          timeout = 0;
+
+        int count = epoll_wait (m_epoll_fd, events, STANDIN_MAX_EVENTS,
+                                (int)std::min (timeout, 1000L));
+        if (count == -1 && errno != EINTR)
+          {
+            fprintf (stderr, "Wait error: %s\n", strerror (errno));
+            break;
+          }
+
+        for (int i = 0; i < count; i++)
+          {
+            int fd = events[i].data.fd;
+            if (fd == m_tcp_fd)
+              accept_client ();
+            else if (fd == m_udp_fd)
+              receive_datagrams ();
+            else
+              read_client (fd);
+          }
+
+        deliver_due ();
+
+        if (clock_type::now () >= next_stats)
+          {
+            print_stats ();
+            next_stats = clock_type::now () + std::chrono::seconds (stats_sec);
+          }
+      }
+
+    print_stats ();
+  }
+
+private:
+  int
+  open_socket (int type, uint16_t port)
+  {
+    int fd = socket (AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      {
+        fprintf (stderr, "Socket error: %s\n", strerror (errno));
+        return -1;
+      }
+
+    int on = 1;
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+
+    if (type == SOCK_DGRAM)
+      {
+        int size = STANDIN_UDP_BUFFER;
+        setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+        setsockopt (fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size));
+      }
+
+    struct sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons (port);
+    address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    if (bind (fd, (struct sockaddr *)&address, sizeof (address)) == -1)
+      {
+        fprintf (stderr, "Bind to port %u error: %s\n", port,
+                 strerror (errno));
+        close (fd);
+        return -1;
+      }
+
+    return fd;
+  }
+
+  void
+  watch (int fd)
+  {
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl (m_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  void
+  accept_client ()
+  {
+    struct sockaddr_in address{};
+    socklen_t len = sizeof (address);
+    int fd = accept4 (m_tcp_fd, (struct sockaddr *)&address, &len,
+                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1)
+      return;
+
+    m_clients[fd].address = address;
+    watch (fd);
+  }
+
+  void
+  close_client (int fd)
+  {
+    auto it = m_clients.find (fd);
+    if (it == m_clients.end ())
+      return;
+
+    /// Session is closed with its control connection, as in SAM
+    if (!it->second.session_id.empty ())
+      {
+        auto found = m_sessions.find (it->second.session_id);
+        if (found != m_sessions.end ())
+          {
+            m_by_pub.erase (found->second.pub);
+            m_sessions.erase (found);
+          }
+      }
+
+    epoll_ctl (m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close (fd);
+    m_clients.erase (it);
+  }
+
+  void
+  read_client (int fd)
+  {
+    char buf[4096];
+    ssize_t len = recv (fd, buf, sizeof (buf), 0);
+    if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR))
+      {
+        close_client (fd);
+        return;
+      }
+    if (len < 0)
+      return;
+
+    auto &input = m_clients[fd].input;
+    input.append (buf, (size_t)len);
+
+    size_t eol;
+    while ((eol = input.find ('\n')) != std::string::npos)
+      {
+        std::string line = input.substr (0, eol);
+        input.erase (0, eol + 1);
+        if (!line.empty () && line.back () == '\r')
+          line.pop_back ();
+
+        if (!command (fd, line))
+          {
+            close_client (fd);
+            return;
+          }
+      }
+
+    if (input.size () > STANDIN_MAX_LINE)
+      close_client (fd);
+  }
+
+  /// Answers are short, socket buffer takes them whole
+  bool
+  answer (int fd, const std::string &line)
+  {
+    std::string data = line + "\n";
+    return send (fd, data.data (), data.size (), MSG_NOSIGNAL)
+           == (ssize_t)data.size ();
+  }
+
+  bool
+  command (int fd, const std::string &line)
+  {
+    auto options = parse_options (line);
+
+    if (line.rfind ("HELLO VERSION", 0) == 0)
+      return answer (fd, "HELLO REPLY RESULT=OK VERSION=3.1");
+
+    if (line.rfind ("DEST GENERATE", 0) == 0)
+      {
+        std::string pub, priv;
+        generate_keys (options["SIGNATURE_TYPE"], pub, priv);
+        return answer (fd, "DEST REPLY PUB=" + pub + " PRIV=" + priv);
+      }
+
+    if (line.rfind ("SESSION CREATE", 0) == 0)
+      return create_session (fd, options);
+
+    if (line.rfind ("NAMING LOOKUP", 0) == 0)
+      return lookup (fd, options["NAME"]);
+
+    if (line.rfind ("PING", 0) == 0)
+      return answer (fd, "PONG" + line.substr (4));
+
+    if (line.rfind ("QUIT", 0) == 0)
+      return false;
+
+    return answer (fd, "SESSION STATUS RESULT=I2P_ERROR MESSAGE=\"Unsupported\"");
+  }
+
+  void
+  generate_keys (const std::string &signature_type, std::string &pub,
+                 std::string &priv)
+  {
+    /// Same as keys of bootstrap nodes, SAM default DSA is not used there
+    i2p::data::SigningKeyType type
+        = i2p::data::SIGNING_KEY_TYPE_EDDSA_SHA512_ED25519;
+    if (!signature_type.empty ())
+      type = (i2p::data::SigningKeyType)std::strtoul (signature_type.c_str (),
+                                                      nullptr, 10);
+
+    auto keys = i2p::data::PrivateKeys::CreateRandomKeys (type);
+    pub = keys.GetPublic ()->ToBase64 ();
+    priv = keys.ToBase64 ();
+  }
+
+  bool
+  create_session (int fd, std::map<std::string, std::string> &options)
+  {
+    auto &owner = m_clients[fd];
+    const std::string &id = options["ID"];
+
+    if (options["STYLE"] != "DATAGRAM")
+      return answer (fd, "SESSION STATUS RESULT=I2P_ERROR "
+                         "MESSAGE=\"Only DATAGRAM style is emulated\"");
+
+    if (id.empty () || !owner.session_id.empty ()
+        || m_sessions.count (id) > 0)
+      return answer (fd, "SESSION STATUS RESULT=DUPLICATED_ID");
+
+    session created;
+    created.id = id;
+    created.client_fd = fd;
+
+    const std::string &destination = options["DESTINATION"];
+    if (destination.empty () || destination == "TRANSIENT")
+      generate_keys (options["SIGNATURE_TYPE"], created.pub, created.priv);
+    else
+      {
+        i2p::data::PrivateKeys keys;
+        if (keys.FromBase64 (destination) == 0)
+          return answer (fd, "SESSION STATUS RESULT=INVALID_KEY");
+
+        created.pub = keys.GetPublic ()->ToBase64 ();
+        created.priv = destination;
+      }
+
+    if (m_by_pub.count (created.pub) > 0)
+      return answer (fd, "SESSION STATUS RESULT=DUPLICATED_DEST");
+
+    /// Forward address defaults to host of control connection
+    created.forward = owner.address;
+    created.forward.sin_port = htons ((uint16_t)std::strtoul (
+        options["PORT"].c_str (), nullptr, 10));
+    if (!options["HOST"].empty ())
+      inet_pton (AF_INET, options["HOST"].c_str (),
+                 &created.forward.sin_addr);
+    /// Nodes listen on 0.0.0.0 by default, it's not an address to send to
+    if (created.forward.sin_addr.s_addr == htonl (INADDR_ANY))
+      created.forward.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    owner.session_id = id;
+    m_by_pub[created.pub] = id;
+
+    if (m_sessions_file)
+      {
+        fprintf (m_sessions_file, "%s %s\n", id.c_str (), created.pub.c_str ());
+        fflush (m_sessions_file);
+      }
+
+    std::string priv = created.priv;
+    m_sessions.emplace (id, std::move (created));
+
+    printf ("Session created: %s, sessions: %zu\n", id.c_str (),
+            m_sessions.size ());
+    fflush (stdout);
+
+    return answer (fd, "SESSION STATUS RESULT=OK DESTINATION=" + priv);
+  }
+
+  bool
+  lookup (int fd, const std::string &name)
+  {
+    if (name == "ME")
+      {
+        auto found = m_sessions.find (m_clients[fd].session_id);
+        if (found != m_sessions.end ())
+          return answer (fd, "NAMING REPLY RESULT=OK NAME=ME VALUE="
+                                 + found->second.pub);
+      }
+    else if (m_by_pub.count (name) > 0)
+      return answer (fd, "NAMING REPLY RESULT=OK NAME=" + name
+                             + " VALUE=" + name);
+    else
+      {
+        for (const auto &entry : m_sessions)
+          {
+            i2p::data::IdentityEx identity;
+            identity.FromBase64 (entry.second.pub);
+            if (identity.GetIdentHash ().ToBase32 () + ".b32.i2p" == name)
+              return answer (fd, "NAMING REPLY RESULT=OK NAME=" + name
+                                     + " VALUE=" + entry.second.pub);
+          }
+      }
+
+    return answer (fd, "NAMING REPLY RESULT=KEY_NOT_FOUND NAME=" + name);
+  }
+
+  void
+  receive_datagrams ()
+  {
+    static char buf[STANDIN_MAX_DATAGRAM];
+
+    while (true)
+      {
+        ssize_t len = recv (m_udp_fd, buf, sizeof (buf), 0);
+        if (len < 0)
+          return;
+
+        m_stats.received++;
+        route ({ buf, (size_t)len });
+      }
+  }
+
+  void
+  route (const std::string &datagram)
+  {
+    size_t eol = datagram.find ('\n');
+    if (eol == std::string::npos)
+      {
+        m_stats.malformed++;
+        return;
+      }
+
+    /// "3.x <session ID> <destination> [options]"
+    std::istringstream header (datagram.substr (0, eol));
+    std::string version, id, destination;
+    header >> version >> id >> destination;
+
+    auto sender = m_sessions.find (id);
+    auto target_id = m_by_pub.find (destination);
+    if (version.rfind ("3.", 0) != 0 || sender == m_sessions.end ())
+      {
+        m_stats.malformed++;
+        return;
+      }
+
+    if (target_id == m_by_pub.end ())
+      {
+        m_stats.unknown++;
+        return;
+      }
+
+    const session &target = m_sessions[target_id->second];
+    if (target.forward.sin_port == 0)
+      {
+        m_stats.unknown++;
+        return;
+      }
+
+    size_t payload_len = datagram.size () - eol - 1;
+    auto now = clock_type::now ();
+
+    /// Uplink sends datagrams one by one with its bandwidth
+    auto &uplink = sender->second.uplink_free;
+    if (uplink < now)
+      uplink = now;
+
+    if (m_config.bandwidth > 0)
+      {
+        if (uplink - now > std::chrono::milliseconds (m_config.queue_ms))
+          {
+            m_stats.congested++;
+            return;
+          }
+
+        uplink += std::chrono::microseconds (
+            (int64_t)(payload_len * 1e6 / m_config.bandwidth));
+      }
+
+    if (std::uniform_real_distribution<double> (0, 1) (m_rng) < m_config.loss)
+      {
+        m_stats.lost++;
+        return;
+      }
+
+    long delay = m_config.latency_ms;
+    if (m_config.jitter_ms > 0)
+      delay += std::uniform_int_distribution<long> (
+          -m_config.jitter_ms, m_config.jitter_ms) (m_rng);
+
+    delivery next;
+    next.due = uplink + std::chrono::milliseconds (std::max (delay, 0L));
+    next.order = m_order++;
+    next.to = target.forward;
+    next.datagram = sender->second.pub + "\n" + datagram.substr (eol + 1);
+    m_pending.push (std::move (next));
+  }
+
+  void
+  deliver_due ()
+  {
+    auto now = clock_type::now ();
+    while (!m_pending.empty () && m_pending.top ().due <= now)
+      {
+        const delivery &next = m_pending.top ();
+        ssize_t sent = sendto (m_udp_fd, next.datagram.data (),
+                               next.datagram.size (), 0,
+                               (const struct sockaddr *)&next.to,
+                               sizeof (next.to));
+        if (sent > 0)
+          {
+            m_stats.delivered++;
+            m_stats.bytes += (uint64_t)sent;
+          }
+
+        m_pending.pop ();
+      }
+  }
+
+  void
+  print_stats ()
+  {
+    printf ("sessions: %zu, received: %llu, delivered: %llu (%llu B), "
+            "in flight: %zu, lost: %llu, congested: %llu, unknown: %llu, "
+            "malformed: %llu\n",
+            m_sessions.size (), (unsigned long long)m_stats.received,
+            (unsigned long long)m_stats.delivered,
+            (unsigned long long)m_stats.bytes, m_pending.size (),
+            (unsigned long long)m_stats.lost,
+            (unsigned long long)m_stats.congested,
+            (unsigned long long)m_stats.unknown,
+            (unsigned long long)m_stats.malformed);
+    fflush (stdout);
+  }
+
+  link_config m_config;
+  link_stats m_stats;
+  std::mt19937 m_rng;
+
+  int m_epoll_fd, m_tcp_fd, m_udp_fd;
+  FILE *m_sessions_file;
+
+  std::map<int, client> m_clients;
+  std::map<std::string, session> m_sessions;
+  /// Session ID by public destination
+  std::map<std::string, std::string> m_by_pub;
+
+  uint64_t m_order;
+  std::priority_queue<delivery, std::vector<delivery>,
+                      std::greater<delivery> >
+      m_pending;
+};
+
+} // namespace
+
+int
+main (int argc, char *argv[])
+{
+  link_config config;
+  uint16_t tcp_port = 7656, udp_port = 7655;
+  long stats_sec = 10;
+  uint32_t seed = 1;
+  std::string sessions_path;
+
+  for (int i = 1; i + 1 < argc; i += 2)
+    {
+      std::string name = argv[i];
+      const char *value = argv[i + 1];
+
+      if (name == "--tcp")
+        tcp_port = (uint16_t)std::strtoul (value, nullptr, 10);
+      else if (name == "--udp")
+        udp_port = (uint16_t)std::strtoul (value, nullptr, 10);
+      else if (name == "--latency")
+        config.latency_ms = std::strtol (value, nullptr, 10);
+      else if (name == "--jitter")
+        config.jitter_ms = std::strtol (value, nullptr, 10);
+      else if (name == "--loss")
+        config.loss = std::strtod (value, nullptr);
+      else if (name == "--bandwidth")
+        config.bandwidth = std::strtod (value, nullptr);
+      else if (name == "--queue")
+        config.queue_ms = std::strtol (value, nullptr, 10);
+      else if (name == "--stats")
+        stats_sec = std::max (1L, std::strtol (value, nullptr, 10));
+      else if (name == "--seed")
+        seed = (uint32_t)std::strtoul (value, nullptr, 10);
+      else if (name == "--sessions")
+        sessions_path = value;
+      else
+        {
+          fprintf (stderr, "Unknown option: %s\n", name.c_str ());
+          return 1;
+        }
+    }
+
+  signal (SIGINT, on_signal);
+  signal (SIGTERM, on_signal);
+
+  StandIn stand_in (config, seed);
+  if (!stand_in.start (tcp_port, udp_port, sessions_path))
+    return 1;
+
+  stand_in.run (stats_sec);
+  return 0;
+}
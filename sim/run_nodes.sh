@@ -0,0 +1,118 @@
+#!/bin/sh
+#
+# Copyright (C) 2019-2022, polistern
+#
+# This file is part of pboted and licensed under BSD3
+#
+# See full license text in LICENSE file at top of project tree
+#
+# Starts SAM stand-in and N pboted nodes on this host. Node 0 is bootstrap
+# node for the rest. Every node gets own directory in work dir with config,
+# keys, storage and log, so next run keeps identities and DHT state.
+# Stop with Ctrl+C, stand-in prints datagram stats on exit.
+#
+# Usage: run_nodes.sh <pboted> <sam_standin> <nodes> <work dir> [stand-in options]
+#
+# Environment: SAM_TCP, SAM_UDP - stand-in ports (default: 17656, 17655),
+# LOGLEVEL - log level of nodes (default: info)
+#
+# Example, 100 nodes with 300 ms latency, 2% loss and 64 KiB/s uplinks:
+#   run_nodes.sh build/pboted build/sam_standin 100 /tmp/bote \
+#     --latency 300 --loss 0.02 --bandwidth 65536
+
+set -e
+
+if [ $# -lt 4 ]; then
+  sed -n '9,21p' "$0" | cut -c 3-
+  exit 1
+fi
+
+PBOTED=$(realpath "$1")
+STANDIN=$(realpath "$2")
+NODES=$3
+WORKDIR=$4
+shift 4
+
+SAM_TCP=${SAM_TCP:-17656}
+SAM_UDP=${SAM_UDP:-17655}
+LOGLEVEL=${LOGLEVEL:-info}
+SESSIONS="$WORKDIR/sessions.txt"
+
+mkdir -p "$WORKDIR"
+PIDS=""
+
+stop_all() {
+  trap - INT TERM
+  for pid in $PIDS; do
+    kill "$pid" 2>/dev/null || true
+  done
+  wait $PIDS 2>/dev/null || true
+  kill -INT "$STANDIN_PID" 2>/dev/null || true
+  wait "$STANDIN_PID" 2>/dev/null || true
+  exit 0
+}
+
+# $1 - node number, $2 - bootstrap destination or empty
+start_node() {
+  dir="$WORKDIR/node$1"
+  mkdir -p "$dir"
+
+  cat > "$dir/pboted.conf" <<EOF
+log = file
+logfile = $dir/pboted.log
+loglevel = $LOGLEVEL
+host = 127.0.0.1
+port = 0
+
+[sam]
+name = node$1
+address = 127.0.0.1
+tcp = $SAM_TCP
+udp = $SAM_UDP
+key = $dir/destination.key
+
+[smtp]
+enabled = false
+
+[pop3]
+enabled = false
+EOF
+
+  if [ -n "$2" ]; then
+    printf '\n[bootstrap]\naddress = %s\n' "$2" >> "$dir/pboted.conf"
+  fi
+
+  "$PBOTED" --conf="$dir/pboted.conf" --datadir="$dir" > "$dir/stdout.log" 2>&1 &
+  PIDS="$PIDS $!"
+}
+
+"$STANDIN" --tcp "$SAM_TCP" --udp "$SAM_UDP" --sessions "$SESSIONS" "$@" &
+STANDIN_PID=$!
+trap stop_all INT TERM
+
+sleep 1
+start_node 0 ""
+
+# Session of node 0 is the first one created
+tries=0
+while [ ! -s "$SESSIONS" ]; do
+  tries=$((tries + 1))
+  if [ $tries -gt 60 ]; then
+    echo "Node 0 didn't create SAM session, see $WORKDIR/node0/pboted.log"
+    stop_all
+  fi
+  sleep 1
+done
+
+BOOTSTRAP=$(head -n 1 "$SESSIONS" | cut -d ' ' -f 2)
+
+i=1
+while [ $i -lt "$NODES" ]; do
+  start_node $i "$BOOTSTRAP"
+  # Don't let all nodes bootstrap in the same second
+  sleep 0.2
+  i=$((i + 1))
+done
+
+echo "Started $NODES nodes in $WORKDIR, press Ctrl+C to stop"
+wait "$STANDIN_PID"
@@ -0,0 +1,171 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_ASYNC_BATCH_H_
+#define PBOTED_SRC_ASYNC_BATCH_H_
+
+#include <atomic>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+
+#include "Packet.h"
+#include "PacketHandler.h"
+
+namespace pbote
+{
+namespace packet
+{
+
+/// Interval in msec to check for stop while waiting for task result
+#define ASYNC_RESULT_WAIT_CHECK 100
+
+/**
+ * Continuation based waits on packet handler IO service.
+ *
+ * Instead of parking thread in waitLast or sleep_for, caller passes
+ * handler which is called on IO service thread when batch condition is
+ * met or timeout is expired. Long task is a chain of such handlers,
+ * so many tasks can share one thread.
+ */
+
+/// Gets true if condition was met, false on timeout or cancel
+using async_handler = std::function<void (bool)>;
+
+namespace detail
+{
+
+struct AsyncWaitState
+{
+  explicit AsyncWaitState (boost::asio::io_service &io)
+      : strand (io), timer (io), done (false)
+  {
+  }
+
+  /// IO service has several threads, timer is used only on this strand
+  boost::asio::io_service::strand strand;
+  boost::asio::steady_timer timer;
+  /// Set by first of timer and batch, second one is ignored
+  std::atomic<bool> done;
+  /// Reset once called, it can hold batch which holds this state
+  async_handler handler;
+  /// Batch completion to drop on timeout
+  size_t completion = 0;
+
+  void
+  finish (bool completed)
+  {
+    auto callback = std::move (handler);
+    handler = nullptr;
+    callback (completed);
+  }
+};
+
+} // namespace detail
+
+/**
+ * @brief Call handler when batch condition is met or on timeout
+ *
+ * Batch should be sent before. Handler is always called on IO service
+ * thread, so it can wait for next batch in the same way.
+ */
+template <typename T>
+void
+async_wait (const std::shared_ptr<PacketBatch<T> > &batch,
+            const typename PacketBatch<T>::condition &cond, long timeout_sec,
+            async_handler handler)
+{
+  auto &io = packet_handler.get_IO_service ();
+  auto state = std::make_shared<detail::AsyncWaitState> (io);
+  state->handler = std::move (handler);
+
+  state->strand.post ([state, batch, cond, timeout_sec] ()
+    {
+      std::weak_ptr<PacketBatch<T> > weak_batch = batch;
+      state->timer.expires_from_now (std::chrono::seconds (timeout_sec));
+      state->timer.async_wait (state->strand.wrap (
+          [state, weak_batch] (const boost::system::error_code &ec)
+            {
+              if (ec == boost::asio::error::operation_aborted)
+                return;
+
+              if (state->done.exchange (true))
+                return;
+
+              /// Otherwise batch keeps completion, and with it this state
+              if (auto batch = weak_batch.lock ())
+                batch->dropCompletion (state->completion);
+
+              state->finish (false);
+            }));
+
+      /// Called from receiving thread or right here if condition is met.
+      /// Timer handler runs on this strand, so it sees completion id.
+      state->completion = batch->onComplete (cond, [state] (bool completed)
+        {
+          if (state->done.exchange (true))
+            return;
+
+          state->strand.post ([state, completed] ()
+            {
+              state->timer.cancel ();
+              state->finish (completed);
+            });
+        });
+    });
+}
+
+/// Call handler on IO service thread after timeout
+inline void
+async_sleep (long timeout_sec, std::function<void ()> handler)
+{
+  auto timer = std::make_shared<boost::asio::steady_timer> (
+      packet_handler.get_IO_service (), std::chrono::seconds (timeout_sec));
+
+  timer->async_wait ([timer, handler] (const boost::system::error_code &ec)
+    {
+      if (!ec)
+        handler ();
+    });
+}
+
+/**
+ * @brief Start continuation task and wait for its result
+ *
+ * For callers in own threads, like email tasks, which need result
+ * right away. Only caller is parked, task itself runs on IO service.
+ * Must not be called from IO service thread. Gives default value if
+ * packet handler stops before task is done.
+ *
+ * @param start Starts task with handler which gets result
+ */
+template <typename Result>
+Result
+wait_result (const std::function<void (std::function<void (Result)>)> &start)
+{
+  auto promise = std::make_shared<std::promise<Result> > ();
+  auto result = promise->get_future ();
+
+  start ([promise] (Result value) { promise->set_value (std::move (value)); });
+
+  while (result.wait_for (std::chrono::milliseconds (ASYNC_RESULT_WAIT_CHECK))
+         != std::future_status::ready)
+    {
+      if (!packet_handler.isRunning ())
+        return Result ();
+    }
+
+  return result.get ();
+}
+
+} // namespace packet
+} // namespace pbote
+
+#endif // PBOTED_SRC_ASYNC_BATCH_H_
@@ -6,15 +6,45 @@
  * See full license text in LICENSE file at top of project tree
  */
 
+#include <algorithm>
 #include <utility>
 
 #include "BoteContext.h"
+#include "RandomPool.h"
 
 namespace pbote
 {
 
 BoteContext context;
 
+static std::vector<size_t>
+send_weights()
+{
+  std::vector<size_t> weights(eSendPriorityCount);
+  weights[eSendResponse] = SEND_WEIGHT_RESPONSE;
+  weights[eSendLookup] = SEND_WEIGHT_LOOKUP;
+  weights[eSendRelay] = SEND_WEIGHT_RELAY;
+  weights[eSendBulk] = SEND_WEIGHT_BULK;
+  return weights;
+}
+
+static pbote::util::QueueOverflow
+queue_overflow(const std::string &option)
+{
+  std::string policy;
+  pbote::config::GetOption(option, policy);
+
+  if (policy == "drop-oldest")
+    return pbote::util::eQueueDropOldest;
+  if (policy == "block")
+    return pbote::util::eQueueBlock;
+  if (policy != "drop-newest")
+    LogPrint(eLogWarning, "Context: Unknown ", option, " value ", policy,
+             ", use drop-newest");
+
+  return pbote::util::eQueueDropNewest;
+}
+
 BoteContext::BoteContext()
     : keys_loaded_(false),
       listenPortSAM(0),
@@ -23,12 +53,12 @@ BoteContext::BoteContext()
       bytes_recv_(0),
       bytes_sent_(0),
       m_recvQueue(std::make_shared<pbote::util::Queue<sp_queue_pkt>>()),
-      m_sendQueue(std::make_shared<pbote::util::Queue<sp_queue_pkt>>()),
+      m_sendQueue(std::make_shared<pbote::util::PriorityQueue<sp_queue_pkt>>(
+          send_weights())),
       localDestination(std::make_shared<i2p::data::IdentityEx>()),
       local_keys_(std::make_shared<i2p::data::PrivateKeys>())
 {
   start_time_ = ts_now ();
-  rbe.seed(time (NULL));
 }
 
 BoteContext::~BoteContext()
@@ -49,6 +79,17 @@ BoteContext::init()
   pbote::config::GetOption("sam.tcp", routerPortTCP);
   pbote::config::GetOption("sam.udp", routerPortUDP);
 
+  uint32_t recv_size = QUEUE_DEFAULT_CAPACITY,
+           send_size = QUEUE_DEFAULT_CAPACITY;
+  pbote::config::GetOption("queue.recv.size", recv_size);
+  pbote::config::GetOption("queue.send.size", send_size);
+
+  /// Workers take queues in their init, after this
+  m_recvQueue = std::make_shared<pbote::util::Queue<sp_queue_pkt>>(
+      recv_size, queue_overflow("queue.recv.overflow"));
+  m_sendQueue = std::make_shared<pbote::util::PriorityQueue<sp_queue_pkt>>(
+      send_weights(), send_size, queue_overflow("queue.send.overflow"));
+
   LogPrint(eLogInfo, "Context: Config loaded");
 
   std::string destination_key_path;
@@ -87,71 +128,199 @@ BoteContext::init()
 }
 
 void
-BoteContext::send(const PacketForQueue &packet)
+BoteContext::send(PacketForQueue packet, SendPriority prio)
 {
-  m_sendQueue->Put(std::make_shared<PacketForQueue>(packet));
+  m_sendQueue->Put(util::make_pooled<PacketForQueue>(std::move(packet)), prio);
+}
+
+void
+BoteContext::send(const sp_queue_pkt &packet, SendPriority prio)
+{
+  m_sendQueue->Put(packet, prio);
+}
+
+void
+BoteContext::send(dest_handle destination,
+                  std::optional<std::vector<uint8_t>> data, SendPriority prio)
+{
+  /// Reason is already logged by to_bytes
+  if (!data)
+    return;
+
+  send(util::make_pooled<PacketForQueue>(destination, std::move(*data)), prio);
 }
 
 void
-BoteContext::send(const std::shared_ptr<batch_comm_packet>& batch)
+BoteContext::send(const std::shared_ptr<batch_comm_packet>& batch,
+                  SendPriority prio)
 {
   size_t count = 0;
-  runningBatches.push_back(batch);
-  LogPrint(eLogDebug, "Context: send: Running batches: ",
-           runningBatches.size ());
 
-  auto packets = batch->getPackets();
-  for (const auto& packet: packets)
+  /// Queue gets the same packets as batch holds, nothing is copied.
+  /// Put can wait for room in queue, so batch is not locked meanwhile,
+  /// receiving thread needs it for responses.
+  for (const auto& packet : batch->getPackets())
     {
-      send(packet.second);
+      registerCID(batch, packet.first);
+      batch->markSent(packet.first);
+      send(packet.second, prio);
       count++;
     }
+
+  LogPrint(eLogDebug, "Context: send: Running batches: ",
+           get_running_batches());
   LogPrint(eLogDebug, "Context: send: Sent ", count, " packets from batch ",
            batch->owner);
 }
 
+void
+BoteContext::send(const std::shared_ptr<batch_comm_packet>& batch,
+                  const cid_type& cid, const sp_queue_pkt& packet,
+                  SendPriority prio)
+{
+  batch->addPacket(cid, packet);
+  /// Register before send, response can come back very fast
+  registerCID(batch, cid);
+  batch->markSent(cid);
+  send(packet, prio);
+}
+
 bool
 BoteContext::receive(const std::shared_ptr<CommunicationPacket>& packet)
 {
-  std::vector<uint8_t> v_cid(packet->cid, packet->cid + 32);
-  for (const auto& batch: runningBatches)
+  cid_type cid(packet->cid);
+  std::shared_ptr<batch_comm_packet> batch;
+
+  {
+    std::shared_lock<std::shared_mutex> l(m_batchesMutex);
+    auto it = m_batchByCID.find(cid);
+    if (it == m_batchByCID.end())
+      return false;
+
+    batch = it->second.lock();
+  }
+
+  if (!batch)
     {
-      if (batch->contains(v_cid))
-      {
-        batch->addResponse(packet);
-        LogPrint(eLogDebug, "Context: receive: Response for batch ",
-                 batch->owner, ", remain count: ", batch->remain ());
-               
-        return true;
-      }
+      /// Owner dropped batch without removeBatch
+      std::unique_lock<std::shared_mutex> l(m_batchesMutex);
+      m_batchByCID.erase(cid);
+      return false;
     }
-  return false;
+
+  /// Packet for this CID could be removed from batch after first response
+  if (!batch->contains(cid))
+    return false;
+
+  batch->addResponse(packet);
+  LogPrint(eLogDebug, "Context: receive: Response for batch ",
+           batch->owner, ", remain count: ", batch->remain ());
+
+  return true;
+}
+
+/// Both references are to the same batch, even if it's already destroyed
+static bool
+same_batch(const std::weak_ptr<batch_comm_packet>& a,
+           const std::weak_ptr<batch_comm_packet>& b)
+{
+  return !a.owner_before(b) && !b.owner_before(a);
 }
 
 void
 BoteContext::removeBatch(const std::shared_ptr<batch_comm_packet>& r_batch)
 {
-  for (auto batch : runningBatches)
+  if (!r_batch)
     {
-      if (batch)
-        LogPrint(eLogDebug, "Context: Batch: ", batch->owner);
-      else
-        LogPrint(eLogError, "Context: Batch ERROR ERROR");
+      LogPrint(eLogError, "Context: removeBatch: Empty batch");
+      return;
+    }
+
+  std::unique_lock<std::shared_mutex> l(m_batchesMutex);
+  batch_ref key(r_batch);
+  auto it = m_batchCIDs.find(key);
+  if (it == m_batchCIDs.end())
+    return;
+
+  LogPrint(eLogDebug, "Context: Removing batch ", r_batch->owner);
+
+  for (const auto& cid: it->second)
+    {
+      auto by_cid = m_batchByCID.find(cid);
+      if (by_cid != m_batchByCID.end() && same_batch(by_cid->second, key))
+        m_batchByCID.erase(by_cid);
+    }
+
+  m_batchCIDs.erase(it);
+  LogPrint(eLogDebug, "Context: Running batches: ", m_batchCIDs.size());
+}
+
+size_t
+BoteContext::get_running_batches()
+{
+  std::shared_lock<std::shared_mutex> l(m_batchesMutex);
+  return std::count_if(m_batchCIDs.begin(), m_batchCIDs.end(),
+                       [](const auto& entry) { return !entry.first.expired(); });
+}
+
+void
+BoteContext::registerCID(const std::shared_ptr<batch_comm_packet>& batch,
+                         const cid_type& cid)
+{
+  std::unique_lock<std::shared_mutex> l(m_batchesMutex);
+  batch_ref key(batch);
+
+  auto owner = m_batchCIDs.find(key);
+  if (owner == m_batchCIDs.end())
+    {
+      dropExpiredBatches();
+      owner = m_batchCIDs.emplace(key, std::vector<cid_type>()).first;
+    }
+
+  auto it = m_batchByCID.find(cid);
+  if (it == m_batchByCID.end())
+    {
+      m_batchByCID.emplace(cid, key);
+      owner->second.push_back(cid);
+      return;
+    }
+
+  /// Resent packet, CID is already registered for this batch
+  if (same_batch(it->second, key))
+    return;
+
+  /// CID moves to another batch, previous one must not drop it on removal
+  auto previous = m_batchCIDs.find(it->second);
+  if (previous != m_batchCIDs.end())
+    {
+      auto& cids = previous->second;
+      cids.erase(std::remove(cids.begin(), cids.end(), cid), cids.end());
     }
 
-  for (auto batch_it = runningBatches.begin(); batch_it != runningBatches.end(); batch_it++)
+  it->second = key;
+  owner->second.push_back(cid);
+}
+
+void
+BoteContext::dropExpiredBatches()
+{
+  auto it = m_batchCIDs.begin();
+  while (it != m_batchCIDs.end())
     {
-      if (!*batch_it)
-        continue;
+      if (!it->first.expired())
+        {
+          ++it;
+          continue;
+        }
 
-      if (r_batch == *batch_it)
+      for (const auto& cid: it->second)
         {
-          LogPrint(eLogDebug, "Context: Removing batch ", r_batch->owner);
-          runningBatches.erase(batch_it);
-          LogPrint(eLogDebug, "Context: Running batches: ",
-                   runningBatches.size ());
-          break;
+          auto by_cid = m_batchByCID.find(cid);
+          if (by_cid != m_batchByCID.end() && same_batch(by_cid->second, it->first))
+            m_batchByCID.erase(by_cid);
         }
+
+      it = m_batchCIDs.erase(it);
     }
 }
 
@@ -235,9 +404,7 @@ BoteContext::saveLocalIdentity(const std::string &path)
 void
 BoteContext::random_cid(uint8_t *buf, size_t len)
 {
-  std::vector<uint8_t> cid_data(len);
-  std::generate(cid_data.begin(), cid_data.end(), std::ref(rbe));
-  memcpy(buf, cid_data.data(), len);
+  pbote::util::random_bytes(buf, len);
 }
 
 int32_t
@@ -10,11 +10,18 @@
 #define BOTE_CONTEXT_H__
 
 #include <chrono>
+#include <map>
+#include <memory>
+#include <optional>
 #include <random>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
 
 #include "AddressBook.h"
 #include "BoteIdentity.h"
 #include "ConfigParser.h"
+#include "DestinationTable.h"
 #include "FileSystem.h"
 #include "Logging.h"
 #include "Packet.h"
@@ -26,7 +33,28 @@ namespace pbote
 
 #define DEFAULT_KEY_FILE_NAME "destination.key"
 
+/// Share of every send batch for class, see util::PriorityQueue
+#define SEND_WEIGHT_RESPONSE 8
+#define SEND_WEIGHT_LOOKUP 4
+#define SEND_WEIGHT_RELAY 2
+#define SEND_WEIGHT_BULK 1
+
+/// Classes of outbound packets, set by caller of BoteContext::send
+enum SendPriority
+{
+  /// Responses to requests of other nodes
+  eSendResponse = 0,
+  /// Our own lookups and retrieve requests
+  eSendLookup,
+  /// Relay peer checks
+  eSendRelay,
+  /// Store, deletion and replication traffic
+  eSendBulk,
+  eSendPriorityCount
+};
+
 using queue_type = std::shared_ptr<pbote::util::Queue<std::shared_ptr<PacketForQueue>>>;
+using send_queue_type = std::shared_ptr<pbote::util::PriorityQueue<std::shared_ptr<PacketForQueue>>>;
 
 class BoteContext
 {
@@ -36,12 +64,22 @@ class BoteContext
 
   void init();
 
-  void send(const PacketForQueue& packet);
-  void send(const std::shared_ptr<PacketBatch<pbote::CommunicationPacket>>& batch);
+  void send(PacketForQueue packet, SendPriority prio);
+  void send(const sp_queue_pkt& packet, SendPriority prio);
+  /// Serialized packet, nothing is sent if serialization failed
+  void send(dest_handle destination, std::optional<std::vector<uint8_t>> data,
+            SendPriority prio);
+  void send(const std::shared_ptr<PacketBatch<pbote::CommunicationPacket>>& batch,
+            SendPriority prio);
+  /// Add packet to already running batch and send it
+  void send(const std::shared_ptr<batch_comm_packet>& batch,
+            const cid_type& cid, const sp_queue_pkt& packet,
+            SendPriority prio);
 
   bool receive(const std::shared_ptr<pbote::CommunicationPacket>& packet);
 
   void removeBatch(const std::shared_ptr<PacketBatch<pbote::CommunicationPacket>>& batch);
+  size_t get_running_batches();
 
   std::string get_nickname() { return nickname; }
 
@@ -64,7 +102,7 @@ class BoteContext
   std::string address_for_name(const std::string &name) { return address_book_.address_for_name(name); }
   std::string address_for_alias(const std::string &alias) { return address_book_.address_for_alias(alias); }
 
-  queue_type getSendQueue() { return m_sendQueue; }
+  send_queue_type getSendQueue() { return m_sendQueue; }
   queue_type getRecvQueue() { return m_recvQueue; }
 
   int32_t get_uptime();
@@ -101,14 +139,25 @@ class BoteContext
   uint64_t bytes_sent_;
 
   queue_type m_recvQueue;
-  queue_type m_sendQueue;
+  send_queue_type m_sendQueue;
 
   std::shared_ptr<i2p::data::IdentityEx> localDestination;
   std::shared_ptr<i2p::data::PrivateKeys> local_keys_;
 
-  std::vector<std::shared_ptr<PacketBatch<pbote::CommunicationPacket>>> runningBatches;
+  using batch_ref = std::weak_ptr<batch_comm_packet>;
+
+  void registerCID(const std::shared_ptr<batch_comm_packet>& batch,
+                   const cid_type& cid);
+  /// Forget batches destroyed without removeBatch, under m_batchesMutex
+  void dropExpiredBatches();
 
-  std::independent_bits_engine<std::default_random_engine, CHAR_BIT, uint8_t> rbe;
+  /// Running batches by CID of sent packets, so response lookup is O(1)
+  std::shared_mutex m_batchesMutex;
+  std::unordered_map<cid_type, batch_ref, IdentHashHasher> m_batchByCID;
+  /// CIDs registered for every running batch, to drop them on removal.
+  /// Keyed by control block, it is not reused while reference exists,
+  /// so new batch never gets CIDs of destroyed one.
+  std::map<batch_ref, std::vector<cid_type>, std::owner_less<batch_ref>> m_batchCIDs;
 };
 
 extern BoteContext context;
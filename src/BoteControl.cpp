@@ -6,11 +6,15 @@
  * See full license text in LICENSE file at top of project tree
  */
 
+#include <fcntl.h>
+
 #include "BoteControl.h"
 #include "BoteContext.h"
+#include "BufferPool.h"
 #include "DHTworker.h"
 #include "FileSystem.h"
 #include "Logging.h"
+#include "Reactor.h"
 #include "RelayWorker.h"
 
 namespace bote
@@ -18,7 +22,6 @@ namespace bote
 
 BoteControl::BoteControl (const std::string &sock_path)
   : m_is_running (false),
-    m_thread (nullptr),
     socket_path (sock_path)
 {
   if (!pbote::fs::Exists (socket_path))
@@ -60,18 +63,13 @@ BoteControl::BoteControl (const std::string &sock_path)
   handlers["storage"] = &BoteControl::storage;
   handlers["peer"] = &BoteControl::peer;
   handlers["node"] = &BoteControl::node;
+  handlers["queue"] = &BoteControl::queue;
+  handlers["pool"] = &BoteControl::pool;
 }
 
 BoteControl::~BoteControl ()
 {
   stop ();
-
-  if (m_thread)
-    {
-      m_thread->join ();
-      delete m_thread;
-      m_thread = nullptr;
-    }
 }
 
 void
@@ -80,8 +78,10 @@ BoteControl::start ()
   if (m_is_running)
     return;
 
-  m_is_running = true;
-  m_thread = new std::thread ([this] { run (); });
+  fcntl (conn_sockfd, F_SETFL, fcntl (conn_sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+  m_is_running = pbote::network::reactor.add (
+      conn_sockfd, EPOLLIN, [this] (uint32_t) { accept_client (); });
 }
 
 void
@@ -91,65 +91,114 @@ BoteControl::stop ()
     return;
 
   m_is_running = false;
+  pbote::network::reactor.remove (conn_sockfd);
+
+  while (!clients.empty ())
+    close_client (clients.begin ()->first);
+
   close ();
 }
 
 void
-BoteControl::run ()
+BoteControl::accept_client ()
 {
-  while (m_is_running)
+  int sockfd = accept4 (conn_sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (sockfd == -1)
     {
-      if ((data_sockfd = accept (conn_sockfd, NULL, NULL)) == -1)
-        {
-          if (errno != EWOULDBLOCK && errno != EAGAIN)
-            {
-              LogPrint (eLogError,
-                        "BoteControl: run: Accept error: ", strerror (errno));
-              std::this_thread::sleep_for(std::chrono::seconds (5));
-            }
-        }
-      else
-        {
-          //LogPrint (eLogDebug, "BoteControl: run: Received new connection");
-          handle_request ();
-        }
-        ::close(data_sockfd);
+      if (errno != EWOULDBLOCK && errno != EAGAIN)
+        LogPrint (eLogError,
+                  "BoteControl: accept: Accept error: ", strerror (errno));
+      return;
+    }
+
+  //LogPrint (eLogDebug, "BoteControl: accept: Received new connection");
+  clients[sockfd] = std::string ();
+
+  bool added = pbote::network::reactor.add (
+      sockfd, EPOLLIN,
+      [this, sockfd] (uint32_t events) { handle_client (sockfd, events); });
+
+  if (!added)
+    {
+      clients.erase (sockfd);
+      ::close (sockfd);
     }
 }
 
 void
-BoteControl::write_data (const std::string &msg)
+BoteControl::handle_client (int sockfd, uint32_t events)
+{
+  if (events & EPOLLOUT)
+    write_data (sockfd);
+  else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    read_data (sockfd);
+}
+
+void
+BoteControl::read_data (int sockfd)
 {
-  ssize_t sent_bytes = write (data_sockfd, msg.c_str (), msg.length ());
-  if (sent_bytes == SOCKET_ERROR)
+  char buffer[BUFF_SIZE];
+
+  ssize_t recieved_bytes = read (sockfd, buffer, BUFF_SIZE);
+  if (recieved_bytes == SOCKET_ERROR)
     {
-      LogPrint (eLogError, "BoteControl: write: Failed to send data");
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return;
+
+      LogPrint (eLogError, "BoteControl: read: Failed to read data");
+      close_client (sockfd);
       return;
     }
-  if (sent_bytes == 0)
+  if (recieved_bytes == 0)
     {
-      LogPrint (eLogError, "BoteControl: write: Socket was closed");
+      LogPrint (eLogError, "BoteControl: read: Socket was closed");
+      close_client (sockfd);
       return;
     }
+
+  /// One request per connection, nothing is read after it
+  clients[sockfd]
+      = handle_request (std::string (buffer, (size_t)recieved_bytes));
+  pbote::network::reactor.modify (sockfd, EPOLLOUT);
+  write_data (sockfd);
 }
 
-std::string
-BoteControl::read_data ()
+void
+BoteControl::write_data (int sockfd)
 {
-  char buffer[BUFF_SIZE];
-  memset (buffer, 0, BUFF_SIZE);
+  auto client = clients.find (sockfd);
+  if (client == clients.end ())
+    return;
 
-  ssize_t recieved_bytes = read (data_sockfd, buffer, BUFF_SIZE);
-  if (recieved_bytes == SOCKET_ERROR)
+  std::string &msg = client->second;
+  while (!msg.empty ())
     {
-      LogPrint (eLogError, "BoteControl: write: Failed to read data");
-      return std::string ();
-    }
-  if (recieved_bytes == 0)
-    {
-      LogPrint (eLogError, "BoteControl: write: Socket was closed");
+      ssize_t sent_bytes = send (sockfd, msg.c_str (), msg.length (),
+                                 MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (sent_bytes == SOCKET_ERROR)
+        {
+          /// Rest is written when client takes what it has
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+          if (errno == EINTR)
+            continue;
+
+          LogPrint (eLogError, "BoteControl: write: Failed to send data");
+          break;
+        }
+
+      msg.erase (0, (size_t)sent_bytes);
     }
-  return std::string (buffer);
+
+  close_client (sockfd);
+}
+
+void
+BoteControl::close_client (int sockfd)
+{
+  pbote::network::reactor.remove (sockfd);
+  ::close (sockfd);
+  clients.erase (sockfd);
 }
 
 int
@@ -171,10 +220,9 @@ BoteControl::close ()
     }
 }
 
-void
-BoteControl::handle_request ()
+std::string
+BoteControl::handle_request (const std::string &request)
 {
-  auto request = read_data ();
   //LogPrint (eLogDebug, "BoteControl: handle_request: Got request: ",
   //          request);
 
@@ -203,7 +251,7 @@ BoteControl::handle_request ()
       unknown_cmd (request, result);
     }
 
-  write_data (result.str ());
+  return result.str ();
 }
 
 void
@@ -244,6 +292,10 @@ BoteControl::all (const std::string &cmd_id, std::ostringstream &results)
   peer (empty, results);
   results << ", ";
   node (empty, results);
+  results << ", ";
+  queue (empty, results);
+  results << ", ";
+  pool (empty, results);
 }
   
 void
@@ -299,9 +351,76 @@ BoteControl::node (const std::string &cmd_id, std::ostringstream &results)
   results << ", ";
   insert_param (results, "unlocked",
                 (int)pbote::kademlia::DHT_worker.get_unlocked_nodes_count ());
+  results << "}, ";
+  insert_param (results, "lookups",
+                (int)pbote::kademlia::DHT_worker.get_lookups_in_flight ());
+  results << ", ";
+  insert_param (results, "rtt_p90",
+                (int)pbote::kademlia::DHT_worker.get_rtt_percentile (0.9));
+  results << ", ";
+  insert_param (results, "hedged",
+                (int)pbote::kademlia::DHT_worker.get_hedged_count ());
+  results << "}";
+}
+
+void
+BoteControl::queue (const std::string &cmd_id, std::ostringstream &results)
+{
+  auto queue_stats = [this, &results] (
+      const std::string &name,
+      pbote::util::Queue<pbote::sp_queue_pkt> &queue)
+    {
+      results << "\"" << name << "\": {";
+      insert_param (results, "depth", (int)queue.GetSize ());
+      results << ", ";
+      insert_param (results, "capacity", (int)queue.GetCapacity ());
+      results << ", ";
+      insert_param (results, "high_water", (int)queue.GetHighWater ());
+      results << ", ";
+      insert_param (results, "dropped", (int)queue.GetDropped ());
+      results << "}";
+    };
+
+  /// In order of pbote::SendPriority
+  const char *send_classes[] = { "response", "lookup", "relay", "bulk" };
+  auto send_queue = pbote::context.getSendQueue ();
+
+  results << "\"queues\": {";
+  queue_stats ("recv", *pbote::context.getRecvQueue ());
+  results << ", \"send\": {";
+  for (size_t cls = 0; cls < send_queue->GetClasses (); cls++)
+    {
+      if (cls > 0)
+        results << ", ";
+      queue_stats (send_classes[cls], send_queue->GetQueue (cls));
+    }
   results << "}}";
 }
 
+void
+BoteControl::pool (const std::string &cmd_id, std::ostringstream &results)
+{
+  auto pool_stats = [this, &results] (const std::string &name,
+                                      const pbote::util::PoolStats &stats)
+    {
+      results << "\"" << name << "\": {";
+      insert_param (results, "requests", (double)stats.requests);
+      results << ", ";
+      insert_param (results, "hits", (double)stats.hits);
+      results << ", ";
+      insert_param (results, "recycled", (double)stats.recycled);
+      results << ", ";
+      insert_param (results, "released", (double)stats.released);
+      results << "}";
+    };
+
+  results << "\"pools\": {";
+  pool_stats ("buffers", pbote::util::buffer_pool_stats ());
+  results << ", ";
+  pool_stats ("blocks", pbote::util::block_pool_stats ());
+  results << "}";
+}
+
 void
 BoteControl::unknown_cmd (const std::string &cmd, std::ostringstream &results)
 {
@@ -13,7 +13,6 @@
 #include <string>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <thread>
 
 #include "i2psam.h"
 
@@ -35,11 +34,16 @@ public:
                                         std::ostringstream &results);
 
 private:
-  void run ();
-  void handle_request ();
-
-  void write_data (const std::string &msg);
-  std::string read_data ();
+  /// Called on reactor thread when client is connecting
+  void accept_client ();
+  /// Called on reactor thread when client socket is ready
+  void handle_client (int sockfd, uint32_t events);
+  std::string handle_request (const std::string &request);
+
+  void read_data (int sockfd);
+  /// Writes what socket takes now, rest waits for EPOLLOUT
+  void write_data (int sockfd);
+  void close_client (int sockfd);
   int release ();
   void close ();
 
@@ -57,15 +61,20 @@ private:
   void storage (const std::string &cmd_id, std::ostringstream &results);
   void peer (const std::string &cmd_id, std::ostringstream &results);
   void node (const std::string &cmd_id, std::ostringstream &results);
+  void queue (const std::string &cmd_id, std::ostringstream &results);
+  void pool (const std::string &cmd_id, std::ostringstream &results);
   // for unknown
   void unknown_cmd (const std::string &cmd, std::ostringstream &results);
 
   bool m_is_running;
-  std::thread *m_thread;
 
   const std::string socket_path;
-  int conn_sockfd, data_sockfd;
-  struct sockaddr_un conn_addr, data_addr;
+  int conn_sockfd;
+  struct sockaddr_un conn_addr;
+
+  /// Response not yet written to client, by client socket.
+  /// Touched on reactor thread only, daemon stops reactor before us
+  std::map<int, std::string> clients;
 
   std::map<std::string, Handler> handlers;
 };
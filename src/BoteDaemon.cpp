@@ -17,8 +17,10 @@
 #include "FileSystem.h"
 #include "Logging.h"
 #include "POP3.h"
+#include "Reactor.h"
 #include "RelayWorker.h"
 #include "SMTP.h"
+#include "Trace.h"
 #include "version.h"
 
 namespace pbote
@@ -152,20 +154,56 @@ Daemon_Singleton::start()
   LogPrint(eLogDebug, "Daemon: Start services");
   pbote::log::Logger().Start();
 
-  LogPrint(eLogInfo, "Daemon: Starting network worker");
-  pbote::network::network_worker.start();
+  LogPrint(eLogInfo, "Daemon: Starting reactor");
+  pbote::network::reactor.start();
 
-  LogPrint(eLogInfo, "Daemon: Starting relay");
-  pbote::relay::relay_worker.start();
+  std::string trace_record, trace_replay;
+  pbote::config::GetOption("trace.record", trace_record);
+  pbote::config::GetOption("trace.replay", trace_replay);
 
-  LogPrint(eLogInfo, "Daemon: Starting DHT");
-  pbote::kademlia::DHT_worker.start();
+  if (!trace_record.empty())
+    pbote::network::trace_recorder.open(trace_record);
+
+  if (trace_replay.empty())
+    {
+      LogPrint(eLogInfo, "Daemon: Starting network worker");
+      pbote::network::network_worker.start();
+    }
+  else
+    {
+      double speed;
+      pbote::config::GetOption("trace.speed", speed);
+      LogPrint(eLogInfo, "Daemon: Starting trace replay");
+      if (!pbote::network::trace_replayer.start(trace_replay, speed))
+        ThrowFatal("Unable to replay trace ", trace_replay);
+    }
+
+  bool replay = !trace_replay.empty();
+  if (replay)
+    {
+      /// Only handlers run, own traffic of periodic tasks would mix
+      /// with replayed one and make runs differ
+      LogPrint(eLogInfo, "Daemon: Replay, relay, DHT and Email tasks are not started");
+      pbote::relay::relay_worker.init();
+      pbote::kademlia::DHT_worker.init();
+    }
+  else
+    {
+      LogPrint(eLogInfo, "Daemon: Starting relay");
+      pbote::relay::relay_worker.start();
+
+      LogPrint(eLogInfo, "Daemon: Starting DHT");
+      pbote::kademlia::DHT_worker.start();
+    }
 
   LogPrint(eLogInfo, "Daemon: Starting packet handler");
   pbote::packet::packet_handler.start();
 
-  LogPrint(eLogInfo, "Daemon: Starting Email");
-  pbote::kademlia::email_worker.start();
+  if (!replay)
+    {
+      LogPrint(eLogInfo, "Daemon: Starting Email");
+      pbote::kademlia::email_worker.start();
+    }
 
   if (isDaemon)
     {
@@ -234,6 +272,11 @@ Daemon_Singleton::stop()
 {
   LogPrint(eLogInfo, "Daemon: Start shutting down");
 
+  /// Socket handlers are not called after this
+  LogPrint(eLogInfo, "Daemon: Stopping reactor");
+  pbote::network::reactor.stop();
+  LogPrint(eLogInfo, "Daemon: Reactor stopped");
+
   if (d.SMTPserver)
     {
       LogPrint(eLogInfo, "Daemon: Stopping SMTP server");
@@ -261,6 +304,9 @@ Daemon_Singleton::stop()
   pbote::network::network_worker.stop();
   LogPrint(eLogInfo, "Daemon: Network worker stopped");
 
+  pbote::network::trace_replayer.stop();
+  pbote::network::trace_recorder.close();
+
   LogPrint(eLogInfo, "Daemon: Stopping packet handler");
   pbote::packet::packet_handler.stop();
   LogPrint(eLogInfo, "Daemon: Packet handler stopped");
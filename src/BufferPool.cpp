@@ -0,0 +1,316 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+
+#include "BufferPool.h"
+
+namespace pbote
+{
+namespace util
+{
+
+namespace
+{
+
+/**
+ * @brief Free lists by size class with per-thread cache
+ *
+ * Pools live until process exit, so packets destroyed by static
+ * destructors can still give items back. After thread cache is destroyed
+ * thread works with global lists only.
+ */
+template <typename Item, size_t Classes>
+class FreeListPool
+{
+public:
+  using release_func = void (*) (Item &);
+
+  explicit FreeListPool (release_func release) : m_release (release) {}
+
+  /// Get free item of class, false if there is none
+  bool
+  take (size_t cls, Item &item)
+  {
+    m_requests.fetch_add (1, std::memory_order_relaxed);
+
+    Local *local = get_local ();
+    std::vector<Item> *list = local ? &local->free[cls] : nullptr;
+
+    if (list && list->empty ())
+      refill (cls, *list);
+
+    if (list && !list->empty ())
+      {
+        item = std::move (list->back ());
+        list->pop_back ();
+        m_hits.fetch_add (1, std::memory_order_relaxed);
+        return true;
+      }
+
+    if (!list)
+      {
+        std::unique_lock<std::mutex> l (m_mutex);
+        if (!m_free[cls].empty ())
+          {
+            item = std::move (m_free[cls].back ());
+            m_free[cls].pop_back ();
+            m_hits.fetch_add (1, std::memory_order_relaxed);
+            return true;
+          }
+      }
+
+    return false;
+  }
+
+  void
+  give (size_t cls, Item &&item)
+  {
+    m_recycled.fetch_add (1, std::memory_order_relaxed);
+
+    Local *local = get_local ();
+    if (!local)
+      {
+        std::vector<Item> single;
+        single.push_back (std::move (item));
+        flush (cls, single, single.size ());
+        return;
+      }
+
+    std::vector<Item> &list = local->free[cls];
+    if (list.size () >= POOL_LOCAL_MAX)
+      flush (cls, list, POOL_LOCAL_MAX / 2);
+
+    list.push_back (std::move (item));
+  }
+
+  PoolStats
+  stats () const
+  {
+    PoolStats result;
+    result.requests = m_requests.load (std::memory_order_relaxed);
+    result.hits = m_hits.load (std::memory_order_relaxed);
+    result.recycled = m_recycled.load (std::memory_order_relaxed);
+    result.released = m_released.load (std::memory_order_relaxed);
+    return result;
+  }
+
+  void
+  count_release ()
+  {
+    m_released.fetch_add (1, std::memory_order_relaxed);
+  }
+
+private:
+  struct Local
+  {
+    explicit Local (FreeListPool *pool_) : pool (pool_) {}
+
+    ~Local ()
+    {
+      for (size_t cls = 0; cls < Classes; cls++)
+        pool->flush (cls, free[cls], free[cls].size ());
+
+      destroyed = true;
+    }
+
+    FreeListPool *pool;
+    std::vector<Item> free[Classes];
+    static thread_local bool destroyed;
+  };
+
+  Local *
+  get_local ()
+  {
+    if (Local::destroyed)
+      return nullptr;
+
+    static thread_local Local local (this);
+    return &local;
+  }
+
+  /// Take up to half of thread limit from global list
+  void
+  refill (size_t cls, std::vector<Item> &list)
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+    std::vector<Item> &global = m_free[cls];
+
+    size_t count = std::min (global.size (), (size_t)POOL_LOCAL_MAX / 2);
+    for (size_t i = 0; i < count; i++)
+      {
+        list.push_back (std::move (global.back ()));
+        global.pop_back ();
+      }
+  }
+
+  /// Move count items from end of list to global, free what does not fit
+  void
+  flush (size_t cls, std::vector<Item> &list, size_t count)
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+    std::vector<Item> &global = m_free[cls];
+
+    for (size_t i = 0; i < count && !list.empty (); i++)
+      {
+        if (global.size () < POOL_GLOBAL_MAX)
+          global.push_back (std::move (list.back ()));
+        else
+          {
+            m_release (list.back ());
+            count_release ();
+          }
+
+        list.pop_back ();
+      }
+  }
+
+  release_func m_release;
+
+  std::mutex m_mutex;
+  std::vector<Item> m_free[Classes];
+
+  std::atomic<uint64_t> m_requests{ 0 };
+  std::atomic<uint64_t> m_hits{ 0 };
+  std::atomic<uint64_t> m_recycled{ 0 };
+  std::atomic<uint64_t> m_released{ 0 };
+};
+
+template <typename Item, size_t Classes>
+thread_local bool FreeListPool<Item, Classes>::Local::destroyed = false;
+
+using buffer_pool_type
+    = FreeListPool<std::vector<uint8_t>, BUFFER_POOL_CLASSES>;
+using block_pool_type = FreeListPool<void *, BLOCK_POOL_CLASSES>;
+
+void
+release_buffer (std::vector<uint8_t> &buf)
+{
+  std::vector<uint8_t> ().swap (buf);
+}
+
+void
+release_block (void *&block)
+{
+  ::operator delete (block);
+  block = nullptr;
+}
+
+/// Never destroyed, see FreeListPool
+buffer_pool_type &
+buffer_pool ()
+{
+  static auto *pool = new buffer_pool_type (release_buffer);
+  return *pool;
+}
+
+block_pool_type &
+block_pool ()
+{
+  static auto *pool = new block_pool_type (release_block);
+  return *pool;
+}
+
+/// Smallest class which can hold size, Classes if it's too big
+size_t
+class_for_size (size_t min_size, size_t classes, size_t size)
+{
+  size_t cls = 0;
+  while (cls < classes && (min_size << cls) < size)
+    cls++;
+
+  return cls;
+}
+
+} // namespace
+
+std::vector<uint8_t>
+take_buffer (size_t len)
+{
+  std::vector<uint8_t> buf;
+  size_t cls = class_for_size (BUFFER_POOL_MIN_SIZE, BUFFER_POOL_CLASSES, len);
+
+  if (cls < BUFFER_POOL_CLASSES && buffer_pool ().take (cls, buf))
+    return buf;
+
+  buf.reserve (cls < BUFFER_POOL_CLASSES ? BUFFER_POOL_MIN_SIZE << cls : len);
+  return buf;
+}
+
+void
+recycle_buffer (std::vector<uint8_t> &&buf)
+{
+  size_t capacity = buf.capacity ();
+  if (capacity == 0)
+    return;
+
+  /// Pool only buffers which were taken from it or are close in size
+  size_t max_size = (size_t)BUFFER_POOL_MIN_SIZE << (BUFFER_POOL_CLASSES - 1);
+  if (capacity < BUFFER_POOL_MIN_SIZE || capacity > max_size * 2)
+    {
+      buffer_pool ().count_release ();
+      release_buffer (buf);
+      return;
+    }
+
+  /// Largest class which fits into capacity
+  size_t cls = BUFFER_POOL_CLASSES - 1;
+  while (cls > 0 && ((size_t)BUFFER_POOL_MIN_SIZE << cls) > capacity)
+    cls--;
+
+  buf.clear ();
+  buffer_pool ().give (cls, std::move (buf));
+}
+
+void *
+take_block (size_t size)
+{
+  size_t cls = class_for_size (BLOCK_POOL_MIN_SIZE, BLOCK_POOL_CLASSES, size);
+  if (cls == BLOCK_POOL_CLASSES)
+    return ::operator new (size);
+
+  void *block = nullptr;
+  if (block_pool ().take (cls, block))
+    return block;
+
+  return ::operator new ((size_t)BLOCK_POOL_MIN_SIZE << cls);
+}
+
+void
+recycle_block (void *block, size_t size)
+{
+  if (!block)
+    return;
+
+  size_t cls = class_for_size (BLOCK_POOL_MIN_SIZE, BLOCK_POOL_CLASSES, size);
+  if (cls == BLOCK_POOL_CLASSES)
+    {
+      ::operator delete (block);
+      return;
+    }
+
+  block_pool ().give (cls, std::move (block));
+}
+
+PoolStats
+buffer_pool_stats ()
+{
+  return buffer_pool ().stats ();
+}
+
+PoolStats
+block_pool_stats ()
+{
+  return block_pool ().stats ();
+}
+
+} // namespace util
+} // namespace pbote
@@ -0,0 +1,116 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_BUFFER_POOL_H_
+#define PBOTED_SRC_BUFFER_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace pbote
+{
+namespace util
+{
+
+/// Byte buffer classes are 512 << N up to max datagram size (32768)
+#define BUFFER_POOL_MIN_SIZE 512
+#define BUFFER_POOL_CLASSES 7
+/// Object block classes are 64 << N up to 512
+#define BLOCK_POOL_MIN_SIZE 64
+#define BLOCK_POOL_CLASSES 4
+/// Free items per class kept by thread, half is moved to global on overflow
+#define POOL_LOCAL_MAX 64
+/// Free items per class kept in global pool for all threads
+#define POOL_GLOBAL_MAX 1024
+
+struct PoolStats
+{
+  /// Items asked from pool
+  uint64_t requests = 0;
+  /// Requests served with free item without allocation
+  uint64_t hits = 0;
+  /// Free items given back
+  uint64_t recycled = 0;
+  /// Items freed because pool was full or size is out of classes
+  uint64_t released = 0;
+};
+
+/**
+ * @brief Get empty byte buffer with capacity for at least len bytes
+ *
+ * Buffers are pooled by size class. Every thread takes them from own free
+ * list and refills it from global pool, so usual take and recycle don't
+ * lock or allocate.
+ */
+std::vector<uint8_t> take_buffer (size_t len);
+/// Keep capacity of buffer for next take_buffer, buffer is left empty
+void recycle_buffer (std::vector<uint8_t> &&buf);
+
+/// Raw memory block for object, pooled by size class like buffers
+void *take_block (size_t size);
+void recycle_block (void *block, size_t size);
+
+PoolStats buffer_pool_stats ();
+PoolStats block_pool_stats ();
+
+/// Allocator over block pool, for std::allocate_shared of packets
+template <typename T>
+struct PoolAllocator
+{
+  using value_type = T;
+
+  PoolAllocator () = default;
+
+  template <typename U>
+  PoolAllocator (const PoolAllocator<U> &)
+  {
+  }
+
+  T *
+  allocate (size_t n)
+  {
+    return static_cast<T *> (take_block (n * sizeof (T)));
+  }
+
+  void
+  deallocate (T *p, size_t n)
+  {
+    recycle_block (p, n * sizeof (T));
+  }
+
+  template <typename U>
+  bool
+  operator== (const PoolAllocator<U> &) const
+  {
+    return true;
+  }
+
+  template <typename U>
+  bool
+  operator!= (const PoolAllocator<U> &) const
+  {
+    return false;
+  }
+};
+
+/// Object and shared_ptr control block in one pooled block
+template <typename T, typename... Args>
+std::shared_ptr<T>
+make_pooled (Args &&...args)
+{
+  return std::allocate_shared<T> (PoolAllocator<T> (),
+                                  std::forward<Args> (args)...);
+}
+
+} // namespace util
+} // namespace pbote
+
+#endif // PBOTED_SRC_BUFFER_POOL_H_
@@ -0,0 +1,328 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_BYTE_STREAM_H_
+#define PBOTED_SRC_BYTE_STREAM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace pbote
+{
+
+/**
+ * @brief Read-only bytes sharing ownership of underlying buffer
+ *
+ * Parsed packets keep slices of received datagram instead of copies,
+ * slice holds whole datagram alive. Bytes are copied with to_vector ()
+ * only when they need to outlive it, e.g. to be stored.
+ */
+class SharedBuffer
+{
+public:
+  SharedBuffer () : m_data (nullptr), m_size (0) {}
+
+  /// Takes vector without copying bytes
+  SharedBuffer (std::vector<uint8_t> &&bytes)
+    : m_data (nullptr), m_size (0)
+  {
+    auto owner
+        = std::make_shared<const std::vector<uint8_t> > (std::move (bytes));
+    m_data = owner->data ();
+    m_size = owner->size ();
+    m_owner = std::move (owner);
+  }
+
+  SharedBuffer (const std::vector<uint8_t> &bytes)
+    : SharedBuffer (std::vector<uint8_t> (bytes))
+  {
+  }
+
+  /// Bytes inside buffer held by owner
+  SharedBuffer (std::shared_ptr<const void> owner, const uint8_t *data,
+                size_t size)
+    : m_owner (std::move (owner)), m_data (data), m_size (size)
+  {
+  }
+
+  /// Part of this buffer, cut to available bytes
+  SharedBuffer
+  slice (size_t offset, size_t len) const
+  {
+    if (offset > m_size)
+      offset = m_size;
+    if (len > m_size - offset)
+      len = m_size - offset;
+
+    return { m_owner, m_data + offset, len };
+  }
+
+  std::vector<uint8_t>
+  to_vector () const
+  {
+    return { begin (), end () };
+  }
+
+  const uint8_t *data () const { return m_data; }
+  size_t size () const { return m_size; }
+  bool empty () const { return m_size == 0; }
+  const uint8_t *begin () const { return m_data; }
+  const uint8_t *end () const { return m_data + m_size; }
+  const uint8_t &operator[] (size_t i) const { return m_data[i]; }
+
+private:
+  std::shared_ptr<const void> m_owner;
+  const uint8_t *m_data;
+  size_t m_size;
+};
+
+/**
+ * @brief Bounds-checked writer over caller-provided buffer
+ *
+ * Integers are written in network byte order. Write which does not fit
+ * marks writer as failed and nothing more is written, so serializer can
+ * check result once at the end.
+ */
+class ByteWriter
+{
+public:
+  ByteWriter (uint8_t *buf, size_t capacity)
+    : m_buf (buf), m_capacity (capacity), m_offset (0), m_ok (true)
+  {
+  }
+
+  void
+  u8 (uint8_t value)
+  {
+    uint8_t *out = reserve (1);
+    if (out)
+      out[0] = value;
+  }
+
+  void
+  u16 (uint16_t value)
+  {
+    uint8_t *out = reserve (2);
+    if (!out)
+      return;
+
+    out[0] = static_cast<uint8_t> (value >> 8);
+    out[1] = static_cast<uint8_t> (value & 0xff);
+  }
+
+  void
+  u32 (uint32_t value)
+  {
+    uint8_t *out = reserve (4);
+    if (!out)
+      return;
+
+    out[0] = static_cast<uint8_t> (value >> 24);
+    out[1] = static_cast<uint8_t> (value >> 16);
+    out[2] = static_cast<uint8_t> (value >> 8);
+    out[3] = static_cast<uint8_t> (value & 0xff);
+  }
+
+  void
+  bytes (const uint8_t *data, size_t len)
+  {
+    uint8_t *out = reserve (len);
+    if (out && len > 0)
+      memcpy (out, data, len);
+  }
+
+  void
+  bytes (const std::vector<uint8_t> &data)
+  {
+    bytes (data.data (), data.size ());
+  }
+
+  void
+  bytes (const SharedBuffer &data)
+  {
+    bytes (data.data (), data.size ());
+  }
+
+  /**
+   * @brief Take next len bytes for direct fill
+   *
+   * @return uint8_t* Start of taken bytes, nullptr if they don't fit
+   */
+  uint8_t *
+  reserve (size_t len)
+  {
+    if (!m_ok || len > m_capacity - m_offset)
+      {
+        m_ok = false;
+        return nullptr;
+      }
+
+    uint8_t *out = m_buf + m_offset;
+    m_offset += len;
+    return out;
+  }
+
+  bool ok () const { return m_ok; }
+  size_t size () const { return m_offset; }
+  /// Buffer was filled up to the end without overflow
+  bool complete () const { return m_ok && m_offset == m_capacity; }
+
+private:
+  uint8_t *m_buf;
+  size_t m_capacity;
+  size_t m_offset;
+  bool m_ok;
+};
+
+/**
+ * @brief Bounds-checked reader over byte span
+ *
+ * Integers are read in network byte order, or as is if source is local
+ * and was written in host order. Read past the end fails, leaves output
+ * untouched and marks reader as failed.
+ */
+class ByteReader
+{
+public:
+  ByteReader (const uint8_t *buf, size_t len, bool from_net = true)
+    : m_source (nullptr), m_buf (buf), m_len (len), m_offset (0),
+      m_from_net (from_net), m_ok (true)
+  {
+  }
+
+  /// Byte strings can be taken as slices of source without copy
+  explicit ByteReader (const SharedBuffer &source, bool from_net = true)
+    : ByteReader (source.data (), source.size (), from_net)
+  {
+    m_source = &source;
+  }
+
+  bool
+  u8 (uint8_t &value)
+  {
+    const uint8_t *in = take (1);
+    if (!in)
+      return false;
+
+    value = in[0];
+    return true;
+  }
+
+  bool
+  u16 (uint16_t &value)
+  {
+    const uint8_t *in = take (2);
+    if (!in)
+      return false;
+
+    if (m_from_net)
+      value = static_cast<uint16_t> ((in[0] << 8) | in[1]);
+    else
+      memcpy (&value, in, 2);
+
+    return true;
+  }
+
+  bool
+  u32 (uint32_t &value)
+  {
+    const uint8_t *in = take (4);
+    if (!in)
+      return false;
+
+    if (m_from_net)
+      value = (static_cast<uint32_t> (in[0]) << 24)
+              | (static_cast<uint32_t> (in[1]) << 16)
+              | (static_cast<uint32_t> (in[2]) << 8)
+              | static_cast<uint32_t> (in[3]);
+    else
+      memcpy (&value, in, 4);
+
+    return true;
+  }
+
+  bool
+  bytes (uint8_t *out, size_t len)
+  {
+    const uint8_t *in = take (len);
+    if (!in)
+      return false;
+
+    if (len > 0)
+      memcpy (out, in, len);
+
+    return true;
+  }
+
+  bool
+  bytes (std::vector<uint8_t> &out, size_t len)
+  {
+    const uint8_t *in = take (len);
+    if (!in)
+      return false;
+
+    out.assign (in, in + len);
+    return true;
+  }
+
+  bool
+  bytes (SharedBuffer &out, size_t len)
+  {
+    size_t start = m_offset;
+    const uint8_t *in = take (len);
+    if (!in)
+      return false;
+
+    if (m_source)
+      out = m_source->slice (start, len);
+    else
+      out = std::vector<uint8_t> (in, in + len);
+
+    return true;
+  }
+
+  /**
+   * @brief Skip next len bytes without copy
+   *
+   * @return const uint8_t* Start of skipped bytes, nullptr if not enough
+   */
+  const uint8_t *
+  take (size_t len)
+  {
+    if (!m_ok || len > m_len - m_offset)
+      {
+        m_ok = false;
+        return nullptr;
+      }
+
+    const uint8_t *in = m_buf + m_offset;
+    m_offset += len;
+    return in;
+  }
+
+  bool ok () const { return m_ok; }
+  size_t offset () const { return m_offset; }
+  size_t remaining () const { return m_len - m_offset; }
+  const uint8_t *current () const { return m_buf + m_offset; }
+
+private:
+  const SharedBuffer *m_source;
+  const uint8_t *m_buf;
+  size_t m_len;
+  size_t m_offset;
+  bool m_from_net;
+  bool m_ok;
+};
+
+} // namespace pbote
+
+#endif // PBOTED_SRC_BYTE_STREAM_H_
@@ -45,7 +45,10 @@ void Init() {
       ("logclftime",bool_switch()->default_value(false),"Write full CLF-formatted date and time to log (default: disabled, write only time)")
       ("datadir",value<std::string>()->default_value(""),"Path to storage of pboted data (keys, peer, packets, etc.) (default: try ~/.pboted/ or /var/lib/pboted/)")
       ("host", value<std::string>()->default_value("0.0.0.0"), "External IP fot incomming UDP listener (default: 0.0.0.0)")
-      ("port", value<uint16_t>()->default_value(5050), "Port to listen for incoming connections (default: 5050)")
+      ("port", value<uint16_t>()->default_value(5050), "Port to listen for incoming connections, 0 to pick free one (default: 5050)")
+      ("threads", value<uint16_t>()->default_value(0), "Number of packet handler threads, 0 - one per CPU core (default: 0)")
+      ("cryptothreads", value<uint16_t>()->default_value(0), "Number of email encryption threads, 0 - one per CPU core (default: 0)")
+      ("sendinflight", value<uint16_t>()->default_value(4), "Number of outgoing emails stored to DHT at the same time (default: 4)")
       ("daemon", bool_switch()->default_value(false), "Router will go to background after start (default: disabled)")
       ("service",bool_switch()->default_value(false),"Service will use system folders like '/var/lib/pboted' (default: disabled)")
       ("storage", value<std::string>()->default_value("50 MiB"), "Limit for local storage usage (default: 50 MiB)");
@@ -60,6 +63,19 @@ void Init() {
       ("sam.login", value<std::string>()->default_value(""),"SAM login")
       ("sam.password", value<std::string>()->default_value(""),"SAM password")*/
       ;
+  options_description queue("Queue options");
+  queue.add_options()
+  ("queue.recv.size", value<uint32_t>()->default_value(4096), "Capacity of inbound packet queue (default: 4096)")
+  ("queue.recv.overflow", value<std::string>()->default_value("drop-oldest"), "What to do if inbound queue is full: drop-oldest, drop-newest, block (default: drop-oldest)")
+  ("queue.send.size", value<uint32_t>()->default_value(4096), "Capacity of outbound queue of every packet class (default: 4096)")
+  ("queue.send.overflow", value<std::string>()->default_value("drop-newest"), "What to do if outbound queue is full: drop-oldest, drop-newest, block (default: drop-newest)")
+  ;
+  options_description trace("Trace options");
+  trace.add_options()
+  ("trace.record", value<std::string>()->default_value(""), "Write received and sent datagrams to trace file (default: disabled)")
+  ("trace.replay", value<std::string>()->default_value(""), "Replay inbound datagrams from trace file instead of I2P network (default: disabled)")
+  ("trace.speed", value<double>()->default_value(1.0), "Replay speed relative to recording, 0 for as fast as possible (default: 1)")
+  ;
   options_description bootstrap("Bootstrap options");
   bootstrap.add_options()
       ("bootstrap.address", value<std::vector<std::string>>(), "I2P destination key in Base64 format");
@@ -97,6 +113,8 @@ void Init() {
   m_OptionsDesc
       .add(general)
       .add(sam)
+      .add(queue)
+      .add(trace)
       .add(bootstrap)
     /*.add(mail)
     .add(delivery)*/
@@ -14,14 +14,13 @@
 #include "Tag.h"
 
 #include "Cryptography.h"
+#include "RandomPool.h"
 
 namespace pbote
 {
 
 ECDHP256Encryptor::ECDHP256Encryptor (const byte *pubkey)
 {
-  rbe.seed (time (NULL));
-
   ec_curve = EC_GROUP_new_by_curve_name (NID_X9_62_prime256v1);
   ec_public_point = EC_POINT_new (ec_curve);
   ec_shared_key = create_EC_key (NID_X9_62_prime256v1);
@@ -79,7 +78,7 @@ ECDHP256Encryptor::Encrypt (const byte *data, int len)
 
   /// Encrypt the data using the hash of the shared secret as an AES key
   byte ivec[AES_BLOCK_SIZE];
-  std::generate (ivec, ivec + AES_BLOCK_SIZE, std::ref (rbe));
+  util::random_bytes (ivec, AES_BLOCK_SIZE);
   result.insert (result.end (), ivec, ivec + AES_BLOCK_SIZE);
 
   const int padding = len % 16;
@@ -183,8 +182,6 @@ ECDHP256Decryptor::Decrypt (const byte *encrypted, int elen)
 
 ECDHP521Encryptor::ECDHP521Encryptor (const byte *pubkey)
 {
-  rbe.seed (time (NULL));
-
   ec_curve = EC_GROUP_new_by_curve_name (NID_secp521r1);
   ec_public_point = EC_POINT_new (ec_curve);
   ec_shared_key = create_EC_key (NID_secp521r1);
@@ -275,7 +272,7 @@ ECDHP521Encryptor::Encrypt (const byte *data, int len)
 
   /// Encrypt the data using the hash of the shared secret as an AES key
   byte ivec[AES_BLOCK_SIZE];
-  std::generate (ivec, ivec + AES_BLOCK_SIZE, std::ref (rbe));
+  util::random_bytes (ivec, AES_BLOCK_SIZE);
   result.insert (result.end (), ivec, ivec + AES_BLOCK_SIZE);
 
   const int padding = len % 16;
@@ -382,8 +379,6 @@ ECDHP521Decryptor::Decrypt (const byte *encrypted, int elen)
 
 X25519Encryptor::X25519Encryptor (const byte *pubkey)
 {
-  rbe.seed (time (NULL));
-
   shared_key = nullptr;
   ctx = EVP_PKEY_CTX_new_id (NID_X25519, nullptr);
 
@@ -482,7 +477,7 @@ X25519Encryptor::Encrypt (const byte *data, int len)
 
   /// Encrypt the data using the hash of the shared secret as an AES key
   byte ivec[AES_BLOCK_SIZE];
-  std::generate (ivec, ivec + AES_BLOCK_SIZE, std::ref (rbe));
+  util::random_bytes (ivec, AES_BLOCK_SIZE);
   result.insert (result.end (), ivec, ivec + AES_BLOCK_SIZE);
 
   const int padding = len % 16;
@@ -72,8 +72,6 @@ class ECDHP256Encryptor : public CryptoKeyEncryptor
   EC_GROUP *ec_curve;
   EC_POINT *ec_public_point;
   EC_KEY *ec_shared_key;
-
-  std::independent_bits_engine<std::default_random_engine, CHAR_BIT, uint8_t> rbe;
 };
 
 class ECDHP256Decryptor : public CryptoKeyDecryptor
@@ -100,8 +98,6 @@ class ECDHP521Encryptor : public CryptoKeyEncryptor
   EC_GROUP *ec_curve;
   EC_POINT *ec_public_point;
   EC_KEY *ec_shared_key;
-
-  std::independent_bits_engine<std::default_random_engine, CHAR_BIT, uint8_t> rbe;
 };
 
 class ECDHP521Decryptor : public CryptoKeyDecryptor
@@ -128,8 +124,6 @@ class X25519Encryptor : public CryptoKeyEncryptor
   EVP_PKEY_CTX *ctx;
   EVP_PKEY *public_key;
   EVP_PKEY *shared_key;
-
-  std::independent_bits_engine<std::default_random_engine, CHAR_BIT, uint8_t> rbe;
 };
 
 class X25519Decryptor : public CryptoKeyDecryptor
@@ -56,6 +56,14 @@ DHTStorage::update ()
 int
 DHTStorage::safe(const std::vector<uint8_t>& data)
 {
+  /// type[1] + ver[1] + key[32]
+  if (data.size() < 34)
+    {
+      LogPrint(eLogWarning, "DHTStorage: safe: Packet is too short: ",
+               data.size());
+      return STORE_FILE_NOT_STORED;
+    }
+
   uint8_t dataType = data[0];
   int success = 0;
   uint8_t key[32];
@@ -280,6 +288,13 @@ DHTStorage::safeEmail(i2p::data::Tag<32> key, const std::vector<uint8_t>& data)
       return STORE_FILE_EXIST;
     }
 
+  EmailEncryptedPacket email_packet;
+  email_packet.fromBuffer(const_cast<uint8_t *>(data.data()), data.size(), true);
+  email_packet.stored_time = context.ts_now ();
+  auto packet_bytes = email_packet.toByte();
+  if (!packet_bytes)
+    return STORE_FILE_NOT_STORED;
+
   LogPrint(eLogDebug, "DHTStorage: safeEmail: save packet to ", packetPath);
   std::ofstream file(packetPath, std::ofstream::binary | std::ofstream::out);
   if (!file.is_open())
@@ -288,12 +303,7 @@ DHTStorage::safeEmail(i2p::data::Tag<32> key, const std::vector<uint8_t>& data)
       return STORE_FILE_OPEN_ERROR;
     }
 
-  EmailEncryptedPacket email_packet;
-  email_packet.fromBuffer(const_cast<uint8_t *>(data.data()), data.size(), true);
-  email_packet.stored_time = context.ts_now ();
-  auto packet_bytes = email_packet.toByte();
-
-  file.write(reinterpret_cast<const char *>(packet_bytes.data()), (long)packet_bytes.size());
+  file.write(reinterpret_cast<const char *>(packet_bytes->data()), (long)packet_bytes->size());
   file.close();
 
   update_storage_usage();
@@ -419,17 +429,22 @@ DHTStorage::clean_index (i2p::data::Tag<32> key, int32_t ts_now)
       removed++;
     }
 
-  Delete(type::DataI, key);
-
   index_packet.nump = index_packet.data.size();
 
   if (index_packet.data.empty())
     {
+      Delete(type::DataI, key);
       LogPrint(eLogDebug, "DHTStorage: clean_index: Empty packet removed: ", key.ToBase64());
       return -1;
     }
 
-  safeIndex(key, index_packet.toByte());
+  /// Old packet is kept if cleaned one can't be serialized
+  auto index_bytes = index_packet.toByte();
+  if (!index_bytes)
+    return 0;
+
+  Delete(type::DataI, key);
+  safeIndex(key, *index_bytes);
 
   return removed;
 }
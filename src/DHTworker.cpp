@@ -9,6 +9,7 @@
 #include <mutex>
 #include <thread>
 
+#include "AsyncBatch.h"
 #include "BoteContext.h"
 #include "DHTworker.h"
 #include "Packet.h"
@@ -21,7 +22,8 @@ namespace kademlia
 DHTworker DHT_worker;
 
 DHTworker::DHTworker ()
-    : started_ (false), m_worker_thread_ (nullptr), local_node_ (nullptr)
+    : started_ (false), m_worker_thread_ (nullptr), local_node_ (nullptr),
+      local_handle_ (DEST_HANDLE_NONE)
 {
 }
 
@@ -38,12 +40,10 @@ DHTworker::~DHTworker ()
 }
 
 void
-DHTworker::start ()
+DHTworker::init ()
 {
-  local_node_
-      = std::make_shared<Node> (context.getLocalDestination ()->ToBase64 ());
-  if (isStarted ())
-    return;
+  local_node_ = std::make_shared<Node> (*context.getLocalDestination ());
+  local_handle_ = local_node_->handle ();
 
   if (!loadNodes ())
     LogPrint (eLogWarning, "DHT: Have no nodes for start");
@@ -51,8 +51,18 @@ DHTworker::start ()
   LogPrint (eLogDebug, "DHT: Load local packets");
   dht_storage_.set_storage_limit ();
   dht_storage_.update ();
+}
+
+void
+DHTworker::start ()
+{
+  if (isStarted ())
+    return;
+
+  init ();
 
   started_ = true;
+  m_resend_pool_.start (DHT_RESEND_THREADS);
   m_worker_thread_ = new std::thread (std::bind (&DHTworker::run, this));
 }
 
@@ -63,6 +73,9 @@ DHTworker::stop ()
     return;
 
   started_ = false;
+  /// Queued re-sends see stop and return at once
+  m_resend_pool_.stop ();
+  writeNodes ();
 
   LogPrint (eLogInfo, "DHT: Stopped");
 }
@@ -82,6 +95,17 @@ DHTworker::addNode (const std::string &dest)
     }
 }
 
+bool
+DHTworker::addNode (dest_handle dest)
+{
+  auto identity = dest_table.identity (dest);
+  if (identity)
+    return addNode (*identity);
+
+  LogPrint (eLogDebug, "DHT: addNode: Unknown destination handle");
+  return false;
+}
+
 bool
 DHTworker::addNode (const uint8_t *buf, size_t len)
 {
@@ -108,8 +132,8 @@ DHTworker::addNode (const i2p::data::IdentityEx &identity)
       return false;
     }
 
-  auto node = std::make_shared<Node> ();
-  node->FromBase64 (identity.ToBase64 ());
+  auto node = std::make_shared<Node> (identity);
+  node->first_seen = context.ts_now ();
   std::unique_lock<std::mutex> l (m_nodes_mutex_);
   return m_nodes_
       .insert (std::pair<HashKey, sp_node> (node->GetIdentHash (), node))
@@ -209,7 +233,9 @@ DHTworker::getClosestNodes (HashKey key, size_t num, bool to_us)
 std::vector<sp_node>
 DHTworker::getAllNodes ()
 {
+  /// Snapshot, handler threads add nodes meanwhile
   std::vector<sp_node> result;
+  std::unique_lock<std::mutex> l (m_nodes_mutex_);
 
   for (const auto &node : m_nodes_)
     result.push_back (node.second);
@@ -267,13 +293,111 @@ DHTworker::find (HashKey key, uint8_t type, bool exhaustive)
     return {};
   }
 
-  LogPrint (eLogDebug, "DHT: find: Start for type: ", type,
-            ", key: ", key.ToBase64 ());
+  return packet::wait_result<std::vector<sp_comm_pkt> > (
+    [this, key, type, exhaustive] (find_handler done)
+    {
+      findAsync (key, type, exhaustive, std::move (done));
+    });
+}
 
-  auto batch = std::make_shared<batch_comm_packet> ();
-  batch->owner = "DHT::find";
+/// Steps of continuation tasks share state, only one step runs at a time
+struct DHTworker::FindState
+{
+  HashKey key;
+  uint8_t type = 0;
+  bool exhaustive = false;
+  find_handler done;
+
+  std::shared_ptr<batch_comm_packet> batch;
+  /// Nodes which already got request from pipeline
+  std::set<HashKey> requested;
+  std::vector<sp_node> nodes;
+  size_t next_node = 0;
+  int counter = 0;
+  int32_t round_start = 0;
+  long hedge_delay = 0;
+  /// Hedge wait is over, next step doesn't wait again
+  bool waited = false;
+};
+
+void
+DHTworker::findAsync (HashKey key, uint8_t type, bool exhaustive,
+                      find_handler done)
+{
+  /// Concurrent lookups for the same key and type share one network task
+  flight_key f_key (exhaustive ? FLIGHT_FIND_ALL : FLIGHT_FIND_ONE, key, type);
+
+  bool joined = m_find_flights_.run_async (f_key,
+    [this, key, type, exhaustive] (find_handler flight_done)
+    {
+      auto state = std::make_shared<FindState> ();
+      state->key = key;
+      state->type = type;
+      state->exhaustive = exhaustive;
+      state->done = std::move (flight_done);
+
+      packet::packet_handler.get_IO_service ().post (
+          [this, state] () { find_task (state); });
+    }, std::move (done));
+
+  if (joined)
+    LogPrint (eLogDebug, "DHT: find: Joined lookup in flight for type: ",
+              type, ", key: ", key.ToBase64 ());
+}
+
+void
+DHTworker::find_task (const std::shared_ptr<FindState> &state)
+{
+  if (!started_)
+  {
+    LogPrint (eLogDebug, "DHT: Stopping");
+    state->done ({});
+    return;
+  }
+
+  LogPrint (eLogDebug, "DHT: find: Start for type: ", state->type,
+            ", key: ", state->key.ToBase64 ());
+
+  state->batch = std::make_shared<batch_comm_packet> ();
+  state->batch->owner = "DHT::find";
+
+  /// Batch is running from the start, so retrieve request can be sent
+  /// to node as soon as lookup finds it among the closest ones
+  context.send (state->batch, eSendLookup);
+
+  auto pipeline = [this, state] (const std::vector<sp_node> &nodes) -> bool
+    {
+      for (const auto &node : nodes)
+        {
+          if (state->requested.insert (node->GetIdentHash ()).second)
+            sendRetrieveRequest (state->batch, node, state->type,
+                                 state->key);
+        }
+
+      if (!nodes.empty ())
+        {
+          m_hedge_budget_.deposit (nodes.size ());
+          LogPrint (eLogDebug, "DHT: find: Pipelined ", nodes.size (),
+                    " request(s), batch size: ",
+                    state->batch->packetCount ());
+        }
+
+      /// findOne is done with first valid answer, findAll waits for lookup
+      return !state->exhaustive && countValid (state->batch) > 0;
+    };
+
+  closestNodesLookupAsync (state->key, pipeline,
+    [this, state] (std::vector<sp_node> nodes)
+    {
+      find_send (state, std::move (nodes));
+    });
+}
 
-  std::vector<sp_node> closestNodes = closestNodesLookupTask (key);
+void
+DHTworker::find_send (const std::shared_ptr<FindState> &state,
+                      std::vector<sp_node> closestNodes)
+{
+  auto &batch = state->batch;
 
   // ToDo: add find locally
 
@@ -284,55 +408,158 @@ DHTworker::find (HashKey key, uint8_t type, bool exhaustive)
     {
       LogPrint (eLogInfo, "DHT: find: Not enough nodes, try usual nodes");
 
-      for (const auto &node : m_nodes_)
-        closestNodes.push_back (node.second);
+      auto all_nodes = getAllNodes ();
+      closestNodes.insert (closestNodes.end (), all_nodes.begin (), all_nodes.end ());
 
       LogPrint (eLogDebug, "DHT: find: Usual nodes: ", closestNodes.size ());
     }
 
-  if (closestNodes.empty ())
+  /// Skip nodes which already got request from pipeline
+  const auto &requested = state->requested;
+  closestNodes.erase (std::remove_if (closestNodes.begin (),
+                                      closestNodes.end (),
+                                      [&requested] (const sp_node &node)
+                                      {
+                                        return requested.find (
+                                          node->GetIdentHash ())
+                                          != requested.end ();
+                                      }),
+                      closestNodes.end ());
+
+  if (closestNodes.empty () && batch->packetCount () == 0)
     {
       LogPrint (eLogError, "DHT: find: Not enough nodes");
-      return {};
+      context.removeBatch (batch);
+      state->done ({});
+      return;
     }
 
-  for (const auto &node : closestNodes)
+  /// For findOne we keep ALPHA requests in flight and the rest of nodes
+  /// for hedged requests, findAll needs answers from all of them
+  size_t in_flight = std::min (batch->packetCount (),
+                               (size_t)KADEMLIA_CONSTANT_ALPHA);
+  state->next_node = state->exhaustive
+                         ? closestNodes.size ()
+                         : std::min (closestNodes.size (),
+                                     KADEMLIA_CONSTANT_ALPHA - in_flight);
+
+  for (size_t i = 0; i < state->next_node; i++)
+    sendRetrieveRequest (batch, closestNodes[i], state->type, state->key);
+
+  LogPrint (eLogDebug, "DHT: find: Batch size: ", batch->packetCount ());
+  m_hedge_budget_.deposit (state->next_node);
+
+  state->nodes = std::move (closestNodes);
+  state->round_start = context.ts_now ();
+  state->hedge_delay = get_hedge_delay ();
+
+  if (!state->exhaustive)
     {
-      auto packet = retrieveRequestPacket (type, key);
+      find_hedge (state);
+      return;
+    }
 
-      PacketForQueue q_packet (node->ToBase64 (), packet.toByte ().data (),
-                               packet.toByte ().size ());
+  packet::async_wait (batch, batch_comm_packet::all (), RESPONSE_TIMEOUT,
+    [this, state] (bool) { find_resend (state); });
+}
 
-      std::vector<uint8_t> v_cid (std::begin (packet.cid),
-                                  std::end (packet.cid));
-      batch->addPacket (v_cid, q_packet);
+void
+DHTworker::find_resend (const std::shared_ptr<FindState> &state)
+{
+  auto &batch = state->batch;
+  if (!started_ || batch->responseCount () > 0 || state->counter >= 5)
+    {
+      find_finish (state);
+      return;
     }
 
-  LogPrint (eLogDebug, "DHT: find: Batch size: ", batch->packetCount ());
-  context.send (batch);
+  LogPrint (eLogWarning, "DHT: find: No responses, resend: #",
+            state->counter);
+  context.removeBatch (batch);
+  context.send (batch, eSendLookup);
+  state->counter++;
 
-  if (exhaustive)
-    batch->waitLast (RESPONSE_TIMEOUT);
-  else
-    batch->waitFist (RESPONSE_TIMEOUT);
+  packet::async_wait (batch, batch_comm_packet::all (), RESPONSE_TIMEOUT,
+    [this, state] (bool) { find_resend (state); });
+}
 
-  int counter = 0;
+void
+DHTworker::find_hedge (const std::shared_ptr<FindState> &state)
+{
+  auto &batch = state->batch;
+  auto &nodes = state->nodes;
 
-  while (batch->responseCount () < 1 && counter < 5 && started_)
+  while (started_)
     {
-      LogPrint (eLogWarning, "DHT: find: No responses, resend: #", counter);
-      context.removeBatch (batch);
-      context.send (batch);
+      /// First valid answer wins
+      if (countValid (batch) > 0)
+        break;
 
-      if (exhaustive)
-        batch->waitLast (RESPONSE_TIMEOUT);
-      else
-        batch->waitFist (RESPONSE_TIMEOUT);
-      counter++;
+      bool all_answered = batch->remain () == 0;
+      if (all_answered && state->next_node >= nodes.size ())
+        break;
+
+      /// Continues on first valid answer or when everybody answered
+      if (!all_answered && !state->waited)
+        {
+          state->waited = true;
+          packet::async_wait (batch,
+                              batch_comm_packet::quorum (1, isValidResponse),
+                              state->hedge_delay,
+                              [this, state] (bool) { find_hedge (state); });
+          return;
+        }
+
+      state->waited = false;
+
+      /// No valid answer within p90 RTT, ask next closest nodes too
+      if (state->next_node < nodes.size ())
+        {
+          size_t wanted = std::min (nodes.size () - state->next_node,
+                                    (size_t)KADEMLIA_CONSTANT_ALPHA);
+          size_t allowed = m_hedge_budget_.withdraw (wanted);
+
+          for (size_t i = 0; i < allowed; i++, state->next_node++)
+            sendRetrieveRequest (batch, nodes[state->next_node], state->type,
+                                 state->key);
+
+          if (allowed > 0)
+            {
+              LogPrint (eLogDebug, "DHT: find: Hedged ", allowed,
+                        " request(s) after ", state->hedge_delay, " sec");
+              continue;
+            }
+        }
+
+      /// Nobody left to wait for and hedge budget is exhausted
+      if (all_answered)
+        break;
+
+      if (context.ts_now () - state->round_start < RESPONSE_TIMEOUT)
+        continue;
+
+      if (state->counter >= 5)
+        break;
+
+      LogPrint (eLogWarning, "DHT: find: No responses, resend: #",
+                state->counter);
+      context.removeBatch (batch);
+      context.send (batch, eSendLookup);
+      state->round_start = context.ts_now ();
+      state->counter++;
     }
 
+  find_finish (state);
+}
+
+void
+DHTworker::find_finish (const std::shared_ptr<FindState> &state)
+{
+  auto &batch = state->batch;
+
   LogPrint (eLogDebug, "DHT: find: Got ", batch->responseCount (),
-            " responses for ", key.ToBase64 (), ", type: ", type);
+            " responses for ", state->key.ToBase64 (), ", type: ",
+            state->type);
 
   context.removeBatch (batch);
   auto responses = batch->getResponses ();
@@ -359,10 +586,10 @@ DHTworker::find (HashKey key, uint8_t type, bool exhaustive)
 
   LogPrint (eLogDebug, "DHT: find: Got ", result.size (), " valid responses");
 
-  return result;
+  state->done (std::move (result));
 }
 
-std::vector<std::string>
+std::vector<dest_handle>
 DHTworker::store (HashKey hash, uint8_t type, pbote::StoreRequestPacket packet)
 {
   if (!started_)
@@ -371,13 +598,54 @@ DHTworker::store (HashKey hash, uint8_t type, pbote::StoreRequestPacket packet)
     return {};
   }
 
+  return pbote::packet::wait_result<std::vector<dest_handle> > (
+    [this, hash, type, &packet] (store_handler done)
+    {
+      storeAsync (hash, type, std::move (packet), std::move (done));
+    });
+}
+
+struct DHTworker::StoreState
+{
+  HashKey hash;
+  uint8_t type = 0;
+  StoreRequestPacket packet;
+  store_handler done;
+
+  std::shared_ptr<batch_comm_packet> batch;
+  int counter = 0;
+};
+
+void
+DHTworker::storeAsync (HashKey hash, uint8_t type,
+                       pbote::StoreRequestPacket packet, store_handler done)
+{
   LogPrint (eLogDebug, "DHT: store: Start for type: ", type,
             ", key: ", hash.ToBase64 ());
 
-  auto batch = std::make_shared<batch_comm_packet> ();
-  batch->owner = "DHT::store";
+  auto state = std::make_shared<StoreState> ();
+  state->hash = hash;
+  state->type = type;
+  state->packet = std::move (packet);
+  state->done = std::move (done);
 
-  std::vector<sp_node> closestNodes = closestNodesLookupTask (hash);
+  closestNodesLookupAsync (hash, nullptr,
+    [this, state] (std::vector<sp_node> nodes)
+    {
+      store_send (state, std::move (nodes));
+    });
+}
+
+void
+DHTworker::store_send (const std::shared_ptr<StoreState> &state,
+                       std::vector<sp_node> closestNodes)
+{
+  if (!started_)
+  {
+    LogPrint (eLogDebug, "DHT: Stopping");
+    state->done ({});
+    return;
+  }
 
   LogPrint (eLogDebug, "DHT: store: Closest nodes: ", closestNodes.size ());
 
@@ -385,8 +653,8 @@ DHTworker::store (HashKey hash, uint8_t type, pbote::StoreRequestPacket packet)
     {
       LogPrint (eLogWarning, "DHT: store: Not enough nodes, try usual nodes");
 
-      for (const auto &node : m_nodes_)
-        closestNodes.push_back (node.second);
+      auto all_nodes = getAllNodes ();
+      closestNodes.insert (closestNodes.end (), all_nodes.begin (), all_nodes.end ());
 
       LogPrint (eLogDebug, "DHT: store: Usual nodes: ", closestNodes.size ());
     }
@@ -394,47 +662,70 @@ DHTworker::store (HashKey hash, uint8_t type, pbote::StoreRequestPacket packet)
   if (closestNodes.empty ())
     {
       LogPrint (eLogError, "DHT: store: Not enough nodes");
-      return {};
+      state->done ({});
+      return;
     }
 
+  auto &batch = state->batch;
+  batch = std::make_shared<batch_comm_packet> ();
+  batch->owner = "DHT::store";
+
+  auto &request = state->packet;
   for (const auto &node : closestNodes)
     {
-      context.random_cid (packet.cid, 32);
-      auto packet_bytes = packet.toByte ();
-      PacketForQueue q_packet (node->ToBase64 (), packet_bytes.data (),
-                               packet_bytes.size ());
+      context.random_cid (request.cid, 32);
+      auto bytes = request.toByte ();
+      if (!bytes)
+        continue;
 
-      std::vector<uint8_t> v_cid (std::begin (packet.cid),
-                                  std::end (packet.cid));
-      batch->addPacket (v_cid, q_packet);
+      batch->addPacket (request.cid, util::make_pooled<PacketForQueue> (
+                                        node->handle (), std::move (*bytes)));
     }
 
   LogPrint (eLogDebug, "DHT: store: Batch size: ", batch->packetCount ());
 
-  context.send (batch);
-  batch->waitLast (RESPONSE_TIMEOUT);
+  context.send (batch, eSendBulk);
+  packet::async_wait (batch, batch_comm_packet::all (), RESPONSE_TIMEOUT,
+    [this, state] (bool) { store_resend (state); });
+}
 
-  int counter = 0;
+void
+DHTworker::store_resend (const std::shared_ptr<StoreState> &state)
+{
+  auto &batch = state->batch;
 
   // ToDo:
-  //while (batch->responseCount () < KADEMLIA_CONSTANT_K && counter <= 5)
-  while (batch->responseCount () < 2 && counter <= 5 && started_)
+  //if (batch->responseCount () >= KADEMLIA_CONSTANT_K || counter > 5)
+  if (batch->responseCount () >= 2 || state->counter > 5 || !started_)
     {
-      LogPrint (eLogWarning, "DHT: store: No responses, resend: #", counter);
-      context.removeBatch (batch);
-      context.send (batch);
-
-      batch->waitLast (RESPONSE_TIMEOUT);
-      counter++;
+      store_finish (state);
+      return;
     }
 
+  LogPrint (eLogWarning, "DHT: store: No responses, resend: #",
+            state->counter);
+  context.removeBatch (batch);
+  context.send (batch, eSendBulk);
+  state->counter++;
+
+  packet::async_wait (batch, batch_comm_packet::all (), RESPONSE_TIMEOUT,
+    [this, state] (bool) { store_resend (state); });
+}
+
+void
+DHTworker::store_finish (const std::shared_ptr<StoreState> &state)
+{
+  auto &batch = state->batch;
+  collectRtt (batch);
+
   LogPrint (eLogDebug, "DHT: store: Got ", batch->responseCount (),
-            " responses for ", hash.ToBase64 (), ", type: ", type);
+            " responses for ", state->hash.ToBase64 (), ", type: ",
+            state->type);
 
   context.removeBatch (batch);
   auto responses = batch->getResponses ();
 
-  std::vector<std::string> result;
+  std::vector<dest_handle> result;
   result.reserve (responses.size ());
 
   for (const auto &response : responses)
@@ -459,10 +750,10 @@ DHTworker::store (HashKey hash, uint8_t type, pbote::StoreRequestPacket packet)
 
   LogPrint (eLogDebug, "DHT: store: Got ", result.size (), " valid responses");
 
-  return result;
+  state->done (std::move (result));
 }
 
-std::vector<std::string>
+std::vector<dest_handle>
 DHTworker::deleteEmail (HashKey hash, uint8_t type,
                         pbote::EmailDeleteRequestPacket packet)
 {
@@ -475,7 +766,10 @@ DHTworker::deleteEmail (HashKey hash, uint8_t type,
   LogPrint (eLogDebug, "DHT: deleteEmail: Start for type: ", type,
             ", hash: ", hash.ToBase64 ());
 
-  if (dht_storage_.Delete (type::DataE, hash))
+  /// Called from email tasks, storage is changed only on storage strand
+  bool deleted = packet::packet_handler.run_on_storage (
+      [this, hash] { return dht_storage_.Delete (type::DataE, hash); });
+  if (deleted)
     {
       LogPrint (eLogDebug, "DHT: deleteEmail: Removed local packet, hash: ",
         hash.ToBase64 ());
@@ -494,8 +788,8 @@ DHTworker::deleteEmail (HashKey hash, uint8_t type,
       LogPrint (eLogInfo,
                 "DHT: deleteEmail: Not enough nodes, try usual nodes");
 
-      for (const auto &node : m_nodes_)
-        closestNodes.push_back (node.second);
+      auto all_nodes = getAllNodes ();
+      closestNodes.insert (closestNodes.end (), all_nodes.begin (), all_nodes.end ());
 
       LogPrint (eLogDebug,
                 "DHT: deleteEmail: Usual nodes: ", closestNodes.size ());
@@ -510,18 +804,17 @@ DHTworker::deleteEmail (HashKey hash, uint8_t type,
   for (const auto &node : closestNodes)
     {
       context.random_cid (packet.cid, 32);
-      auto packet_bytes = packet.toByte ();
-      PacketForQueue q_packet (node->ToBase64 (), packet_bytes.data (),
-                               packet_bytes.size ());
+      auto bytes = packet.toByte ();
+      if (!bytes)
+        continue;
 
-      std::vector<uint8_t> v_cid (std::begin (packet.cid),
-                                  std::end (packet.cid));
-      batch->addPacket (v_cid, q_packet);
+      batch->addPacket (packet.cid, util::make_pooled<PacketForQueue> (
+                                        node->handle (), std::move (*bytes)));
     }
 
   LogPrint (eLogDebug,
             "DHT: deleteEmail: Batch size: ", batch->packetCount ());
-  context.send (batch);
+  context.send (batch, eSendBulk);
 
   batch->waitLast (RESPONSE_TIMEOUT);
 
@@ -531,7 +824,7 @@ DHTworker::deleteEmail (HashKey hash, uint8_t type,
       LogPrint (eLogWarning, "DHT: deleteEmail: No responses, resend: #",
                 counter);
       context.removeBatch (batch);
-      context.send (batch);
+      context.send (batch, eSendBulk);
       // ToDo: remove answered nodes from batch
       batch->waitLast (RESPONSE_TIMEOUT);
       counter++;
@@ -541,7 +834,7 @@ DHTworker::deleteEmail (HashKey hash, uint8_t type,
             " responses for ", hash.ToBase64 (), ", type: ", type);
   context.removeBatch (batch);
 
-  std::vector<std::string> res;
+  std::vector<dest_handle> res;
 
   auto responses = batch->getResponses ();
 
@@ -556,14 +849,14 @@ DHTworker::deleteEmail (HashKey hash, uint8_t type,
         {
           res.push_back (response->from);
           LogPrint (eLogDebug, "DHT: deleteEmail: Valid response from: ",
-                    response->from.substr (0, 15), "...");
+                    dest_table.short_name (response->from));
         }
     }
 
   return res;
 }
 
-std::vector<std::string>
+std::vector<dest_handle>
 DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
                              HashKey del_auth)
 {
@@ -577,7 +870,11 @@ DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
             email_dht_key.ToBase64 (), ", hash: ", del_auth.ToBase64 ());
 
   // ToDo: Need to check if we need to remove part
-  if (dht_storage_.Delete (type::DataI, index_dht_key))
+  bool deleted = packet::packet_handler.run_on_storage (
+      [this, index_dht_key] {
+        return dht_storage_.Delete (type::DataI, index_dht_key);
+      });
+  if (deleted)
     {
       LogPrint (eLogDebug,
         "DHT: deleteIndexEntry: Removed local packet, hash: ",
@@ -597,8 +894,8 @@ DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
       LogPrint (eLogInfo,
                 "DHT: deleteIndexEntry: Not enough nodes, try usual nodes");
 
-      for (const auto &node : m_nodes_)
-        closestNodes.push_back (node.second);
+      auto all_nodes = getAllNodes ();
+      closestNodes.insert (closestNodes.end (), all_nodes.begin (), all_nodes.end ());
 
       LogPrint (eLogDebug,
                 "DHT: deleteIndexEntry: Usual nodes: ", closestNodes.size ());
@@ -623,19 +920,18 @@ DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
 
       packet.data.push_back (item);
 
-      auto packet_bytes = packet.toByte ();
-      PacketForQueue q_packet (node->ToBase64 (), packet_bytes.data (),
-                               packet_bytes.size ());
+      auto bytes = packet.toByte ();
+      if (!bytes)
+        continue;
 
-      std::vector<uint8_t> v_cid (std::begin (packet.cid),
-                                  std::end (packet.cid));
-      batch->addPacket (v_cid, q_packet);
+      batch->addPacket (packet.cid, util::make_pooled<PacketForQueue> (
+                                        node->handle (), std::move (*bytes)));
     }
 
   LogPrint (eLogDebug,
             "DHT: deleteIndexEntry: Batch size: ", batch->packetCount ());
 
-  context.send (batch);
+  context.send (batch, eSendBulk);
 
   batch->waitLast (RESPONSE_TIMEOUT);
 
@@ -645,7 +941,7 @@ DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
       LogPrint (eLogWarning, "DHT: deleteIndexEntry: No responses, resend: #",
                 counter);
       context.removeBatch (batch);
-      context.send (batch);
+      context.send (batch, eSendBulk);
       // ToDo: remove answered nodes from batch
       batch->waitLast (RESPONSE_TIMEOUT);
       counter++;
@@ -656,7 +952,7 @@ DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
 
   context.removeBatch (batch);
 
-  std::vector<std::string> res;
+  std::vector<dest_handle> res;
 
   auto responses = batch->getResponses ();
 
@@ -670,14 +966,14 @@ DHTworker::deleteIndexEntry (HashKey index_dht_key, HashKey email_dht_key,
         {
           res.push_back (response->from);
           LogPrint (eLogDebug, "DHT: deleteIndexEntry: Valid response from: ",
-                    response->from.substr (0, 15), "...");
+                    dest_table.short_name (response->from));
         }
     }
 
   return res;
 }
 
-std::vector<std::shared_ptr<pbote::DeletionInfoPacket> >
+std::vector<sp_del_info>
 DHTworker::deletion_query (const HashKey &key)
 {
   if (!started_)
@@ -686,6 +982,23 @@ DHTworker::deletion_query (const HashKey &key)
     return {};
   }
 
+  flight_key f_key (FLIGHT_DELETION_QUERY, key, DataT);
+  bool joined = false;
+
+  auto result = m_del_query_flights_.run (f_key,
+    [this, key] () { return deletion_query_task (key); }, &joined);
+
+  if (joined)
+    LogPrint (eLogDebug, "DHT: deletion_query: Joined query in flight for key: ",
+              key.ToBase64 (), ", results: ", result.size ());
+
+  return result;
+}
+
+std::vector<sp_del_info>
+DHTworker::deletion_query_task (const HashKey &key)
+{
+
   LogPrint (eLogDebug, "DHT: deletion_query: Start for key: ", key.ToBase64 ());
 
   // ToDo: Need to check if we have localy
@@ -710,8 +1023,8 @@ DHTworker::deletion_query (const HashKey &key)
       LogPrint (eLogInfo,
                 "DHT: deletion_query: Not enough nodes, try usual nodes");
 
-      for (const auto &node : m_nodes_)
-        close_nodes.push_back (node.second);
+      auto all_nodes = getAllNodes ();
+      close_nodes.insert (close_nodes.end (), all_nodes.begin (), all_nodes.end ());
 
       LogPrint (eLogDebug,
                 "DHT: deletion_query: Usual nodes: ", close_nodes.size ());
@@ -729,19 +1042,18 @@ DHTworker::deletion_query (const HashKey &key)
       context.random_cid (packet.cid, 32);
       memcpy (packet.dht_key, key.data (), 32);
 
-      auto packet_bytes = packet.toByte ();
-      PacketForQueue q_packet (node->ToBase64 (), packet_bytes.data (),
-                               packet_bytes.size ());
+      auto bytes = packet.toByte ();
+      if (!bytes)
+        continue;
 
-      std::vector<uint8_t> v_cid (std::begin (packet.cid),
-                                  std::end (packet.cid));
-      batch->addPacket (v_cid, q_packet);
+      batch->addPacket (packet.cid, util::make_pooled<PacketForQueue> (
+                                        node->handle (), std::move (*bytes)));
     }
 
   LogPrint (eLogDebug,
             "DHT: deletion_query: Batch size: ", batch->packetCount ());
 
-  context.send (batch);
+  context.send (batch, eSendLookup);
 
   batch->waitLast (RESPONSE_TIMEOUT);
 
@@ -751,7 +1063,7 @@ DHTworker::deletion_query (const HashKey &key)
       LogPrint (eLogWarning, "DHT: deletion_query: No responses, resend: #",
                 counter);
       context.removeBatch (batch);
-      context.send (batch);
+      context.send (batch, eSendLookup);
       // ToDo: remove answered nodes from batch
       batch->waitLast (RESPONSE_TIMEOUT);
       counter++;
@@ -769,15 +1081,23 @@ DHTworker::deletion_query (const HashKey &key)
   for (const auto &response : responses)
     {
       pbote::ResponsePacket res_packet;
-      res_packet.from_comm_packet (*response, true);
+      bool parsed = res_packet.from_comm_packet (*response, true);
 
-      if (res_packet.status == StatusCode::OK)
+      if (parsed && res_packet.status == StatusCode::OK)
         {
           LogPrint (eLogDebug, "DHT: deletion_query: OK response from: ",
-                    response->from.substr (0, 15), "...");
+                    dest_table.short_name (response->from));
 
           pbote::DeletionInfoPacket del_info_packet;
-          del_info_packet.fromBuffer (res_packet.data, true);
+          parsed = del_info_packet.fromBuffer (res_packet.data.data (),
+                                               res_packet.data.size (), true);
+          if (!parsed)
+            {
+              LogPrint (eLogWarning, "DHT: deletion_query: Bad packet from: ",
+                        dest_table.short_name (response->from));
+              continue;
+            }
+
           results.push_back (std::make_shared<pbote::DeletionInfoPacket>(del_info_packet));
         }
     }
@@ -789,7 +1109,7 @@ DHTworker::deletion_query (const HashKey &key)
 }
 
 std::vector<sp_node>
-DHTworker::closestNodesLookupTask (HashKey key)
+DHTworker::closestNodesLookupTask (HashKey key, const LookupObserver &observer)
 {
   if (!started_)
   {
@@ -797,15 +1117,64 @@ DHTworker::closestNodesLookupTask (HashKey key)
     return {};
   }
 
-  auto batch = std::make_shared<batch_comm_packet> ();
-  batch->owner = "DHT::closestNodesLookup";
+  return packet::wait_result<std::vector<sp_node> > (
+    [this, key, &observer] (lookup_handler done)
+    {
+      closestNodesLookupAsync (key, observer, std::move (done));
+    });
+}
+
+struct DHTworker::LookupState
+{
+  HashKey key;
+  LookupObserver observer;
+  lookup_handler done;
 
+  std::shared_ptr<batch_comm_packet> batch;
   std::map<HashKey, sp_node> closestNodes;
   std::vector<sp_comm_pkt> responses;
-  std::map<std::vector<uint8_t>, sp_node> active_requests;
+  std::unordered_map<cid_type, sp_node, IdentHashHasher> active_requests;
+  /// Nodes which answered to us, candidates for best set too
+  std::map<HashKey, sp_node> responders;
+  /// Nodes already passed to observer
+  std::set<HashKey> announced;
+  size_t processed = 0;
+  /// Responses processed before current round
+  size_t round_processed = 0;
+  size_t counter = 1;
+  bool stopped = false;
+  int32_t task_start_time = 0;
+  int32_t round_start = 0;
+};
+
+void
+DHTworker::closestNodesLookupAsync (HashKey key, LookupObserver observer,
+                                    lookup_handler done)
+{
+  auto state = std::make_shared<LookupState> ();
+  state->key = key;
+  state->observer = std::move (observer);
+  state->done = std::move (done);
+
+  packet::packet_handler.get_IO_service ().post (
+      [this, state] () { lookup_start (state); });
+}
+
+void
+DHTworker::lookup_start (const std::shared_ptr<LookupState> &state)
+{
+  if (!started_)
+  {
+    LogPrint (eLogDebug, "DHT: Stopping");
+    state->done ({});
+    return;
+  }
+
+  state->batch = std::make_shared<batch_comm_packet> ();
+  state->batch->owner = "DHT::closestNodesLookup";
 
   /// Set start time
-  int32_t task_start_time = context.ts_now ();
+  state->task_start_time = context.ts_now ();
   auto unlocked_nodes = getUnlockedNodes ();
 
   if (unlocked_nodes.empty ())
@@ -814,238 +1183,326 @@ DHTworker::closestNodesLookupTask (HashKey key)
   for (auto node : unlocked_nodes)
     {
       /// Create find closest peers packet
-      auto packet = findClosePeersPacket (key);
-      auto bytes = packet.toByte ();
+      auto packet = findClosePeersPacket (state->key);
 
-      PacketForQueue q_packet (node->ToBase64 (), bytes.data (), bytes.size ());
-      std::vector<uint8_t> vcid (std::begin (packet.cid), std::end (packet.cid));
+      /// Remember requested node to check timeout later
+      state->active_requests.emplace (packet.cid, node);
+      auto bytes = packet.toByte ();
+      if (!bytes)
+        continue;
 
-      /// Copy packet to pending task for check timeout later
-      active_requests.insert (
-          std::pair<std::vector<uint8_t>, sp_node> (vcid, node));
-      batch->addPacket (vcid, q_packet);
+      state->batch->addPacket (packet.cid, util::make_pooled<PacketForQueue> (
+                                        node->handle (), std::move (*bytes)));
     }
 
-  int32_t exec_duration = 0;
-  size_t counter = 1;
+  lookup_round (state);
+}
+
+void
+DHTworker::lookup_round (const std::shared_ptr<LookupState> &state)
+{
+  int32_t exec_duration = context.ts_now () - state->task_start_time;
 
   /// While we have unanswered requests and timeout not reached
-  while (!active_requests.empty ()  && started_
-         && exec_duration < CLOSEST_NODES_LOOKUP_TIMEOUT)
+  if (state->active_requests.empty () || !started_ || state->stopped
+      || exec_duration >= CLOSEST_NODES_LOOKUP_TIMEOUT)
     {
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: Request #", counter);
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: Batch size: ",
-                batch->packetCount ());
-
-      counter++;
-
-      context.send (batch);
-      batch->waitLast (RESPONSE_TIMEOUT);
-      context.removeBatch (batch);
-      responses = batch->getResponses ();
-
-      if (responses.empty ())
-        {
-          LogPrint (eLogWarning, "DHT: closestNodesLookup: Not enough "
-                                 "responses, resend batch");
-          exec_duration = context.ts_now () - task_start_time;
-          LogPrint (eLogDebug, "DHT: closestNodesLookup: Duration: ", exec_duration);
-          continue;
-        }
+      lookup_finish (state);
+      return;
+    }
 
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: Got ",responses.size (),
-                " responses for key ", key.ToBase64 ());
+  LogPrint (eLogDebug, "DHT: closestNodesLookup: Request #", state->counter);
+  LogPrint (eLogDebug, "DHT: closestNodesLookup: Batch size: ",
+            state->batch->packetCount ());
 
-      for (const auto &response : responses)
-        {
-          std::vector<uint8_t> vcid (std::begin (response->cid),
-                                     std::end (response->cid));
-          /// Check if we sent requests with this CID
-          if (active_requests.find (vcid) != active_requests.end ())
-            {
-              /// Remove node from active requests and from batch
-              active_requests.erase (vcid);
-              batch->removePacket (vcid);
-            }
-        }
+  state->counter++;
+  state->round_processed = state->processed;
 
-      exec_duration = context.ts_now () - task_start_time;
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: Duration: ", exec_duration);
-    }
+  context.send (state->batch, eSendLookup);
+  state->round_start = context.ts_now ();
 
-  if (!started_)
-  {
-    LogPrint (eLogDebug, "DHT: Stopping");
-    return {};
-  }
+  lookup_wait (state);
+}
 
-  if (exec_duration >= CLOSEST_NODES_LOOKUP_TIMEOUT)
-    {
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: Timed out");
-    }
+void
+DHTworker::lookup_wait (const std::shared_ptr<LookupState> &state)
+{
+  auto on_wait = [this, state] (bool) { lookup_collect (state); };
+
+  /// With observer responses are handled one by one as they come,
+  /// so caller can start its requests before lookup converged
+  if (state->observer)
+    packet::async_wait (state->batch,
+                        batch_comm_packet::next (state->processed),
+                        LOOKUP_OBSERVER_INTERVAL, on_wait);
+  else
+    packet::async_wait (state->batch, batch_comm_packet::all (),
+                        RESPONSE_TIMEOUT, on_wait);
+}
 
-  context.removeBatch (batch);
+void
+DHTworker::lookup_collect (const std::shared_ptr<LookupState> &state)
+{
+  auto &batch = state->batch;
+  state->responses = batch->getResponses ();
 
-  /// If we have at least one response
-  for (const auto &response : responses)
+  for (; state->processed < state->responses.size (); state->processed++)
     {
-      if (response->type != type::CommN)
+      const auto &response = state->responses[state->processed];
+      cid_type cid (response->cid);
+      /// Check if we sent requests with this CID
+      auto request = state->active_requests.find (cid);
+      if (request != state->active_requests.end ())
         {
-          // ToDo: Looks like in case if we got request to ourself,
-          // for now we just skip it
-          LogPrint (eLogWarning,
-                    "DHT: closestNodesLookup: Got non-response packet, type: ",
-                    response->type, ", ver: ", unsigned (response->ver));
-          continue;
+          state->responders.emplace (request->second->GetIdentHash (),
+                                     request->second);
+          /// Remove node from active requests and from batch
+          state->active_requests.erase (request);
+          batch->removePacket (cid);
         }
 
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: Response from: ",
-                response->from.substr (0, 15), "...");
-
-      pbote::ResponsePacket packet;
-      bool parsed = packet.from_comm_packet (*response, true);
-      if (!parsed)
+      for (const auto &peer : parsePeerList (response))
         {
-          LogPrint (eLogWarning, "DHT: closestNodesLookup: Payload is too "
-                                 "short, parsing skipped");
-          continue;
+          if (state->closestNodes.emplace (peer->GetIdentHash (), peer).second)
+            LogPrint (eLogDebug, "DHT: closestNodesLookup: Added node: ",
+                      peer->GetIdentHash ().ToBase64 ());
         }
+    }
 
-      if (packet.status != StatusCode::OK)
-        {
-          LogPrint (eLogWarning, "DHT: closestNodesLookup: Response status: ",
-                    statusToString (packet.status), ", parsing skipped");
-          continue;
-        }
+  if (state->observer)
+    {
+      state->stopped = lookup_announce (*state);
 
-      if (packet.length == 0)
+      if (!state->stopped && started_ && !state->active_requests.empty ()
+          && context.ts_now () - state->round_start < RESPONSE_TIMEOUT)
         {
-          LogPrint (eLogWarning, "DHT: closestNodesLookup: Packet without "
-                                 "payload, parsing skipped");
-          continue;
+          lookup_wait (state);
+          return;
         }
+    }
 
-      size_t nodes_added = 0, nodes_dup = 0;
-      std::vector<sp_node> node_list;
+  context.removeBatch (batch);
 
-      if (unsigned (packet.data[1]) == 4)
-        {
-          pbote::PeerListPacketV4 peer_list;
-          bool parsed = peer_list.fromBuffer (packet.data.data (),
-                                              packet.length, true);
+  if (state->processed == state->round_processed && !state->stopped)
+    LogPrint (eLogWarning, "DHT: closestNodesLookup: Not enough "
+                           "responses, resend batch");
+  else
+    LogPrint (eLogDebug, "DHT: closestNodesLookup: Got ",
+              state->processed - state->round_processed,
+              " responses for key ", state->key.ToBase64 ());
 
-          if (!parsed)
-          {
-            LogPrint (eLogWarning,
-                      "DHT: closestNodesLookup: V4 packet parsing failed");
-            continue;
-          }
+  LogPrint (eLogDebug, "DHT: closestNodesLookup: Duration: ",
+            context.ts_now () - state->task_start_time);
 
-          for (auto node : peer_list.data)
-            {
-              if (addNode (node))
-                nodes_added++;
-              else
-                nodes_dup++;
-              node_list.emplace_back (std::make_shared<Node> (node.ToBase64 ()));
-            }
-          LogPrint (eLogDebug, "DHT: closestNodesLookup: V4 nodes: ",
-                    node_list.size (), ", added: ", nodes_added,
-                    ", dup: ", nodes_dup);
-        }
+  lookup_round (state);
+}
 
-      if (unsigned (packet.data[1]) == 5)
-        {
-          pbote::PeerListPacketV5 peer_list;
-          bool parsed = peer_list.fromBuffer (packet.data.data (),
-                                              packet.length, true);
+bool
+DHTworker::lookup_announce (LookupState &state)
+{
+  const auto &key = state.key;
+  std::vector<std::pair<i2p::data::XORMetric, sp_node> > sorted;
+  sorted.reserve (state.closestNodes.size () + state.responders.size ());
 
-          if (!parsed)
-          {
-            LogPrint (eLogWarning,
-                      "DHT: closestNodesLookup: V5 packet parsing failed");
-            continue;
-          }
+  for (const auto &it : state.closestNodes)
+    sorted.emplace_back (key ^ it.first, it.second);
 
-          for (auto node : peer_list.data)
-            {
-              if (addNode (node))
-                nodes_added++;
-              else
-                nodes_dup++;
-              node_list.emplace_back (std::make_shared<Node> (node.ToBase64 ()));
-            }
-          LogPrint (eLogDebug, "DHT: closestNodesLookup: V5 nodes: ",
-                    node_list.size (), ", added: ", nodes_added,
-                    ", dup: ", nodes_dup);
-        }
+  for (const auto &it : state.responders)
+    if (state.closestNodes.find (it.first) == state.closestNodes.end ())
+      sorted.emplace_back (key ^ it.first, it.second);
 
-      if (node_list.empty ())
-        {
-          LogPrint (eLogDebug, "DHT: closestNodesLookup: node_list empty");
-          continue;
-        }
+  size_t best = std::min (sorted.size (), (size_t)CLOSEST_NODES_COUNT);
+  std::partial_sort (sorted.begin (), sorted.begin () + best, sorted.end (),
+                     [] (const auto &a, const auto &b)
+                     { return a.first < b.first; });
 
-      LogPrint (eLogDebug, "DHT: closestNodesLookup: node_list size: ",
-                node_list.size ());
+  std::vector<sp_node> entered;
+  for (size_t i = 0; i < best; i++)
+    {
+      const auto &hash = sorted[i].second->GetIdentHash ();
+      if (hash == local_node_->GetIdentHash ())
+        continue;
 
-      for (const auto &peer : node_list)
-        {
-          auto it = closestNodes.find (peer->GetIdentHash ());
-          if (it == closestNodes.end ())
-            {
-              closestNodes.insert (
-                  std::pair<HashKey, sp_node> (peer->GetIdentHash (), peer));
-              LogPrint (eLogDebug, "DHT: closestNodesLookup: Added node: ",
-                        peer->GetIdentHash ().ToBase64 ());
-            }
-        }
+      if (state.announced.insert (hash).second)
+        entered.push_back (sorted[i].second);
     }
 
-  context.removeBatch (batch);
+  /// Called even without new nodes, so observer can stop lookup
+  /// because of its own progress
+  return state.observer (entered);
+}
+
+void
+DHTworker::lookup_finish (const std::shared_ptr<LookupState> &state)
+{
+  if (!started_)
+  {
+    LogPrint (eLogDebug, "DHT: Stopping");
+    state->done ({});
+    return;
+  }
+
+  if (context.ts_now () - state->task_start_time
+      >= CLOSEST_NODES_LOOKUP_TIMEOUT)
+    {
+      LogPrint (eLogDebug, "DHT: closestNodesLookup: Timed out");
+    }
+
+  collectRtt (state->batch);
 
   /// If we have no responses - try with known nodes
-  if (responses.empty ())
+  if (state->responses.empty ())
     {
       LogPrint (eLogWarning, "DHT: closestNodesLookup: Not enough "
                 "responses, will use known nodes");
-      return getClosestNodes (key, 20, false);
+      state->done (getClosestNodes (state->key, CLOSEST_NODES_COUNT, false));
+      return;
     }
 
-  /// Now we can lock nodes
-  calc_locks (responses);
+  /// Lookup was cut short, silent nodes could just not have time to answer
+  if (state->stopped)
+    LogPrint (eLogDebug, "DHT: closestNodesLookup: Stopped by observer after ",
+              state->responses.size (), " responses");
+  else
+    /// Now we can lock nodes
+    calc_locks (state->responses);
 
   /// If the node is in the received list - the answering node has it unlocked
   /// If we have node locally and it's locked - unlock it
   size_t unlocked_counter = 0;
-  auto node_itr = closestNodes.begin ();
-  while (node_itr != closestNodes.end ())
+  for (const auto &node : state->closestNodes)
     {
-      auto known_node = findNode (node_itr->second->GetIdentHash ());
+      auto known_node = findNode (node.second->GetIdentHash ());
       if (known_node && known_node->locked ())
         {
           known_node->gotResponse ();
           unlocked_counter++;
         }
-      ++node_itr;
     }
 
   LogPrint (eLogDebug, "DHT: closestNodesLookup: Unlocked node(s): ",
             unlocked_counter);
 
-  for (const auto &node : closestNodes)
-    addNode (node.second->ToBase64 ());
+  for (const auto &node : state->closestNodes)
+    addNode (*node.second);
 
-  return getClosestNodes (key, 20, false);
+  state->done (getClosestNodes (state->key, CLOSEST_NODES_COUNT, false));
+}
+
+std::vector<sp_node>
+DHTworker::parsePeerList (const sp_comm_pkt &response)
+{
+  if (response->type != type::CommN)
+    {
+      // ToDo: Looks like in case if we got request to ourself,
+      // for now we just skip it
+      LogPrint (eLogWarning,
+                "DHT: closestNodesLookup: Got non-response packet, type: ",
+                response->type, ", ver: ", unsigned (response->ver));
+      return {};
+    }
+
+  LogPrint (eLogDebug, "DHT: closestNodesLookup: Response from: ",
+            dest_table.short_name (response->from));
+
+  pbote::ResponsePacket packet;
+  bool parsed = packet.from_comm_packet (*response, true);
+  if (!parsed)
+    {
+      LogPrint (eLogWarning, "DHT: closestNodesLookup: Payload is too "
+                             "short, parsing skipped");
+      return {};
+    }
+
+  if (packet.status != StatusCode::OK)
+    {
+      LogPrint (eLogWarning, "DHT: closestNodesLookup: Response status: ",
+                statusToString (packet.status), ", parsing skipped");
+      return {};
+    }
+
+  /// Need type[1] + ver[1] of peer list
+  if (packet.data.size () < 2)
+    {
+      LogPrint (eLogWarning, "DHT: closestNodesLookup: Packet without "
+                             "payload, parsing skipped");
+      return {};
+    }
+
+  size_t nodes_added = 0, nodes_dup = 0;
+  std::vector<sp_node> node_list;
+
+  if (unsigned (packet.data[1]) == 4)
+    {
+      pbote::PeerListPacketV4 peer_list;
+      parsed = peer_list.fromBuffer (packet.data.data (), packet.data.size (),
+                                     true);
+
+      if (!parsed)
+      {
+        LogPrint (eLogWarning,
+                  "DHT: closestNodesLookup: V4 packet parsing failed");
+        return {};
+      }
+
+      for (auto node : peer_list.data)
+        {
+          if (addNode (node))
+            nodes_added++;
+          else
+            nodes_dup++;
+          node_list.emplace_back (std::make_shared<Node> (node));
+        }
+      LogPrint (eLogDebug, "DHT: closestNodesLookup: V4 nodes: ",
+                node_list.size (), ", added: ", nodes_added,
+                ", dup: ", nodes_dup);
+    }
+
+  if (unsigned (packet.data[1]) == 5)
+    {
+      pbote::PeerListPacketV5 peer_list;
+      parsed = peer_list.fromBuffer (packet.data.data (), packet.data.size (),
+                                     true);
+
+      if (!parsed)
+      {
+        LogPrint (eLogWarning,
+                  "DHT: closestNodesLookup: V5 packet parsing failed");
+        return {};
+      }
+
+      for (auto node : peer_list.data)
+        {
+          if (addNode (node))
+            nodes_added++;
+          else
+            nodes_dup++;
+          node_list.emplace_back (std::make_shared<Node> (node));
+        }
+      LogPrint (eLogDebug, "DHT: closestNodesLookup: V5 nodes: ",
+                node_list.size (), ", added: ", nodes_added,
+                ", dup: ", nodes_dup);
+    }
+
+  if (node_list.empty ())
+    {
+      LogPrint (eLogDebug, "DHT: closestNodesLookup: node_list empty");
+      return {};
+    }
+
+  LogPrint (eLogDebug, "DHT: closestNodesLookup: node_list size: ",
+            node_list.size ());
+
+  return node_list;
 }
 
 void
 DHTworker::receiveRetrieveRequest (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "DHT: receiveRetrieveRequest: Request from: ",
-            packet->from.substr (0, 15), "...");
+            dest_table.short_name (packet->from));
 
-  if (packet->from == local_node_->ToBase64 ())
+  if (packet->from == local_handle_)
     {
       LogPrint (eLogWarning,
                 "DHT: receiveRetrieveRequest: Self request, skipped");
@@ -1070,11 +1527,9 @@ DHTworker::receiveRetrieveRequest (const sp_comm_pkt &packet)
       response.status = pbote::StatusCode::INVALID_PACKET;
       response.length = 0;
 
-      PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                               response.toByte ().size ());
       LogPrint (eLogDebug, "DHT: receiveRetrieveRequest: Response status: ",
                 statusToString (response.status));
-      context.send (q_packet);
+      context.send (packet->from, response.toByte (), eSendResponse);
       return;
     }
 
@@ -1113,23 +1568,21 @@ DHTworker::receiveRetrieveRequest (const sp_comm_pkt &packet)
 
       response.status = pbote::StatusCode::OK;
       response.length = data.size ();
-      response.data = data;
+      response.data = std::move (data);
     }
 
-  PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                           response.toByte ().size ());
   LogPrint (eLogDebug, "DHT: receiveRetrieveRequest: Response status: ",
             statusToString (response.status));
-  context.send (q_packet);
+  context.send (packet->from, response.toByte (), eSendResponse);
 }
 
 void
 DHTworker::receiveDeletionQuery (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "DHT: receiveDeletionQuery: request from: ",
-            packet->from.substr (0, 15), "...");
+            dest_table.short_name (packet->from));
 
-  if (packet->from == local_node_->ToBase64 ())
+  if (packet->from == local_handle_)
     {
       LogPrint (eLogWarning,
                 "DHT: receiveDeletionQuery: Self request, skipped");
@@ -1152,11 +1605,9 @@ DHTworker::receiveDeletionQuery (const sp_comm_pkt &packet)
       response.status = pbote::StatusCode::INVALID_PACKET;
       response.length = 0;
 
-      PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                           response.toByte ().size ());
       LogPrint (eLogDebug, "DHT: receiveDeletionQuery: Response status: ",
                 statusToString (response.status));
-      context.send (q_packet);
+      context.send (packet->from, response.toByte (), eSendResponse);
       return;
     }
 
@@ -1192,20 +1643,18 @@ DHTworker::receiveDeletionQuery (const sp_comm_pkt &packet)
   response.status = pbote::StatusCode::NO_DATA_FOUND;
   response.length = 0;
 
-  PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                           response.toByte ().size ());
   LogPrint (eLogDebug, "DHT: receiveDeletionQuery: Response status: ",
             statusToString (response.status));
-  context.send (q_packet);
+  context.send (packet->from, response.toByte (), eSendResponse);
 }
 
 void
 DHTworker::receiveStoreRequest (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "DHT: StoreRequest: request from: ",
-            packet->from.substr (0, 15), "...");
+            dest_table.short_name (packet->from));
 
-  if (packet->from == local_node_->ToBase64 ())
+  if (packet->from == local_handle_)
     {
       LogPrint (eLogWarning, "DHT: StoreRequest: Self request, skipped");
       return;
@@ -1227,10 +1676,20 @@ DHTworker::receiveStoreRequest (const sp_comm_pkt &packet)
       response.status = pbote::StatusCode::INVALID_PACKET;
     }
 
-  if ((store_packet.data[0] == (uint8_t)'I' ||
+  /// Stored packet starts with type[1] + ver[1] + key[32]
+  if (parsed && store_packet.data.size () < 34)
+    {
+      LogPrint (eLogWarning, "DHT: receiveStoreRequest: Data is too short: ",
+                store_packet.data.size ());
+      response.status = pbote::StatusCode::INVALID_PACKET;
+      parsed = false;
+    }
+
+  if (parsed &&
+      (store_packet.data[0] == (uint8_t)'I' ||
        store_packet.data[0] == (uint8_t)'E' ||
        store_packet.data[0] == (uint8_t)'C') &&
-      store_packet.data[1] >= 4 && parsed)
+      store_packet.data[1] >= 4)
     {
       bool prev_status = true;
 
@@ -1250,7 +1709,7 @@ DHTworker::receiveStoreRequest (const sp_comm_pkt &packet)
       int save_status = 0;
 
       if (prev_status)
-        save_status = dht_storage_.safe (store_packet.data);
+        save_status = dht_storage_.safe (store_packet.data.to_vector ());
 
       if (prev_status && save_status == STORE_SUCCESS)
         {
@@ -1267,27 +1726,25 @@ DHTworker::receiveStoreRequest (const sp_comm_pkt &packet)
                     statusToString (response.status));
         }
     }
-  else
+  else if (parsed)
     {
       LogPrint (eLogWarning, "DHT: StoreRequest: Unsupported packet, type: ",
                 store_packet.data[0], ", ver: ", unsigned (store_packet.data[1]));
       response.status = pbote::StatusCode::INVALID_PACKET;
     }
 
-  PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                           response.toByte ().size ());
   LogPrint (eLogDebug, "DHT: StoreRequest: Response status: ",
             statusToString (response.status));
-  context.send (q_packet);
+  context.send (packet->from, response.toByte (), eSendResponse);
 }
 
 void
 DHTworker::receiveEmailPacketDeleteRequest (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "DHT: EmailPacketDelete: request from: ",
-            packet->from.substr (0, 15), "...");
+            dest_table.short_name (packet->from));
 
-  if (packet->from == local_node_->ToBase64 ())
+  if (packet->from == local_handle_)
     {
       LogPrint (eLogWarning, "DHT: EmailPacketDelete: Self request, skipped");
       return;
@@ -1306,11 +1763,9 @@ DHTworker::receiveEmailPacketDeleteRequest (const sp_comm_pkt &packet)
     {
       LogPrint (eLogDebug, "DHT: EmailPacketDelete: Can't parse Email Delete");
       response.status = pbote::StatusCode::INVALID_PACKET;
-      PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                               response.toByte ().size ());
       LogPrint (eLogDebug, "DHT: EmailPacketDelete: Response status: ",
                 statusToString (response.status));
-      context.send (q_packet);
+      context.send (packet->from, response.toByte (), eSendResponse);
       return;
     }
 
@@ -1325,11 +1780,9 @@ DHTworker::receiveEmailPacketDeleteRequest (const sp_comm_pkt &packet)
       LogPrint (eLogDebug, "DHT: EmailPacketDelete: Key not found: ",
                 t_key.ToBase64 ());
       response.status = pbote::StatusCode::NO_DATA_FOUND;
-      PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                               response.toByte ().size ());
       LogPrint (eLogDebug, "DHT: EmailPacketDelete: Response status: ",
                 statusToString (response.status));
-      context.send (q_packet);
+      context.send (packet->from, response.toByte (), eSendResponse);
       return;
     }
 
@@ -1354,11 +1807,9 @@ DHTworker::receiveEmailPacketDeleteRequest (const sp_comm_pkt &packet)
     {
       LogPrint (eLogWarning, "DHT: EmailPacketDelete: DA hash mismatch");
       response.status = pbote::StatusCode::INVALID_PACKET;
-      PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                               response.toByte ().size ());
       LogPrint (eLogDebug, "DHT: EmailPacketDelete: Response status: ",
                 statusToString (response.status));
-      context.send (q_packet);
+      context.send (packet->from, response.toByte (), eSendResponse);
       return;
     }
 
@@ -1377,7 +1828,11 @@ DHTworker::receiveEmailPacketDeleteRequest (const sp_comm_pkt &packet)
 
       deleted_packet.data.push_back (item);
 
-      response.data = deleted_packet.toByte ();
+      auto deleted_bytes = deleted_packet.toByte ();
+      if (!deleted_bytes)
+        return;
+
+      response.data = std::move (*deleted_bytes);
       response.status = pbote::StatusCode::OK;
     }
   else
@@ -1386,17 +1841,24 @@ DHTworker::receiveEmailPacketDeleteRequest (const sp_comm_pkt &packet)
       response.status = pbote::StatusCode::GENERAL_ERROR;
     }
 
-  PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                           response.toByte ().size ());
   LogPrint (eLogDebug, "DHT: EmailPacketDelete: Response status: ",
             statusToString (response.status));
-  context.send (q_packet);
+  context.send (packet->from, response.toByte (), eSendResponse);
 
   if (response.status == pbote::StatusCode::OK)
     {
-      LogPrint (eLogDebug,
-                "DHT: EmailPacketDelete: Re-send request to other nodes");
-      deleteEmail(t_key, DataE, delete_packet);
+      /// Lookup and waits for responses take minutes, strand is free
+      /// for other storage handlers meanwhile
+      bool queued = m_resend_pool_.try_post ([this, t_key, delete_packet] ()
+        {
+          LogPrint (eLogDebug,
+                    "DHT: EmailPacketDelete: Re-send request to other nodes");
+          deleteEmail (t_key, DataE, delete_packet);
+        });
+
+      if (!queued)
+        LogPrint (eLogWarning,
+                  "DHT: EmailPacketDelete: Re-send queue is full, skipped");
     }
 }
 
@@ -1404,9 +1866,9 @@ void
 DHTworker::receiveIndexPacketDeleteRequest (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "DHT: IndexPacketDelete: Request from: ",
-            packet->from.substr (0, 15), "...");
+            dest_table.short_name (packet->from));
 
-  if (packet->from == local_node_->ToBase64 ())
+  if (packet->from == local_handle_)
     {
       LogPrint (eLogWarning, "DHT: IndexPacketDelete: Self request, skipped");
       return;
@@ -1425,11 +1887,9 @@ DHTworker::receiveIndexPacketDeleteRequest (const sp_comm_pkt &packet)
     {
       LogPrint (eLogDebug, "DHT: IndexPacketDelete: Can't parse Index Delete");
       response.status = pbote::StatusCode::INVALID_PACKET;
-      PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                               response.toByte ().size ());
       LogPrint (eLogDebug, "DHT: IndexPacketDelete: Response status: ",
                 statusToString (response.status));
-      context.send (q_packet);
+      context.send (packet->from, response.toByte (), eSendResponse);
       return;
     }
 
@@ -1442,11 +1902,9 @@ DHTworker::receiveIndexPacketDeleteRequest (const sp_comm_pkt &packet)
       LogPrint (eLogDebug, "DHT: IndexPacketDelete: Key not found: ",
                 t_key.ToBase64 ());
       response.status = pbote::StatusCode::NO_DATA_FOUND;
-      PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                               response.toByte ().size ());
       LogPrint (eLogDebug, "DHT: IndexPacketDelete: Response status: ",
                 statusToString (response.status));
-      context.send (q_packet);
+      context.send (packet->from, response.toByte (), eSendResponse);
       return;
     }
 
@@ -1460,11 +1918,9 @@ DHTworker::receiveIndexPacketDeleteRequest (const sp_comm_pkt &packet)
       LogPrint (eLogDebug, "DHT: IndexPacketDelete: Unparsable local: ",
                 t_key.ToBase64 ());
       response.status = pbote::StatusCode::GENERAL_ERROR;
-      PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                               response.toByte ().size ());
       LogPrint (eLogDebug, "DHT: IndexPacketDelete: Response status: ",
                 statusToString (response.status));
-      context.send (q_packet);
+      context.send (packet->from, response.toByte (), eSendResponse);
       return;
     }
 
@@ -1489,17 +1945,19 @@ DHTworker::receiveIndexPacketDeleteRequest (const sp_comm_pkt &packet)
     }
 
   deleted_packet.count = deleted_packet.data.size ();
-  response.data = deleted_packet.toByte ();
+  auto deleted_bytes = deleted_packet.toByte ();
+  if (!deleted_bytes)
+    return;
+
+  response.data = std::move (*deleted_bytes);
 
   if (!erased)
     {
       LogPrint (eLogDebug, "DHT: IndexPacketDelete: No matching DA's");
       response.status = pbote::StatusCode::INVALID_PACKET;
-      PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                               response.toByte ().size ());
       LogPrint (eLogDebug, "DHT: IndexPacketDelete: Response status: ",
                 statusToString (response.status));
-      context.send (q_packet);
+      context.send (packet->from, response.toByte (), eSendResponse);
       return;
     }
 
@@ -1511,7 +1969,11 @@ DHTworker::receiveIndexPacketDeleteRequest (const sp_comm_pkt &packet)
 
   /// Write "new" packet, if not empty
   if (!index_packet.data.empty ())
-    saved = dht_storage_.safe (index_packet.toByte ());
+    {
+      auto index_bytes = index_packet.toByte ();
+      if (index_bytes)
+        saved = dht_storage_.safe (*index_bytes);
+    }
 
   /// Compare statuses and prepare response
   if (deleted && saved == STORE_SUCCESS)
@@ -1543,11 +2005,9 @@ DHTworker::receiveIndexPacketDeleteRequest (const sp_comm_pkt &packet)
         response.status = pbote::StatusCode::GENERAL_ERROR;
     }
 
-  PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                           response.toByte ().size ());
   LogPrint (eLogDebug, "DHT: IndexPacketDelete: Response status: ",
             statusToString (response.status));
-  context.send (q_packet);
+  context.send (packet->from, response.toByte (), eSendResponse);
 
   // ToDo: re-send to other nodes
   //if (response.status == pbote::StatusCode::OK)
@@ -1560,9 +2020,9 @@ void
 DHTworker::receiveFindClosePeers (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "DHT: receiveFindClosePeers: Request from: ",
-            packet->from.substr (0, 15), "...");
+            dest_table.short_name (packet->from));
 
-  if (packet->from == local_node_->ToBase64 ())
+  if (packet->from == local_handle_)
     {
       LogPrint (eLogWarning,
                 "DHT: receiveFindClosePeers: Self request, skipped");
@@ -1578,6 +2038,13 @@ DHTworker::receiveFindClosePeers (const sp_comm_pkt &packet)
   pbote::ResponsePacket response;
   memcpy (response.cid, packet->cid, 32);
 
+  if (packet->payload.size () < 32)
+    {
+      LogPrint (eLogWarning, "DHT: receiveFindClosePeers: Payload is too ",
+                "short: ", packet->payload.size ());
+      return;
+    }
+
   uint8_t key[32];
   std::memcpy (&key, packet->payload.data (), 32);
   HashKey t_key (key);
@@ -1597,11 +2064,9 @@ DHTworker::receiveFindClosePeers (const sp_comm_pkt &packet)
       response.status = pbote::StatusCode::GENERAL_ERROR;
       response.length = 0;
 
-      PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                               response.toByte ().size ());
       LogPrint (eLogDebug, "DHT: receiveFindClosePeers: Response status: ",
                 statusToString (response.status));
-      context.send (q_packet);
+      context.send (packet->from, response.toByte (), eSendResponse);
       return;
     }
 
@@ -1617,13 +2082,13 @@ DHTworker::receiveFindClosePeers (const sp_comm_pkt &packet)
       peer_list.count = closest_nodes.size ();
 
       for (const auto &node : closest_nodes)
-        {
-          i2p::data::IdentityEx identity;
-          identity.FromBase64 (node->ToBase64 ());
-          peer_list.data.push_back (identity);
-        }
+        peer_list.data.push_back (*node);
 
-      response.data = peer_list.toByte ();
+      auto list_bytes = peer_list.toByte ();
+      if (!list_bytes)
+        return;
+
+      response.data = std::move (*list_bytes);
     }
 
   if (packet->ver == 5)
@@ -1633,25 +2098,22 @@ DHTworker::receiveFindClosePeers (const sp_comm_pkt &packet)
       peer_list.count = closest_nodes.size ();
 
       for (const auto &node : closest_nodes)
-        {
-          i2p::data::IdentityEx identity;
-          identity.FromBase64 (node->ToBase64 ());
-          peer_list.data.push_back (identity);
-        }
+        peer_list.data.push_back (*node);
+
+      auto list_bytes = peer_list.toByte ();
+      if (!list_bytes)
+        return;
 
-      response.data = peer_list.toByte ();
+      response.data = std::move (*list_bytes);
     }
 
   response.length = response.data.size ();
 
   LogPrint (eLogDebug, "DHT: receiveFindClosePeers: Send response with ",
             closest_nodes.size (), " node(s)");
-  PacketForQueue q_packet (packet->from, response.toByte ().data (),
-                           response.toByte ().size ());
   LogPrint (eLogDebug, "DHT: receiveFindClosePeers: Response status: ",
             statusToString (response.status));
-  
-  context.send (q_packet);
+  context.send (packet->from, response.toByte (), eSendResponse);
 }
 
 void
@@ -1660,7 +2122,10 @@ DHTworker::run ()
   while (started_)
     {
       writeNodes ();
-      dht_storage_.update ();
+      packet::packet_handler.run_on_storage ([this] {
+        dht_storage_.update ();
+        return true;
+      });
       std::this_thread::sleep_for (std::chrono::seconds (60));
     }
 }
@@ -1694,30 +2159,43 @@ bool
 DHTworker::loadNodes ()
 {
   size_t counter = 0, dup = 0;
-  std::vector<std::string> nodes_list = readNodes ();
-  std::vector<sp_node> nodes;
 
-  for (const auto &node_str : nodes_list)
-    {
-      auto node = std::make_shared<Node> (node_str);
-      nodes.push_back (node);
-    }
+  auto insert_node = [this, &counter, &dup] (const sp_node &node)
+  {
+    LogPrint (eLogDebug, "DHT: loadNodes: Node: ", node->short_name ());
+    auto t_hash = node->GetIdentHash ();
+    std::unique_lock<std::mutex> l (m_nodes_mutex_);
+    bool result
+        = m_nodes_.insert (std::pair<HashKey, sp_node> (t_hash, node))
+              .second;
 
-  if (!nodes.empty ())
+    if (result)
+      counter++;
+    else
+      dup++;
+  };
+
+  std::string db_path = pbote::fs::DataDirPath (DEFAULT_NODE_DB_FILE_NAME);
+  LogPrint (eLogInfo, "DHT: loadNodes: Read nodes from ", db_path);
+
+  bool db_loaded = m_node_db_.load (db_path,
+    [&insert_node] (const HashKey &, const uint8_t *buf, size_t len)
     {
+      auto node = std::make_shared<Node> ();
+      if (node->from_record (buf, len))
+        insert_node (node);
+      else
+        LogPrint (eLogWarning, "DHT: loadNodes: Skip broken record");
+    });
 
-      for (const auto &node : nodes)
+  if (!db_loaded)
+    {
+      /// Migrate from text list, it will be saved to database on next write
+      for (const auto &node_str : readNodes ())
         {
-          LogPrint (eLogDebug, "DHT: loadNodes: Node: ", node->short_name ());
-          auto t_hash = node->GetIdentHash ();
-          bool result
-              = m_nodes_.insert (std::pair<HashKey, sp_node> (t_hash, node))
-                    .second;
-
-          if (result)
-            counter++;
-          else
-            dup++;
+          auto node = std::make_shared<Node> (node_str);
+          node->first_seen = context.ts_now ();
+          insert_node (node);
         }
     }
 
@@ -1728,8 +2206,8 @@ DHTworker::loadNodes ()
 
       /// Now we need lock all loaded nodes for initial check in
       /// first running of closestNodesLookupTask
-      for (auto node : m_nodes_)
-        node.second->noResponse ();
+      for (const auto &node : getAllNodes ())
+        node->noResponse ();
 
       return true;
     }
@@ -1761,58 +2239,114 @@ DHTworker::loadNodes ()
 void
 DHTworker::writeNodes ()
 {
-  std::string nodes_file_path
-      = pbote::fs::DataDirPath (DEFAULT_NODE_FILE_NAME);
-  std::ofstream nodes_file (nodes_file_path);
-
-  LogPrint (eLogInfo, "DHT: writeNodes: Save nodes to ", nodes_file_path);
+  {
+    std::unique_lock<std::mutex> l (m_nodes_mutex_);
+    for (const auto &node : m_nodes_)
+      m_node_db_.put (node.first, node.second->to_record ());
+  }
 
-  if (!nodes_file.is_open ())
+  size_t changed = m_node_db_.dirty ();
+  if (!m_node_db_.flush ())
     {
-      LogPrint (eLogError, "DHT: writeNodes: Can't open file ",
-                nodes_file_path);
+      LogPrint (eLogError, "DHT: writeNodes: Can't save nodes");
       return;
     }
 
-  nodes_file << "# Each line is one Base64-encoded I2P destination.\n";
-  nodes_file << "# Do not edit this file while pbote is running as it will be "
-                "overwritten.\n\n";
-  std::unique_lock<std::mutex> l (m_nodes_mutex_);
-
-  size_t saved = 0;
-  for (const auto &node : m_nodes_)
-    {
-      nodes_file << node.second->ToBase64 ();
-      nodes_file << "\n";
-      saved++;
-    }
-
-  nodes_file.close ();
-  LogPrint (eLogDebug, "DHT: writeNodes: ", saved, " node(s) saved to FS");
+  LogPrint (eLogDebug, "DHT: writeNodes: ", changed, " of ",
+            m_node_db_.size (), " node(s) saved to FS");
 }
 
 void
 DHTworker::calc_locks (std::vector<sp_comm_pkt> responses)
 {
+  std::set<HashKey> responders;
+  for (const auto &response : responses)
+    responders.insert (dest_table.hash (response->from));
+
   size_t counter = 0;
-  for (const auto &node : m_nodes_)
+  for (const auto &node : getAllNodes ())
     {
       /// If we found response later node will be unlocked
-      node.second->noResponse ();
-      for (auto response : responses)
+      node->noResponse ();
+      if (responders.find (node->GetIdentHash ()) != responders.end ())
         {
-          if (response->from == node.second->ToBase64 ())
-            {
-              node.second->gotResponse ();
-              LogPrint (eLogDebug, "DHT: calc_locks: Node unlocked: ",
-                        node.second->short_name ());
-              counter++;
-            }
+          node->gotResponse ();
+          LogPrint (eLogDebug, "DHT: calc_locks: Node unlocked: ",
+                    node->short_name ());
+          counter++;
         }
     }
   LogPrint (eLogDebug, "DHT: calc_locks: Nodes unlocked: ", counter);
 }
 
+void
+DHTworker::sendRetrieveRequest (const std::shared_ptr<batch_comm_packet> &batch,
+                                const sp_node &node, uint8_t type, HashKey key)
+{
+  auto packet = retrieveRequestPacket (type, key);
+  auto bytes = packet.toByte ();
+  if (!bytes)
+    return;
+
+  context.send (batch, packet.cid,
+                util::make_pooled<PacketForQueue> (node->handle (),
+                                                  std::move (*bytes)),
+                eSendLookup);
+}
+
+bool
+DHTworker::isValidResponse (const sp_comm_pkt &response)
+{
+  ResponsePacket response_packet;
+  return response_packet.from_comm_packet (*response, true)
+         && response_packet.status == StatusCode::OK;
+}
+
+size_t
+DHTworker::countValid (const std::shared_ptr<batch_comm_packet> &batch)
+{
+  size_t valid = 0;
+  batch->forEachResponse ([&valid] (const sp_comm_pkt &response)
+    {
+      if (isValidResponse (response))
+        valid++;
+    });
+
+  return valid;
+}
+
+void
+DHTworker::collectRtt (const std::shared_ptr<batch_comm_packet> &batch)
+{
+  auto responses = batch->getResponses ();
+  auto rtts = batch->getResponseRtt ();
+
+  for (size_t i = 0; i < responses.size () && i < rtts.size (); i++)
+    {
+      if (rtts[i] == BATCH_RTT_UNKNOWN)
+        continue;
+
+      m_rtt_.add (rtts[i]);
+
+      auto node = findNode (dest_table.hash (responses[i]->from));
+      if (node)
+        node->update_rtt (rtts[i]);
+    }
+}
+
+long
+DHTworker::get_hedge_delay () const
+{
+  long p90 = m_rtt_.percentile (HEDGE_PERCENTILE);
+  if (p90 == 0)
+    return HEDGE_DEFAULT_DELAY;
+
+  /// Round up to seconds, batch waits have seconds resolution
+  long delay = (p90 + 999) / 1000;
+  return std::max ((long)HEDGE_MIN_DELAY,
+                   std::min (delay, (long)RESPONSE_TIMEOUT));
+}
+
 pbote::FindClosePeersRequestPacket
 DHTworker::findClosePeersPacket (HashKey key)
 {
@@ -10,19 +10,26 @@
 #define PBOTE_DHT_WORKER_H_
 
 #include <chrono>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <random>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <utility>
 
 #include "ConfigParser.h"
 #include "DHTStorage.h"
 #include "FileSystem.h"
+#include "Hedging.h"
+#include "JournalStore.h"
 #include "Logging.h"
 #include "NetworkWorker.h"
 #include "PacketHandler.h"
+#include "SingleFlight.h"
+#include "WorkerPool.h"
 
 // libi2pd
 #include "Identity.h"
@@ -70,8 +77,22 @@ namespace kademlia
 /// Max. number of seconds to wait for replies to retrieve requests
 #define RESPONSE_TIMEOUT 60
 
+/// RTT percentile after which findOne sends hedged requests
+#define HEDGE_PERCENTILE 0.9
+/// Hedge delay in seconds while we have not enough RTT samples
+#define HEDGE_DEFAULT_DELAY 10
+/// Lower limit for hedge delay in seconds
+#define HEDGE_MIN_DELAY 2
+
 /// the maximum amount of time a FIND_CLOSEST_NODES can take
 #define CLOSEST_NODES_LOOKUP_TIMEOUT (5 * 60)
+/// the number of closest nodes returned by lookup
+#define CLOSEST_NODES_COUNT 20
+/// how often lookup observer is checked if there are no new responses
+#define LOOKUP_OBSERVER_INTERVAL 1
+
+/// Threads which forward delete requests of other nodes to closest nodes
+#define DHT_RESEND_THREADS 2
 
 /// the minimum nodes for find request
 #ifdef NDEBUG
@@ -80,7 +101,12 @@ namespace kademlia
 #define MIN_CLOSEST_NODES 5
 #endif // NDEBUG
 
+/// Legacy text list, read only if there is no node database yet
 #define DEFAULT_NODE_FILE_NAME "nodes.txt"
+#define DEFAULT_NODE_DB_FILE_NAME "nodes.dat"
+
+/// first_seen[8] + last_seen[8] + timeouts[4] + locked_until[8] + rtt[4]
+#define NODE_RECORD_STATS_LEN 32
 
 struct Node : i2p::data::IdentityEx
 {
@@ -88,6 +114,8 @@ struct Node : i2p::data::IdentityEx
   long last_seen;
   int consecutive_timeouts = 0;
   long locked_until = 0;
+  /// Smoothed round-trip time in msec, 0 if unknown
+  uint32_t rtt = 0;
 
   Node ()
       : first_seen (0), last_seen (0), consecutive_timeouts (0),
@@ -109,6 +137,12 @@ struct Node : i2p::data::IdentityEx
     this->FromBuffer (buf, len);
   }
 
+  Node (const i2p::data::IdentityEx &identity)
+      : i2p::data::IdentityEx (identity), first_seen (0), last_seen (0),
+        consecutive_timeouts (0), locked_until (0)
+  {
+  }
+
   Node (const std::string &new_destination, long firstSeen,
         int consecutiveTimeouts, long lockedUntil)
       : first_seen (firstSeen), last_seen (0),
@@ -121,6 +155,17 @@ struct Node : i2p::data::IdentityEx
     return this->FromBase64(new_destination);
   }*/
 
+  /// Interned destination for outgoing packets, pinned in table
+  dest_handle
+  handle () const
+  {
+    dest_handle pinned = pin_.get ();
+    if (pinned != DEST_HANDLE_NONE)
+      return pinned;
+
+    return pin_.bind (dest_table.intern (*this));
+  }
+
   std::string
   short_name ()
   {
@@ -149,6 +194,67 @@ struct Node : i2p::data::IdentityEx
   {
     consecutive_timeouts = 0;
     locked_until = 0;
+
+    const auto epoch_now
+        = std::chrono::system_clock::now ().time_since_epoch ();
+    last_seen
+        = std::chrono::duration_cast<std::chrono::seconds> (epoch_now)
+              .count ();
+  }
+
+  void
+  update_rtt (uint32_t sample)
+  {
+    /// Exponential moving average with 1/8 weight, as in TCP SRTT
+    rtt = rtt == 0 ? sample : (7 * rtt + sample) / 8;
+  }
+
+  /// Serialize stats and identity for node database
+  std::vector<uint8_t>
+  to_record () const
+  {
+    size_t ident_len = GetFullLen ();
+    std::vector<uint8_t> record (NODE_RECORD_STATS_LEN + ident_len);
+
+    int64_t v_first_seen = first_seen, v_last_seen = last_seen,
+            v_locked_until = locked_until;
+    int32_t v_timeouts = consecutive_timeouts;
+
+    uint8_t *buf = record.data ();
+    memcpy (buf, &v_first_seen, 8);
+    memcpy (buf + 8, &v_last_seen, 8);
+    memcpy (buf + 16, &v_timeouts, 4);
+    memcpy (buf + 20, &v_locked_until, 8);
+    memcpy (buf + 28, &rtt, 4);
+    ToBuffer (buf + NODE_RECORD_STATS_LEN, ident_len);
+
+    return record;
+  }
+
+  bool
+  from_record (const uint8_t *buf, size_t len)
+  {
+    if (len <= NODE_RECORD_STATS_LEN)
+      return false;
+
+    if (!FromBuffer (buf + NODE_RECORD_STATS_LEN, len - NODE_RECORD_STATS_LEN))
+      return false;
+
+    int64_t v_first_seen, v_last_seen, v_locked_until;
+    int32_t v_timeouts;
+
+    memcpy (&v_first_seen, buf, 8);
+    memcpy (&v_last_seen, buf + 8, 8);
+    memcpy (&v_timeouts, buf + 16, 4);
+    memcpy (&v_locked_until, buf + 20, 8);
+    memcpy (&rtt, buf + 28, 4);
+
+    first_seen = v_first_seen;
+    last_seen = v_last_seen;
+    consecutive_timeouts = v_timeouts;
+    locked_until = v_locked_until;
+
+    return true;
   }
 
   bool
@@ -161,21 +267,48 @@ struct Node : i2p::data::IdentityEx
               .count ();
     return time_now < locked_until;
   }
+
+private:
+  mutable DestPin pin_;
 };
 
 using sp_node = std::shared_ptr<Node>;
 using HashKey = i2p::data::Tag<32>;
 
+/// Operations which can be shared by concurrent callers
+enum FlightOp : uint8_t
+{
+  FLIGHT_FIND_ONE,
+  FLIGHT_FIND_ALL,
+  FLIGHT_DELETION_QUERY
+};
+
+/// (operation, key, data type)
+using flight_key = std::tuple<uint8_t, HashKey, uint8_t>;
+using sp_del_info = std::shared_ptr<DeletionInfoPacket>;
+
+/// Gets nodes which entered best set of running lookup,
+/// returns true if lookup can be stopped
+using LookupObserver = std::function<bool (const std::vector<sp_node> &)>;
+
+/// Handlers of continuation tasks, called on packet handler IO service
+using lookup_handler = std::function<void (std::vector<sp_node>)>;
+using find_handler = std::function<void (std::vector<sp_comm_pkt>)>;
+using store_handler = std::function<void (std::vector<dest_handle>)>;
+
 class DHTworker
 {
 public:
   DHTworker ();
   ~DHTworker ();
 
+  /// Load nodes and local storage, enough for handling of requests
+  void init ();
   void start ();
   void stop ();
 
   bool addNode (const std::string &dest);
+  bool addNode (dest_handle dest);
   bool addNode (const uint8_t *buf, size_t len);
   bool addNode (const i2p::data::IdentityEx &identity);
   sp_node findNode (const HashKey &ident) const; /// duplication check
@@ -188,6 +321,7 @@ public:
   size_t
   getNodesCount ()
   {
+    std::unique_lock<std::mutex> l (m_nodes_mutex_);
     return m_nodes_.size ();
   }
   size_t
@@ -196,21 +330,54 @@ public:
     return getUnlockedNodes ().size ();
   }
 
+  long
+  get_rtt_percentile (double p) const
+  {
+    return m_rtt_.percentile (p);
+  }
+
+  size_t
+  get_hedged_count () const
+  {
+    return m_hedge_budget_.spent ();
+  }
+
   std::vector<sp_comm_pkt> findOne (HashKey hash, uint8_t type);
   std::vector<sp_comm_pkt> findAll (HashKey hash, uint8_t type);
   std::vector<sp_comm_pkt> find (HashKey hash, uint8_t type, bool exhaustive);
-  std::vector<std::string> store (HashKey hash, uint8_t type,
+  std::vector<dest_handle> store (HashKey hash, uint8_t type,
                                   StoreRequestPacket packet);
 
-  std::vector<std::string> deleteEmail (HashKey hash, uint8_t type,
+  std::vector<dest_handle> deleteEmail (HashKey hash, uint8_t type,
                                         EmailDeleteRequestPacket packet);
-  std::vector<std::string> deleteIndexEntry (HashKey index_dht_key,
+  std::vector<dest_handle> deleteIndexEntry (HashKey index_dht_key,
                                              HashKey email_dht_key,
                                              HashKey del_auth);
   std::vector<std::shared_ptr<DeletionInfoPacket> >
   deletion_query (const HashKey &key);
 
-  std::vector<sp_node> closestNodesLookupTask (HashKey key);
+  std::vector<sp_node>
+  closestNodesLookupTask (HashKey key, const LookupObserver &observer = nullptr);
+
+  /**
+   * Continuation versions of lookup, find and store. Task is a chain of
+   * handlers on packet handler IO service, so no thread is parked while
+   * it waits for responses. Blocking versions above start them and wait
+   * for result.
+   */
+  void closestNodesLookupAsync (HashKey key, LookupObserver observer,
+                                lookup_handler done);
+  void findAsync (HashKey key, uint8_t type, bool exhaustive,
+                  find_handler done);
+  void storeAsync (HashKey hash, uint8_t type, StoreRequestPacket packet,
+                   store_handler done);
+
+  /// Number of distinct find and deletion query lookups in flight
+  size_t
+  get_lookups_in_flight () const
+  {
+    return m_find_flights_.InFlight () + m_del_query_flights_.InFlight ();
+  }
 
   void receiveRetrieveRequest (const sp_comm_pkt &packet);
   void receiveDeletionQuery (const sp_comm_pkt &packet);
@@ -257,6 +424,44 @@ private:
   bool loadNodes ();
   void writeNodes ();
 
+  /// State of continuation tasks, steps below are called in turn
+  struct LookupState;
+  struct FindState;
+  struct StoreState;
+
+  void lookup_start (const std::shared_ptr<LookupState> &state);
+  void lookup_round (const std::shared_ptr<LookupState> &state);
+  void lookup_wait (const std::shared_ptr<LookupState> &state);
+  void lookup_collect (const std::shared_ptr<LookupState> &state);
+  /// Pass nodes which entered current best set to observer
+  bool lookup_announce (LookupState &state);
+  void lookup_finish (const std::shared_ptr<LookupState> &state);
+
+  void find_task (const std::shared_ptr<FindState> &state);
+  void find_send (const std::shared_ptr<FindState> &state,
+                  std::vector<sp_node> closestNodes);
+  /// findAll: resend until somebody answers
+  void find_resend (const std::shared_ptr<FindState> &state);
+  /// findOne: wait for first valid answer, hedge to next nodes
+  void find_hedge (const std::shared_ptr<FindState> &state);
+  void find_finish (const std::shared_ptr<FindState> &state);
+
+  void store_send (const std::shared_ptr<StoreState> &state,
+                   std::vector<sp_node> closestNodes);
+  void store_resend (const std::shared_ptr<StoreState> &state);
+  void store_finish (const std::shared_ptr<StoreState> &state);
+
+  std::vector<sp_del_info> deletion_query_task (const HashKey &key);
+
+  /// Add retrieve request to running batch and send it
+  void sendRetrieveRequest (const std::shared_ptr<batch_comm_packet> &batch,
+                            const sp_node &node, uint8_t type, HashKey key);
+  static bool isValidResponse (const sp_comm_pkt &response);
+  static size_t countValid (const std::shared_ptr<batch_comm_packet> &batch);
+  void collectRtt (const std::shared_ptr<batch_comm_packet> &batch);
+  long get_hedge_delay () const;
+
+  std::vector<sp_node> parsePeerList (const sp_comm_pkt &response);
   void calc_locks (std::vector<sp_comm_pkt> responses);
 
   static FindClosePeersRequestPacket findClosePeersPacket (HashKey key);
@@ -278,12 +483,25 @@ private:
   bool started_;
   std::thread *m_worker_thread_;
   sp_node local_node_;
+  dest_handle local_handle_;
 
   mutable std::mutex m_nodes_mutex_, check_closest_mutex;
   std::map<HashKey, sp_node> m_nodes_;
 
   // ToDo: K-bucket/routing table and S-bucket (NEED MORE DISCUSSION)
 
+  pbote::fs::JournalStore m_node_db_;
+
+  RttEstimator m_rtt_;
+  HedgeBudget m_hedge_budget_;
+
+  util::SingleFlight<flight_key, std::vector<sp_comm_pkt> > m_find_flights_;
+  util::SingleFlight<flight_key, std::vector<sp_del_info> >
+      m_del_query_flights_;
+
+  /// Network part of delete handlers, it must not hold storage strand
+  util::WorkerPool m_resend_pool_;
+
   // pbote::fs::HashedStorage m_storage_;
   kademlia::DHTStorage dht_storage_;
 };
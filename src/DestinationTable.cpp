@@ -0,0 +1,338 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <utility>
+
+#include "DestinationTable.h"
+#include "Logging.h"
+
+namespace pbote
+{
+
+DestinationTable dest_table;
+
+namespace
+{
+const i2p::data::IdentHash empty_hash{};
+
+/// Pins of global objects can outlive table on exit
+bool table_alive = false;
+
+const uint32_t generation_mask = (1U << (32 - DEST_HANDLE_SLOT_BITS)) - 1;
+
+uint32_t
+now_sec ()
+{
+  return static_cast<uint32_t> (
+      std::chrono::duration_cast<std::chrono::seconds> (
+          std::chrono::steady_clock::now ().time_since_epoch ())
+          .count ());
+}
+
+void
+touch (std::atomic<uint32_t> &last_used)
+{
+  /// Store only once per second, lookups don't fight for cache line
+  uint32_t now = now_sec ();
+  if (last_used.load (std::memory_order_relaxed) != now)
+    last_used.store (now, std::memory_order_relaxed);
+}
+} // namespace
+
+DestinationTable::DestinationTable ()
+{
+  table_alive = true;
+}
+
+DestinationTable::~DestinationTable ()
+{
+  table_alive = false;
+}
+
+dest_handle
+DestinationTable::intern (std::string_view base64)
+{
+  if (base64.empty ())
+    return DEST_HANDLE_NONE;
+
+  {
+    std::shared_lock<std::shared_mutex> l (m_mutex);
+    auto it = m_by_base64.find (base64);
+    if (it != m_by_base64.end ())
+      {
+        touch (find_entry (it->second)->last_used);
+        return it->second;
+      }
+  }
+
+  /// Unknown yet, parse outside of lock
+  std::string s_base64 (base64);
+  auto identity = std::make_shared<i2p::data::IdentityEx> ();
+  if (!identity->FromBase64 (s_base64))
+    {
+      LogPrint (eLogWarning, "DestTable: intern: Can't parse destination");
+      return DEST_HANDLE_NONE;
+    }
+
+  return insert (std::move (s_base64), identity);
+}
+
+dest_handle
+DestinationTable::intern (const i2p::data::IdentityEx &identity)
+{
+  dest_handle handle = find (identity.GetIdentHash ());
+  if (handle != DEST_HANDLE_NONE)
+    return handle;
+
+  return insert (identity.ToBase64 (),
+                 std::make_shared<i2p::data::IdentityEx> (identity));
+}
+
+dest_handle
+DestinationTable::find (const i2p::data::IdentHash &hash) const
+{
+  std::shared_lock<std::shared_mutex> l (m_mutex);
+  auto it = m_by_hash.find (hash);
+  if (it == m_by_hash.end ())
+    return DEST_HANDLE_NONE;
+
+  touch (find_entry (it->second)->last_used);
+  return it->second;
+}
+
+std::string
+DestinationTable::base64 (dest_handle handle) const
+{
+  auto e = entry (handle);
+  return e ? e->base64 : std::string ();
+}
+
+i2p::data::IdentHash
+DestinationTable::hash (dest_handle handle) const
+{
+  auto e = entry (handle);
+  return e ? e->hash : empty_hash;
+}
+
+std::shared_ptr<const i2p::data::IdentityEx>
+DestinationTable::identity (dest_handle handle) const
+{
+  auto e = entry (handle);
+  return e ? e->identity : nullptr;
+}
+
+std::string
+DestinationTable::short_name (dest_handle handle) const
+{
+  auto e = entry (handle);
+  if (!e)
+    return "<none>";
+
+  return e->base64.substr (0, DEST_SHORT_NAME_LEN) + "...";
+}
+
+size_t
+DestinationTable::size () const
+{
+  std::shared_lock<std::shared_mutex> l (m_mutex);
+  return m_by_hash.size ();
+}
+
+uint64_t
+DestinationTable::evicted () const
+{
+  std::shared_lock<std::shared_mutex> l (m_mutex);
+  return m_evicted;
+}
+
+bool
+DestinationTable::pin (dest_handle handle)
+{
+  /// Eviction takes unique lock, so entry can't go away meanwhile
+  std::shared_lock<std::shared_mutex> l (m_mutex);
+  auto e = find_entry (handle);
+  if (!e)
+    return false;
+
+  e->pins.fetch_add (1, std::memory_order_relaxed);
+  return true;
+}
+
+void
+DestinationTable::unpin (dest_handle handle)
+{
+  std::shared_lock<std::shared_mutex> l (m_mutex);
+  auto e = find_entry (handle);
+  if (e)
+    e->pins.fetch_sub (1, std::memory_order_relaxed);
+}
+
+dest_handle
+DestinationTable::insert (std::string base64,
+                          std::shared_ptr<const i2p::data::IdentityEx> identity)
+{
+  std::unique_lock<std::shared_mutex> l (m_mutex);
+
+  /// Other thread could intern it while we parsed
+  auto it = m_by_hash.find (identity->GetIdentHash ());
+  if (it != m_by_hash.end ())
+    return it->second;
+
+  if (m_by_hash.size () >= DEST_TABLE_MAX_ENTRIES)
+    evict ();
+
+  uint32_t slot;
+  if (!m_free_slots.empty ())
+    {
+      slot = m_free_slots.back ();
+      m_free_slots.pop_back ();
+    }
+  else
+    {
+      if (m_slots.size () >= DEST_HANDLE_SLOT_MASK)
+        {
+          LogPrint (eLogError, "DestTable: insert: No free slots");
+          return DEST_HANDLE_NONE;
+        }
+
+      slot = static_cast<uint32_t> (m_slots.size ());
+      m_slots.emplace_back ();
+    }
+
+  auto e = std::make_shared<Entry> ();
+  e->base64 = std::move (base64);
+  e->hash = identity->GetIdentHash ();
+  e->identity = std::move (identity);
+  e->last_used = now_sec ();
+
+  Slot &s = m_slots[slot];
+  s.entry = e;
+  dest_handle handle = (s.generation << DEST_HANDLE_SLOT_BITS) | (slot + 1);
+
+  m_by_base64.emplace (std::string_view (e->base64), handle);
+  m_by_hash.emplace (e->hash, handle);
+
+  return handle;
+}
+
+std::shared_ptr<const DestinationTable::Entry>
+DestinationTable::entry (dest_handle handle) const
+{
+  std::shared_lock<std::shared_mutex> l (m_mutex);
+  auto e = find_entry (handle);
+  if (!e)
+    return nullptr;
+
+  touch (e->last_used);
+  /// Owned copy, entry outlives eviction while caller holds it
+  const Slot &s = m_slots[(handle & DEST_HANDLE_SLOT_MASK) - 1];
+  return s.entry;
+}
+
+DestinationTable::Entry *
+DestinationTable::find_entry (dest_handle handle) const
+{
+  uint32_t slot = handle & DEST_HANDLE_SLOT_MASK;
+  if (slot == 0 || slot > m_slots.size ())
+    return nullptr;
+
+  const Slot &s = m_slots[slot - 1];
+  if (!s.entry || s.generation != (handle >> DEST_HANDLE_SLOT_BITS))
+    return nullptr;
+
+  return s.entry.get ();
+}
+
+void
+DestinationTable::evict ()
+{
+  std::vector<std::pair<uint32_t, uint32_t> > candidates;
+  candidates.reserve (m_slots.size ());
+  for (uint32_t i = 0; i < m_slots.size (); i++)
+    {
+      const auto &e = m_slots[i].entry;
+      if (e && e->pins.load (std::memory_order_relaxed) == 0)
+        candidates.emplace_back (e->last_used.load (std::memory_order_relaxed), i);
+    }
+
+  if (candidates.empty ())
+    {
+      LogPrint (eLogWarning, "DestTable: evict: All entries are pinned");
+      return;
+    }
+
+  /// Several at once, so full table doesn't scan on every insert
+  size_t count = std::min (candidates.size (),
+                           (size_t)std::max (1, DEST_TABLE_MAX_ENTRIES
+                                                    / DEST_TABLE_EVICT_DIVIDER));
+  std::nth_element (candidates.begin (), candidates.begin () + (count - 1),
+                    candidates.end ());
+
+  for (size_t i = 0; i < count; i++)
+    {
+      Slot &s = m_slots[candidates[i].second];
+      m_by_base64.erase (std::string_view (s.entry->base64));
+      m_by_hash.erase (s.entry->hash);
+
+      /// Freed here or by last caller which still holds it
+      s.entry = nullptr;
+      s.generation = (s.generation + 1) & generation_mask;
+      m_free_slots.push_back (candidates[i].second);
+    }
+
+  m_evicted += count;
+  LogPrint (eLogDebug, "DestTable: evict: Evicted ", count, " destinations");
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+DestPin::DestPin (const DestPin &other) : m_handle (DEST_HANDLE_NONE)
+{
+  bind (other.get ());
+}
+
+DestPin &
+DestPin::operator= (const DestPin &other)
+{
+  if (this == &other)
+    return *this;
+
+  dest_handle old = m_handle.exchange (DEST_HANDLE_NONE);
+  if (old != DEST_HANDLE_NONE)
+    dest_table.unpin (old);
+
+  bind (other.get ());
+  return *this;
+}
+
+DestPin::~DestPin ()
+{
+  dest_handle handle = get ();
+  if (handle != DEST_HANDLE_NONE && table_alive)
+    dest_table.unpin (handle);
+}
+
+dest_handle
+DestPin::bind (dest_handle handle)
+{
+  if (handle == DEST_HANDLE_NONE || !dest_table.pin (handle))
+    return handle;
+
+  dest_handle expected = DEST_HANDLE_NONE;
+  if (m_handle.compare_exchange_strong (expected, handle))
+    return handle;
+
+  /// Other thread was first
+  dest_table.unpin (handle);
+  return expected;
+}
+
+} // namespace pbote
@@ -0,0 +1,187 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_DESTINATION_TABLE_H_
+#define PBOTED_SRC_DESTINATION_TABLE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// libi2pd
+#include "Identity.h"
+
+namespace pbote
+{
+
+/// Small integer which stands for interned I2P destination
+using dest_handle = uint32_t;
+
+/// Handle of empty or unparsable destination
+#define DEST_HANDLE_NONE 0
+
+/// Low bits of handle are slot number plus one, high bits are generation
+/// of slot, so handle of evicted destination never matches new one
+#define DEST_HANDLE_SLOT_BITS 20
+#define DEST_HANDLE_SLOT_MASK ((1U << DEST_HANDLE_SLOT_BITS) - 1)
+
+/// Max number of destinations in table, must fit in slot bits
+#define DEST_TABLE_MAX_ENTRIES 16384
+/// Part of table evicted at once when it's full
+#define DEST_TABLE_EVICT_DIVIDER 8
+
+/// Length of destination prefix in log messages
+#define DEST_SHORT_NAME_LEN 15
+
+/**
+ * @brief Hash functor for 32-byte ident hashes
+ *
+ * Ident hash is SHA-256 result, so first machine word is already
+ * uniformly distributed.
+ */
+struct IdentHashHasher
+{
+  size_t
+  operator() (const i2p::data::IdentHash &hash) const
+  {
+    size_t result;
+    memcpy (&result, hash.data (), sizeof (result));
+    return result;
+  }
+};
+
+/**
+ * @brief Interning table for I2P destinations
+ *
+ * Every received datagram carries ~516 chars of Base64 destination.
+ * Table maps it to small handle with parsed identity and ident hash,
+ * so packet path can pass and compare handles instead of strings.
+ * Base64 form is needed only on SAM send boundary.
+ *
+ * Table is bounded by DEST_TABLE_MAX_ENTRIES. When it's full, least
+ * recently used entries which are not pinned are evicted. Nodes and
+ * relay peers pin own entries with DestPin, so evicted are only
+ * destinations of one-time senders. Handle of evicted destination
+ * resolves to nothing: lookups return empty values and packets to it
+ * are dropped by sender. Lookups return copies or shared pointers, so
+ * eviction never frees data caller still uses.
+ */
+class DestinationTable
+{
+public:
+  DestinationTable ();
+  ~DestinationTable ();
+
+  /**
+   * @brief Get handle for Base64 destination, parse it if not known yet
+   *
+   * @param base64 Destination in I2P Base64 format
+   * @return dest_handle Handle or DEST_HANDLE_NONE if can't be parsed
+   */
+  dest_handle intern (std::string_view base64);
+
+  /**
+   * @brief Get handle for already parsed identity
+   *
+   * @param identity Parsed I2P identity
+   * @return dest_handle Handle
+   */
+  dest_handle intern (const i2p::data::IdentityEx &identity);
+
+  /// Lookup by ident hash only, returns DEST_HANDLE_NONE if not known
+  dest_handle find (const i2p::data::IdentHash &hash) const;
+
+  std::string base64 (dest_handle handle) const;
+  i2p::data::IdentHash hash (dest_handle handle) const;
+  std::shared_ptr<const i2p::data::IdentityEx>
+  identity (dest_handle handle) const;
+
+  /// Shortened Base64 for logging
+  std::string short_name (dest_handle handle) const;
+
+  size_t size () const;
+  /// Destinations evicted since start
+  uint64_t evicted () const;
+
+  /// Pinned entry is not evicted, returns false if handle is stale
+  bool pin (dest_handle handle);
+  void unpin (dest_handle handle);
+
+private:
+  struct Entry
+  {
+    std::string base64;
+    i2p::data::IdentHash hash;
+    std::shared_ptr<const i2p::data::IdentityEx> identity;
+    /// Seconds of steady clock, updated on lookup
+    std::atomic<uint32_t> last_used{ 0 };
+    std::atomic<uint32_t> pins{ 0 };
+  };
+
+  struct Slot
+  {
+    std::shared_ptr<Entry> entry;
+    uint32_t generation = 0;
+  };
+
+  dest_handle insert (std::string base64,
+                      std::shared_ptr<const i2p::data::IdentityEx> identity);
+  std::shared_ptr<const Entry> entry (dest_handle handle) const;
+  /// Same as entry, for use under lock
+  Entry *find_entry (dest_handle handle) const;
+  /// Called under unique lock when table is full
+  void evict ();
+
+  mutable std::shared_mutex m_mutex;
+  std::vector<Slot> m_slots;
+  std::vector<uint32_t> m_free_slots;
+  /// Keys point to Entry::base64 strings
+  std::unordered_map<std::string_view, dest_handle> m_by_base64;
+  std::unordered_map<i2p::data::IdentHash, dest_handle, IdentHashHasher>
+      m_by_hash;
+  uint64_t m_evicted = 0;
+};
+
+extern DestinationTable dest_table;
+
+/**
+ * @brief Keeps destination pinned in table while it's alive
+ *
+ * Bound once, copies pin the same destination.
+ */
+class DestPin
+{
+public:
+  DestPin () : m_handle (DEST_HANDLE_NONE) {}
+  DestPin (const DestPin &other);
+  DestPin &operator= (const DestPin &other);
+  ~DestPin ();
+
+  /// Pin handle if nothing is bound yet, returns bound handle
+  dest_handle bind (dest_handle handle);
+
+  dest_handle
+  get () const
+  {
+    return m_handle.load (std::memory_order_acquire);
+  }
+
+private:
+  std::atomic<dest_handle> m_handle;
+};
+
+} // namespace pbote
+
+#endif // PBOTED_SRC_DESTINATION_TABLE_H_
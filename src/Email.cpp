@@ -274,7 +274,7 @@ Email::get_to_addresses ()
 }
 
 bool
-Email::verify (uint8_t *hash)
+Email::verify (const uint8_t *hash)
 {
   uint8_t da_h[32] = {0};
   SHA256 (packet.DA, 32, da_h);
@@ -431,6 +431,12 @@ Email::encrypt ()
   LogPrint (eLogDebug, "Email: encrypt: packet.data.size: ", packet.data.size ());
 
   auto packet_bytes = packet.toByte ();
+  if (!packet_bytes)
+    {
+      LogPrint (eLogError, "Email: encrypt: Can't serialize packet");
+      skip (true);
+      return;
+    }
 
   if (!sender)
     {
@@ -440,7 +446,7 @@ Email::encrypt ()
     }
 
   encrypted.edata = sender->GetPublicIdentity ()->Encrypt (
-          packet_bytes.data (), packet_bytes.size (),
+          packet_bytes->data (), packet_bytes->size (),
           recipient->GetCryptoPublicKey ());
 
   if (encrypted.edata.empty ())
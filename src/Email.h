@@ -157,7 +157,8 @@ class Email
   bool skip () const { return skip_; };
   void deleted (bool s) { deleted_ = s; };
   bool deleted () const { return deleted_; };
-  bool verify (uint8_t *hash);
+  bool is_encrypted () const { return encrypted_; };
+  bool verify (const uint8_t *hash);
 
   std::string filename () { return filename_; }
   void filename (const std::string& fn) { filename_ = fn; }
@@ -13,8 +13,10 @@
 #include <vector>
 
 #include "BoteContext.h"
+#include "ConfigParser.h"
 #include "DHTworker.h"
 #include "EmailWorker.h"
+#include "PacketHandler.h"
 
 namespace pbote
 {
@@ -49,6 +51,16 @@ EmailWorker::start ()
   if (started_ && m_worker_thread_)
     return;
 
+  uint16_t crypto_threads = 0;
+  pbote::config::GetOption ("cryptothreads", crypto_threads);
+  m_crypto_pool_.start (crypto_threads);
+  LogPrint (eLogInfo, "EmailWorker: Crypto threads: ",
+            m_crypto_pool_.threads ());
+
+  uint16_t send_inflight = 1;
+  pbote::config::GetOption ("sendinflight", send_inflight);
+  m_store_pool_.start (std::max<uint16_t> (1, send_inflight));
+
   if (context.get_identities_count () == 0)
     LogPrint (eLogError, "EmailWorker: Have no Bote identities for start");
   else
@@ -72,6 +84,8 @@ EmailWorker::stop ()
   stopSendEmailTask ();
   stopCheckEmailTasks ();
   stop_check_delivery_task ();
+  m_crypto_pool_.stop ();
+  m_store_pool_.stop ();
 
   LogPrint (eLogInfo, "EmailWorker: Stopped");
 }
@@ -216,8 +230,10 @@ EmailWorker::checkEmailTask (const sp_id_full &email_identity)
 
       auto index_packets = retrieveIndex (email_identity);
 
-      auto local_index_packet
-          = DHT_worker.getIndex (email_identity->identity.GetIdentHash ());
+      auto local_index_packet = packet::packet_handler.run_on_storage (
+          [key = email_identity->identity.GetIdentHash ()] {
+            return DHT_worker.getIndex (key);
+          });
 
       if (!local_index_packet.empty ())
         {
@@ -257,12 +273,15 @@ EmailWorker::checkEmailTask (const sp_id_full &email_identity)
       if (!started_)
         return;
 
-      auto enc_mail_packets = retrieveEmail (index_packets);
+      /// Decryption starts while the rest of packets are fetched
+      pending_emails pending;
+      size_t mail_count = retrieveEmail (email_identity, index_packets,
+                                         pending);
 
       LogPrint (eLogDebug, "EmailWorker: Check: ", id_name,
-                ": Mail count: ", enc_mail_packets.size ());
+                ": Mail count: ", mail_count);
 
-      if (enc_mail_packets.empty ())
+      if (pending.empty ())
         {
           LogPrint (eLogDebug, "EmailWorker: Check: ", id_name,
                     ": Have no mail for process");
@@ -271,7 +290,7 @@ EmailWorker::checkEmailTask (const sp_id_full &email_identity)
           continue;
         }
 
-      auto emails = processEmail (email_identity, enc_mail_packets);
+      auto emails = processEmail (pending);
 
       LogPrint (eLogInfo, "EmailWorker: Check: ", id_name,
                 ": email(s) processed: ", emails.size ());
@@ -293,7 +312,7 @@ EmailWorker::checkEmailTask (const sp_id_full &email_identity)
 
           /// We need to remove packets for all received email from nodes
           // ToDo: multipart email support
-          std::vector<std::string> responses;
+          std::vector<dest_handle> responses;
           responses = DHT_worker.deleteEmail (email_dht_key,
                                               DataE, delete_email_packet);
 
@@ -338,7 +357,6 @@ EmailWorker::sendEmailTask ()
       // ToDo: read interval parameter from config
       std::this_thread::sleep_for (std::chrono::seconds (SEND_EMAIL_INTERVAL));
 
-      std::vector<std::string> nodes;
       checkOutbox (outbox);
 
       if (outbox.empty ())
@@ -347,7 +365,8 @@ EmailWorker::sendEmailTask ()
           continue;
         }
 
-      /// Store Encrypted Email Packet
+      /// Emails are encrypted in parallel on crypto pool
+      std::vector<std::future<std::shared_ptr<OutboundEmail> > > encrypted;
       for (const auto &email : outbox)
         {
           if (email->skip ())
@@ -356,102 +375,26 @@ EmailWorker::sendEmailTask ()
               continue;
             }
 
-          // ToDo: Sign before encrypt
-          //email->sign ();
-          email->encrypt ();
-
-          if (email->skip ())
-            {
-              LogPrint (eLogWarning, "EmailWorker: Send: Email skipped");
-              continue;
-            }
-
-          StoreRequestPacket store_packet;
-
-          auto encrypted_mail = email->getEncrypted ();
-          store_packet.data = encrypted_mail.toByte ();
-          store_packet.length = store_packet.data.size ();
-          LogPrint (eLogDebug, "EmailWorker: Send: store_packet.length: ",
-                    store_packet.length);
-
-          /// For now, HashCash not checking from Java Bote side
-          store_packet.hashcash = email->hashcash ();
-          store_packet.hc_length = store_packet.hashcash.size ();
-          LogPrint (eLogDebug, "EmailWorker: Send: store_packet.hc_length: ",
-                    store_packet.hc_length);
-
-          /// Send Store Request with Encrypted Email Packet to nodes
-          i2p::data::Tag<32> email_dht_key (encrypted_mail.key);
-          nodes = DHT_worker.store (email_dht_key, DataE, store_packet);
-
-          /// If have no OK store responses - mark message as skipped
-          if (nodes.empty ())
-            {
-              email->skip (true);
-              LogPrint (eLogWarning, "EmailWorker: Send: email not sent");
-              continue;
-            }
-
-          DHT_worker.safe (encrypted_mail.toByte ());
-          LogPrint (eLogDebug, "EmailWorker: Send: Email sent to ",
-                    nodes.size (), " node(s)");
+          encrypted.push_back (m_crypto_pool_.submit (
+              [email] { return encryptEmail (email); }));
         }
 
-      /// Create and store Index Packet
-      // ToDo: move to function?
-      for (const auto &email : outbox)
+      /// Every encrypted email goes to store pool, which limits number of
+      /// emails in flight
+      std::vector<std::future<void> > stored;
+      for (auto &result : encrypted)
         {
-          if (email->skip ())
+          auto outbound = result.get ();
+          if (!outbound)
             continue;
 
-          IndexPacket new_index_packet;
-
-          auto recipient = email->get_recipient ();
-          memcpy (new_index_packet.hash,
-                  recipient->GetIdentHash ().data (), 32);
-
-          // ToDo: for test, need to rewrite
-          // for (const auto &email : encryptedEmailPackets) {
-          IndexPacket::Entry entry;
-          memcpy (entry.key, email->getEncrypted ().key, 32);
-          memcpy (entry.dv, email->getEncrypted ().delete_hash, 32);
-          entry.time = context.ts_now ();
-
-          new_index_packet.data.push_back (entry);
-          //}
-
-          new_index_packet.nump = new_index_packet.data.size ();
-
-          StoreRequestPacket store_index_packet;
-
-          /// For now it's not checking from Java-Bote side
-          store_index_packet.hashcash = email->hashcash ();
-          store_index_packet.hc_length = store_index_packet.hashcash.size ();
-          LogPrint (eLogDebug, "EmailWorker: Send: store_index.hc_length: ",
-              store_index_packet.hc_length);
-
-          auto index_bytes = new_index_packet.toByte ();
-
-          store_index_packet.length = index_bytes.size ();
-          store_index_packet.data = index_bytes;
-
-          /// Send Store Request with Index Packet to nodes
-          nodes = DHT_worker.store (recipient->GetIdentHash (), DataI,
-                                    store_index_packet);
-
-          /// If have no OK store responses - mark message as skipped
-          if (nodes.empty ())
-            {
-              email->skip (true);
-              LogPrint (eLogWarning, "EmailWorker: Send: Index not sent");
-              continue;
-            }
-
-          DHT_worker.safe (new_index_packet.toByte ());
-          LogPrint (eLogDebug, "EmailWorker: Send: Index send to ",
-                    nodes.size (), " node(s)");
+          stored.push_back (m_store_pool_.submit (
+              [this, outbound] { storeEmail (*outbound); }));
         }
 
+      for (auto &result : stored)
+        result.get ();
+
       auto email_it = outbox.begin ();
       while (email_it != outbox.end ())
         {
@@ -476,6 +419,136 @@ EmailWorker::sendEmailTask ()
   LogPrint (eLogInfo, "EmailWorker: Send: Stopped");
 }
 
+std::shared_ptr<OutboundEmail>
+EmailWorker::encryptEmail (const std::shared_ptr<Email> &email)
+{
+  auto recipient = email->get_recipient ();
+  if (!recipient)
+    {
+      LogPrint (eLogError, "EmailWorker: Send: Recipient error");
+      email->skip (true);
+      return nullptr;
+    }
+
+  /// Email is kept encrypted for next round if store failed
+  if (!email->is_encrypted ())
+    {
+      if (recipient->GetKeyType () == KEY_TYPE_X25519_ED25519_SHA512_AES256CBC)
+        email->compress (Email::CompressionAlgorithm::ZLIB);
+      else
+        email->compress (Email::CompressionAlgorithm::UNCOMPRESSED);
+
+      // ToDo: slice big packet after compress
+    }
+
+  // ToDo: Sign before encrypt
+  //email->sign ();
+  email->encrypt ();
+
+  if (email->skip ())
+    {
+      LogPrint (eLogWarning, "EmailWorker: Send: Email skipped");
+      return nullptr;
+    }
+
+  auto outbound = std::make_shared<OutboundEmail> ();
+  outbound->email = email;
+
+  /// For now, HashCash not checking from Java Bote side
+  SharedBuffer hashcash (email->hashcash ());
+
+  auto encrypted_mail = email->getEncrypted ();
+  outbound->email_key = i2p::data::Tag<32> (encrypted_mail.key);
+  auto email_bytes = encrypted_mail.toByte ();
+  if (!email_bytes)
+    {
+      LogPrint (eLogError, "EmailWorker: Send: Can't serialize email packet");
+      return nullptr;
+    }
+
+  outbound->email_store.data = std::move (*email_bytes);
+  outbound->email_store.length = outbound->email_store.data.size ();
+  outbound->email_store.hashcash = hashcash;
+  outbound->email_store.hc_length = hashcash.size ();
+  LogPrint (eLogDebug, "EmailWorker: Send: store_packet.length: ",
+            outbound->email_store.length);
+
+  IndexPacket new_index_packet;
+  memcpy (new_index_packet.hash, recipient->GetIdentHash ().data (), 32);
+
+  // ToDo: for test, need to rewrite
+  IndexPacket::Entry entry;
+  memcpy (entry.key, encrypted_mail.key, 32);
+  memcpy (entry.dv, encrypted_mail.delete_hash, 32);
+  entry.time = context.ts_now ();
+
+  new_index_packet.data.push_back (entry);
+  new_index_packet.nump = new_index_packet.data.size ();
+
+  outbound->index_key = recipient->GetIdentHash ();
+  auto index_bytes = new_index_packet.toByte ();
+  if (!index_bytes)
+    {
+      LogPrint (eLogError, "EmailWorker: Send: Can't serialize index packet");
+      return nullptr;
+    }
+
+  outbound->index_store.data = std::move (*index_bytes);
+  outbound->index_store.length = outbound->index_store.data.size ();
+  /// For now it's not checking from Java-Bote side
+  outbound->index_store.hashcash = hashcash;
+  outbound->index_store.hc_length = hashcash.size ();
+
+  return outbound;
+}
+
+void
+EmailWorker::storeEmail (const OutboundEmail &outbound)
+{
+  if (!started_)
+    {
+      outbound.email->skip (true);
+      return;
+    }
+
+  /// Send Store Request with Encrypted Email Packet to nodes
+  auto nodes = DHT_worker.store (outbound.email_key, DataE,
+                                 outbound.email_store);
+
+  /// If have no OK store responses - mark message as skipped
+  if (nodes.empty ())
+    {
+      outbound.email->skip (true);
+      LogPrint (eLogWarning, "EmailWorker: Send: email not sent");
+      return;
+    }
+
+  /// Storage is changed only on storage strand
+  packet::packet_handler.run_on_storage (
+      [data = outbound.email_store.data.to_vector ()] {
+        return DHT_worker.safe (data);
+      });
+  LogPrint (eLogDebug, "EmailWorker: Send: Email sent to ", nodes.size (),
+            " node(s)");
+
+  /// Send Store Request with Index Packet to nodes
+  nodes = DHT_worker.store (outbound.index_key, DataI, outbound.index_store);
+
+  if (nodes.empty ())
+    {
+      outbound.email->skip (true);
+      LogPrint (eLogWarning, "EmailWorker: Send: Index not sent");
+      return;
+    }
+
+  packet::packet_handler.run_on_storage (
+      [data = outbound.index_store.data.to_vector ()] {
+        return DHT_worker.safe (data);
+      });
+  LogPrint (eLogDebug, "EmailWorker: Send: Index send to ", nodes.size (),
+            " node(s)");
+}
+
 void
 EmailWorker::check_delivery_task ()
 {
@@ -535,7 +608,7 @@ EmailWorker::retrieveIndex (const sp_id_full &identity)
         }
 
       LogPrint (eLogDebug, "EmailWorker: retrieveIndex: Got response from: ",
-                response->from.substr (0, 15), "...");
+                dest_table.short_name (response->from));
       
       ResponsePacket res_packet;
       bool parsed = res_packet.from_comm_packet (*response, true);
@@ -561,11 +634,16 @@ EmailWorker::retrieveIndex (const sp_id_full &identity)
           continue;
         }
 
-      if (DHT_worker.safe (res_packet.data))
+      bool saved = packet::packet_handler.run_on_storage (
+          [data = res_packet.data.to_vector ()] {
+            return DHT_worker.safe (data);
+          });
+      if (saved)
         LogPrint (eLogDebug, "EmailWorker: retrieveIndex: Index packet saved");
 
       IndexPacket index_packet;
-      parsed = index_packet.fromBuffer (res_packet.data, true);
+      parsed = index_packet.fromBuffer (res_packet.data.data (),
+                                        res_packet.data.size (), true);
 
       if (!parsed)
         {
@@ -599,19 +677,24 @@ EmailWorker::retrieveIndex (const sp_id_full &identity)
   return res;
 }
 
-std::vector<EmailEncryptedPacket>
-EmailWorker::retrieveEmail (const std::vector<IndexPacket> &indices)
+size_t
+EmailWorker::retrieveEmail (const sp_id_full &identity,
+                            const std::vector<IndexPacket> &indices,
+                            pending_emails &pending)
 {
-  std::vector<std::shared_ptr<CommunicationPacket> > responses;
-  std::vector<EmailEncryptedPacket> local_email_packets;
+  size_t responses_count = 0;
 
   for (const auto &index : indices)
     {
       for (auto entry : index.data)
         {
+          if (!started_)
+            return pending.size ();
+
           i2p::data::Tag<32> hash (entry.key);
 
-          auto local_email_packet = DHT_worker.getEmail (hash);
+          auto local_email_packet = packet::packet_handler.run_on_storage (
+              [hash] { return DHT_worker.getEmail (hash); });
           if (!local_email_packet.empty ())
             {
               LogPrint (eLogDebug,
@@ -624,7 +707,7 @@ EmailWorker::retrieveEmail (const std::vector<IndexPacket> &indices)
 
               if (parsed && !parsed_local_email_packet.edata.empty ())
                 {
-                  local_email_packets.push_back (parsed_local_email_packet);
+                  decryptAsync (identity, parsed_local_email_packet, pending);
                 }
             }
           else
@@ -634,99 +717,91 @@ EmailWorker::retrieveEmail (const std::vector<IndexPacket> &indices)
                         "encrypted email for key: ", hash.ToBase64 ());
             }
 
-          auto temp_results = DHT_worker.findAll (hash, DataE);
-          responses.insert (responses.end (), temp_results.begin (),
-                            temp_results.end ());
-        }
-    }
+          auto responses = DHT_worker.findAll (hash, DataE);
+          responses_count += responses.size ();
 
-  LogPrint (eLogDebug, "EmailWorker: retrieveEmail: Responses: ",
-            responses.size ());
+          for (const auto &response : responses)
+            {
+              if (response->type != type::CommN)
+                {
+                  // ToDo: looks like we got request to ourself, for now just skip it
+                  LogPrint (eLogWarning,
+                            "EmailWorker: retrieveIndex: Got non-response packet in "
+                            "batch, type: ", response->type, ", ver: ",
+                            unsigned (response->ver));
+                  continue;
+                }
 
-  std::map<i2p::data::Tag<32>, EmailEncryptedPacket> mail_packets;
-  for (const auto &response : responses)
-    {
-      if (response->type != type::CommN)
-        {
-          // ToDo: looks like we got request to ourself, for now just skip it
-          LogPrint (eLogWarning,
-                    "EmailWorker: retrieveIndex: Got non-response packet in "
-                    "batch, type: ", response->type, ", ver: ",
-                    unsigned (response->ver));
-          continue;
-        }
+              ResponsePacket res_packet;
+              bool parsed = res_packet.from_comm_packet (*response, true);
 
-      ResponsePacket res_packet;
-      bool parsed = res_packet.from_comm_packet (*response, true);
+              if (!parsed)
+                {
+                  LogPrint (eLogDebug, "EmailWorker: retrieveEmail: ",
+                            "Can't parse packet, skipped");
+                  continue;
+                }
 
-      if (!parsed)
-        {
-          LogPrint (eLogDebug, "EmailWorker: retrieveEmail: ",
-                    "Can't parse packet, skipped");
-          continue;
-        }
+              if (res_packet.status != StatusCode::OK)
+                {
+                  LogPrint (eLogWarning, "EmailWorker: retrieveEmail: Status: ",
+                            statusToString (res_packet.status));
+                  continue;
+                }
 
-      if (res_packet.status != StatusCode::OK)
-        {
-          LogPrint (eLogWarning, "EmailWorker: retrieveEmail: Status: ",
-                    statusToString (res_packet.status));
-          continue;
-        }
+              if (res_packet.length <= 0)
+                {
+                  LogPrint (eLogDebug, "EmailWorker: retrieveEmail: ",
+                            "Empty packet, skipped");
+                  continue;
+                }
 
-      if (res_packet.length <= 0)
-        {
-          LogPrint (eLogDebug, "EmailWorker: retrieveEmail: ",
-                    "Empty packet, skipped");
-          continue;
-        }
+              LogPrint (eLogDebug, "EmailWorker: retrieveEmail: Got email ",
+                        "packet, payload size: ", res_packet.length);
 
-      LogPrint (eLogDebug, "EmailWorker: retrieveEmail: Got email ",
-                "packet, payload size: ", res_packet.length);
+              bool saved = packet::packet_handler.run_on_storage (
+                  [data = res_packet.data.to_vector ()] {
+                    return DHT_worker.safe (data);
+                  });
+              if (saved)
+                LogPrint (eLogDebug, "EmailWorker: retrieveEmail: Encrypted ",
+                          "email packet saved locally");
 
-      if (DHT_worker.safe (res_packet.data))
-        LogPrint (eLogDebug, "EmailWorker: retrieveEmail: Encrypted ",
-                  "email packet saved locally");
+              EmailEncryptedPacket email_packet;
+              parsed = email_packet.fromBuffer (res_packet.data.data (),
+                                                res_packet.data.size (), true);
 
-      EmailEncryptedPacket email_packet;
-      parsed = email_packet.fromBuffer (res_packet.data.data (),
-                                        res_packet.length, true);
+              if (!parsed || email_packet.edata.empty ())
+                {
+                  LogPrint (eLogWarning, "EmailWorker: retrieveEmail: Mail packet",
+                            " without entries");
+                  continue;
+                }
 
-      if (!parsed || email_packet.edata.empty ())
-        {
-          LogPrint (eLogWarning, "EmailWorker: retrieveEmail: Mail packet",
-                    " without entries");
-          continue;
+              decryptAsync (identity, email_packet, pending);
+            }
         }
-
-      i2p::data::Tag<32> hash (email_packet.key);
-      mail_packets.insert (std::pair<i2p::data::Tag<32>, 
-                                     EmailEncryptedPacket> (hash, email_packet));
     }
 
-  LogPrint (eLogDebug, "EmailWorker: retrieveEmail: Parsed mail ",
-            "packets: ",mail_packets.size ());
-
-  for (auto local_packet : local_email_packets)
-    {
-      i2p::data::Tag<32> hash (local_packet.key);
-      mail_packets.insert (
-          std::pair<i2p::data::Tag<32>, EmailEncryptedPacket> (
-              hash, local_packet));
-    }
-
-  LogPrint (eLogDebug, "EmailWorker: retrieveEmail: Mail packets: ",
-            mail_packets.size ());
-
-  std::vector<EmailEncryptedPacket> res;
-  res.reserve (mail_packets.size ());
+  LogPrint (eLogDebug, "EmailWorker: retrieveEmail: Responses: ",
+            responses_count, ", mail packets: ", pending.size ());
 
-  for (const auto &packet : mail_packets)
-    res.push_back (packet.second);
+  return pending.size ();
+}
 
-  // save encrypted email packets for interrupt case
-  // ToDo: check if we have packet locally and sent delete request now
+void
+EmailWorker::decryptAsync (const sp_id_full &identity,
+                           const EmailEncryptedPacket &packet,
+                           pending_emails &pending)
+{
+  /// Same packet can come from local storage and from several nodes
+  i2p::data::Tag<32> hash (packet.key);
+  if (pending.find (hash) != pending.end ())
+    return;
 
-  return res;
+  pending.emplace (hash, m_crypto_pool_.submit ([identity, packet] {
+                     return decryptEmail (identity, packet);
+                   }));
 }
 
 std::vector<EmailUnencryptedPacket>
@@ -906,12 +981,7 @@ EmailWorker::checkOutbox (v_sp_email &emails)
           continue;
         }
 
-      if (recipient->GetKeyType () == KEY_TYPE_X25519_ED25519_SHA512_AES256CBC)
-        mailPacket.compress (Email::CompressionAlgorithm::ZLIB);
-      else
-        mailPacket.compress (Email::CompressionAlgorithm::UNCOMPRESSED);
-
-      // ToDo: slice big packet after compress
+      /// Compression is done with encryption in sendEmailTask
 
       if (!mailPacket.empty ())
         emails.push_back (std::make_shared<Email> (mailPacket));
@@ -973,49 +1043,53 @@ EmailWorker::check_inbox ()
   return emails;
 }
 
-std::vector<Email>
-EmailWorker::processEmail (
-    const sp_id_full &identity,
-    const std::vector<EmailEncryptedPacket> &mail_packets)
+Email
+EmailWorker::decryptEmail (const sp_id_full &identity,
+                           const EmailEncryptedPacket &enc_mail)
 {
-  // ToDo: move to incompleteEmailTask?
-  LogPrint (eLogDebug, "EmailWorker: processEmail: Emails for process: ",
-            mail_packets.size ());
-  std::vector<Email> emails;
-
-  for (auto enc_mail : mail_packets)
+  if (enc_mail.edata.empty ())
     {
-      std::vector<uint8_t> unencrypted_email_data;
+      LogPrint (eLogWarning, "EmailWorker: processEmail: Packet is empty ");
+      return {};
+    }
 
-      if (enc_mail.edata.empty ())
-        {
-          LogPrint (eLogWarning, "EmailWorker: processEmail: Packet is empty ");
-          continue;
-        }
+  std::vector<uint8_t> unencrypted_email_data = identity->identity.Decrypt (
+      enc_mail.edata.data (), enc_mail.edata.size ());
 
-      unencrypted_email_data = identity->identity.Decrypt (
-          enc_mail.edata.data (), enc_mail.edata.size ());
+  if (unencrypted_email_data.empty ())
+    {
+      LogPrint (eLogWarning, "EmailWorker: processEmail: Can't decrypt ");
+      return {};
+    }
 
-      if (unencrypted_email_data.empty ())
-        {
-          LogPrint (eLogWarning, "EmailWorker: processEmail: Can't decrypt ");
-          continue;
-        }
+  Email temp_mail (unencrypted_email_data, true);
 
-      Email temp_mail (unencrypted_email_data, true);
+  if (!temp_mail.verify (enc_mail.delete_hash))
+    {
+      i2p::data::Tag<32> cur_hash (enc_mail.delete_hash);
+      LogPrint (eLogWarning, "EmailWorker: processEmail: email ",
+                cur_hash.ToBase64 (), " is unequal");
+      return {};
+    }
 
-      if (!temp_mail.verify (enc_mail.delete_hash))
-        {
-          i2p::data::Tag<32> cur_hash (enc_mail.delete_hash);
-          LogPrint (eLogWarning, "EmailWorker: processEmail: email ",
-                    cur_hash.ToBase64 (), " is unequal");
-          continue;
-        }
+  temp_mail.setEncrypted (enc_mail);
+  return temp_mail;
+}
+
+std::vector<Email>
+EmailWorker::processEmail (pending_emails &pending)
+{
+  // ToDo: move to incompleteEmailTask?
+  LogPrint (eLogDebug, "EmailWorker: processEmail: Emails for process: ",
+            pending.size ());
+  std::vector<Email> emails;
 
-      temp_mail.setEncrypted (enc_mail);
+  for (auto &result : pending)
+    {
+      Email mail = result.second.get ();
 
-      if (!temp_mail.empty ())
-        emails.push_back (temp_mail);
+      if (!mail.empty ())
+        emails.push_back (std::move (mail));
     }
 
   LogPrint (eLogDebug,
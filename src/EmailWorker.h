@@ -13,10 +13,13 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <future>
+#include <map>
 #include <memory>
 #include <thread>
 
 #include "Email.h"
+#include "WorkerPool.h"
 
 namespace pbote
 {
@@ -35,6 +38,18 @@ using sp_id_full = std::shared_ptr<BoteIdentityFull>;
 using thread_map
     = std::unordered_map<std::string, std::shared_ptr<std::thread> >;
 using v_sp_email = std::vector<std::shared_ptr<Email> >;
+/// Decryption results by DHT key of encrypted packet
+using pending_emails = std::map<i2p::data::Tag<32>, std::future<Email> >;
+
+/// Store requests of outgoing email, built on crypto pool
+struct OutboundEmail
+{
+  std::shared_ptr<Email> email;
+  i2p::data::Tag<32> email_key;
+  StoreRequestPacket email_store;
+  i2p::data::Tag<32> index_key;
+  StoreRequestPacket index_store;
+};
 
 class EmailWorker
 {
@@ -68,16 +83,29 @@ private:
   void check_delivery_task ();
 
   std::vector<IndexPacket> retrieveIndex (const sp_id_full &identity);
-  std::vector<EmailEncryptedPacket>
-  retrieveEmail (const std::vector<IndexPacket> &indices);
+  size_t retrieveEmail (const sp_id_full &identity,
+                        const std::vector<IndexPacket> &indices,
+                        pending_emails &pending);
+
+  /// Encrypt email and build store requests, nullptr if email is skipped
+  static std::shared_ptr<OutboundEmail>
+  encryptEmail (const std::shared_ptr<Email> &email);
+  /// Store email packet, then index packet, skip email on failure
+  void storeEmail (const OutboundEmail &outbound);
 
   static std::vector<EmailUnencryptedPacket> loadLocalIncompletePacket ();
 
   static void checkOutbox (v_sp_email &emails);
 
-  std::vector<Email>
-  processEmail (const sp_id_full &identity,
-                const std::vector<EmailEncryptedPacket> &mail_packets);
+  /// Queue packet for decryption on crypto pool, if key is not queued yet
+  void decryptAsync (const sp_id_full &identity,
+                     const EmailEncryptedPacket &packet,
+                     pending_emails &pending);
+  /// Empty email if packet can't be decrypted or verified
+  static Email decryptEmail (const sp_id_full &identity,
+                             const EmailEncryptedPacket &enc_mail);
+  /// Wait for decryption results, in order of keys
+  static std::vector<Email> processEmail (pending_emails &pending);
 
   bool check_thread_exist (const std::string &identity_name);
 
@@ -86,6 +114,11 @@ private:
   std::thread *m_worker_thread_;
   std::thread *m_check_thread_;
   thread_map m_check_threads_;
+
+  /// Decryption and encryption of emails for all identities
+  util::WorkerPool m_crypto_pool_;
+  /// Outgoing emails stored to DHT at the same time
+  util::WorkerPool m_store_pool_;
 };
 
 extern EmailWorker email_worker;
@@ -0,0 +1,132 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_HEDGING_H_
+#define PBOTED_SRC_HEDGING_H_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace pbote
+{
+namespace kademlia
+{
+
+/// Number of last RTT samples used for percentile
+#define RTT_SAMPLES 256
+/// Below this number of samples percentile is not trusted
+#define RTT_MIN_SAMPLES 16
+
+/// Hedge tokens earned per primary request
+#define HEDGE_BUDGET_RATIO 0.1
+/// Max hedge tokens, limits burst after quiet period
+#define HEDGE_BUDGET_MAX 40.0
+
+/**
+ * @brief Sliding window of response round-trip times
+ */
+class RttEstimator
+{
+public:
+  RttEstimator () : m_count (0), m_pos (0) { m_samples.fill (0); }
+
+  void
+  add (long rtt_ms)
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+    m_samples[m_pos] = rtt_ms;
+    m_pos = (m_pos + 1) % RTT_SAMPLES;
+    if (m_count < RTT_SAMPLES)
+      m_count++;
+  }
+
+  /**
+   * @brief Get RTT percentile over the window
+   *
+   * @param p Percentile from 0.0 to 1.0
+   * @return long RTT in msec or 0 if have not enough samples
+   */
+  long
+  percentile (double p) const
+  {
+    std::vector<long> samples;
+    {
+      std::unique_lock<std::mutex> l (m_mutex);
+      if (m_count < RTT_MIN_SAMPLES)
+        return 0;
+      samples.assign (m_samples.begin (), m_samples.begin () + m_count);
+    }
+
+    size_t n = std::min (samples.size () - 1, (size_t)(p * samples.size ()));
+    std::nth_element (samples.begin (), samples.begin () + n, samples.end ());
+    return samples[n];
+  }
+
+  size_t
+  count () const
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+    return m_count;
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  std::array<long, RTT_SAMPLES> m_samples;
+  size_t m_count, m_pos;
+};
+
+/**
+ * @brief Global budget for hedged (speculative) requests
+ *
+ * Every primary request earns HEDGE_BUDGET_RATIO tokens, every hedged
+ * request costs one, so hedges can't add more than ~10% of load.
+ */
+class HedgeBudget
+{
+public:
+  HedgeBudget () : m_tokens (HEDGE_BUDGET_MAX / 4), m_spent (0) {}
+
+  void
+  deposit (size_t requests)
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+    m_tokens = std::min (HEDGE_BUDGET_MAX,
+                         m_tokens + requests * HEDGE_BUDGET_RATIO);
+  }
+
+  /// Returns how many of wanted hedges are allowed
+  size_t
+  withdraw (size_t wanted)
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+    size_t allowed = std::min (wanted, (size_t)m_tokens);
+    m_tokens -= allowed;
+    m_spent += allowed;
+    return allowed;
+  }
+
+  size_t
+  spent () const
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+    return m_spent;
+  }
+
+private:
+  mutable std::mutex m_mutex;
+  double m_tokens;
+  size_t m_spent;
+};
+
+} // namespace kademlia
+} // namespace pbote
+
+#endif // PBOTED_SRC_HEDGING_H_
@@ -0,0 +1,336 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "JournalStore.h"
+#include "Logging.h"
+
+namespace pbote
+{
+namespace fs
+{
+
+namespace
+{
+
+bool
+write_all (int fd, const uint8_t *buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t written = ::write (fd, buf, len);
+      if (written < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return false;
+        }
+      buf += written;
+      len -= written;
+    }
+  return true;
+}
+
+void
+write_header (std::vector<uint8_t> &buf)
+{
+  buf.push_back (static_cast<uint8_t> (JOURNAL_MAGIC >> 24));
+  buf.push_back (static_cast<uint8_t> (JOURNAL_MAGIC >> 16));
+  buf.push_back (static_cast<uint8_t> (JOURNAL_MAGIC >> 8));
+  buf.push_back (static_cast<uint8_t> (JOURNAL_MAGIC & 0xff));
+  buf.push_back (JOURNAL_VERSION);
+  buf.insert (buf.end (), 3, 0);
+}
+
+} // namespace
+
+JournalStore::JournalStore ()
+    : m_journal_records (0),
+      m_need_rewrite (true)
+{
+}
+
+bool
+JournalStore::load (const std::string &path, const RecordVisitor &visitor)
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  m_path = path;
+  m_records.clear ();
+  m_dirty.clear ();
+  m_journal_records = 0;
+  /// Until we have read valid file, next flush should write full snapshot
+  m_need_rewrite = true;
+
+  int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      LogPrint (eLogDebug, "Journal: load: Can't open ", path, ": ",
+                strerror (errno));
+      return false;
+    }
+
+  struct stat st{};
+  if (fstat (fd, &st) != 0 || st.st_size < JOURNAL_HEADER_LEN)
+    {
+      LogPrint (eLogWarning, "Journal: load: File is too short: ", path);
+      ::close (fd);
+      return false;
+    }
+
+  size_t size = st.st_size;
+  void *map = mmap (nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close (fd);
+
+  if (map == MAP_FAILED)
+    {
+      LogPrint (eLogError, "Journal: load: Can't map ", path, ": ",
+                strerror (errno));
+      return false;
+    }
+
+  const auto *buf = static_cast<const uint8_t *> (map);
+
+  uint32_t magic = (uint32_t (buf[0]) << 24) | (uint32_t (buf[1]) << 16)
+                   | (uint32_t (buf[2]) << 8) | uint32_t (buf[3]);
+  if (magic != JOURNAL_MAGIC || buf[4] != JOURNAL_VERSION)
+    {
+      LogPrint (eLogWarning, "Journal: load: Unknown format: ", path);
+      munmap (map, size);
+      return false;
+    }
+
+  bool clean = true;
+  size_t offset = JOURNAL_HEADER_LEN;
+
+  while (offset < size)
+    {
+      if (offset + JOURNAL_RECORD_HEADER_LEN > size)
+        {
+          clean = false;
+          break;
+        }
+
+      uint8_t op = buf[offset];
+      key_type key (buf + offset + 1);
+      size_t len = (size_t (buf[offset + 33]) << 8) | buf[offset + 34];
+      offset += JOURNAL_RECORD_HEADER_LEN;
+
+      if (offset + len > size)
+        {
+          clean = false;
+          break;
+        }
+
+      if (op == JOURNAL_PUT)
+        m_records[key] = value_type (buf + offset, buf + offset + len);
+      else if (op == JOURNAL_DELETE)
+        m_records.erase (key);
+      else
+        {
+          clean = false;
+          break;
+        }
+
+      offset += len;
+      m_journal_records++;
+    }
+
+  munmap (map, size);
+
+  /// Incomplete tail usually means interrupted append,
+  /// records before it are still valid
+  if (!clean)
+    LogPrint (eLogWarning, "Journal: load: Broken tail in ", path,
+              ", records: ", m_journal_records);
+
+  m_need_rewrite = !clean;
+
+  LogPrint (eLogDebug, "Journal: load: ", m_records.size (),
+            " record(s) from ", m_journal_records, " journal entries");
+
+  /// Copy to release lock before calling owner code
+  auto records = m_records;
+  l.unlock ();
+
+  for (const auto &record : records)
+    visitor (record.first, record.second.data (), record.second.size ());
+
+  return true;
+}
+
+void
+JournalStore::put (const key_type &key, const value_type &value)
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  auto it = m_records.find (key);
+  if (it != m_records.end () && it->second == value)
+    return;
+
+  m_records[key] = value;
+  m_dirty.insert (key);
+}
+
+void
+JournalStore::remove (const key_type &key)
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  if (m_records.erase (key) > 0)
+    m_dirty.insert (key);
+}
+
+bool
+JournalStore::contains (const key_type &key) const
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+  return m_records.find (key) != m_records.end ();
+}
+
+bool
+JournalStore::flush ()
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+
+  if (m_path.empty ())
+    {
+      LogPrint (eLogError, "Journal: flush: Path not set");
+      return false;
+    }
+
+  if (m_need_rewrite)
+    return compact ();
+
+  if (m_dirty.empty ())
+    return true;
+
+  if (!append_dirty ())
+    return compact ();
+
+  if (m_journal_records > JOURNAL_COMPACT_MIN_RECORDS
+      && m_journal_records > JOURNAL_COMPACT_RATIO * m_records.size ())
+    return compact ();
+
+  return true;
+}
+
+size_t
+JournalStore::size () const
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+  return m_records.size ();
+}
+
+size_t
+JournalStore::dirty () const
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+  return m_dirty.size ();
+}
+
+bool
+JournalStore::append_dirty ()
+{
+  std::vector<uint8_t> buf;
+
+  for (const auto &key : m_dirty)
+    {
+      auto it = m_records.find (key);
+      if (it != m_records.end ())
+        write_record (buf, JOURNAL_PUT, key, it->second);
+      else
+        write_record (buf, JOURNAL_DELETE, key, {});
+    }
+
+  int fd = ::open (m_path.c_str (), O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (fd < 0)
+    {
+      LogPrint (eLogWarning, "Journal: append: Can't open ", m_path, ": ",
+                strerror (errno));
+      return false;
+    }
+
+  bool success = write_all (fd, buf.data (), buf.size ());
+  ::close (fd);
+
+  if (!success)
+    {
+      LogPrint (eLogError, "Journal: append: Write failed: ",
+                strerror (errno));
+      return false;
+    }
+
+  LogPrint (eLogDebug, "Journal: append: ", m_dirty.size (),
+            " record(s) to ", m_path);
+
+  m_journal_records += m_dirty.size ();
+  m_dirty.clear ();
+  return true;
+}
+
+bool
+JournalStore::compact ()
+{
+  std::vector<uint8_t> buf;
+  buf.reserve (JOURNAL_HEADER_LEN + m_records.size () * 512);
+  write_header (buf);
+
+  for (const auto &record : m_records)
+    write_record (buf, JOURNAL_PUT, record.first, record.second);
+
+  std::string tmp_path = m_path + ".tmp";
+  int fd = ::open (tmp_path.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0600);
+  if (fd < 0)
+    {
+      LogPrint (eLogError, "Journal: compact: Can't open ", tmp_path, ": ",
+                strerror (errno));
+      return false;
+    }
+
+  bool success = write_all (fd, buf.data (), buf.size ()) && fsync (fd) == 0;
+  ::close (fd);
+
+  if (!success || std::rename (tmp_path.c_str (), m_path.c_str ()) != 0)
+    {
+      LogPrint (eLogError, "Journal: compact: Can't write ", m_path, ": ",
+                strerror (errno));
+      std::remove (tmp_path.c_str ());
+      return false;
+    }
+
+  LogPrint (eLogDebug, "Journal: compact: ", m_records.size (),
+            " record(s) saved to ", m_path);
+
+  m_journal_records = m_records.size ();
+  m_dirty.clear ();
+  m_need_rewrite = false;
+  return true;
+}
+
+void
+JournalStore::write_record (std::vector<uint8_t> &buf, JournalOp op,
+                            const key_type &key, const value_type &value)
+{
+  buf.push_back (op);
+  buf.insert (buf.end (), key.data (), key.data () + 32);
+  buf.push_back (static_cast<uint8_t> (value.size () >> 8));
+  buf.push_back (static_cast<uint8_t> (value.size () & 0xff));
+  buf.insert (buf.end (), value.begin (), value.end ());
+}
+
+} // namespace fs
+} // namespace pbote
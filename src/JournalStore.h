@@ -0,0 +1,115 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_JOURNAL_STORE_H_
+#define PBOTED_SRC_JOURNAL_STORE_H_
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// libi2pd
+#include "Tag.h"
+
+namespace pbote
+{
+namespace fs
+{
+
+/// "PBJS" + format version
+#define JOURNAL_MAGIC 0x50424A53
+#define JOURNAL_VERSION 1
+
+/// magic[4] + version[1] + reserved[3]
+#define JOURNAL_HEADER_LEN 8
+/// op[1] + key[32] + length[2]
+#define JOURNAL_RECORD_HEADER_LEN 35
+
+/// Rewrite file when journal has this many stale records per live one
+#define JOURNAL_COMPACT_RATIO 2
+/// Don't compact small files
+#define JOURNAL_COMPACT_MIN_RECORDS 64
+
+enum JournalOp : uint8_t
+{
+  JOURNAL_PUT = 0x01,
+  JOURNAL_DELETE = 0x02
+};
+
+/**
+ * @brief Binary key-value file with append-only journal
+ *
+ * Keeps in-memory image of records keyed by 32-byte hash. Only changed
+ * (dirty) records are appended to the file on flush, so periodic saves
+ * cost is proportional to number of changes, not to number of records.
+ * On load whole file is mapped once and replayed, last record for key
+ * wins. When stale records outnumber live ones, the file is rewritten
+ * with a snapshot of live records only.
+ *
+ * Values are opaque for store, owner defines their layout.
+ * File is local to host, so values may use host byte order.
+ */
+class JournalStore
+{
+public:
+  using key_type = i2p::data::Tag<32>;
+  using value_type = std::vector<uint8_t>;
+  using RecordVisitor
+      = std::function<void (const key_type &, const uint8_t *, size_t)>;
+
+  JournalStore ();
+  ~JournalStore () = default;
+
+  /**
+   * @brief Map and replay file, calls visitor for every live record
+   *
+   * @param path Path to file
+   * @param visitor Called for every live record after replay
+   * @return true if file was read, false if file is missing or broken
+   */
+  bool load (const std::string &path, const RecordVisitor &visitor);
+
+  /// Store value, record becomes dirty only if value changed
+  void put (const key_type &key, const value_type &value);
+  void remove (const key_type &key);
+  bool contains (const key_type &key) const;
+
+  /**
+   * @brief Append dirty records to file, compact if needed
+   *
+   * @return true if journal on disk matches image
+   */
+  bool flush ();
+
+  size_t size () const;
+  size_t dirty () const;
+
+private:
+  bool append_dirty ();
+  bool compact ();
+  static void write_record (std::vector<uint8_t> &buf, JournalOp op,
+                            const key_type &key, const value_type &value);
+
+  std::string m_path;
+
+  mutable std::mutex m_mutex;
+  std::map<key_type, value_type> m_records;
+  std::set<key_type> m_dirty;
+  /// Total records in file, includes stale ones
+  size_t m_journal_records;
+  bool m_need_rewrite;
+};
+
+} // namespace fs
+} // namespace pbote
+
+#endif // PBOTED_SRC_JOURNAL_STORE_H_
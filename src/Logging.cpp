@@ -65,7 +65,7 @@ static inline int GetSyslogPrio(enum LogLevel l) {
 
 Logging::Logging()
     : m_Destination(eLogStdout), m_MinLevel(eLogInfo), m_LogStream(nullptr),
-      m_Logfile(""), m_HasColors(true), m_TimeFormat("%H:%M:%S"),
+      m_Logfile(""), m_Queue(LOG_QUEUE_CAPACITY), m_Dropped(0), m_HasColors(true), m_TimeFormat("%H:%M:%S"),
       m_IsRunning(false), m_Thread(nullptr) {}
 
 Logging::~Logging() { delete m_Thread; }
@@ -172,6 +172,7 @@ void Logging::Run() {
     std::shared_ptr<LogMsg> msg;
     while ((msg = m_Queue.Get()))
       Process(msg);
+    ReportDropped();
     if (m_LogStream)
       m_LogStream->flush();
     if (m_IsRunning)
@@ -179,7 +180,21 @@ void Logging::Run() {
   }
 }
 
-void Logging::Append(std::shared_ptr<pbote::log::LogMsg> &msg) { m_Queue.Put(msg); }
+void Logging::Append(std::shared_ptr<pbote::log::LogMsg> &msg) {
+  if (!m_Queue.Put(msg))
+    m_Dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Logging::ReportDropped() {
+  uint64_t dropped = m_Dropped.exchange(0, std::memory_order_relaxed);
+  if (dropped == 0)
+    return;
+
+  auto msg = std::make_shared<LogMsg>(eLogWarning, std::time(nullptr),
+                                      "Log: queue is full, " + std::to_string(dropped) + " message(s) dropped");
+  msg->tid = std::this_thread::get_id();
+  Process(msg);
+}
 
 void Logging::SendTo(const std::string &path) {
   if (m_LogStream)
@@ -10,6 +10,7 @@
 #ifndef LOG_H__
 #define LOG_H__
 
+#include <atomic>
 #include <chrono>
 #include <ctime>
 #include <fstream>
@@ -41,6 +42,11 @@ enum LogType {
 namespace pbote {
 namespace log {
 
+/// Messages logged before logger thread starts are kept in queue too.
+/// If queue is full, message is dropped and counted, logger thread
+/// reports number of dropped messages.
+#define LOG_QUEUE_CAPACITY 65536
+
 struct LogMsg; /* forward declaration */
 
 class Logging {
@@ -52,6 +58,7 @@ class Logging {
   std::time_t m_LastTimestamp;
   char m_LastDateTime[64];
   pbote::util::Queue<std::shared_ptr<LogMsg>> m_Queue;
+  std::atomic<uint64_t> m_Dropped;
   bool m_HasColors;
   std::string m_TimeFormat;
   volatile bool m_IsRunning;
@@ -64,6 +71,8 @@ class Logging {
 
   void Run();
   void Process(std::shared_ptr<LogMsg> msg);
+  /** @brief Writes warning with number of dropped messages, if any */
+  void ReportDropped();
 
   /**
    * @brief Makes formatted string from unix timestamp
@@ -7,9 +7,11 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <utility>
 
 #include "NetworkWorker.h"
+#include "Trace.h"
 
 namespace pbote
 {
@@ -19,9 +21,19 @@ namespace network
 NetworkWorker network_worker;
 
 UDPReceiver::UDPReceiver (const std::string &address, int port)
-  : running_ (false), m_RecvThread (nullptr), f_port (port),
-    f_addr (address), m_recvQueue (nullptr)
+  : running_ (false), f_port (port), f_addr (address),
+    m_recv_buffers (UDP_RECV_BATCH * (MAX_DATAGRAM_SIZE + 1)),
+    m_recvQueue (nullptr)
 {
+  for (size_t i = 0; i < UDP_RECV_BATCH; i++)
+    {
+      m_recv_iovecs[i].iov_base = m_recv_buffers.data ()
+                                  + i * (MAX_DATAGRAM_SIZE + 1);
+      m_recv_iovecs[i].iov_len = MAX_DATAGRAM_SIZE;
+      m_recv_msgs[i].msg_hdr.msg_iov = &m_recv_iovecs[i];
+      m_recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
   // ToDo: restart on error
   int errcode;
   char decimal_port[16];
@@ -63,6 +75,15 @@ UDPReceiver::UDPReceiver (const std::string &address, int port)
            + ":" + decimal_port + "\", errcode=" + gai_strerror (errcode))
               .c_str ());
     }
+
+  /// Port 0 lets kernel pick free one, SAM session needs the real port
+  if (f_port == 0)
+    {
+      struct sockaddr_in bound{};
+      socklen_t bound_len = sizeof (bound);
+      if (getsockname (f_socket, (struct sockaddr *)&bound, &bound_len) == 0)
+        f_port = ntohs (bound.sin_port);
+    }
 }
 
 UDPReceiver::~UDPReceiver ()
@@ -81,92 +102,126 @@ UDPReceiver::~UDPReceiver ()
 void
 UDPReceiver::start ()
 {
-  if (m_RecvThread)
-    {
-      delete m_RecvThread;
-      m_RecvThread = nullptr;
-    }
+  if (running_)
+    return;
 
-  running_ = true;
-  m_RecvThread = new std::thread ([this] { run (); });
+  fcntl (f_socket, F_SETFL, fcntl (f_socket, F_GETFL, 0) | O_NONBLOCK);
+
+  running_ = reactor.add (f_socket, EPOLLIN,
+                          [this] (uint32_t) { handle_receive (); });
+
+  if (running_)
+    LogPrint (eLogInfo, "Network: UDPReceiver: Started");
 }
 
 void
 UDPReceiver::stop ()
 {
-  running_ = false;
-
-  if (m_RecvThread)
-    {
-      m_RecvThread->join ();
+  if (!running_)
+    return;
 
-      delete m_RecvThread;
-      m_RecvThread = nullptr;
-    }
+  reactor.remove (f_socket);
+  running_ = false;
 
   LogPrint (eLogInfo, "Network: UDPReceiver: Stopped");
 }
 
-void
-UDPReceiver::run ()
-{
-  LogPrint (eLogInfo, "Network: UDPReceiver: Started");
-
-  while (running_)
-    {
-      handle_receive ();
-    }
-}
-
-ssize_t
+int
 UDPReceiver::recv ()
 {
-  return ::recv (f_socket, UDP_recv_buffer, MAX_DATAGRAM_SIZE, 0);
+  /// Takes what is already queued, epoll calls us again if there is more
+  return ::recvmmsg (f_socket, m_recv_msgs, UDP_RECV_BATCH, MSG_DONTWAIT,
+                     nullptr);
 }
 
 void
 UDPReceiver::handle_receive ()
 {
-  ssize_t bytes_transferred = recv ();
+  int count = recv ();
 
-  if (bytes_transferred < 1)
+  if (count < 1)
     {
-      if (bytes_transferred == 0)
-        {
-          LogPrint (eLogWarning, "Network: UDPReceiver: Zero-length datagram");
-          return;
-        }
+      if (count == 0 || errno == EINTR || errno == EAGAIN
+          || errno == EWOULDBLOCK)
+        return;
 
       LogPrint (eLogError, "Network: UDPReceiver: Receive error: ", strerror(errno));
       return;
     }
 
+  std::vector<sp_queue_pkt> packets;
+  packets.reserve (count);
+  size_t total_bytes = 0;
+
+  for (int i = 0; i < count; i++)
+    {
+      size_t len = m_recv_msgs[i].msg_len;
+      total_bytes += len;
+
+      if (m_recv_msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+        {
+          LogPrint (eLogWarning, "Network: UDPReceiver: Truncated datagram");
+          continue;
+        }
+
+      auto packet = parse_datagram ((uint8_t *)m_recv_iovecs[i].iov_base, len);
+      if (!packet)
+        continue;
+
+      if (trace_recorder.enabled ())
+        trace_recorder.record (TRACE_RECORD_IN, packet->destination,
+                               packet->payload.data (),
+                               packet->payload.size ());
+
+      packets.push_back (std::move (packet));
+    }
+
   /// Count total receive bytes
-  context.add_recv_byte_count (bytes_transferred);
-  /// Terminating array
-  UDP_recv_buffer[bytes_transferred] = 0;
+  context.add_recv_byte_count (total_bytes);
+
+  if (!packets.empty ())
+    m_recvQueue->PutBatch (packets);
+}
+
+sp_queue_pkt
+UDPReceiver::parse_datagram (uint8_t *buf, size_t len)
+{
+  if (len == 0)
+    {
+      LogPrint (eLogWarning, "Network: UDPReceiver: Zero-length datagram");
+      return nullptr;
+    }
+
+  /// Terminating array, buffer has one spare byte
+  buf[len] = 0;
   /// Get newline char position
-  char *eol = strchr ((char *)UDP_recv_buffer, '\n');
+  char *eol = strchr ((char *)buf, '\n');
 
   if (!eol)
     {
       LogPrint (eLogWarning, "Network: UDPReceiver: Malformed datagram");
-      return;
+      return nullptr;
     }
 
   *eol = 0;
   eol++;
-  size_t payload_len = bytes_transferred - ((uint8_t *)eol - UDP_recv_buffer);
-  size_t dest_len = bytes_transferred - payload_len - 1;
+  size_t payload_len = len - ((uint8_t *)eol - buf);
+  size_t dest_len = len - payload_len - 1;
 
-  std::string dest (&UDP_recv_buffer[0], &UDP_recv_buffer[dest_len]);
+  std::string_view dest ((char *)buf, dest_len);
+  dest_handle handle = dest_table.intern (dest);
+
+  if (handle == DEST_HANDLE_NONE)
+    {
+      LogPrint (eLogWarning, "Network: UDPReceiver: Bad sender destination");
+      return nullptr;
+    }
 
   LogPrint (eLogDebug, "Network: UDPReceiver: Datagram received, dest: ",
-            dest, ", size: ", payload_len);
+            dest_table.short_name (handle), ", size: ", payload_len);
 
-  auto packet = std::make_shared<PacketForQueue> (dest, (uint8_t *)eol,
-                                                  payload_len);
-  m_recvQueue->Put (packet);
+  return util::make_pooled<PacketForQueue> (handle, (uint8_t *)eol,
+                                           payload_len);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -265,37 +320,99 @@ UDPSender::run ()
 void
 UDPSender::send ()
 {
-  auto packet = m_sendQueue->GetNextWithTimeout (UDP_SEND_TIMEOUT);
+  std::vector<sp_queue_pkt> packets;
+  m_sendQueue->GetBatch (packets, UDP_SEND_BATCH, UDP_SEND_TIMEOUT);
 
-  if (!packet)
+  if (packets.empty ())
     return;
 
   check_session();
 
-  std::string payload (packet->payload.begin (), packet->payload.end ());
-  std::string message
-      = SAM::Message::datagramSend (m_sessionID_, packet->destination);
-  message.append (payload);
+  /// Header and payload are gathered by kernel, nothing is concatenated
+  size_t count = packets.size ();
+  /// Clear only between batches, iovecs point into cached headers
+  if (m_headers.size () + count > UDP_HEADER_CACHE_SIZE)
+    m_headers.clear ();
 
-  ssize_t bytes_transferred
-      = sendto (f_socket, message.c_str (), message.size (), 0,
-                f_addrinfo->ai_addr, f_addrinfo->ai_addrlen);
+  std::vector<struct iovec> iovecs (count * 2);
+  std::vector<struct mmsghdr> msgs (count);
 
-  if (bytes_transferred < 1)
+  size_t filled = 0;
+  for (size_t i = 0; i < count; i++)
     {
-      if (bytes_transferred == 0)
+      const std::string &prefix = header (packets[i]->destination);
+      /// Destination was evicted from table while packet was queued
+      if (prefix.empty ())
         {
-          LogPrint (eLogWarning, "Network: UDPSender: Zero-length datagram");
-          return;
+          LogPrint (eLogDebug, "Network: UDPSender: Unknown destination, skipped");
+          continue;
         }
 
-      LogPrint (eLogError, "Network: UDPSender: Send error: ", strerror(errno));
-      return;
+      iovecs[filled * 2].iov_base = (void *)prefix.data ();
+      iovecs[filled * 2].iov_len = prefix.size ();
+      iovecs[filled * 2 + 1].iov_base = packets[i]->payload.data ();
+      iovecs[filled * 2 + 1].iov_len = packets[i]->payload.size ();
+
+      auto &hdr = msgs[filled].msg_hdr;
+      memset (&hdr, 0, sizeof (hdr));
+      hdr.msg_name = f_addrinfo->ai_addr;
+      hdr.msg_namelen = f_addrinfo->ai_addrlen;
+      hdr.msg_iov = &iovecs[filled * 2];
+      hdr.msg_iovlen = 2;
+      filled++;
+
+      if (trace_recorder.enabled ())
+        trace_recorder.record (TRACE_RECORD_OUT, packets[i]->destination,
+                               packets[i]->payload.data (),
+                               packets[i]->payload.size ());
+    }
+
+  count = filled;
+
+  size_t sent = 0, bytes_transferred = 0;
+  while (sent < count)
+    {
+      int res = sendmmsg (f_socket, msgs.data () + sent, count - sent, 0);
+      if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          LogPrint (eLogError, "Network: UDPSender: Send error: ", strerror(errno));
+          /// Skip datagram which failed, try the rest
+          sent++;
+          continue;
+        }
+
+      for (int i = 0; i < res; i++)
+        bytes_transferred += msgs[sent + i].msg_len;
+
+      sent += res;
     }
 
   context.add_sent_byte_count (bytes_transferred);
 }
 
+const std::string &
+UDPSender::header (dest_handle destination)
+{
+  static const std::string unknown;
+
+  auto it = m_headers.find (destination);
+  if (it != m_headers.end ())
+    return it->second;
+
+  /// Only here we need destination in Base64 form
+  std::string base64 = dest_table.base64 (destination);
+  if (base64.empty ())
+    return unknown;
+
+  return m_headers
+      .emplace (destination,
+                SAM::Message::datagramSend (m_sessionID_, base64))
+      .first->second;
+}
+
 void
 UDPSender::check_session()
 {
@@ -351,8 +468,6 @@ NetworkWorker::start ()
   LogPrint (eLogInfo, "Network: SAM UDP endpoint: ", routerAddress_, ":",
             routerPortUDP_);
 
-  // ToDo: we can init with empty listen port for auto port
-  //   and use it in SAM init
   m_RecvHandler->start ();
 
   LogPrint (eLogInfo, "Network: Starting SAM session");
@@ -469,6 +584,12 @@ NetworkWorker::createRecvHandler ()
   m_RecvHandler
       = std::make_shared<UDPReceiver> (listenAddress_, listenPortUDP_);
 
+  if (listenPortUDP_ == 0)
+    {
+      listenPortUDP_ = m_RecvHandler->get_port ();
+      LogPrint (eLogInfo, "Network: UDP receiver got port ", listenPortUDP_);
+    }
+
   m_RecvHandler->setNickname (m_nickname_);
   m_RecvHandler->setQueue (m_recvQueue);
 }
@@ -17,11 +17,15 @@
 #include <string>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "BoteContext.h"
 #include "Logging.h"
 #include "Queue.h"
+#include "Reactor.h"
 
 #include "i2psam.h"
 
@@ -32,6 +36,12 @@ namespace network
 
 /// Timeout in msec
 #define UDP_SEND_TIMEOUT 500
+/// Max packets taken from send queue per wakeup
+#define UDP_SEND_BATCH 64
+/// Max datagrams received per recvmmsg call
+#define UDP_RECV_BATCH 32
+/// Cached SAM headers are dropped when there are more
+#define UDP_HEADER_CACHE_SIZE 4096
 /// 32 KiB
 #define MAX_DATAGRAM_SIZE 32768
 
@@ -89,19 +99,22 @@ public:
   };
 
 private:
-  void run ();
-  ssize_t recv ();
+  int recv ();
+  /// Called on reactor thread when socket is readable
   void handle_receive ();
+  sp_queue_pkt parse_datagram (uint8_t *buf, size_t len);
 
   bool running_;
-  std::thread *m_RecvThread;
   std::string m_nickname_;
   int f_socket;
   int f_port;
   std::string f_addr;
   struct addrinfo *f_addrinfo{};
 
-  uint8_t UDP_recv_buffer[MAX_DATAGRAM_SIZE + 1] = {0};
+  /// Ring of buffers filled by one recvmmsg, extra byte for terminator
+  std::vector<uint8_t> m_recv_buffers;
+  struct iovec m_recv_iovecs[UDP_RECV_BATCH]{};
+  struct mmsghdr m_recv_msgs[UDP_RECV_BATCH]{};
   queue_type m_recvQueue;
 };
 
@@ -124,10 +137,12 @@ public:
   setSessionID (const std::string &sessionID)
   {
     m_sessionID_ = sessionID;
+    /// Headers contain session ID, set before start
+    m_headers.clear ();
   };
 
   void
-  setQueue (const queue_type &sendQueue)
+  setQueue (const send_queue_type &sendQueue)
   {
     m_sendQueue = sendQueue;
   };
@@ -165,6 +180,7 @@ public:
 private:
   void run ();
   void send ();
+  const std::string &header (dest_handle destination);
 
   void check_session();
 
@@ -172,6 +188,8 @@ private:
   std::thread *m_SendThread;
   std::string m_nickname_;
   std::string m_sessionID_;
+  /// SAM datagram headers by destination, used only by sender thread
+  std::unordered_map<dest_handle, std::string> m_headers;
 
   std::shared_ptr<SAM::DatagramSession> sam_session;
 
@@ -180,7 +198,7 @@ private:
   std::string f_addr;
   struct addrinfo *f_addrinfo{};
 
-  queue_type m_sendQueue;
+  send_queue_type m_sendQueue;
 };
 
 class NetworkWorker
@@ -221,7 +239,7 @@ private:
   std::shared_ptr<UDPSender> m_SendHandler;
 
   queue_type m_recvQueue;
-  queue_type m_sendQueue;
+  send_queue_type m_sendQueue;
 };
 
 extern NetworkWorker network_worker;
@@ -19,6 +19,7 @@
 #include "FileSystem.h"
 #include "Logging.h"
 #include "POP3.h"
+#include "Reactor.h"
 
 namespace bote
 {
@@ -28,7 +29,9 @@ namespace pop3
 POP3::POP3 (const std::string &address, int port)
   : started (false),
     processing (false),
-    pop3_thread (nullptr),
+    write_pending (false),
+    closing (false),
+    session_timer (-1),
     server_sockfd (-1),
     client_sockfd (-1),
     sin_size (0),
@@ -56,11 +59,6 @@ POP3::POP3 (const std::string &address, int port)
 POP3::~POP3 ()
 {
   stop ();
-
-  pop3_thread->join ();
-  
-  delete pop3_thread;
-  pop3_thread = nullptr;
 }
 
 void
@@ -84,48 +82,51 @@ POP3::start ()
       LogPrint (eLogError, "POP3: Listen error: ", strerror (errno));
     }
 
-  started = true;
-  pop3_thread = new std::thread ([this] { run (); });
+  started = pbote::network::reactor.add (server_sockfd, EPOLLIN,
+                                         [this] (uint32_t) { accept_client (); });
+
+  if (started)
+    LogPrint (eLogInfo, "POP3: Started");
 }
 
 void
 POP3::stop ()
 {
+  if (!started)
+    return;
+
   started = false;
+
+  if (processing)
+    finish ();
+
+  pbote::network::reactor.remove (server_sockfd);
   close (server_sockfd);
 
   LogPrint (eLogInfo, "POP3: Stopped");
 }
 
 void
-POP3::run ()
+POP3::accept_client ()
 {
-  LogPrint (eLogInfo, "POP3: Started");
   sin_size = sizeof (client_addr);
+  client_sockfd = accept4 (server_sockfd, (struct sockaddr *)&client_addr,
+                           &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-  while (started)
+  if (client_sockfd == -1)
     {
-      client_sockfd =
-        accept (server_sockfd, (struct sockaddr *)&client_addr, &sin_size);
-
-      if (client_sockfd == -1)
+      if (errno != EWOULDBLOCK && errno != EAGAIN)
         {
-          if (errno != EWOULDBLOCK && errno != EAGAIN)
-            {
-              // ToDo: add error handling
-              LogPrint (eLogError, "POP3: Accept error: ", strerror (errno));
-            }
-
-          std::this_thread::sleep_for (std::chrono::milliseconds (POP3_WAIT_TIMEOUT));
-        }
-      else
-        {
-          LogPrint (eLogInfo, "POP3: Received connection from ",
-                    inet_ntoa (client_addr.sin_addr));
-
-          handle ();
+          // ToDo: add error handling
+          LogPrint (eLogError, "POP3: Accept error: ", strerror (errno));
         }
+      return;
     }
+
+  LogPrint (eLogInfo, "POP3: Received connection from ",
+            inet_ntoa (client_addr.sin_addr));
+
+  handle ();
 }
 
 void
@@ -134,50 +135,78 @@ POP3::handle ()
   LogPrint (eLogDebug, "POP3session: New session");
 
   processing = true;
-  process ();
+  write_pending = false;
+  closing = false;
+  out_buf.clear ();
+
+  /// One session at a time, next client waits in listen backlog
+  pbote::network::reactor.modify (server_sockfd, 0);
+  pbote::network::reactor.add (client_sockfd, EPOLLIN,
+                               [this] (uint32_t events)
+                                 {
+                                   if (events & EPOLLOUT)
+                                     flush ();
+                                   else
+                                     receive ();
+                                 });
+  session_timer = pbote::network::reactor.add_timer (
+      POP3_SESSION_TIMEOUT, [this] ()
+        {
+          LogPrint (eLogWarning, "POP3session: Session timed out");
+          finish ();
+        });
+
+  reply (reply_ok[OK_HELO]);
+  session_state = STATE_USER;
 }
 
 void
 POP3::finish ()
 {
+  if (!processing)
+    return;
+
   LogPrint (eLogDebug, "POP3session: Finish session");
 
   processing = false;
+  out_buf.clear ();
+  pbote::network::reactor.remove_timer (session_timer);
+  session_timer = -1;
+  pbote::network::reactor.remove (client_sockfd);
   close (client_sockfd);
 
+  if (started)
+    pbote::network::reactor.modify (server_sockfd, EPOLLIN);
+
   LogPrint (eLogInfo, "POP3session: Socket closed");
 }
 
 void
-POP3::process ()
+POP3::receive ()
 {
-  reply (reply_ok[OK_HELO]);
-  session_state = STATE_USER;
-
-  while (processing)
+  ssize_t len = recv (client_sockfd, buf, sizeof (buf) - 1, MSG_DONTWAIT);
+  if (len > 0)
     {
-      memset (buf, 0, sizeof (buf));
-      ssize_t len = recv (client_sockfd, buf, sizeof (buf), 0);
-      if (len > 0)
-        {
-          std::string str_buf (buf);
-          str_buf = str_buf.substr (0, str_buf.size () - 2);
+      buf[len] = 0;
+      pbote::network::reactor.rearm_timer (session_timer, POP3_SESSION_TIMEOUT);
 
-          LogPrint (eLogDebug, "POP3session: Request stream: ", str_buf);
-          respond (buf);
-        }
-      else if (len == 0)
-        continue;
-      else
-        {
-          /// The server exit permanently
-          // ToDo: add error handling
-          LogPrint (eLogError, "POP3session: Can't recieve data, exit");
-          processing = false;
-        }
-    }
+      std::string str_buf (buf);
+      str_buf = str_buf.substr (0, str_buf.size () - 2);
 
-  finish ();
+      LogPrint (eLogDebug, "POP3session: Request stream: ", str_buf);
+      respond (buf);
+    }
+  else if (len == 0)
+    {
+      LogPrint (eLogDebug, "POP3session: Client closed connection");
+      finish ();
+    }
+  else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      // ToDo: add error handling
+      LogPrint (eLogError, "POP3session: Can't recieve data, exit");
+      finish ();
+    }
 }
 
 void
@@ -246,15 +275,58 @@ POP3::respond (char *request)
 void
 POP3::reply (const char *data)
 {
-  if (!data)
+  if (!data || !processing)
     return;
 
-  send (client_sockfd, data, strlen (data), 0);
-
   std::string str_data (data);
-  str_data = str_data.substr (0, str_data.size () - 2);
+  out_buf.append (str_data);
 
+  str_data = str_data.substr (0, str_data.size () - 2);
   LogPrint (eLogDebug, "POP3session: reply: Reply stream: ", str_data);
+
+  if (!write_pending)
+    flush ();
+}
+
+void
+POP3::flush ()
+{
+  while (!out_buf.empty ())
+    {
+      ssize_t sent = send (client_sockfd, out_buf.data (), out_buf.size (),
+                           MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (sent == -1)
+        {
+          if (errno == EINTR)
+            continue;
+
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+              if (!write_pending)
+                pbote::network::reactor.modify (client_sockfd, EPOLLOUT);
+              write_pending = true;
+              return;
+            }
+
+          LogPrint (eLogError, "POP3session: Can't send data, exit");
+          finish ();
+          return;
+        }
+
+      out_buf.erase (0, (size_t)sent);
+    }
+
+  if (closing)
+    {
+      finish ();
+      return;
+    }
+
+  if (write_pending)
+    {
+      write_pending = false;
+      pbote::network::reactor.modify (client_sockfd, EPOLLIN);
+    }
 }
 
 void
@@ -490,9 +562,9 @@ POP3::QUIT ()
     }
 
   session_state = STATE_QUIT;
+  /// Session is finished when client got the reply
+  closing = true;
   reply (reply_ok[OK_QUIT]);
-
-  finish ();
 }
 
 /// Extension
@@ -25,8 +25,8 @@ namespace pop3
 #define MAX_CLIENTS 5
 #define MAX_RCPT_USR 1
 #define BUF_SIZE 10485760 // 10MB
-// Timeout in milliseconds
-#define POP3_WAIT_TIMEOUT 200
+// Idle session timeout in milliseconds, RFC 1939 section 3
+#define POP3_SESSION_TIMEOUT 600000
 
 const char capa_list[][100] =
 {
@@ -120,14 +120,17 @@ public:
   void stop ();
 
 private:
-  void run ();
+  /// Called on reactor thread
+  void accept_client ();
+  void receive ();
 
   void handle ();
-  void process ();
   void finish ();
 
   void respond (char *request);
+  /// Queues data for client, what socket doesn't take now waits for EPOLLOUT
   void reply (const char *data);
+  void flush ();
 
   void USER (char *request);
   void PASS (char *request);
@@ -150,7 +153,11 @@ private:
   static bool check_pass (const std::string &pass);
 
   bool started, processing;
-  std::thread *pop3_thread;
+  /// Reply is waiting for EPOLLOUT, client input is paused meanwhile
+  bool write_pending;
+  /// Session ends when reply is written, after QUIT
+  bool closing;
+  int session_timer;
   int server_sockfd, client_sockfd;
   socklen_t sin_size;
   struct sockaddr_in server_addr, client_addr;
@@ -158,6 +165,7 @@ private:
   /// Session
   int session_state;
   char buf[BUF_SIZE];
+  std::string out_buf;
 
   std::vector<std::shared_ptr<pbote::Email> > emails;
 };
@@ -13,6 +13,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <cstring>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <map>
@@ -20,11 +21,16 @@
 #include <mutex>
 #include <netinet/in.h>
 #include <openssl/sha.h>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "BufferPool.h"
+#include "ByteStream.h"
+#include "DestinationTable.h"
 #include "Logging.h"
 
 // libi2pd
@@ -36,6 +42,8 @@ namespace pbote
 
 /// because prefix[4] + type[1] + ver[1] +  cid[32] = 38
 #define COMM_DATA_LEN 38
+/// Round-trip time of response to resent request, it can't be measured
+#define BATCH_RTT_UNKNOWN -1
 
 //#define PACKET_ERROR_MALFORMED -1
 
@@ -45,7 +53,7 @@ const std::array<std::uint8_t, 12> PACKET_TYPE{ 0x52, 0x4b, 0x46, 0x4e,
 const std::array<std::uint8_t, 4> COMM_PREFIX{ 0x6D, 0x30, 0x52, 0xE9 };
 const std::array<std::uint8_t, 5> BOTE_VERSION{ 0x1, 0x2, 0x3, 0x4, 0x5 };
 
-enum StatusCode
+enum StatusCode : uint8_t
 {
   OK,
   GENERAL_ERROR,
@@ -124,93 +132,183 @@ statusToString (uint8_t status_code)
 
 struct PacketForQueue
 {
-  PacketForQueue (std::string destination, uint8_t *buf, size_t len)
-      : destination (std::move (destination)), payload (buf, buf + len)
+  PacketForQueue (dest_handle destination, const uint8_t *buf, size_t len)
+      : destination (destination), payload (util::take_buffer (len))
   {
+    payload.assign (buf, buf + len);
   }
-  std::string destination;
+  PacketForQueue (dest_handle destination, std::vector<uint8_t> &&buf)
+      : destination (destination), payload (std::move (buf))
+  {
+  }
+  PacketForQueue (const PacketForQueue &) = default;
+  PacketForQueue (PacketForQueue &&) = default;
+  PacketForQueue &operator= (const PacketForQueue &) = default;
+  PacketForQueue &operator= (PacketForQueue &&) = default;
+  /// Payload buffer goes back to pool for next datagram
+  ~PacketForQueue () { util::recycle_buffer (std::move (payload)); }
+
+  /// Interned destination, resolved to Base64 only by UDPSender
+  dest_handle destination;
   std::vector<uint8_t> payload;
+  /// Set by trace replay only, for handler latency
+  std::chrono::steady_clock::time_point queued_at;
 };
 
+using sp_queue_pkt = std::shared_ptr<PacketForQueue>;
+using cid_type = i2p::data::Tag<32>;
+
+/**
+ * @brief Set of requests sent together and responses to them
+ *
+ * Outgoing packets are shared with send queue and are not changed
+ * after they were added, so batch can be (re)sent without copying.
+ * CID is random, so IdentHashHasher spreads it well.
+ */
 template <typename T> struct PacketBatch
 {
-  std::map<std::vector<uint8_t>, PacketForQueue> outgoingPackets;
+  using packets_map = std::unordered_map<cid_type, sp_queue_pkt, IdentHashHasher>;
+  using responses_type = std::vector<std::shared_ptr<T> >;
+  /// Gets responses so far and number of requests still without response
+  using condition = std::function<bool (const responses_type &, size_t)>;
+  using response_handler = std::function<void (const std::shared_ptr<T> &)>;
+  /// Gets true if condition was met, false if batch was cancelled
+  using completion_handler = std::function<void (bool)>;
+
+  packets_map outgoingPackets;
   std::vector<std::shared_ptr<T> > incomingPackets;
   std::mutex m_batchMutex;
-  std::condition_variable m_first, m_last;
   std::string owner;
   size_t removed = 0;
+  /// Time of first send of every request, for round-trip time of responses
+  struct send_time
+  {
+    std::chrono::steady_clock::time_point at;
+    bool resent = false;
+  };
+  std::unordered_map<cid_type, send_time, IdentHashHasher> sentAt;
+  /// Round-trip time in msec for every response in incomingPackets,
+  /// BATCH_RTT_UNKNOWN if request was sent more than once
+  std::vector<long> responseRtt;
 
   bool
   operator== (const PacketBatch &other) const
   {
-    return outgoingPackets.size () == other.outgoingPackets.size ()
-           && incomingPackets.size () == other.incomingPackets.size ()
-           && std::equal (outgoingPackets.begin (), outgoingPackets.end (),
-                          other.outgoingPackets.begin ())
-           && std::equal (incomingPackets.begin (), incomingPackets.end (),
-                          other.incomingPackets.begin ());
+    return outgoingPackets == other.outgoingPackets
+           && incomingPackets == other.incomingPackets;
+  }
+
+  /**
+   * @brief Call f (cid, packet) for every outgoing packet
+   *
+   * Batch is locked during iteration, f must not call batch methods.
+   */
+  template <typename F>
+  void
+  forEachPacket (F f)
+  {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    for (const auto &packet : outgoingPackets)
+      f (packet.first, packet.second);
   }
 
-  std::map<std::vector<uint8_t>, PacketForQueue>
+  /// Copy of outgoing packets, for work which must not hold batch lock
+  std::vector<std::pair<cid_type, sp_queue_pkt> >
   getPackets ()
   {
-    return outgoingPackets;
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    return { outgoingPackets.begin (), outgoingPackets.end () };
+  }
+
+  /// Call f (response) for every response, same rules as forEachPacket
+  template <typename F>
+  void
+  forEachResponse (F f)
+  {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    for (const auto &response : incomingPackets)
+      f (response);
   }
 
   std::vector<std::shared_ptr<T> >
   getResponses ()
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     return incomingPackets;
   }
 
+  std::vector<long>
+  getResponseRtt ()
+  {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    return responseRtt;
+  }
+
+  /// Called right before request is queued for send
+  void
+  markSent (const cid_type &cid)
+  {
+    auto now = std::chrono::steady_clock::now ();
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    auto sent = sentAt.emplace (cid, send_time{ now });
+    /// Response can be to any of sends, so RTT sample would be wrong
+    if (!sent.second)
+      sent.first->second.resent = true;
+  }
+
   bool
-  contains (const std::vector<uint8_t> &id)
+  contains (const cid_type &cid)
   {
-    return outgoingPackets.find (id) != outgoingPackets.end ();
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    return outgoingPackets.find (cid) != outgoingPackets.end ();
   }
 
   size_t
   packetCount ()
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     return outgoingPackets.size ();
   }
 
   size_t
   responseCount ()
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     return incomingPackets.size ();
   }
 
   size_t
   remain ()
   {
-    size_t total_requests = packetCount () + removed;
-    return total_requests - responseCount ();
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    return pending ();
   }
 
   void
-  addPacket (const std::vector<uint8_t> &id, const PacketForQueue &packet)
+  addPacket (const cid_type &cid, sp_queue_pkt packet)
   {
-    outgoingPackets.insert (
-        std::pair<std::vector<uint8_t>, PacketForQueue> (id, packet));
+    /// Batch can be already running, e.g. for pipelined requests
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    outgoingPackets.emplace (cid, std::move (packet));
   }
 
   void
-  removePacket (const std::vector<uint8_t> &cid)
+  removePacket (const cid_type &cid)
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     if (outgoingPackets.erase (cid) > 0)
       removed++;
   }
 
   void
-  removePacket (const std::string &to)
+  removePacket (dest_handle to)
   {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
     for (auto it = outgoingPackets.begin(); it != outgoingPackets.end(); it++)
       {
-        if (it->second.destination == to)
+        if (it->second->destination == to)
           {
-            outgoingPackets.erase (it->first);
+            outgoingPackets.erase (it);
             removed++;
             return;
           }
@@ -220,57 +318,262 @@ template <typename T> struct PacketBatch
   void
   addResponse (std::shared_ptr<T> packet)
   {
-    incomingPackets.push_back (packet);
+    auto now = std::chrono::steady_clock::now ();
+
+    response_handler on_response;
+    std::vector<completion_handler> completed;
+
+    {
+      std::unique_lock<std::mutex> lk (m_batchMutex);
+      long rtt = BATCH_RTT_UNKNOWN;
+      auto sent = sentAt.find (cid_type (packet->cid));
+      if (sent != sentAt.end () && !sent->second.resent)
+        rtt = std::chrono::duration_cast<std::chrono::milliseconds> (
+                  now - sent->second.at)
+                  .count ();
+
+      incomingPackets.push_back (packet);
+      responseRtt.push_back (rtt);
+
+      on_response = m_onResponse;
+      takeCompleted (completed);
+    }
+
+    m_changed.notify_all ();
 
-    if (incomingPackets.size () == 1)
-      m_first.notify_one ();
+    /// Handlers are called without lock, so they can use batch
+    if (on_response)
+      on_response (packet);
 
-    if (remain () == 0)
-      m_last.notify_one ();
+    for (const auto &handler : completed)
+      handler (true);
   }
 
-  bool
-  waitFist (long timeout_sec)
+  /// Called from receiving thread for every response
+  void
+  onResponse (response_handler handler)
   {
-    std::chrono::duration<long> timeout = std::chrono::seconds (timeout_sec);
     std::unique_lock<std::mutex> lk (m_batchMutex);
+    m_onResponse = std::move (handler);
+  }
 
-    auto status = m_first.wait_for (lk, timeout);
+  /**
+   * @brief Call handler once when condition is met
+   *
+   * Handler is called from receiving thread, or right away if condition
+   * is already met. Owner which gives up on batch should call cancel,
+   * pending handlers then get false. Single waiter which gives up can
+   * drop own handler with dropCompletion.
+   *
+   * @return Handler id, 0 if handler was already called
+   */
+  size_t
+  onComplete (const condition &cond, completion_handler handler)
+  {
+    std::unique_lock<std::mutex> lk (m_batchMutex);
+    if (!cond (incomingPackets, pending ()))
+      {
+        m_completions.push_back ({ ++m_lastCompletion, cond,
+                                   std::move (handler) });
+        return m_lastCompletion;
+      }
 
-    if (status == std::cv_status::no_timeout)
-      LogPrint (eLogDebug, "Packet: Batch ", owner, " got first");
+    lk.unlock ();
+    handler (true);
+    return 0;
+  }
 
-    if (status == std::cv_status::timeout)
-      LogPrint (eLogDebug, "Packet: Batch ", owner, " timed out");
+  /// Forget handler without calling it, e.g. after waiter's timeout
+  void
+  dropCompletion (size_t id)
+  {
+    completion_handler dropped;
+    {
+      std::unique_lock<std::mutex> lk (m_batchMutex);
+      auto it = std::find_if (m_completions.begin (), m_completions.end (),
+                              [id] (const pending_completion &completion)
+                                { return completion.id == id; });
+      if (it == m_completions.end ())
+        return;
+
+      /// Destroyed out of lock, handler can hold last reference to batch
+      dropped = std::move (it->handler);
+      m_completions.erase (it);
+    }
+  }
 
-    lk.unlock ();
-    return true;
+  void
+  cancel ()
+  {
+    std::vector<pending_completion> cancelled;
+    {
+      std::unique_lock<std::mutex> lk (m_batchMutex);
+      cancelled.swap (m_completions);
+      m_onResponse = nullptr;
+    }
+
+    for (const auto &completion : cancelled)
+      completion.handler (false);
   }
 
+  /**
+   * @brief Wait until condition is met
+   *
+   * Condition is checked under lock before waiting and on every response,
+   * so early responses and spurious wakeups are handled.
+   *
+   * @return true if condition is met, false on timeout
+   */
   bool
-  waitLast (long timeout_sec)
+  waitUntil (const condition &cond, long timeout_sec)
   {
-    std::chrono::duration<long> timeout = std::chrono::seconds (timeout_sec);
     std::unique_lock<std::mutex> lk (m_batchMutex);
+    return m_changed.wait_for (lk, std::chrono::seconds (timeout_sec),
+                               [&] { return cond (incomingPackets, pending ()); });
+  }
+
+  bool
+  waitFist (long timeout_sec)
+  {
+    bool done = waitUntil (firstN (1), timeout_sec);
+    LogPrint (eLogDebug, "Packet: Batch ", owner,
+              done ? " got first" : " timed out");
+    return done;
+  }
+
+  bool
+  waitLast (long timeout_sec)
+  {
+    bool done = waitUntil (all (), timeout_sec);
+    LogPrint (eLogDebug, "Packet: Batch ", owner,
+              done ? " got last" : " timed out");
+    return done;
+  }
+
+  /**
+   * @brief Wait for response after already known ones
+   *
+   * @param known Number of responses caller has already seen
+   * @param timeout_sec Timeout in seconds
+   * @return true if new response arrived, false on timeout
+   */
+  bool
+  waitNext (size_t known, long timeout_sec)
+  {
+    return waitUntil (next (known), timeout_sec);
+  }
 
-    auto status = m_last.wait_for (lk, timeout);
+  /// Completion conditions, all of them are met if nothing is pending
 
-    if (status == std::cv_status::no_timeout)
-      LogPrint (eLogDebug, "Packet: Batch ", owner, " got last");
+  /// At least n responses
+  static condition
+  firstN (size_t n)
+  {
+    return [n] (const responses_type &responses, size_t pending)
+      { return responses.size () >= n || pending == 0; };
+  }
 
-    if (status == std::cv_status::timeout)
-      LogPrint (eLogDebug, "Packet: Batch ", owner, " timed out");
+  /// At least n responses accepted by filter
+  static condition
+  quorum (size_t n, std::function<bool (const std::shared_ptr<T> &)> filter)
+  {
+    return [n, filter] (const responses_type &responses, size_t pending)
+      {
+        size_t accepted = std::count_if (responses.begin (), responses.end (),
+                                         filter);
+        return accepted >= n || pending == 0;
+      };
+  }
 
-    lk.unlock ();
-    return true;
+  /// Response after known ones, not met just because nothing is pending
+  static condition
+  next (size_t known)
+  {
+    return [known] (const responses_type &responses, size_t)
+      { return responses.size () > known; };
+  }
+
+  /// Responses to all sent packets
+  static condition
+  all ()
+  {
+    return [] (const responses_type &, size_t pending)
+      { return pending == 0; };
+  }
+
+private:
+  /// Same as remain, for use under lock
+  size_t
+  pending () const
+  {
+    size_t total_requests = outgoingPackets.size () + removed;
+    /// Duplicated responses to resent packets can exceed requests count
+    if (incomingPackets.size () >= total_requests)
+      return 0;
+
+    return total_requests - incomingPackets.size ();
+  }
+
+  void
+  takeCompleted (std::vector<completion_handler> &completed)
+  {
+    auto it = m_completions.begin ();
+    while (it != m_completions.end ())
+      {
+        if (it->cond (incomingPackets, pending ()))
+          {
+            completed.push_back (std::move (it->handler));
+            it = m_completions.erase (it);
+          }
+        else
+          ++it;
+      }
   }
+
+  std::condition_variable m_changed;
+  response_handler m_onResponse;
+  struct pending_completion
+  {
+    size_t id;
+    condition cond;
+    completion_handler handler;
+  };
+
+  std::vector<pending_completion> m_completions;
+  size_t m_lastCompletion = 0;
 };
 
 /// Packets
 
+/**
+ * @brief Serialize packet into one buffer of exact size
+ *
+ * Packet reports own size with byteSize () and fills buffer with
+ * write (), which can also be used with caller-provided buffer.
+ * Empty result means packet is broken and must not be sent.
+ */
+template <typename packet_type>
+std::optional<std::vector<uint8_t> >
+to_bytes (const packet_type &packet)
+{
+  std::vector<uint8_t> result = util::take_buffer (packet.byteSize ());
+  result.resize (packet.byteSize ());
+  ByteWriter writer (result.data (), result.size ());
+  packet.write (writer);
+
+  if (!writer.complete ())
+    {
+      LogPrint (eLogError, "Packet: to_bytes: Size mismatch, type: ",
+                packet.type, ", written: ", writer.size (), "/",
+                result.size ());
+      return std::nullopt;
+    }
+
+  return result;
+}
+
 struct CommunicationPacket;
 
-using sp_queue_pkt = std::shared_ptr<PacketForQueue>;
 using sp_comm_pkt = std::shared_ptr<CommunicationPacket>;
 using batch_comm_packet = PacketBatch<CommunicationPacket>;
 
@@ -281,6 +584,17 @@ public:
   explicit DataPacket (uint8_t type_) : type (type_), ver (version::V4) {}
   uint8_t type;
   uint8_t ver = version::V4;
+
+protected:
+  /// type[1] + ver[1]
+  static const size_t header_size = 2;
+
+  void
+  writeHeader (ByteWriter &writer) const
+  {
+    writer.u8 (type);
+    writer.u8 (ver);
+  }
 };
 
 struct EmailEncryptedPacket : public DataPacket
@@ -296,7 +610,7 @@ public:
   std::vector<uint8_t> edata;
 
   bool
-  fromBuffer (uint8_t *buf, size_t len, bool from_net)
+  fromBuffer (const uint8_t *buf, size_t len, bool from_net)
   {
     /// 105 cause type[1] + ver[1] + key[32] + stored_time[4] + delete_hash[32]
     /// + alg[1] + length[2] + DA[32]
@@ -370,42 +684,42 @@ public:
 
     LogPrint (eLogDebug, "Packet: E: fromBuffer: alg: ", unsigned (alg),
               ", length: ", length);
-    std::vector<uint8_t> data (buf + offset, buf + offset + length);
-    edata = data;
+
+    if (length > len - offset)
+      {
+        LogPrint (eLogWarning, "Packet: E: fromBuffer: Incomplete packet, ",
+                  "length: ", length, ", left: ", len - offset);
+        return false;
+      }
+
+    edata.assign (buf + offset, buf + offset + length);
 
     return true;
   }
 
-  std::vector<uint8_t>
-  toByte ()
+  size_t
+  byteSize () const
   {
-    /// Start basic part
-    std::vector<uint8_t> result;
-    result.reserve (71 + edata.size ());
-
-    result.push_back (type);
-    result.push_back (ver);
-    /// End basic part
-
-    result.insert (result.end (), std::begin (key), std::end (key));
-
-    uint8_t v_time[4] = { static_cast<uint8_t> (stored_time >> 24),
-                          static_cast<uint8_t> (stored_time >> 16),
-                          static_cast<uint8_t> (stored_time >> 8),
-                          static_cast<uint8_t> (stored_time & 0xffff) };
-
-    result.insert (result.end (), std::begin (v_time), std::end (v_time));
-    result.insert (result.end (), std::begin (delete_hash),
-                   std::end (delete_hash));
-
-    result.push_back (alg);
+    /// key[32] + stored_time[4] + delete_hash[32] + alg[1] + length[2]
+    return header_size + 71 + edata.size ();
+  }
 
-    uint8_t v_length[2] = { static_cast<uint8_t> (length >> 8),
-                            static_cast<uint8_t> (length & 0xff) };
-    result.insert (result.end (), std::begin (v_length), std::end (v_length));
-    result.insert (result.end (), edata.begin (), edata.end ());
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+    writer.bytes (key, 32);
+    writer.u32 ((uint32_t)stored_time);
+    writer.bytes (delete_hash, 32);
+    writer.u8 (alg);
+    writer.u16 (length);
+    writer.bytes (edata);
+  }
 
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 
   bool
@@ -434,35 +748,29 @@ public:
   uint16_t length = 0;
   std::vector<uint8_t> data;
 
-  std::vector<uint8_t>
-  toByte ()
+  size_t
+  byteSize () const
   {
-    /// Start basic part
-    std::vector<uint8_t> result;
-    result.reserve (72 + data.size ());
-
-    result.push_back (type);
-    result.push_back (ver);
-    /// End basic part
-
-    result.insert (result.end (), std::begin (mes_id), std::end (mes_id));
-    result.insert (result.end (), std::begin (DA), std::end (DA));
-
-    uint8_t v_fr_id[2] = { static_cast<uint8_t> (fr_id >> 8),
-                           static_cast<uint8_t> (fr_id & 0xff) };
-    result.insert (result.end (), std::begin (v_fr_id), std::end (v_fr_id));
-
-    uint8_t v_fr_count[2] = { static_cast<uint8_t> (fr_count >> 8),
-                              static_cast<uint8_t> (fr_count & 0xff) };
-    result.insert (result.end (), std::begin (v_fr_count),
-                   std::end (v_fr_count));
+    /// mes_id[32] + DA[32] + fr_id[2] + fr_count[2] + length[2]
+    return header_size + 70 + data.size ();
+  }
 
-    uint8_t v_length[2] = { static_cast<uint8_t> (length >> 8),
-                            static_cast<uint8_t> (length & 0xff) };
-    result.insert (result.end (), std::begin (v_length), std::end (v_length));
-    result.insert (result.end (), data.begin (), data.end ());
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+    writer.bytes (mes_id, 32);
+    writer.bytes (DA, 32);
+    writer.u16 (fr_id);
+    writer.u16 (fr_count);
+    writer.u16 (length);
+    writer.bytes (data);
+  }
 
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 };
 
@@ -490,23 +798,23 @@ public:
   std::vector<Entry> data;
 
   bool
-  fromBuffer (const std::vector<uint8_t> &buf, bool from_net)
+  fromBuffer (const uint8_t *buf, size_t len, bool from_net)
   {
-    if (buf.size () < COMM_DATA_LEN)
+    if (len < COMM_DATA_LEN)
       {
         LogPrint (eLogWarning, "Packet: I: fromBuffer: Payload is too short");
         return false;
       }
-    uint16_t offset = 0;
+    size_t offset = 0;
 
-    std::memcpy (&type, buf.data (), 1);
+    std::memcpy (&type, buf, 1);
     offset += 1;
-    std::memcpy (&ver, buf.data () + offset, 1);
+    std::memcpy (&ver, buf + offset, 1);
     offset += 1;
-    std::memcpy (&hash, buf.data () + offset, 32);
+    std::memcpy (&hash, buf + offset, 32);
     offset += 32;
 
-    std::memcpy (&nump, buf.data () + offset, 4);
+    std::memcpy (&nump, buf + offset, 4);
     
     //LogPrint (eLogDebug, "Packet: I: fromBuffer: nump raw: ", nump,
     //          ", ntohl: ", ntohl (nump),
@@ -534,7 +842,8 @@ public:
       }
 
     // Check if payload length enough to parse all entries
-    if (buf.size () < (COMM_DATA_LEN + (68 * nump)))
+    /// Division keeps check right for any nump
+    if ((len - offset) / 68 < nump)
       {
         LogPrint (eLogWarning, "Packet: I: fromBuffer: Incomplete packet");
         return false;
@@ -543,20 +852,20 @@ public:
     for (uint32_t i = 0; i < nump; i++)
       {
         IndexPacket::Entry entry = {};
-        std::memcpy (&entry.key, buf.data () + offset, 32);
+        std::memcpy (&entry.key, buf + offset, 32);
         offset += 32;
         //i2p::data::Tag<32> key (entry.key);
         //LogPrint (eLogDebug, "Packet: I: fromBuffer: mail key: ",
         //          key.ToBase64 ());
 
-        std::memcpy (&entry.dv, buf.data () + offset, 32);
+        std::memcpy (&entry.dv, buf + offset, 32);
         offset += 32;
         //i2p::data::Tag<32> dv (entry.dv);
         //LogPrint (eLogDebug, "Packet: I: fromBuffer: mail dvr: ",
         //          dv.ToBase64 ());
 
         uint32_t temp_time;
-        std::memcpy (&temp_time, buf.data () + offset, 4);
+        std::memcpy (&temp_time, buf + offset, 4);
         temp_time = ntohl (temp_time);
         std::memcpy (&entry.time, &temp_time, 4);
         //LogPrint (eLogDebug, "Packet: I: fromBuffer: time: ", entry.time);
@@ -568,39 +877,38 @@ public:
     return true;
   }
 
-  std::vector<uint8_t>
-  toByte ()
+  bool
+  fromBuffer (const std::vector<uint8_t> &buf, bool from_net)
   {
-    /// Start basic part
-    std::vector<uint8_t> result;
-    result.reserve (COMM_DATA_LEN + (data.size () * 68));
-
-    result.push_back (type);
-    result.push_back (ver);
-    /// End basic part
-
-    result.insert (result.end (), std::begin (hash), std::end (hash));
+    return fromBuffer (buf.data (), buf.size (), from_net);
+  }
 
-    uint8_t v_nump[4] = { static_cast<uint8_t> (nump >> 24),
-                          static_cast<uint8_t> (nump >> 16),
-                          static_cast<uint8_t> (nump >> 8),
-                          static_cast<uint8_t> (nump & 0xffff) };
+  size_t
+  byteSize () const
+  {
+    /// hash[32] + nump[4] + entries by key[32] + dv[32] + time[4]
+    return header_size + 36 + (data.size () * 68);
+  }
 
-    result.insert (result.end (), std::begin (v_nump), std::end (v_nump));
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+    writer.bytes (hash, 32);
+    writer.u32 (nump);
 
-    for (auto entry : data)
+    for (const auto &entry : data)
       {
-        uint32_t temp_time;
-        std::memcpy (&temp_time, &entry.time, 4);
-        temp_time = htonl (temp_time);
-        std::memcpy (&entry.time, &temp_time, 4);
-
-        uint8_t arr[68];
-        memcpy (arr, entry.key, 68);
-        result.insert (result.end (), std::begin (arr), std::end (arr));
+        writer.bytes (entry.key, 32);
+        writer.bytes (entry.dv, 32);
+        writer.u32 ((uint32_t)entry.time);
       }
+  }
 
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 
   int32_t
@@ -615,17 +923,17 @@ public:
     LogPrint (eLogDebug, "Packet: I: erase_entry: DA: ", da_h.ToBase64 ());
     LogPrint (eLogDebug, "Packet: I: erase_entry: DH: ", dh_h.ToBase64 ());
 
-    for (uint8_t i = 0; i < (uint8_t)data.size (); i++)
+    for (size_t i = 0; i < data.size (); i++)
       {
         i2p::data::Tag<32> dv_h (data[i].dv);
         int key_cmp = memcmp(data[i].key, key, 32);
         if (dh_h == dv_h && key_cmp == 0)
           {
             LogPrint (eLogDebug, "Packet: I: erase_entry: DV: ", dv_h.ToBase64 ());
+            int32_t time = data[i].time;
             data.erase (data.begin () + i);
             nump = data.size ();
-            //return true;
-            return data[i].time;
+            return time;
           }
       }
 
@@ -649,26 +957,26 @@ public:
   std::vector<item> data;
 
   bool
-  fromBuffer (const std::vector<uint8_t> &buf, bool from_net)
+  fromBuffer (const uint8_t *buf, size_t len, bool from_net)
   {
-    /// Because count[4] = 4
-    if (buf.size () < 4)
+    /// Because type[1] + ver[1] + count[4] = 6
+    if (len < 6)
       {
         LogPrint (eLogWarning,
                   "Packet: T: from_comm_packet: Payload is too short: ",
-                  buf.size ());
+                  len);
         return false;
       }
     
-    uint16_t offset = 0;
+    size_t offset = 0;
     /// Start basic part
-    std::memcpy (&type, buf.data () + offset, 1);
+    std::memcpy (&type, buf + offset, 1);
     offset += 1;
-    std::memcpy (&ver, buf.data () + offset, 1);
+    std::memcpy (&ver, buf + offset, 1);
     offset += 1;
     /// End basic part
 
-    std::memcpy (&count, buf.data () + offset, 4);
+    std::memcpy (&count, buf + offset, 4);
     offset += 4;
 
     if (from_net)
@@ -680,23 +988,30 @@ public:
     if (count == 0)
       return true;
 
+    /// key[32] + DA[32] + time[4]
+    if ((len - offset) / 68 < count)
+      {
+        LogPrint (eLogWarning, "Packet: T: fromBuffer: Incomplete packet");
+        return false;
+      }
+
     for (uint32_t i = 0; i < count; i++)
       {
         DeletionInfoPacket::item item;
-        std::memcpy (&item.key, buf.data () + offset, 32);
+        std::memcpy (&item.key, buf + offset, 32);
         offset += 32;
 
         i2p::data::Tag<32> key (item.key);
         LogPrint (eLogDebug, "Packet: T: fromBuffer: key: ", key.ToBase64 ());
 
-        std::memcpy (&item.DA, buf.data () + offset, 32);
+        std::memcpy (&item.DA, buf + offset, 32);
         offset += 32;
 
         i2p::data::Tag<32> DA (item.DA);
         LogPrint (eLogDebug, "Packet: T: fromBuffer: DA: ", DA.ToBase64 ());
 
         uint32_t temp_time;
-        std::memcpy (&temp_time, buf.data () + offset, 4);
+        std::memcpy (&temp_time, buf + offset, 4);
         temp_time = ntohl (temp_time);
         std::memcpy (&item.time, &temp_time, 4);
         offset += 4;
@@ -709,32 +1024,37 @@ public:
     return true;
   }
 
-  std::vector<uint8_t>
-  toByte ()
+  bool
+  fromBuffer (const std::vector<uint8_t> &buf, bool from_net)
   {
-    /// Start basic part
-    std::vector<uint8_t> result;
-    result.reserve (6 + (data.size () * 68));
-
-    result.push_back (type);
-    result.push_back (ver);
-    /// End basic part
+    return fromBuffer (buf.data (), buf.size (), from_net);
+  }
 
-    uint8_t v_count[4] = { static_cast<uint8_t> (count >> 24),
-                           static_cast<uint8_t> (count >> 16),
-                           static_cast<uint8_t> (count >> 8),
-                           static_cast<uint8_t> (count & 0xffff) };
+  size_t
+  byteSize () const
+  {
+    /// count[4] + items by key[32] + DA[32] + time[4]
+    return header_size + 4 + (data.size () * 68);
+  }
 
-    result.insert (result.end (), std::begin (v_count), std::end (v_count));
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+    writer.u32 (count);
 
-    for (auto entry : data)
+    for (const auto &entry : data)
       {
-        uint8_t arr[68];
-        memcpy (arr, entry.key, 68);
-        result.insert (result.end (), std::begin (arr), std::end (arr));
+        writer.bytes (entry.key, 32);
+        writer.bytes (entry.DA, 32);
+        writer.u32 ((uint32_t)entry.time);
       }
+  }
 
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 };
 
@@ -747,8 +1067,15 @@ public:
   std::vector<i2p::data::IdentityEx> data;
 
   bool
-  fromBuffer(uint8_t *buf, size_t len, bool from_net)
+  fromBuffer (const uint8_t *buf, size_t len, bool from_net)
   {
+    /// type[1] + ver[1] + count[2]
+    if (len < 4)
+      {
+        LogPrint (eLogWarning, "Packet: L: V4: Payload is too short: ", len);
+        return false;
+      }
+
     size_t offset = 0;
     std::memcpy (&type, buf, 1);
     offset += 1;
@@ -798,31 +1125,33 @@ public:
     return true;
   }
 
-  std::vector<uint8_t>
-  toByte ()
+  size_t
+  byteSize () const
   {
-    /// Start basic part
-    std::vector<uint8_t> result;
-    result.reserve (4 + (data.size () * 384));
-    result.push_back (type);
-    result.push_back (ver);
-    /// End basic part
+    /// count[2] + identities cut to 384 bytes
+    return header_size + 2 + (data.size () * 384);
+  }
 
-    uint8_t v_count[2] = { static_cast<uint8_t> (count >> 8),
-                           static_cast<uint8_t> (count & 0xff) };
-    result.insert (result.end (), std::begin (v_count), std::end (v_count));
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+    writer.u16 (count);
 
-    for (auto identity : data)
-    {
-      size_t sz = identity.GetFullLen ();
-      uint8_t t_key[sz] = {0};
-      identity.ToBuffer (t_key, sz);
-      uint8_t cut_key[384] = {0};
-      memcpy(cut_key, t_key, 384);
-      result.insert (result.end (), cut_key, cut_key + 384);
-    }
+    std::vector<uint8_t> full_key;
+    for (const auto &identity : data)
+      {
+        full_key.assign (identity.GetFullLen (), 0);
+        identity.ToBuffer (full_key.data (), full_key.size ());
+        full_key.resize (384, 0);
+        writer.bytes (full_key);
+      }
+  }
 
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 };
 
@@ -834,8 +1163,16 @@ public:
   uint16_t count;
   std::vector<i2p::data::IdentityEx> data;
 
-  bool fromBuffer(uint8_t *buf, size_t len, bool from_net)
+  bool
+  fromBuffer (const uint8_t *buf, size_t len, bool from_net)
   {
+    /// type[1] + ver[1] + count[2]
+    if (len < 4)
+      {
+        LogPrint (eLogWarning, "Packet: L: V5: Payload is too short: ", len);
+        return false;
+      }
+
     size_t offset = 0;
     std::memcpy (&type, buf, 1);
     offset += 1;
@@ -877,30 +1214,36 @@ public:
     return true;
   }
 
-  std::vector<uint8_t>
-  toByte ()
+  size_t
+  byteSize () const
   {
-    /// Start basic part
-    std::vector<uint8_t> result;
-    result.reserve (4 + data.size ());
+    /// count[2] + full identities
+    size_t size = header_size + 2;
+    for (const auto &identity : data)
+      size += identity.GetFullLen ();
 
-    result.push_back (type);
-    result.push_back (ver);
-    /// End basic part
+    return size;
+  }
 
-    uint8_t v_count[2] = { static_cast<uint8_t> (count >> 8),
-                           static_cast<uint8_t> (count & 0xff) };
-    result.insert (result.end (), std::begin (v_count), std::end (v_count));
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+    writer.u16 (count);
 
-    for (auto identity : data)
-    {
-      size_t sz = identity.GetFullLen ();
-      uint8_t t_key[sz] = {0};
-      identity.ToBuffer (t_key, sz);
-      result.insert (result.end (), t_key, t_key + sz);
-    }
+    for (const auto &identity : data)
+      {
+        size_t key_len = identity.GetFullLen ();
+        uint8_t *key = writer.reserve (key_len);
+        if (key)
+          identity.ToBuffer (key, key_len);
+      }
+  }
 
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 };
 
@@ -948,8 +1291,11 @@ public:
   uint8_t type;
   uint8_t ver;
   uint8_t cid[32] = {0};
-  std::string from;
-  std::vector<uint8_t> payload;
+  dest_handle from = DEST_HANDLE_NONE;
+  /// Slice of received datagram after common header
+  SharedBuffer payload;
+  /// Copied from queued datagram, see PacketForQueue
+  std::chrono::steady_clock::time_point queued_at;
 };
 
 struct CleanCommunicationPacket
@@ -964,6 +1310,18 @@ public:
   uint8_t type;
   uint8_t ver = version::V4;
   uint8_t cid[32] = {0};
+
+protected:
+  static const size_t header_size = COMM_DATA_LEN;
+
+  void
+  writeHeader (ByteWriter &writer) const
+  {
+    writer.bytes (prefix, 4);
+    writer.u8 (type);
+    writer.u8 (ver);
+    writer.bytes (cid, 32);
+  }
 };
 
 /// not implemented
@@ -1004,10 +1362,10 @@ public:
   // 'C' = Directory Entry
   // 'E' = Email Packet
   // or empty with non-OK status
-  std::vector<uint8_t> data;
+  SharedBuffer data;
 
   bool
-  fromBuffer (uint8_t *buf, size_t len, bool from_net)
+  fromBuffer (const uint8_t *buf, size_t len, bool from_net)
   {
     /// Because COMM_DATA_LEN + status[1] + length[2] = 41
     if (len < 41)
@@ -1044,13 +1402,20 @@ public:
     if (length == 0)
       return true;
 
+    if (length > len - offset)
+      {
+        LogPrint (eLogWarning,
+                  "Packet: N: fromBuffer: Payload is too short: ", len);
+        return false;
+      }
+
     data = std::vector<uint8_t> (buf + offset, buf + offset + length);
 
     return true;
   }
 
   bool
-  from_comm_packet (CommunicationPacket packet, bool from_net)
+  from_comm_packet (const CommunicationPacket &packet, bool from_net)
   {
     /// Because  status[1] + length[2] = 3
     if (packet.payload.size () < 3)
@@ -1067,14 +1432,11 @@ public:
     std::memcpy (&cid, &packet.cid, 32);
     /// End basic part
 
-    uint16_t offset = 0;
-    std::memcpy (&status, packet.payload.data () + offset, 1);
-    offset += 1;
-    std::memcpy (&length, packet.payload.data () + offset, 2);
-    offset += 2;
-
-    if (from_net)
-      length = ntohs (length);
+    ByteReader reader (packet.payload, from_net);
+    uint8_t raw_status = 0;
+    reader.u8 (raw_status);
+    reader.u16 (length);
+    status = (StatusCode)raw_status;
 
     LogPrint (eLogDebug, "Packet: N: fromBuffer: len: ", length,
               ", type: ", type, ", version: ", unsigned (ver));
@@ -1086,7 +1448,7 @@ public:
     if (length == 0)
       return true;
 
-    if ((packet.payload.size () - offset) < length)
+    if (!reader.bytes (data, length))
       {
         LogPrint (eLogWarning,
                   "Packet: N: from_comm_packet: Payload is too short: ",
@@ -1094,35 +1456,31 @@ public:
         return false;
       }
 
-    data = std::vector<uint8_t> (packet.payload.data () + offset,
-                                 packet.payload.data () + offset + length);
-
     return true;
   }
 
-  std::vector<uint8_t>
-  toByte ()
+  size_t
+  byteSize () const
   {
-    /// Start basic part
-    std::vector<uint8_t> result (std::begin (prefix), std::end (prefix));
-    result.push_back (type);
-    result.push_back (ver);
-    result.insert (result.end (), std::begin (cid), std::end (cid));
-    /// End basic part
-
-    result.push_back (status);
+    /// status[1] + length[2]
+    return header_size + 3 + (length > 0 ? data.size () : 0);
+  }
 
-    //uint8_t v_length[2] = { static_cast<uint8_t> (length >> 8),
-    //                        static_cast<uint8_t> (length & 0xff) };
-    uint16_t n_length = htons (length);
-    uint8_t v_length[2];
-    memcpy(v_length, &n_length, 2);
-    result.insert (result.end (), std::begin (v_length), std::end (v_length));
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+    writer.u8 (status);
+    writer.u16 (length);
 
     if (length > 0)
-      result.insert (result.end (), data.begin (), data.end ());
+      writer.bytes (data);
+  }
 
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 };
 
@@ -1132,7 +1490,7 @@ public:
   PeerListRequestPacket () : CleanCommunicationPacket (CommA) {}
 
   bool
-  fromBuffer (uint8_t *buf, size_t len, bool from_net)
+  fromBuffer (const uint8_t *buf, size_t len, bool from_net)
   {
     if (len < COMM_DATA_LEN)
       {
@@ -1154,17 +1512,22 @@ public:
     return true;
   }
 
-  std::vector<uint8_t>
-  toByte ()
+  size_t
+  byteSize () const
   {
-    /// Start basic part
-    std::vector<uint8_t> result (std::begin (prefix), std::end (prefix));
-    result.push_back (type);
-    result.push_back (ver);
-    result.insert (result.end (), std::begin (cid), std::end (cid));
-    /// End basic part
+    return header_size;
+  }
 
-    return result;
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+  }
+
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 };
 
@@ -1179,7 +1542,7 @@ public:
   uint8_t key[32] = {0};
 
   bool
-  from_comm_packet (CommunicationPacket packet)
+  from_comm_packet (const CommunicationPacket &packet)
   {
     /// Because  data_type[1] + dht_key[32] = 33
     if (packet.payload.size () < 33)
@@ -1196,8 +1559,8 @@ public:
     std::memcpy (&cid, &packet.cid, 32);
     /// End basic part
 
-    uint16_t offset = 0;
-    std::memcpy (&data_type, packet.payload.data () + offset, 1);
+    ByteReader reader (packet.payload);
+    reader.u8 (data_type);
 
     if (data_type != (uint8_t)'I' && data_type != (uint8_t)'E' &&
         data_type != (uint8_t)'C')
@@ -1208,26 +1571,28 @@ public:
       return false;
     }
 
-    offset += 1;
-    std::memcpy (&key, packet.payload.data () + offset, 32);
-    //offset += 32;
+    return reader.bytes (key, 32);
+  }
 
-    return true;
+  size_t
+  byteSize () const
+  {
+    /// data_type[1] + key[32]
+    return header_size + 33;
   }
 
-  std::vector<uint8_t>
-  toByte ()
+  void
+  write (ByteWriter &writer) const
   {
-    /// Start basic part
-    std::vector<uint8_t> result (std::begin (prefix), std::end (prefix));
-    result.push_back (type);
-    result.push_back (ver);
-    result.insert (result.end (), std::begin (cid), std::end (cid));
-    /// End basic part
+    writeHeader (writer);
+    writer.u8 (data_type);
+    writer.bytes (key, 32);
+  }
 
-    result.push_back (data_type);
-    result.insert (result.end (), std::begin (key), std::end (key));
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 };
 
@@ -1239,7 +1604,7 @@ public:
   uint8_t dht_key[32] = {0};
 
   bool
-  from_comm_packet (CommunicationPacket packet)
+  from_comm_packet (const CommunicationPacket &packet)
   {
     /// Because  dht_key[32] = 32
     if (packet.payload.size () < 32)
@@ -1256,24 +1621,27 @@ public:
     std::memcpy (&cid, &packet.cid, 32);
     /// End basic part
 
-    std::memcpy (&dht_key, packet.payload.data (), 32);
-
-    return true;
+    ByteReader reader (packet.payload);
+    return reader.bytes (dht_key, 32);
   }
 
-  std::vector<uint8_t>
-  toByte ()
+  size_t
+  byteSize () const
   {
-    /// Start basic part
-    std::vector<uint8_t> result (std::begin (prefix), std::end (prefix));
-    result.push_back (type);
-    result.push_back (ver);
-    result.insert (result.end (), std::begin (cid), std::end (cid));
-    /// End basic part
+    return header_size + 32;
+  }
 
-    result.insert (result.end (), std::begin (dht_key), std::end (dht_key));
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+    writer.bytes (dht_key, 32);
+  }
 
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 };
 
@@ -1283,12 +1651,12 @@ public:
   StoreRequestPacket () : CleanCommunicationPacket (CommS) {}
 
   uint16_t hc_length = 0;
-  std::vector<uint8_t> hashcash;
+  SharedBuffer hashcash;
   uint16_t length = 0;
-  std::vector<uint8_t> data;
+  SharedBuffer data;
 
   bool
-  from_comm_packet (CommunicationPacket packet, bool from_net)
+  from_comm_packet (const CommunicationPacket &packet, bool from_net)
   {
     /// Because  hc_length[2] + length[2] = 4
     if (packet.payload.size () < 4)
@@ -1305,55 +1673,46 @@ public:
     std::memcpy (&cid, &packet.cid, 32);
     /// End basic part
 
-    uint16_t offset = 0;
-    std::memcpy (&hc_length, packet.payload.data () + offset, 2);
-    offset += 2;
-
-    if (from_net)
-      hc_length = ntohs (hc_length);
-
-    hashcash = std::vector<uint8_t> (packet.payload.data () + offset,
-                                     packet.payload.data () + offset + hc_length);
-    offset += hc_length;
-    
-    std::memcpy (&length, packet.payload.data () + offset, 2);
-    offset += 2;
-
-    if (from_net)
-      length = ntohs (length);
+    ByteReader reader (packet.payload, from_net);
+    reader.u16 (hc_length);
+    reader.bytes (hashcash, hc_length);
+    reader.u16 (length);
 
     LogPrint (eLogDebug, "Packet: S: from_comm_packet: len: ", length,
               ", type: ", type, ", version: ", unsigned (ver));
 
-    data = std::vector<uint8_t> (packet.payload.data () + offset,
-                                 packet.payload.data () + offset + length);
+    if (!reader.bytes (data, length))
+      {
+        LogPrint (eLogWarning,
+                  "Packet: S: from_comm_packet: Payload is too short: ",
+                  packet.payload.size ());
+        return false;
+      }
 
     return true;
   }
 
-  std::vector<uint8_t>
-  toByte ()
+  size_t
+  byteSize () const
   {
-    /// Start basic part
-    std::vector<uint8_t> result (std::begin (prefix), std::end (prefix));
-    result.push_back (type);
-    result.push_back (ver);
-    result.insert (result.end (), std::begin (cid), std::end (cid));
-    /// End basic part
-
-    uint8_t v_hc_length[2] = { static_cast<uint8_t> (hc_length >> 8),
-                               static_cast<uint8_t> (hc_length & 0xff) };
-    result.insert (result.end (), std::begin (v_hc_length),
-                   std::end (v_hc_length));
-    result.insert (result.end (), hashcash.begin (), hashcash.end ());
-
-    uint8_t v_length[2] = { static_cast<uint8_t> (length >> 8),
-                            static_cast<uint8_t> (length & 0xff) };
+    /// hc_length[2] + length[2]
+    return header_size + 4 + hashcash.size () + data.size ();
+  }
 
-    result.insert (result.end (), std::begin (v_length), std::end (v_length));
-    result.insert (result.end (), data.begin (), data.end ());
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+    writer.u16 (hc_length);
+    writer.bytes (hashcash);
+    writer.u16 (length);
+    writer.bytes (data);
+  }
 
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 };
 
@@ -1366,7 +1725,7 @@ public:
   uint8_t DA[32] = {0};
 
   bool
-  fromBuffer (uint8_t *buf, size_t len, bool from_net)
+  fromBuffer (const uint8_t *buf, size_t len, bool from_net)
   {
     /// COMM_DATA_LEN + key[32] + DA[32] = 102
     if (len < 102)
@@ -1398,7 +1757,7 @@ public:
   }
 
   bool
-  from_comm_packet (CommunicationPacket packet)
+  from_comm_packet (const CommunicationPacket &packet)
   {
     /// Because  key[32] + DA[32] = 64
     if (packet.payload.size () < 64)
@@ -1420,28 +1779,30 @@ public:
     LogPrint (eLogDebug, "Packet: D: from_comm_packet: type: ", type,
               ", version: ", unsigned (ver));
 
-    uint16_t offset = 0;
-    std::memcpy (&key, packet.payload.data () + offset, 32);
-    offset += 32;
-    std::memcpy (&DA, packet.payload.data () + offset, 32);
-    // offset += 32;
-    return true;
+    ByteReader reader (packet.payload);
+    reader.bytes (key, 32);
+    return reader.bytes (DA, 32);
   }
 
-  std::vector<uint8_t>
-  toByte ()
+  size_t
+  byteSize () const
   {
-    /// Start basic part
-    std::vector<uint8_t> result (std::begin (prefix), std::end (prefix));
-    result.push_back (type);
-    result.push_back (ver);
-    result.insert (result.end (), std::begin (cid), std::end (cid));
-    /// End basic part
+    /// key[32] + DA[32]
+    return header_size + 64;
+  }
 
-    result.insert (result.end (), std::begin (key), std::end (key));
-    result.insert (result.end (), std::begin (DA), std::end (DA));
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+    writer.bytes (key, 32);
+    writer.bytes (DA, 32);
+  }
 
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 };
 
@@ -1461,7 +1822,7 @@ public:
   std::vector<item> data;
 
   bool
-  fromBuffer (uint8_t *buf, size_t len, bool from_net)
+  fromBuffer (const uint8_t *buf, size_t len, bool from_net)
   {
     /// COMM_DATA_LEN + count[1] + dht_key[32] + item[64] = 135 for min 1 item
     if (len < 135)
@@ -1519,7 +1880,7 @@ public:
   }
 
   bool
-  from_comm_packet (CommunicationPacket packet)
+  from_comm_packet (const CommunicationPacket &packet)
   {
     /// Because count[1] + dht_key[32] + item[64] = 97
     if (packet.payload.size () < 97)
@@ -1536,13 +1897,11 @@ public:
     std::memcpy (&cid, &packet.cid, 32);
     /// End basic part
 
-    uint16_t offset = 0;
-    std::memcpy (&dht_key, packet.payload.data () + offset, 32);
-    offset += 32;
-    std::memcpy (&count, packet.payload.data () + offset, 1);
-    offset += 1;
+    ByteReader reader (packet.payload);
+    reader.bytes (dht_key, 32);
+    reader.u8 (count);
 
-    if (packet.payload.size () < (size_t)(33 + (64 * count)))
+    if (reader.remaining () < (size_t)(64 * count))
       {
         LogPrint (eLogWarning,
                   "Packet: X: from_comm_packet: Payload is too short: ",
@@ -1556,14 +1915,12 @@ public:
     for (uint32_t i = 0; i < count; i++)
       {
         IndexDeleteRequestPacket::item item;
-        std::memcpy (&item.key, packet.payload.data () + offset, 32);
-        offset += 32;
+        reader.bytes (item.key, 32);
         i2p::data::Tag<32> key (item.key);
         LogPrint (eLogDebug, "Packet: X: from_comm_packet: mail key: ",
                   key.ToBase64 ());
 
-        std::memcpy (&item.da, packet.payload.data () + offset, 32);
-        offset += 32;
+        reader.bytes (item.da, 32);
         i2p::data::Tag<32> da (item.da);
         LogPrint (eLogDebug, "Packet: X: from_comm_packet: mail da: ",
                   da.ToBase64 ());
@@ -1574,28 +1931,31 @@ public:
     return true;
   }
 
-  std::vector<uint8_t>
-  toByte ()
+  size_t
+  byteSize () const
   {
-    /// Start basic part
-    std::vector<uint8_t> result (std::begin (prefix), std::end (prefix));
-    result.push_back (type);
-    result.push_back (ver);
-    result.insert (result.end (), std::begin (cid), std::end (cid));
-    /// End basic part
-
-    result.insert (result.end (), std::begin (dht_key), std::end (dht_key));
+    /// dht_key[32] + count[1] + items by key[32] + da[32]
+    return header_size + 33 + (data.size () * 64);
+  }
 
-    result.push_back (count);
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+    writer.bytes (dht_key, 32);
+    writer.u8 (count);
 
-    for (auto entry : data)
+    for (const auto &entry : data)
       {
-        uint8_t arr[64];
-        memcpy (arr, entry.key, 64);
-        result.insert (result.end (), std::begin (arr), std::end (arr));
+        writer.bytes (entry.key, 32);
+        writer.bytes (entry.da, 32);
       }
+  }
 
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 };
 
@@ -1606,19 +1966,23 @@ public:
 
   uint8_t key[32] = {0};
 
-  std::vector<uint8_t>
-  toByte ()
+  size_t
+  byteSize () const
   {
-    /// Start basic part
-    std::vector<uint8_t> result (std::begin (prefix), std::end (prefix));
-    result.push_back (type);
-    result.push_back (ver);
-    result.insert (result.end (), std::begin (cid), std::end (cid));
-    /// End basic part
+    return header_size + 32;
+  }
 
-    result.insert (result.end (), std::begin (key), std::end (key));
+  void
+  write (ByteWriter &writer) const
+  {
+    writeHeader (writer);
+    writer.bytes (key, 32);
+  }
 
-    return result;
+  std::optional<std::vector<uint8_t> >
+  toByte () const
+  {
+    return to_bytes (*this);
   }
 };
 
@@ -1657,15 +2021,12 @@ parseCommPacket (const sp_queue_pkt &packet)
 
   CommunicationPacket data (CommA);
 
+  ByteReader reader (packet->payload.data (), packet->payload.size ());
   /// Skipping prefix
-  size_t offset = 4;
-
-  std::memcpy (&data.type, packet->payload.data () + offset, 1);
-  offset += 1;
-  std::memcpy (&data.ver, packet->payload.data () + offset, 1);
-  offset += 1;
-  std::memcpy (&data.cid, packet->payload.data () + offset, 32);
-  offset += 32;
+  reader.take (4);
+  reader.u8 (data.type);
+  reader.u8 (data.ver);
+  reader.bytes (data.cid, 32);
 
   auto found_type = std::find (std::begin (PACKET_TYPE),
                                std::end (PACKET_TYPE), data.type);
@@ -1685,23 +2046,12 @@ parseCommPacket (const sp_queue_pkt &packet)
       return nullptr;
     }
 
-  long clean_payload_size = (long)packet->payload.size () - offset;
-  if (clean_payload_size < 0)
-    {
-      LogPrint (eLogWarning, "Packet: Payload is too short");
-      return nullptr;
-    }
-
-  //CommunicationPacket res (data.type);
-  //res.ver = data.ver;
-  //memcpy (res.cid, data.cid, 32);
-
-  data.from = std::move (packet->destination);
-
-  data.payload = std::vector<uint8_t> (packet->payload.begin () + offset,
-                                       packet->payload.end ());
+  data.from = packet->destination;
+  data.queued_at = packet->queued_at;
+  /// Payload keeps datagram alive, nothing is copied
+  data.payload = SharedBuffer (packet, reader.current (), reader.remaining ());
 
-  return std::make_shared<CommunicationPacket> (data);
+  return util::make_pooled<CommunicationPacket> (std::move (data));
 }
 
 } // namespace pbote
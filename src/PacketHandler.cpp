@@ -6,6 +6,7 @@
  * See full license text in LICENSE file at top of project tree
  */
 
+#include <algorithm>
 #include <random>
 
 #include "DHTworker.h"
@@ -37,12 +38,13 @@ IncomingRequest::IncomingRequest (RequestHandler &owner) : m_owner (owner)
 }
 
 bool
-IncomingRequest::handleNewPacket (const sp_queue_pkt &queuePacket)
+IncomingRequest::handleNewPacket (const sp_queue_pkt &queuePacket) const
 {
   sp_comm_pkt packet = pbote::parseCommPacket (queuePacket);
   if (!packet)
     {
       LogPrint (eLogWarning, "Packet: Can't parse packet");
+      network::trace_replayer.handled (queuePacket->queued_at);
       return false;
     }
 
@@ -53,24 +55,27 @@ IncomingRequest::handleNewPacket (const sp_queue_pkt &queuePacket)
         {
           LogPrint (eLogDebug, "Packet: Pass packet ", packet->type,
                     " to batch");
+          network::trace_replayer.handled (packet->queued_at);
           return true;
         }
     }
 
   LogPrint (eLogDebug, "Packet: Non-batch packet with type ", packet->type);
 
+  bool handled = false;
   if (i_handlers_[packet->type])
-    return (this->*(i_handlers_[packet->type])) (packet);
+    handled = (this->*(i_handlers_[packet->type])) (packet);
   else
-    {
-      LogPrint (eLogWarning, "Packet: Got unknown packet type ", packet->type);
-      return false;
-    }
+    LogPrint (eLogWarning, "Packet: Got unknown packet type ", packet->type);
+
+  /// Time is reset if handler was posted, it reports on its own
+  network::trace_replayer.handled (packet->queued_at);
+  return handled;
 }
 
 /// not implemented
 bool
-IncomingRequest::receiveRelayRequest (const sp_comm_pkt &packet)
+IncomingRequest::receiveRelayRequest (const sp_comm_pkt &packet) const
 {
   LogPrint (eLogDebug, "Packet: receiveRelayRequest");
   // ToDo
@@ -79,7 +84,7 @@ IncomingRequest::receiveRelayRequest (const sp_comm_pkt &packet)
 
 /// not implemented
 bool
-IncomingRequest::receiveRelayReturnRequest (const sp_comm_pkt &packet)
+IncomingRequest::receiveRelayReturnRequest (const sp_comm_pkt &packet) const
 {
   LogPrint (eLogDebug, "Packet: receiveRelayReturnRequest");
   // ToDo
@@ -88,7 +93,7 @@ IncomingRequest::receiveRelayReturnRequest (const sp_comm_pkt &packet)
 
 /// not implemented
 bool
-IncomingRequest::receiveFetchRequest (const sp_comm_pkt &packet)
+IncomingRequest::receiveFetchRequest (const sp_comm_pkt &packet) const
 {
   LogPrint (eLogDebug, "Packet: receiveFetchRequest");
   // ToDo
@@ -96,10 +101,11 @@ IncomingRequest::receiveFetchRequest (const sp_comm_pkt &packet)
 }
 
 bool
-IncomingRequest::receiveResponsePkt (const sp_comm_pkt &packet)
+IncomingRequest::receiveResponsePkt (const sp_comm_pkt &packet) const
 {
   LogPrint (eLogWarning, "Packet: Response: Unexpected Response received");
-  LogPrint (eLogWarning, "Packet: Response: Sender: ", packet->from);
+  LogPrint (eLogWarning, "Packet: Response: Sender: ",
+            dest_table.short_name (packet->from));
 
   ResponsePacket response;
   bool parsed = response.from_comm_packet (*packet, true);
@@ -113,7 +119,8 @@ IncomingRequest::receiveResponsePkt (const sp_comm_pkt &packet)
             "Packet: Response: Status: ", unsigned (response.status),
             ", message: ", pbote::statusToString (response.status));
 
-  if (response.length == 0)
+  /// Length is not checked with non-OK status, so look at data itself
+  if (response.data.empty ())
     {
       LogPrint (eLogWarning, "Packet: Response: Empty packet");
       return true;
@@ -165,19 +172,19 @@ IncomingRequest::receiveResponsePkt (const sp_comm_pkt &packet)
 }
 
 bool
-IncomingRequest::receivePeerListRequest (const sp_comm_pkt &packet)
+IncomingRequest::receivePeerListRequest (const sp_comm_pkt &packet) const
 {
   LogPrint (eLogDebug, "Packet: receivePeerListRequest");
   if (packet->ver == 4)
     {
-      m_owner.get_IO_service ().post (
+      post (m_owner.get_IO_service (), packet,
           std::bind (&pbote::relay::RelayWorker::peerListRequestV4,
                      &pbote::relay::relay_worker, packet));
       return true;
     }
   else if (packet->ver == 5)
     {
-      m_owner.get_IO_service ().post (
+      post (m_owner.get_IO_service (), packet,
           std::bind (&pbote::relay::RelayWorker::peerListRequestV5,
                      &pbote::relay::relay_worker, packet));
       return true;
@@ -193,12 +200,12 @@ IncomingRequest::receivePeerListRequest (const sp_comm_pkt &packet)
 ///////////////////////////////////////////////////////////////////////////////
 
 bool
-IncomingRequest::receiveRetrieveRequest (const sp_comm_pkt &packet)
+IncomingRequest::receiveRetrieveRequest (const sp_comm_pkt &packet) const
 {
   LogPrint (eLogDebug, "Packet: receiveRetrieveRequest");
   if (packet->ver >= 4 && packet->type == type::CommQ)
     {
-      m_owner.get_IO_service ().post (
+      post (m_owner.get_storage_strand (), packet,
           std::bind (&pbote::kademlia::DHTworker::receiveRetrieveRequest,
                      &pbote::kademlia::DHT_worker, packet));
       return true;
@@ -210,13 +217,13 @@ IncomingRequest::receiveRetrieveRequest (const sp_comm_pkt &packet)
 }
 
 bool
-IncomingRequest::receiveDeletionQueryRequest (const sp_comm_pkt &packet)
+IncomingRequest::receiveDeletionQueryRequest (const sp_comm_pkt &packet) const
 {
   LogPrint (eLogDebug, "Packet: receiveDeletionQueryRequest");
   /// Y for mhatta
   if (packet->ver >= 4 && packet->type == type::CommY)
     {
-      m_owner.get_IO_service ().post (
+      post (m_owner.get_storage_strand (), packet,
           std::bind (&pbote::kademlia::DHTworker::receiveDeletionQuery,
                      &pbote::kademlia::DHT_worker, packet));
       return true;
@@ -225,7 +232,7 @@ IncomingRequest::receiveDeletionQueryRequest (const sp_comm_pkt &packet)
   /// L for str4d
   if (packet->ver >= 4 && packet->type == (uint8_t)'L')
     {
-      m_owner.get_IO_service ().post (
+      post (m_owner.get_storage_strand (), packet,
           std::bind (&pbote::kademlia::DHTworker::receiveDeletionQuery,
                      &pbote::kademlia::DHT_worker, packet));
       return true;
@@ -237,12 +244,12 @@ IncomingRequest::receiveDeletionQueryRequest (const sp_comm_pkt &packet)
 }
 
 bool
-IncomingRequest::receiveStoreRequest (const sp_comm_pkt &packet)
+IncomingRequest::receiveStoreRequest (const sp_comm_pkt &packet) const
 {
   LogPrint (eLogDebug, "Packet: receiveStoreRequest");
   if (packet->ver >= 4 && packet->type == type::CommS)
     {
-      m_owner.get_IO_service ().post (
+      post (m_owner.get_storage_strand (), packet,
           std::bind (&pbote::kademlia::DHTworker::receiveStoreRequest,
                      &pbote::kademlia::DHT_worker, packet));
       return true;
@@ -254,12 +261,13 @@ IncomingRequest::receiveStoreRequest (const sp_comm_pkt &packet)
 }
 
 bool
-IncomingRequest::receiveEmailPacketDeleteRequest (const sp_comm_pkt &packet)
+IncomingRequest::receiveEmailPacketDeleteRequest (
+    const sp_comm_pkt &packet) const
 {
   LogPrint (eLogDebug, "Packet: receiveEmailPacketDeleteRequest");
   if (packet->ver >= 4 && packet->type == type::CommD)
     {
-      m_owner.get_IO_service ().post (std::bind (
+      post (m_owner.get_storage_strand (), packet, std::bind (
           &pbote::kademlia::DHTworker::receiveEmailPacketDeleteRequest,
           &pbote::kademlia::DHT_worker, packet));
       return true;
@@ -272,12 +280,13 @@ IncomingRequest::receiveEmailPacketDeleteRequest (const sp_comm_pkt &packet)
 }
 
 bool
-IncomingRequest::receiveIndexPacketDeleteRequest (const sp_comm_pkt &packet)
+IncomingRequest::receiveIndexPacketDeleteRequest (
+    const sp_comm_pkt &packet) const
 {
   LogPrint (eLogDebug, "Packet: receiveIndexPacketDeleteRequest");
   if (packet->ver >= 4 && packet->type == type::CommX)
     {
-      m_owner.get_IO_service ().post (std::bind (
+      post (m_owner.get_storage_strand (), packet, std::bind (
           &pbote::kademlia::DHTworker::receiveIndexPacketDeleteRequest,
           &pbote::kademlia::DHT_worker, packet));
       return true;
@@ -290,12 +299,12 @@ IncomingRequest::receiveIndexPacketDeleteRequest (const sp_comm_pkt &packet)
 }
 
 bool
-IncomingRequest::receiveFindClosePeersRequest (const sp_comm_pkt &packet)
+IncomingRequest::receiveFindClosePeersRequest (const sp_comm_pkt &packet) const
 {
   LogPrint (eLogDebug, "Packet: receiveFindClosePeersRequest");
   if (packet->ver >= 4 && packet->type == type::CommF)
     {
-      m_owner.get_IO_service ().post (
+      post (m_owner.get_IO_service (), packet,
           std::bind (&pbote::kademlia::DHTworker::receiveFindClosePeers,
                      &pbote::kademlia::DHT_worker, packet));
       return true;
@@ -308,9 +317,9 @@ IncomingRequest::receiveFindClosePeersRequest (const sp_comm_pkt &packet)
 }
 
 RequestHandler::RequestHandler ()
-    : running (false), m_PHandlerThread (nullptr),
-      m_IO_service_thread (nullptr), m_recvQueue (nullptr),
-      m_sendQueue (nullptr), m_IO_work (get_IO_service ())
+    : running (false), m_PHandlerThread (nullptr), m_recvQueue (nullptr),
+      m_sendQueue (nullptr), m_IO_work (get_IO_service ()),
+      m_storage_strand (get_IO_service ()), m_incoming (*this)
 {
 }
 
@@ -335,13 +344,23 @@ RequestHandler::start ()
   if (m_PHandlerThread)
     m_PHandlerThread = nullptr;
 
-  if (m_IO_service_thread)
-    m_IO_service_thread = nullptr;
+  m_IO_service_threads.clear ();
+
+  uint16_t threads = 0;
+  pbote::config::GetOption ("threads", threads);
+  if (threads == 0)
+    threads = std::max (1U, std::thread::hardware_concurrency ());
+  if (threads > PACKET_HANDLER_THREADS_MAX)
+    threads = PACKET_HANDLER_THREADS_MAX;
+
+  LogPrint (eLogInfo, "PacketHandler: IO service threads: ", threads);
 
   m_PHandlerThread.reset (
       new std::thread (std::bind (&RequestHandler::run, this)));
-  m_IO_service_thread.reset (
-      new std::thread (std::bind (&RequestHandler::run_IO_service, this)));
+
+  for (uint16_t i = 0; i < threads; i++)
+    m_IO_service_threads.emplace_back (
+        new std::thread (std::bind (&RequestHandler::run_IO_service, this)));
 }
 
 void
@@ -351,11 +370,10 @@ RequestHandler::stop ()
 
   m_IO_service.stop ();
 
-  if (m_IO_service_thread)
-    {
-      m_IO_service_thread->join ();
-      m_IO_service_thread = nullptr;
-    }
+  for (auto &thread : m_IO_service_threads)
+    thread->join ();
+
+  m_IO_service_threads.clear ();
 
   m_recvQueue = nullptr;
   m_sendQueue = nullptr;
@@ -368,29 +386,36 @@ RequestHandler::run ()
 {
   LogPrint (eLogInfo, "PacketHandler: Started");
 
+  std::vector<sp_queue_pkt> packets;
+  packets.reserve (PACKET_RECEIVE_BATCH);
+
   while (running)
     {
-      auto packet = m_recvQueue->GetNextWithTimeout (PACKET_RECEIVE_TIMEOUT);
+      packets.clear ();
+      m_recvQueue->GetBatch (packets, PACKET_RECEIVE_BATCH,
+                             PACKET_RECEIVE_TIMEOUT);
 
-      if (!packet)
-        continue;
+      for (const auto &packet : packets)
+        {
+          LogPrint (eLogDebug, "PacketHandler: Got new packet");
 
-      LogPrint (eLogDebug, "PacketHandler: Got new packet");
+          /// Parsed here to keep arrival order, handlers run on IO service
+          if (m_incoming.handleNewPacket (packet))
+            continue;
 
-      IncomingRequest handler (*this);
-      /// If successful, we move on to processing the next packet
-      if (handler.handleNewPacket (packet))
-        continue;
+          LogPrint (eLogWarning, "PacketHandler: Parsing failed, skipped");
 
-      LogPrint (eLogWarning, "PacketHandler: Parsing failed, skipped");
+          pbote::ResponsePacket response;
+          response.status = pbote::StatusCode::INVALID_PACKET;
+          response.length = 0;
 
-      pbote::ResponsePacket response;
-      response.status = pbote::StatusCode::INVALID_PACKET;
-      response.length = 0;
-      auto data = response.toByte ();
+          auto bytes = response.toByte ();
+          if (!bytes)
+            continue;
 
-      m_sendQueue->Put (std::make_shared<PacketForQueue> (
-          packet->destination, data.data (), data.size ()));
+          m_sendQueue->Put (util::make_pooled<PacketForQueue> (
+              packet->destination, std::move (*bytes)), eSendResponse);
+        }
     }
 }
 
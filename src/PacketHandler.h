@@ -10,6 +10,7 @@
 #define PACKET_HANDLER_H__
 
 #include <boost/asio.hpp>
+#include <chrono>
 #include <cstdint>
 #include <functional>
 #include <future>
@@ -19,9 +20,12 @@
 #include <string>
 #include <thread>
 #include <tuple>
+#include <vector>
 
+#include "BoteContext.h"
 #include "Logging.h"
 #include "Packet.h"
+#include "Trace.h"
 
 namespace pbote
 {
@@ -30,12 +34,18 @@ namespace packet
 
 /// Timeout in msec
 #define PACKET_RECEIVE_TIMEOUT 500
+/// Max packets taken from receive queue per wakeup
+#define PACKET_RECEIVE_BATCH 64
+/// Upper limit for configured IO service workers
+#define PACKET_HANDLER_THREADS_MAX 64
+/// Interval in msec to check for stop while waiting for storage strand
+#define STORAGE_WAIT_CHECK 100
 
 class IncomingRequest;
 class RequestHandler;
 
 typedef bool (IncomingRequest::*incomingPacketHandler) (
-    const sp_comm_pkt &packet);
+    const sp_comm_pkt &packet) const;
 // typedef bool (OutgoingRequest::*outgoingPacketHandler)(const sp_comm_pkt
 // &packet);
 
@@ -44,23 +54,47 @@ class IncomingRequest
 public:
   IncomingRequest (RequestHandler& owner);
 
-  bool handleNewPacket (const sp_queue_pkt &packet);
+  /// Thread safe, handlers table is filled once in constructor
+  bool handleNewPacket (const sp_queue_pkt &packet) const;
 
 private:
-  bool receiveRelayRequest (const sp_comm_pkt &packet);
-  bool receiveRelayReturnRequest (const sp_comm_pkt &packet);
-  bool receiveFetchRequest (const sp_comm_pkt &packet);
-  bool receiveResponsePkt (const sp_comm_pkt &packet);
-  bool receivePeerListRequest (const sp_comm_pkt &packet);
+  /**
+   * @brief Post handler of packet to executor
+   *
+   * End of handler of replayed packet is reported to trace replayer.
+   * Queue time is taken from packet, so handleNewPacket knows the
+   * packet is not finished yet.
+   */
+  template <typename Executor, typename Handler>
+  void
+  post (Executor &executor, const sp_comm_pkt &packet, Handler handler) const
+  {
+    auto queued_at = packet->queued_at;
+    packet->queued_at = std::chrono::steady_clock::time_point ();
+
+    executor.post ([handler, queued_at] ()
+      {
+        handler ();
+        network::trace_replayer.handled (queued_at);
+      });
+  }
+
+  bool receiveRelayRequest (const sp_comm_pkt &packet) const;
+  bool receiveRelayReturnRequest (const sp_comm_pkt &packet) const;
+  bool receiveFetchRequest (const sp_comm_pkt &packet) const;
+  bool receiveResponsePkt (const sp_comm_pkt &packet) const;
+  bool receivePeerListRequest (const sp_comm_pkt &packet) const;
   ///
-  bool receiveRetrieveRequest (const sp_comm_pkt &packet);
-  bool receiveDeletionQueryRequest (const sp_comm_pkt &packet);
-  bool receiveStoreRequest (const sp_comm_pkt &packet);
-  bool receiveEmailPacketDeleteRequest (const sp_comm_pkt &packet);
-  bool receiveIndexPacketDeleteRequest (const sp_comm_pkt &packet);
-  bool receiveFindClosePeersRequest (const sp_comm_pkt &packet);
-
-  incomingPacketHandler i_handlers_[256];
+  bool receiveRetrieveRequest (const sp_comm_pkt &packet) const;
+  bool receiveDeletionQueryRequest (const sp_comm_pkt &packet) const;
+  bool receiveStoreRequest (const sp_comm_pkt &packet) const;
+  bool receiveEmailPacketDeleteRequest (
+      const sp_comm_pkt &packet) const;
+  bool receiveIndexPacketDeleteRequest (
+      const sp_comm_pkt &packet) const;
+  bool receiveFindClosePeersRequest (const sp_comm_pkt &packet) const;
+
+  incomingPacketHandler i_handlers_[256] = {};
   RequestHandler& m_owner;
 };
 
@@ -79,6 +113,45 @@ public:
     return m_IO_service;
   }
 
+  /// Handlers which read or change DHT storage run one at a time
+  boost::asio::io_service::strand&
+  get_storage_strand ()
+  {
+    return m_storage_strand;
+  }
+
+  /**
+   * @brief Run storage access from outside of IO service and wait for it
+   *
+   * For email tasks and other own threads, which must not touch DHT
+   * storage beside strand. Runs in caller thread if it is already in
+   * strand or handler is not started. Gives default value if handler
+   * stops before task is done.
+   */
+  template <typename F>
+  typename std::result_of<F ()>::type
+  run_on_storage (F &&func)
+  {
+    using result_type = typename std::result_of<F ()>::type;
+
+    if (!running || m_storage_strand.running_in_this_thread ())
+      return func ();
+
+    auto task = std::make_shared<std::packaged_task<result_type ()> > (
+        std::forward<F> (func));
+    auto result = task->get_future ();
+    m_storage_strand.post ([task] { (*task) (); });
+
+    while (result.wait_for (std::chrono::milliseconds (STORAGE_WAIT_CHECK))
+           != std::future_status::ready)
+      {
+        if (!running)
+          return result_type ();
+      }
+
+    return result.get ();
+  }
+
   bool
   isRunning () const
   {
@@ -90,11 +163,16 @@ private:
   void run_IO_service ();
 
   bool running;
-  std::unique_ptr<std::thread> m_PHandlerThread, m_IO_service_thread;
-  queue_type m_recvQueue, m_sendQueue;
+  std::unique_ptr<std::thread> m_PHandlerThread;
+  std::vector<std::unique_ptr<std::thread> > m_IO_service_threads;
+  queue_type m_recvQueue;
+  send_queue_type m_sendQueue;
 
   boost::asio::io_service m_IO_service;
   boost::asio::io_service::work m_IO_work;
+  boost::asio::io_service::strand m_storage_strand;
+
+  IncomingRequest m_incoming;
 };
 
 extern RequestHandler packet_handler;
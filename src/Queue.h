@@ -10,11 +10,14 @@
 #ifndef PBOTED_SRC_QUEUE_H__
 #define PBOTED_SRC_QUEUE_H__
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <cstring>
 #include <functional>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
 #include <utility>
 #include <vector>
@@ -22,93 +25,458 @@
 namespace pbote {
 namespace util {
 
+/// Default capacity of queue, rounded up to power of two
+#define QUEUE_DEFAULT_CAPACITY 4096
+/// How long blocked producer waits for free cell (msec)
+#define QUEUE_BLOCK_TIMEOUT 1000
+
+/// What Put does if queue is full
+enum QueueOverflow {
+  eQueueDropNewest = 0,
+  eQueueDropOldest,
+  /// Wait for consumer up to QUEUE_BLOCK_TIMEOUT, then drop newest
+  eQueueBlock
+};
+
+/**
+ * @brief Bounded lock-free MPMC queue
+ *
+ * Ring buffer where every cell has sequence number telling producers and
+ * consumers whose turn it is (D. Vyukov's bounded MPMC queue), so Put and
+ * Get don't take locks. Mutex and condition variable are used only to
+ * park consumers which wait for new elements, and producers touch them
+ * only if somebody is waiting.
+ *
+ * Element must be default constructible and testable for emptiness,
+ * e.g. std::shared_ptr. Empty element is returned if there is nothing
+ * to get.
+ *
+ * Full queue is handled according to overflow policy. Dropped elements
+ * and highest seen depth are counted for monitoring.
+ */
 template<typename Element>
 class Queue {
  public:
-  void Put(Element e) {
-    std::unique_lock<std::mutex> l(m_QueueMutex);
-    m_Queue.push(std::move(e));
-    m_NonEmpty.notify_one();
+  explicit Queue(size_t capacity = QUEUE_DEFAULT_CAPACITY,
+                 QueueOverflow overflow = eQueueDropNewest)
+      : m_Capacity(RoundUp(capacity)),
+        m_Mask(m_Capacity - 1),
+        m_Overflow(overflow),
+        m_Cells(new Cell[m_Capacity]),
+        m_EnqueuePos(0),
+        m_DequeuePos(0),
+        m_Waiters(0),
+        m_WakeUps(0),
+        m_PutWaiters(0),
+        m_HighWater(0),
+        m_Dropped(0) {
+    for (size_t i = 0; i < m_Capacity; i++)
+      m_Cells[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  Queue(const Queue &) = delete;
+  Queue &operator=(const Queue &) = delete;
+
+  /// Returns false if element was dropped by overflow policy
+  bool Put(Element e) {
+    if (!PutOne(e))
+      return false;
+    Notify();
+    return true;
   }
 
+  /// Returns number of elements put, the rest were dropped
   template<template<typename, typename...> class Container, typename... R>
-  void Put(const Container<Element, R...> &vec) {
-    if (!vec.empty()) {
-      std::unique_lock<std::mutex> l(m_QueueMutex);
-      for (const auto &it : vec)
-        m_Queue.push(std::move(it));
-      m_NonEmpty.notify_one();
+  size_t PutBatch(const Container<Element, R...> &vec) {
+    size_t put = 0;
+    for (auto it : vec) {
+      if (PutOne(it))
+        put++;
     }
+    if (put > 0)
+      Notify();
+    return put;
+  }
+
+  template<template<typename, typename...> class Container, typename... R>
+  void Put(const Container<Element, R...> &vec) {
+    PutBatch(vec);
   }
 
   Element GetNext() {
-    std::unique_lock<std::mutex> l(m_QueueMutex);
-    auto el = GetNonThreadSafe();
-    if (!el) {
-      m_NonEmpty.wait(l);
-      el = GetNonThreadSafe();
-    }
+    Element el;
+    if (TryGet(el))
+      return el;
+
+    std::unique_lock<std::mutex> l(m_WaitMutex);
+    BeginWait();
+    m_NonEmpty.wait(l, [&] { return TryGet(el); });
+    m_Waiters--;
     return el;
   }
 
   Element GetNextWithTimeout(int usec) {
-    std::unique_lock<std::mutex> l(m_QueueMutex);
-    auto el = GetNonThreadSafe();
-    if (!el) {
-      m_NonEmpty.wait_for(l, std::chrono::milliseconds(usec));
-      el = GetNonThreadSafe();
-    }
+    Element el;
+    if (TryGet(el))
+      return el;
+
+    std::unique_lock<std::mutex> l(m_WaitMutex);
+    BeginWait();
+    m_NonEmpty.wait_for(l, std::chrono::milliseconds(usec),
+                        [&] { return TryGet(el); });
+    m_Waiters--;
     return el;
   }
 
+  /**
+   * @brief Take up to max elements, wait for the first one
+   *
+   * @param out Vector to append elements to
+   * @param max Maximum number of elements to take
+   * @param usec Timeout in msec for the first element
+   * @return size_t Number of elements taken
+   */
+  size_t GetBatch(std::vector<Element> &out, size_t max, int usec) {
+    if (max == 0)
+      return 0;
+
+    auto el = GetNextWithTimeout(usec);
+    if (!el)
+      return 0;
+
+    out.push_back(std::move(el));
+    size_t taken = 1;
+    while (taken < max && TryGet(el)) {
+      out.push_back(std::move(el));
+      taken++;
+    }
+    return taken;
+  }
+
+  /// Wait for new element or WakeUp
   void Wait() {
-    std::unique_lock<std::mutex> l(m_QueueMutex);
-    m_NonEmpty.wait(l);
+    uint64_t wakeups = m_WakeUps.load();
+    std::unique_lock<std::mutex> l(m_WaitMutex);
+    BeginWait();
+    m_NonEmpty.wait(l, [&] {
+      return !IsEmpty() || m_WakeUps.load() != wakeups;
+    });
+    m_Waiters--;
   }
 
   bool Wait(int sec, int usec) {
-    std::unique_lock<std::mutex> l(m_QueueMutex);
-    return m_NonEmpty.wait_for(l, std::chrono::seconds(sec) +
-        std::chrono::milliseconds(usec)) !=
-        std::cv_status::timeout;
+    uint64_t wakeups = m_WakeUps.load();
+    std::unique_lock<std::mutex> l(m_WaitMutex);
+    BeginWait();
+    bool woken = m_NonEmpty.wait_for(
+        l, std::chrono::seconds(sec) + std::chrono::milliseconds(usec),
+        [&] { return !IsEmpty() || m_WakeUps.load() != wakeups; });
+    m_Waiters--;
+    return woken;
   }
 
   bool IsEmpty() {
-    std::unique_lock<std::mutex> l(m_QueueMutex);
-    return m_Queue.empty();
+    return GetSize() == 0;
   }
 
+  /// Approximate while producers or consumers are active
   int GetSize() {
-    std::unique_lock<std::mutex> l(m_QueueMutex);
-    return m_Queue.size();
+    size_t tail = m_EnqueuePos.load(std::memory_order_acquire);
+    size_t head = m_DequeuePos.load(std::memory_order_acquire);
+    return tail > head ? tail - head : 0;
   }
 
-  void WakeUp() { m_NonEmpty.notify_all(); };
+  size_t GetCapacity() const { return m_Capacity; }
+  QueueOverflow GetOverflow() const { return m_Overflow; }
+  /// Highest depth seen since start
+  size_t GetHighWater() const { return m_HighWater.load(); }
+  /// Elements dropped because queue was full
+  uint64_t GetDropped() const { return m_Dropped.load(); }
+
+  void WakeUp() {
+    m_WakeUps++;
+    std::unique_lock<std::mutex> l(m_WaitMutex);
+    m_NonEmpty.notify_all();
+  };
 
   Element Get() {
-    std::unique_lock<std::mutex> l(m_QueueMutex);
-    return GetNonThreadSafe();
+    Element el;
+    TryGet(el);
+    return el;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    Element data;
+  };
+
+  static size_t RoundUp(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+    return size;
+  }
+
+  bool PutOne(Element &e) {
+    if (TryPut(e))
+      return true;
+
+    switch (m_Overflow) {
+      case eQueueDropOldest: {
+        Element old;
+        while (!TryPut(e)) {
+          if (TryGet(old)) {
+            old = Element();
+            m_Dropped++;
+          }
+        }
+        return true;
+      }
+      case eQueueBlock:
+        if (WaitNotFull(e))
+          return true;
+        break;
+      default:
+        break;
+    }
+
+    m_Dropped++;
+    return false;
+  }
+
+  bool WaitNotFull(Element &e) {
+    std::unique_lock<std::mutex> l(m_FullMutex);
+    m_PutWaiters++;
+    /// Pairs with fence in NotifyNotFull, as for consumers
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool put = m_NotFull.wait_for(
+        l, std::chrono::milliseconds(QUEUE_BLOCK_TIMEOUT),
+        [&] { return TryPut(e); });
+    m_PutWaiters--;
+    return put;
+  }
+
+  void NotifyNotFull() {
+    if (m_Overflow != eQueueBlock)
+      return;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_PutWaiters.load() == 0)
+      return;
+    std::unique_lock<std::mutex> l(m_FullMutex);
+    m_NotFull.notify_all();
+  }
+
+  void UpdateHighWater(size_t tail) {
+    size_t head = m_DequeuePos.load(std::memory_order_relaxed);
+    size_t depth = tail > head ? tail - head : 0;
+    size_t high = m_HighWater.load(std::memory_order_relaxed);
+    while (depth > high &&
+           !m_HighWater.compare_exchange_weak(high, depth,
+                                              std::memory_order_relaxed)) {
+    }
+  }
+
+  bool TryPut(Element &e) {
+    Cell *cell;
+    size_t pos = m_EnqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &m_Cells[pos & m_Mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+      if (dif == 0) {
+        if (m_EnqueuePos.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+          break;
+      } else if (dif < 0) {
+        /// Cell is not consumed yet, queue is full
+        return false;
+      } else {
+        pos = m_EnqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = std::move(e);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    UpdateHighWater(pos + 1);
+    return true;
   }
 
-  Element Peek() {
-    std::unique_lock<std::mutex> l(m_QueueMutex);
-    return GetNonThreadSafe(true);
+  bool TryGet(Element &e) {
+    Cell *cell;
+    size_t pos = m_DequeuePos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &m_Cells[pos & m_Mask];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (dif == 0) {
+        if (m_DequeuePos.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+          break;
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = m_DequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+    e = std::move(cell->data);
+    /// Don't hold reference in free cell
+    cell->data = Element();
+    cell->seq.store(pos + m_Mask + 1, std::memory_order_release);
+    NotifyNotFull();
+    return true;
+  }
+
+  void BeginWait() {
+    m_Waiters++;
+    /// Producer which missed us in waiters must see our next check
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  void Notify() {
+    /// Pairs with increment of waiters before consumer checks queue
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_Waiters.load() == 0)
+      return;
+    std::unique_lock<std::mutex> l(m_WaitMutex);
+    m_NonEmpty.notify_all();
   }
 
  private:
-  Element GetNonThreadSafe(bool peek = false) {
-    if (!m_Queue.empty()) {
-      auto el = m_Queue.front();
-      if (!peek)
-        m_Queue.pop();
-      return el;
+  const size_t m_Capacity, m_Mask;
+  const QueueOverflow m_Overflow;
+  std::unique_ptr<Cell[]> m_Cells;
+
+  alignas(64) std::atomic<size_t> m_EnqueuePos;
+  alignas(64) std::atomic<size_t> m_DequeuePos;
+
+  alignas(64) std::atomic<size_t> m_Waiters;
+  std::atomic<uint64_t> m_WakeUps;
+  std::mutex m_WaitMutex;
+  std::condition_variable m_NonEmpty;
+
+  std::atomic<size_t> m_PutWaiters;
+  std::mutex m_FullMutex;
+  std::condition_variable m_NotFull;
+
+  alignas(64) std::atomic<size_t> m_HighWater;
+  std::atomic<uint64_t> m_Dropped;
+};
+
+/**
+ * @brief Set of bounded queues, one per class, served by weighted round robin
+ *
+ * Element is put to queue of its class. Consumer takes up to weight
+ * elements of every class in turn, starting from class 0, so class with
+ * bigger weight gets bigger share of every batch, but none is starved.
+ */
+template<typename Element>
+class PriorityQueue {
+ public:
+  PriorityQueue(const std::vector<size_t> &weights,
+                size_t capacity = QUEUE_DEFAULT_CAPACITY,
+                QueueOverflow overflow = eQueueDropNewest)
+      : m_Weights(weights),
+        m_Waiters(0),
+        m_WakeUps(0) {
+    for (size_t i = 0; i < m_Weights.size(); i++) {
+      m_Queues.emplace_back(new Queue<Element>(capacity, overflow));
+      if (m_Weights[i] == 0)
+        m_Weights[i] = 1;
     }
-    return nullptr;
+  }
+
+  PriorityQueue(const PriorityQueue &) = delete;
+  PriorityQueue &operator=(const PriorityQueue &) = delete;
+
+  /// Returns false if element was dropped or class is unknown
+  bool Put(Element e, size_t cls) {
+    if (cls >= m_Queues.size() || !m_Queues[cls]->Put(std::move(e)))
+      return false;
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_Waiters.load() == 0)
+      return true;
+    std::unique_lock<std::mutex> l(m_WaitMutex);
+    m_NonEmpty.notify_all();
+    return true;
+  }
+
+  /**
+   * @brief Take up to max elements by weighted rounds, wait for the first
+   *
+   * @param out Vector to append elements to
+   * @param max Maximum number of elements to take
+   * @param usec Timeout in msec for the first element
+   * @return size_t Number of elements taken
+   */
+  size_t GetBatch(std::vector<Element> &out, size_t max, int usec) {
+    size_t taken = TakeRounds(out, max);
+    if (taken > 0 || max == 0)
+      return taken;
+
+    uint64_t wakeups = m_WakeUps.load();
+    {
+      std::unique_lock<std::mutex> l(m_WaitMutex);
+      m_Waiters++;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      m_NonEmpty.wait_for(l, std::chrono::milliseconds(usec), [&] {
+        return !IsEmpty() || m_WakeUps.load() != wakeups;
+      });
+      m_Waiters--;
+    }
+
+    return TakeRounds(out, max);
+  }
+
+  bool IsEmpty() {
+    for (auto &queue : m_Queues)
+      if (!queue->IsEmpty())
+        return false;
+    return true;
+  }
+
+  int GetSize() {
+    int size = 0;
+    for (auto &queue : m_Queues)
+      size += queue->GetSize();
+    return size;
+  }
+
+  size_t GetClasses() const { return m_Queues.size(); }
+  Queue<Element> &GetQueue(size_t cls) { return *m_Queues[cls]; }
+
+  void WakeUp() {
+    m_WakeUps++;
+    std::unique_lock<std::mutex> l(m_WaitMutex);
+    m_NonEmpty.notify_all();
   }
 
  private:
-  std::queue<Element> m_Queue;
-  std::mutex m_QueueMutex;
+  size_t TakeRounds(std::vector<Element> &out, size_t max) {
+    size_t taken = 0;
+    bool got = true;
+    while (got && taken < max) {
+      got = false;
+      for (size_t cls = 0; cls < m_Queues.size() && taken < max; cls++) {
+        for (size_t i = 0; i < m_Weights[cls] && taken < max; i++) {
+          auto el = m_Queues[cls]->Get();
+          if (!el)
+            break;
+          out.push_back(std::move(el));
+          taken++;
+          got = true;
+        }
+      }
+    }
+    return taken;
+  }
+
+  std::vector<size_t> m_Weights;
+  std::vector<std::unique_ptr<Queue<Element>>> m_Queues;
+
+  std::atomic<size_t> m_Waiters;
+  std::atomic<uint64_t> m_WakeUps;
+  std::mutex m_WaitMutex;
   std::condition_variable m_NonEmpty;
 };
 
@@ -0,0 +1,188 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "Logging.h"
+#include "RandomPool.h"
+
+namespace pbote
+{
+namespace util
+{
+
+namespace
+{
+
+/// Incremented in child after fork, pools with older value are reseeded
+std::atomic<unsigned> fork_generation (0);
+std::once_flag atfork_flag;
+
+void
+on_fork_child ()
+{
+  fork_generation++;
+}
+
+bool
+os_random (uint8_t *buf, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t got = getrandom (buf, len, 0);
+      if (got < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          LogPrint (eLogError, "Random: getrandom failed: ", strerror (errno));
+          return false;
+        }
+
+      buf += got;
+      len -= got;
+    }
+
+  return true;
+}
+
+/**
+ * @brief Fallback to OpenSSL RAND, abort if it fails too
+ *
+ * Predictable CIDs and IVs are worse than stopped daemon, so there is no
+ * way to continue without random bytes.
+ */
+void
+fallback_random (uint8_t *buf, size_t len)
+{
+  for (int attempt = 0; attempt < RANDOM_POOL_FALLBACK_ATTEMPTS; attempt++)
+    {
+      if (RAND_bytes (buf, (int)len) == 1)
+        return;
+    }
+
+  OPENSSL_cleanse (buf, len);
+  LogPrint (eLogError, "Random: OpenSSL RAND failed, abort");
+  fprintf (stderr, "pboted: no source of random bytes, abort\n");
+  std::abort ();
+}
+
+class RandomPool
+{
+public:
+  RandomPool ()
+      : m_ctx (EVP_CIPHER_CTX_new ()),
+        m_pos (RANDOM_POOL_BLOCK_SIZE),
+        m_generation (0),
+        m_seeded (false)
+  {
+    std::call_once (atfork_flag,
+                    [] () { pthread_atfork (nullptr, nullptr, on_fork_child); });
+  }
+
+  ~RandomPool ()
+  {
+    OPENSSL_cleanse (m_key, sizeof (m_key));
+    OPENSSL_cleanse (m_block, sizeof (m_block));
+    EVP_CIPHER_CTX_free (m_ctx);
+  }
+
+  void
+  get (uint8_t *buf, size_t len)
+  {
+    unsigned generation = fork_generation.load (std::memory_order_relaxed);
+    if (!m_seeded || generation != m_generation)
+      {
+        seed ();
+        m_generation = generation;
+      }
+
+    while (len > 0)
+      {
+        if (m_pos == RANDOM_POOL_BLOCK_SIZE)
+          refill ();
+
+        size_t chunk = std::min (len, (size_t)RANDOM_POOL_BLOCK_SIZE - m_pos);
+        memcpy (buf, m_block + m_pos, chunk);
+        /// Don't keep bytes which were given out
+        OPENSSL_cleanse (m_block + m_pos, chunk);
+
+        m_pos += chunk;
+        buf += chunk;
+        len -= chunk;
+      }
+  }
+
+private:
+  void
+  seed ()
+  {
+    if (!os_random (m_key, sizeof (m_key)))
+      fallback_random (m_key, sizeof (m_key));
+
+    m_pos = RANDOM_POOL_BLOCK_SIZE;
+    m_seeded = true;
+  }
+
+  void
+  refill ()
+  {
+    /// Key is used once, so zero nonce is fine
+    static const uint8_t iv[16] = {};
+    static const uint8_t zeros[RANDOM_POOL_KEY_SIZE + RANDOM_POOL_BLOCK_SIZE] = {};
+    uint8_t stream[RANDOM_POOL_KEY_SIZE + RANDOM_POOL_BLOCK_SIZE];
+    int out_len = 0;
+
+    if (!m_ctx
+        || EVP_EncryptInit_ex (m_ctx, EVP_chacha20 (), nullptr, m_key, iv) != 1
+        || EVP_EncryptUpdate (m_ctx, stream, &out_len, zeros,
+                              sizeof (zeros)) != 1
+        || out_len != (int)sizeof (stream))
+      {
+        LogPrint (eLogError, "Random: ChaCha20 failed, use OpenSSL RAND");
+        fallback_random (stream, sizeof (stream));
+      }
+
+    /// First bytes of keystream become next key
+    memcpy (m_key, stream, RANDOM_POOL_KEY_SIZE);
+    memcpy (m_block, stream + RANDOM_POOL_KEY_SIZE, RANDOM_POOL_BLOCK_SIZE);
+    OPENSSL_cleanse (stream, sizeof (stream));
+
+    m_pos = 0;
+  }
+
+  EVP_CIPHER_CTX *m_ctx;
+  uint8_t m_key[RANDOM_POOL_KEY_SIZE];
+  uint8_t m_block[RANDOM_POOL_BLOCK_SIZE];
+  size_t m_pos;
+  unsigned m_generation;
+  bool m_seeded;
+};
+
+} // namespace
+
+void
+random_bytes (uint8_t *buf, size_t len)
+{
+  static thread_local RandomPool pool;
+  pool.get (buf, len);
+}
+
+} // namespace util
+} // namespace pbote
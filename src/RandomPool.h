@@ -0,0 +1,41 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_RANDOM_POOL_H_
+#define PBOTED_SRC_RANDOM_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace pbote
+{
+namespace util
+{
+
+/// Bytes of ChaCha20 keystream generated per refill
+#define RANDOM_POOL_BLOCK_SIZE 4096
+#define RANDOM_POOL_KEY_SIZE 32
+/// RAND_bytes calls before abort if getrandom or ChaCha20 fails
+#define RANDOM_POOL_FALLBACK_ATTEMPTS 3
+
+/**
+ * @brief Fill buffer with cryptographically secure random bytes
+ *
+ * Every thread has own pool with ChaCha20 keystream seeded from
+ * getrandom. Key is replaced from keystream on every refill and given
+ * bytes are wiped from pool, so state leak does not reveal past output.
+ * Pools are reseeded in child process after fork.
+ *
+ * Used for CIDs and encryption IVs.
+ */
+void random_bytes (uint8_t *buf, size_t len);
+
+} // namespace util
+} // namespace pbote
+
+#endif // PBOTED_SRC_RANDOM_POOL_H_
@@ -0,0 +1,252 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "Logging.h"
+#include "Reactor.h"
+
+namespace pbote
+{
+namespace network
+{
+
+Reactor reactor;
+
+Reactor::Reactor ()
+  : m_epoll_fd (epoll_create1 (EPOLL_CLOEXEC)),
+    m_wake_fd (eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)),
+    m_running (false),
+    m_thread (nullptr)
+{
+  if (m_epoll_fd == -1 || m_wake_fd == -1)
+    {
+      LogPrint (eLogError, "Reactor: Can't create descriptors: ",
+                strerror (errno));
+      return;
+    }
+
+  struct epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.fd = m_wake_fd;
+  epoll_ctl (m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &ev);
+}
+
+Reactor::~Reactor ()
+{
+  stop ();
+
+  if (m_wake_fd != -1)
+    close (m_wake_fd);
+
+  if (m_epoll_fd != -1)
+    close (m_epoll_fd);
+}
+
+void
+Reactor::start ()
+{
+  if (m_running)
+    return;
+
+  m_running = true;
+  m_thread = new std::thread ([this] { run (); });
+}
+
+void
+Reactor::stop ()
+{
+  if (!m_running)
+    return;
+
+  m_running = false;
+  wake ();
+
+  if (m_thread)
+    {
+      m_thread->join ();
+
+      delete m_thread;
+      m_thread = nullptr;
+    }
+
+  LogPrint (eLogInfo, "Reactor: Stopped");
+}
+
+bool
+Reactor::add (int fd, uint32_t events, fd_handler handler)
+{
+  {
+    std::unique_lock<std::mutex> l (m_handlers_mutex);
+    m_handlers[fd] = std::make_shared<fd_handler> (std::move (handler));
+  }
+
+  struct epoll_event ev{};
+  ev.events = events;
+  ev.data.fd = fd;
+
+  if (epoll_ctl (m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+      LogPrint (eLogError, "Reactor: Can't add descriptor ", fd, ": ",
+                strerror (errno));
+      std::unique_lock<std::mutex> l (m_handlers_mutex);
+      m_handlers.erase (fd);
+      return false;
+    }
+
+  return true;
+}
+
+bool
+Reactor::modify (int fd, uint32_t events)
+{
+  struct epoll_event ev{};
+  ev.events = events;
+  ev.data.fd = fd;
+
+  if (epoll_ctl (m_epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1)
+    {
+      LogPrint (eLogError, "Reactor: Can't modify descriptor ", fd, ": ",
+                strerror (errno));
+      return false;
+    }
+
+  return true;
+}
+
+void
+Reactor::remove (int fd)
+{
+  epoll_ctl (m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+
+  std::unique_lock<std::mutex> l (m_handlers_mutex);
+  m_handlers.erase (fd);
+}
+
+int
+Reactor::add_timer (long timeout_ms, timer_handler handler)
+{
+  int timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd == -1)
+    {
+      LogPrint (eLogError, "Reactor: Can't create timer: ", strerror (errno));
+      return -1;
+    }
+
+  bool added = add (timer_fd, EPOLLIN, [timer_fd, handler] (uint32_t)
+    {
+      uint64_t expirations = 0;
+      if (read (timer_fd, &expirations, sizeof (expirations)) > 0)
+        handler ();
+    });
+
+  if (!added || !rearm_timer (timer_fd, timeout_ms))
+    {
+      remove (timer_fd);
+      close (timer_fd);
+      return -1;
+    }
+
+  return timer_fd;
+}
+
+bool
+Reactor::rearm_timer (int timer_id, long timeout_ms)
+{
+  struct itimerspec spec{};
+  spec.it_value.tv_sec = timeout_ms / 1000;
+  spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+  /// Zero value would disarm timer
+  if (timeout_ms <= 0)
+    spec.it_value.tv_nsec = 1;
+
+  if (timerfd_settime (timer_id, 0, &spec, nullptr) == -1)
+    {
+      LogPrint (eLogError, "Reactor: Can't arm timer: ", strerror (errno));
+      return false;
+    }
+
+  return true;
+}
+
+void
+Reactor::remove_timer (int timer_id)
+{
+  if (timer_id == -1)
+    return;
+
+  remove (timer_id);
+  close (timer_id);
+}
+
+void
+Reactor::run ()
+{
+  LogPrint (eLogInfo, "Reactor: Started");
+
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+
+  while (m_running)
+    {
+      int count = epoll_wait (m_epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+      if (count == -1)
+        {
+          if (errno == EINTR)
+            continue;
+
+          LogPrint (eLogError, "Reactor: Wait error: ", strerror (errno));
+          break;
+        }
+
+      for (int i = 0; i < count && m_running; i++)
+        {
+          int fd = events[i].data.fd;
+          if (fd == m_wake_fd)
+            {
+              uint64_t value = 0;
+              if (read (m_wake_fd, &value, sizeof (value)) < 0)
+                LogPrint (eLogDebug, "Reactor: Wake read: ", strerror (errno));
+              continue;
+            }
+
+          std::shared_ptr<fd_handler> handler;
+          {
+            std::unique_lock<std::mutex> l (m_handlers_mutex);
+            auto it = m_handlers.find (fd);
+            /// Could be removed by previous handler in this round
+            if (it == m_handlers.end ())
+              continue;
+            handler = it->second;
+          }
+
+          try
+            {
+              (*handler) (events[i].events);
+            }
+          catch (std::exception &ex)
+            {
+              LogPrint (eLogError, "Reactor: Handler exception: ", ex.what ());
+            }
+        }
+    }
+}
+
+void
+Reactor::wake ()
+{
+  uint64_t value = 1;
+  if (write (m_wake_fd, &value, sizeof (value)) < 0)
+    LogPrint (eLogError, "Reactor: Wake write: ", strerror (errno));
+}
+
+} // namespace network
+} // namespace pbote
@@ -0,0 +1,88 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_REACTOR_H_
+#define PBOTED_SRC_REACTOR_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sys/epoll.h>
+#include <thread>
+#include <unordered_map>
+
+namespace pbote
+{
+namespace network
+{
+
+/// Max events taken from epoll per wakeup
+#define REACTOR_MAX_EVENTS 64
+
+/**
+ * @brief Single epoll event loop for sockets owned by daemon
+ *
+ * Handlers are called on reactor thread when descriptor is ready, so
+ * they should not block for long. Timers are timerfd descriptors in the
+ * same epoll set. Descriptors are level-triggered, handler can take part
+ * of available data and will be called again.
+ */
+class Reactor
+{
+public:
+  /// Gets epoll events of descriptor
+  using fd_handler = std::function<void (uint32_t events)>;
+  using timer_handler = std::function<void ()>;
+
+  Reactor ();
+  ~Reactor ();
+
+  void start ();
+  void stop ();
+
+  bool add (int fd, uint32_t events, fd_handler handler);
+  /// Set events to 0 to pause descriptor without removing handler
+  bool modify (int fd, uint32_t events);
+  /// Handler is not called after return, unless it is running right now
+  void remove (int fd);
+
+  /**
+   * @brief Call handler once after timeout
+   *
+   * @return int Timer ID for rearm_timer and remove_timer, -1 on error
+   */
+  int add_timer (long timeout_ms, timer_handler handler);
+  bool rearm_timer (int timer_id, long timeout_ms);
+  void remove_timer (int timer_id);
+
+  bool
+  running () const
+  {
+    return m_running;
+  }
+
+private:
+  void run ();
+  void wake ();
+
+  int m_epoll_fd, m_wake_fd;
+  std::atomic<bool> m_running;
+  std::thread *m_thread;
+
+  std::mutex m_handlers_mutex;
+  std::unordered_map<int, std::shared_ptr<fd_handler> > m_handlers;
+};
+
+extern Reactor reactor;
+
+} // namespace network
+} // namespace pbote
+
+#endif // PBOTED_SRC_REACTOR_H_
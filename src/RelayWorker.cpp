@@ -9,6 +9,7 @@
 #include <netinet/in.h>
 #include <utility>
 
+#include "AsyncBatch.h"
 #include "Packet.h"
 #include "RelayWorker.h"
 
@@ -21,7 +22,6 @@ RelayWorker relay_worker;
 
 RelayWorker::RelayWorker ()
     : started_ (false),
-      m_worker_thread_ (nullptr),
       exec_start_t (0),
       exec_finish_t ()
 {
@@ -33,28 +33,36 @@ RelayWorker::~RelayWorker ()
 }
 
 void
-RelayWorker::start ()
+RelayWorker::init ()
 {
-  started_ = true;
   if (!loadPeers ())
     LogPrint (eLogError, "Relay: No peers for start");
+}
 
-  m_worker_thread_ = new std::thread (std::bind (&RelayWorker::run, this));
+void
+RelayWorker::start ()
+{
+  started_ = true;
+  init ();
+
+  /// Rounds run on packet handler IO service, no own thread needed
+  /// Delay to prevent too quick start
+  packet::async_sleep (RELAY_START_DELAY, [this] () { run_round (); });
 }
 
 void
 RelayWorker::stop ()
 {
+  /// Not started (e.g. trace replay), peers must not be overwritten
+  if (!started_.exchange (false))
+    return;
+
   LogPrint (eLogDebug, "Relay: Stopping");
-  started_ = false;
-  m_check_round.notify_one ();
+  /// Round in progress is dropped together with IO service
+
+  if (getPeersCount () > 0)
+    writePeers ();
 
-  if (m_worker_thread_)
-    {
-      m_worker_thread_->join ();
-      delete m_worker_thread_;
-      m_worker_thread_ = nullptr;
-    }
   LogPrint (eLogDebug, "Relay: Stopped");
 }
 
@@ -80,6 +88,17 @@ RelayWorker::addPeer (const std::string &peer)
   return false;
 }
 
+bool
+RelayWorker::addPeer (dest_handle peer)
+{
+  auto identity = dest_table.identity (peer);
+  if (!identity)
+    return false;
+
+  return addPeer (std::make_shared<i2p::data::IdentityEx> (*identity),
+                  PEER_MIN_REACHABILITY);
+}
+
 bool
 RelayWorker::addPeer (const sp_i2p_ident &identity, int samples)
 {
@@ -93,7 +112,7 @@ RelayWorker::addPeer (const sp_i2p_ident &identity, int samples)
       return false;
     }
 
-  sp_peer peer = std::make_shared<RelayPeer> (identity->ToBase64 (), samples);
+  sp_peer peer = std::make_shared<RelayPeer> (*identity, samples);
 
   std::unique_lock<std::mutex> l (m_peers_mutex_);
   return m_peers_
@@ -105,7 +124,15 @@ void
 RelayWorker::addPeers (const std::vector<sp_peer> &peers)
 {
   for (const auto &peer : peers)
-    addPeer (peer, peer->samples ());
+    {
+      if (!addPeer (peer, peer->samples ()))
+        continue;
+
+      /// Keep stats restored from database
+      auto added = findPeer (peer->GetIdentHash ());
+      if (added && peer->last_seen () > 0)
+        added->last_seen (peer->last_seen ());
+    }
 }
 
 void
@@ -114,7 +141,8 @@ RelayWorker::addPeers (const PeerListPacketV4 &peer_list)
   size_t added = 0, dupl = 0;
 
   for (const auto &peer : peer_list.data)
-    if (addPeer (peer.ToBase64 ()))
+    if (addPeer (std::make_shared<i2p::data::IdentityEx> (peer),
+                 PEER_MIN_REACHABILITY))
       added++;
     else
       dupl++;
@@ -129,7 +157,8 @@ RelayWorker::addPeers (const PeerListPacketV5 &peer_list)
   size_t added = 0, dupl = 0;
 
   for (const auto &peer : peer_list.data)
-    if (addPeer (peer.ToBase64 ()))
+    if (addPeer (std::make_shared<i2p::data::IdentityEx> (peer),
+                 PEER_MIN_REACHABILITY))
       added++;
     else
       dupl++;
@@ -182,7 +211,22 @@ RelayWorker::loadPeers ()
   LogPrint (eLogInfo, "Relay: Load peers from FS");
   std::string value_delimiter = " ";
   std::vector<sp_peer> peers;
-  std::vector<std::string> peers_list = readPeers ();
+
+  std::string db_path = pbote::fs::DataDirPath (PEER_DB_FILE_NAME);
+  bool db_loaded = m_peer_db_.load (db_path,
+    [&peers] (const hash_key &, const uint8_t *buf, size_t len)
+    {
+      auto peer = std::make_shared<RelayPeer> ();
+      if (peer->from_record (buf, len))
+        peers.push_back (peer);
+      else
+        LogPrint (eLogWarning, "Relay: Skip broken peer record");
+    });
+
+  /// Migrate from text list, it will be saved to database on next write
+  std::vector<std::string> peers_list;
+  if (!db_loaded)
+    peers_list = readPeers ();
 
   // std::unique_lock<std::mutex> l(m_peers_mutex_);
   if (!peers_list.empty ())
@@ -224,7 +268,7 @@ RelayWorker::loadPeers ()
   std::vector<std::string> bootstrap_addresses;
   pbote::config::GetOption ("bootstrap.address", bootstrap_addresses);
 
-  if (!bootstrap_addresses.empty () && m_peers_.empty ())
+  if (!bootstrap_addresses.empty () && getPeersCount () == 0)
     {
       size_t peers_added = 0;
       for (const auto &bootstrap_address : bootstrap_addresses)
@@ -250,35 +294,22 @@ void
 RelayWorker::writePeers ()
 {
   LogPrint (eLogInfo, "Relay: Save peers to FS");
-  std::string peer_file_path = pbote::fs::DataDirPath (PEER_FILE_NAME);
-  std::ofstream peer_file (peer_file_path);
 
-  if (!peer_file.is_open ())
-    {
-      LogPrint (eLogError, "Relay: Can't open file ", peer_file_path);
-      return;
-    }
-  std::unique_lock<std::mutex> l (m_peers_mutex_);
+  {
+    std::unique_lock<std::mutex> l (m_peers_mutex_);
+    for (const auto &peer : m_peers_)
+      m_peer_db_.put (peer.first, peer.second->to_record ());
+  }
 
-  peer_file << "# Each line is in the format: <dest> <samp>\n";
-  peer_file << "#   dest = the I2P destination\n";
-  peer_file << "#   samp = samples from 0 to 24, depending on whether the "
-               "peer responded\n";
-  peer_file << "# The fields are separated by a space character.\n";
-  peer_file << "# Lines starting with a # are ignored.\n";
-  peer_file << "# Do not edit this file while pbote is running as it will be "
-               "overwritten.\n\n";
-
-  size_t saved = 0;
-  for (const auto &peer : m_peers_)
+  size_t changed = m_peer_db_.dirty ();
+  if (!m_peer_db_.flush ())
     {
-      peer_file << peer.second->str ();
-      peer_file << "\n";
-      saved++;
+      LogPrint (eLogError, "Relay: Can't save peers");
+      return;
     }
 
-  peer_file.close ();
-  LogPrint (eLogDebug, "Relay: ", saved, " peer(s) saved to FS");
+  LogPrint (eLogDebug, "Relay: ", changed, " of ", m_peer_db_.size (),
+            " peer(s) saved to FS");
 }
 
 void
@@ -292,6 +323,7 @@ RelayWorker::getGoodPeers ()
 {
   std::vector<sp_peer> result;
 
+  std::unique_lock<std::mutex> l (m_peers_mutex_);
   for (const auto &m_peer : m_peers_)
     {
       if (m_peer.second->reachable ())
@@ -317,6 +349,8 @@ RelayWorker::getAllPeers ()
 {
   std::vector<sp_peer> result;
 
+  std::unique_lock<std::mutex> l (m_peers_mutex_);
+  result.reserve (m_peers_.size ());
   for (const auto &m_peer : m_peers_)
     result.push_back (m_peer.second);
 
@@ -326,6 +360,7 @@ RelayWorker::getAllPeers ()
 size_t
 RelayWorker::getPeersCount ()
 {
+  std::unique_lock<std::mutex> l (m_peers_mutex_);
   return m_peers_.size ();
 }
 
@@ -339,7 +374,7 @@ void
 RelayWorker::peerListRequestV4 (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "Relay: peerListRequestV4: request from: ",
-            packet->from.substr (0, 15), "...");
+            dest_table.short_name (packet->from));
   if (addPeer (packet->from))
     {
       LogPrint (eLogDebug,
@@ -351,20 +386,19 @@ RelayWorker::peerListRequestV4 (const sp_comm_pkt &packet)
   peer_list.count = good_peers.size ();
 
   for (const auto &peer : good_peers)
-    {
-      i2p::data::IdentityEx identity;
-      identity.FromBase64 (peer->ToBase64 ());
-      peer_list.data.push_back (identity);
-    }
+    peer_list.data.push_back (*peer);
 
   ResponsePacket response;
   memcpy (response.cid, packet->cid, 32);
   response.status = StatusCode::OK;
-  response.data = peer_list.toByte ();
+  auto list_bytes = peer_list.toByte ();
+  if (!list_bytes)
+    return;
+
+  response.data = std::move (*list_bytes);
   response.length = response.data.size ();
-  auto data = response.toByte ();
 
-  context.send (PacketForQueue (packet->from, data.data (), data.size ()));
+  context.send (packet->from, response.toByte (), eSendResponse);
   LogPrint (eLogInfo, "Relay: peerListRequestV4: Send response with ",
             peer_list.count, " peer(s)");
 }
@@ -373,7 +407,7 @@ void
 RelayWorker::peerListRequestV5 (const sp_comm_pkt &packet)
 {
   LogPrint (eLogDebug, "Relay: peerListRequestV5: Request from: ",
-            packet->from.substr (0, 15), "...");
+            dest_table.short_name (packet->from));
 
   if (addPeer (packet->from))
     {
@@ -386,20 +420,19 @@ RelayWorker::peerListRequestV5 (const sp_comm_pkt &packet)
   peer_list.count = good_peers.size ();
 
   for (const auto &peer : good_peers)
-    {
-      i2p::data::IdentityEx identity;
-      identity.FromBase64 (peer->ToBase64 ());
-      peer_list.data.push_back (identity);
-    }
+    peer_list.data.push_back (*peer);
 
   ResponsePacket response;
   memcpy (response.cid, packet->cid, 32);
   response.status = StatusCode::OK;
-  response.data = peer_list.toByte ();
+  auto list_bytes = peer_list.toByte ();
+  if (!list_bytes)
+    return;
+
+  response.data = std::move (*list_bytes);
   response.length = response.data.size ();
-  auto data = response.toByte ();
 
-  context.send (PacketForQueue (packet->from, data.data (), data.size ()));
+  context.send (packet->from, response.toByte (), eSendResponse);
   LogPrint (eLogInfo, "Relay: peerListRequestV5: Send response with ",
             peer_list.count, " peer(s)");
 }
@@ -419,44 +452,48 @@ RelayWorker::peerListRequestPacket ()
 }
 
 void
-RelayWorker::run ()
+RelayWorker::run_round ()
 {
-  /// To prevent too quick start
-  std::this_thread::sleep_for (std::chrono::seconds(15));
-  bool task_status = false;
+  if (!started_)
+    return;
 
-  while (started_)
-    {
-      set_start_time ();
+  set_start_time ();
 
-      if (!m_peers_.empty ())
-        task_status = check_peers ();
-      else
-        LogPrint (eLogError, "Relay: No peers for start");
+  if (getPeersCount () == 0)
+    {
+      LogPrint (eLogError, "Relay: No peers for start");
+      finish_round (false);
+      return;
+    }
 
-      set_finish_time ();
+  auto batch = send_check ();
 
-      auto delay = get_delay (task_status);
-      LogPrint (eLogDebug, "Relay: Wait for ", (delay.count () / 60), " min.");
+  packet::async_wait (batch, batch_comm_packet::all (), RELAY_CHECK_TIMEOUT,
+    [this, batch] (bool)
+    {
+      context.removeBatch (batch);
+      finish_round (started_ && check_peers (batch));
+    });
+}
 
-      std::unique_lock<std::mutex> lk (m_check_mutex_);
-      auto status = m_check_round.wait_for (lk, std::chrono::seconds(delay));
+void
+RelayWorker::finish_round (bool task_status)
+{
+  set_finish_time ();
 
-      if (status == std::cv_status::no_timeout)
-        LogPrint (eLogDebug, "Relay: Got notification");
+  if (!started_)
+    return;
 
-      if (status == std::cv_status::timeout)
-        LogPrint (eLogDebug, "Relay: Waiting finished");
+  auto delay = get_delay (task_status);
+  LogPrint (eLogDebug, "Relay: Wait for ", (delay.count () / 60), " min.");
 
-      lk.unlock ();
-    }
+  packet::async_sleep (delay.count (), [this] () { run_round (); });
 }
 
-bool
-RelayWorker::check_peers ()
+std::shared_ptr<batch_comm_packet>
+RelayWorker::send_check ()
 {
   LogPrint (eLogDebug, "Relay: Start new round");
-  size_t reachable_peers = 0;
 
   auto batch = std::make_shared<batch_comm_packet> ();
   batch->owner = "relay::main";
@@ -470,16 +507,23 @@ RelayWorker::check_peers ()
 
       auto packet = peerListRequestPacket ();
       auto bytes = packet.toByte ();
-      PacketForQueue q_packet (peer->ToBase64 (), bytes.data (), bytes.size ());
-      std::vector<uint8_t> vcid (std::begin (packet.cid), std::end (packet.cid));
-      batch->addPacket (vcid, q_packet);
+      if (!bytes)
+        continue;
+
+      batch->addPacket (packet.cid, util::make_pooled<PacketForQueue> (
+                                        peer->handle (), std::move (*bytes)));
     }
 
   LogPrint (eLogDebug, "Relay: Batch size: ", batch->packetCount ());
-  context.send (batch);
-  batch->waitLast (RELAY_CHECK_TIMEOUT);
-  context.removeBatch (batch);
+  context.send (batch, eSendRelay);
 
+  return batch;
+}
+
+bool
+RelayWorker::check_peers (const std::shared_ptr<batch_comm_packet> &batch)
+{
+  size_t reachable_peers = 0;
   auto responses = batch->getResponses ();
 
   if (responses.empty ())
@@ -487,8 +531,8 @@ RelayWorker::check_peers ()
       LogPrint (eLogWarning, "Relay: No responses");
       /// Rollback samples, if have no responses at all
       /// Usually in network error case
-      for (const auto &peer : m_peers_)
-        peer.second->rollback ();
+      for (const auto &peer : getAllPeers ())
+        peer->rollback ();
 
       return false;
     }
@@ -515,14 +559,12 @@ RelayWorker::check_peers ()
         }
 
       /// Increment peer metric back, if we have valid Response Packet
-      for (const auto &m_peer : m_peers_)
+      auto responder = findPeer (dest_table.hash (response->from));
+      if (responder)
         {
-          if (m_peer.second->ToBase64 () == response->from)
-            {
-              LogPrint (eLogDebug, "Relay: Got response, mark reachable");
-              m_peer.second->reachable (true);
-              reachable_peers++;
-            }
+          LogPrint (eLogDebug, "Relay: Got response, mark reachable");
+          responder->reachable (true);
+          reachable_peers++;
         }
 
       if (res_packet.status != StatusCode::OK)
@@ -532,6 +574,13 @@ RelayWorker::check_peers ()
           continue;
         }
 
+      /// Need type[1] + ver[1] of peer list
+      if (res_packet.data.size () < 2)
+        {
+          LogPrint (eLogWarning, "Relay: Response without peer list");
+          continue;
+        }
+
       if (unsigned (res_packet.data[1]) == 5)
         {
           PeerListPacketV5 peer_list;
@@ -567,20 +616,19 @@ RelayWorker::check_peers ()
 
   LogPrint (eLogDebug, "Relay: Reachable peers: ", reachable_peers);
 
-  context.removeBatch (batch);
-
   size_t removed = 0;
-  for (auto peer : m_peers_)
+  /// Snapshot, peer list handlers add peers from IO service threads
+  for (const auto &peer : getAllPeers ())
     {
-      long peer_ls = peer.second->last_seen ();
+      long peer_ls = peer->last_seen ();
       long sec_now = context.ts_now ();
       if (((sec_now - peer_ls) > ONE_DAY_SECONDS) &&
-          peer.second->samples () == 0)
+          peer->samples () == 0)
         {
           //m_peers_.erase (peer.first);
           removed++;
           LogPrint (eLogDebug, "Relay: Remove unseen peer: ",
-                    peer.second->short_str ());
+                    peer->short_str ());
         }
     }
 
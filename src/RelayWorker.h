@@ -9,12 +9,14 @@
 #ifndef PBOTED_SRC_RELAY_WORKER_H_
 #define PBOTED_SRC_RELAY_WORKER_H_
 
+#include <atomic>
 #include <iostream>
 #include <random>
 #include <string>
 #include <thread>
 
 #include "BoteContext.h"
+#include "JournalStore.h"
 
 namespace pbote
 {
@@ -35,6 +37,8 @@ namespace relay
 /// Time in seconds while we wait for responses
 //#define RELAY_CHECK_TIMEOUT (2 * 60)
 #define RELAY_CHECK_TIMEOUT 60
+/// Time in seconds before first round
+#define RELAY_START_DELAY 15
   
 /// Time in minutes between updating peers if no high-reachability
 /// peers are known
@@ -47,8 +51,13 @@ namespace relay
 /// 24*60*60
 #define ONE_DAY_SECONDS 86400
 
-/// Default filename for peers file
+/// Default filename for legacy peers file, read only for migration
 #define PEER_FILE_NAME "peers.txt"
+/// Default filename for peers database
+#define PEER_DB_FILE_NAME "peers.dat"
+
+/// samples[4] + last_seen[8]
+#define PEER_RECORD_STATS_LEN 12
 
 class RelayPeer : public i2p::data::IdentityEx
 {
@@ -74,6 +83,11 @@ public:
     this->FromBuffer (buf, len);
   }
 
+  RelayPeer (const i2p::data::IdentityEx &identity, size_t samples)
+      : i2p::data::IdentityEx (identity), samples_ (samples)
+  {
+  }
+
   ~RelayPeer () = default;
 
   /*size_t fromBase64(const std::string &new_destination) {
@@ -117,6 +131,17 @@ public:
     return samples_;
   }
 
+  /// Interned destination for outgoing packets, pinned in table
+  dest_handle
+  handle () const
+  {
+    dest_handle pinned = pin_.get ();
+    if (pinned != DEST_HANDLE_NONE)
+      return pinned;
+
+    return pin_.bind (dest_table.intern (*this));
+  }
+
   std::string
   str ()
   {
@@ -129,6 +154,43 @@ public:
     return this->GetIdentHash ().ToBase64 () + " " + std::to_string (samples_);
   }
 
+  /// Serialize stats and identity for peers database
+  std::vector<uint8_t>
+  to_record () const
+  {
+    size_t ident_len = GetFullLen ();
+    std::vector<uint8_t> record (PEER_RECORD_STATS_LEN + ident_len);
+
+    uint32_t v_samples = samples_;
+    int64_t v_lastseen = lastseen;
+
+    memcpy (record.data (), &v_samples, 4);
+    memcpy (record.data () + 4, &v_lastseen, 8);
+    ToBuffer (record.data () + PEER_RECORD_STATS_LEN, ident_len);
+
+    return record;
+  }
+
+  bool
+  from_record (const uint8_t *buf, size_t len)
+  {
+    if (len <= PEER_RECORD_STATS_LEN)
+      return false;
+
+    if (!FromBuffer (buf + PEER_RECORD_STATS_LEN, len - PEER_RECORD_STATS_LEN))
+      return false;
+
+    uint32_t v_samples;
+    int64_t v_lastseen;
+    memcpy (&v_samples, buf, 4);
+    memcpy (&v_lastseen, buf + 4, 8);
+
+    samples_ = v_samples;
+    lastseen = v_lastseen;
+
+    return true;
+  }
+
   long
   last_seen ()
   {
@@ -144,6 +206,7 @@ public:
 private:
   size_t samples_;
   long lastseen = 0;
+  mutable DestPin pin_;
 };
 
 using sp_peer = std::shared_ptr<RelayPeer>;
@@ -156,11 +219,14 @@ public:
   RelayWorker ();
   ~RelayWorker ();
 
+  /// Load peers, enough for handling of requests
+  void init ();
   void start ();
   void stop ();
 
   bool addPeer (const uint8_t *buf, int len);
   bool addPeer (const std::string &peer);
+  bool addPeer (dest_handle peer);
   bool addPeer (const sp_i2p_ident &identity, int samples);
   void addPeers (const std::vector<sp_peer> &peers);
   void addPeers (const PeerListPacketV4 &peer_list);
@@ -183,19 +249,20 @@ public:
   static PeerListRequestPacket peerListRequestPacket ();
 
 private:
-  void run ();
-  bool check_peers ();
+  void run_round ();
+  void finish_round (bool task_status);
+  std::shared_ptr<batch_comm_packet> send_check ();
+  bool check_peers (const std::shared_ptr<batch_comm_packet> &batch);
 
   void set_start_time ();
   void set_finish_time ();
   std::chrono::seconds get_delay (bool exec_status);
 
-  bool started_;
-  std::thread *m_worker_thread_;
+  std::atomic<bool> started_;
 
-  mutable std::mutex m_peers_mutex_, m_check_mutex_;
-  std::condition_variable m_check_round;
+  mutable std::mutex m_peers_mutex_;
   std::map<hash_key, sp_peer> m_peers_;
+  pbote::fs::JournalStore m_peer_db_;
 
   unsigned long exec_start_t, exec_finish_t;
 };
@@ -6,6 +6,7 @@
  * See full license text in LICENSE file at top of project tree
  */
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <cstring>
 #include <fcntl.h>
@@ -16,6 +17,7 @@
 
 #include "BoteContext.h"
 #include "Logging.h"
+#include "Reactor.h"
 #include "SMTP.h"
 
 namespace bote
@@ -26,7 +28,10 @@ namespace smtp
 SMTP::SMTP (const std::string &address, int port)
   : started (false),
     processing (false),
-    smtp_thread (nullptr),
+    write_pending (false),
+    closing (false),
+    data_pending (false),
+    session_timer (-1),
     server_sockfd (-1),
     client_sockfd (-1),
     sin_size (0),
@@ -57,11 +62,6 @@ SMTP::SMTP (const std::string &address, int port)
 SMTP::~SMTP ()
 {
   stop ();
-
-  smtp_thread->join ();
-
-  delete smtp_thread;
-  smtp_thread = nullptr;
 }
 
 void
@@ -85,48 +85,51 @@ SMTP::start ()
       LogPrint (eLogError, "SMTP: Listen error: ", strerror (errno));
     }
 
-  started = true;
-  smtp_thread = new std::thread ([this] { run (); });
+  started = pbote::network::reactor.add (server_sockfd, EPOLLIN,
+                                         [this] (uint32_t) { accept_client (); });
+
+  if (started)
+    LogPrint (eLogInfo, "SMTP: Started");
 }
 
 void
 SMTP::stop ()
 {
+  if (!started)
+    return;
+
   started = false;
+
+  if (processing)
+    finish ();
+
+  pbote::network::reactor.remove (server_sockfd);
   close (server_sockfd);
 
   LogPrint (eLogInfo, "SMTP: Stopped");
 }
 
 void
-SMTP::run ()
+SMTP::accept_client ()
 {
-  LogPrint (eLogInfo, "SMTP: Started");
   sin_size = sizeof (client_addr);
+  client_sockfd = accept4 (server_sockfd, (struct sockaddr *)&client_addr,
+                           &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
 
-  while (started)
+  if (client_sockfd == -1)
     {
-      client_sockfd =
-        accept (server_sockfd, (struct sockaddr *)&client_addr, &sin_size);
-
-      if (client_sockfd == -1)
+      if (errno != EWOULDBLOCK && errno != EAGAIN)
         {
-          if (errno != EWOULDBLOCK && errno != EAGAIN)
-            {
-              // ToDo: add error handling
-              LogPrint (eLogError, "SMTP: Accept error: ", strerror (errno));
-            }
-
-          std::this_thread::sleep_for (std::chrono::milliseconds (SMTP_WAIT_TIMEOUT));
-        }
-      else
-        {
-          LogPrint (eLogInfo, "SMTP: Received connection from ",
-                    inet_ntoa (client_addr.sin_addr));
-
-          handle ();
+          // ToDo: add error handling
+          LogPrint (eLogError, "SMTP: Accept error: ", strerror (errno));
         }
+      return;
     }
+
+  LogPrint (eLogInfo, "SMTP: Received connection from ",
+            inet_ntoa (client_addr.sin_addr));
+
+  handle ();
 }
 
 void
@@ -135,49 +138,84 @@ SMTP::handle ()
   LogPrint (eLogDebug, "SMTPsession: New session");
 
   processing = true;
-  process ();
+  write_pending = false;
+  closing = false;
+  out_buf.clear ();
+  data_pending = false;
+
+  /// One session at a time, next client waits in listen backlog
+  pbote::network::reactor.modify (server_sockfd, 0);
+  pbote::network::reactor.add (client_sockfd, EPOLLIN,
+                               [this] (uint32_t events)
+                                 {
+                                   if (events & EPOLLOUT)
+                                     flush ();
+                                   else
+                                     receive ();
+                                 });
+  session_timer = pbote::network::reactor.add_timer (
+      SMTP_SESSION_TIMEOUT, [this] ()
+        {
+          LogPrint (eLogWarning, "SMTPsession: Session timed out");
+          finish ();
+        });
+
+  reply (reply_2XX[CODE_220]);
+  session_state = STATE_INIT;
 }
 
 void
 SMTP::finish ()
 {
+  if (!processing)
+    return;
+
   LogPrint (eLogDebug, "SMTPsession: Finish session");
 
   processing = false;
+  out_buf.clear ();
+  pbote::network::reactor.remove_timer (session_timer);
+  session_timer = -1;
+  pbote::network::reactor.remove (client_sockfd);
   close (client_sockfd);
 
+  if (started)
+    pbote::network::reactor.modify (server_sockfd, EPOLLIN);
+
   LogPrint (eLogInfo, "SMTPsession: Socket closed");
 }
 
 void
-SMTP::process ()
+SMTP::receive ()
 {
-  reply (reply_2XX[CODE_220]);
-  session_state = STATE_INIT;
-
-  while (processing)
+  ssize_t len = recv (client_sockfd, buf, sizeof (buf) - 1, MSG_DONTWAIT);
+  if (len > 0)
     {
-      memset (buf, 0, sizeof (buf));
-      ssize_t len = recv (client_sockfd, buf, sizeof (buf), 0);
-      if (len > 0)
-        {
-          std::string str_buf (buf);
-          LogPrint (eLogDebug, "SMTPsession: Request stream: ",
-                    str_buf.substr (0, str_buf.size () - 2));
-          respond (buf);
-        }
-      else if (len == 0)
-        continue;
-      else
+      buf[len] = 0;
+      pbote::network::reactor.rearm_timer (session_timer, SMTP_SESSION_TIMEOUT);
+
+      if (data_pending)
         {
-          /// The server exit permanently
-          // ToDo: add error handling
-          LogPrint (eLogError, "SMTPsession: Can't recieve data, exit");
-          processing = false;
+          receive_data (len);
+          return;
         }
-    }
 
-  finish ();
+      std::string str_buf (buf);
+      LogPrint (eLogDebug, "SMTPsession: Request stream: ",
+                str_buf.substr (0, str_buf.size () - 2));
+      respond (buf);
+    }
+  else if (len == 0)
+    {
+      LogPrint (eLogDebug, "SMTPsession: Client closed connection");
+      finish ();
+    }
+  else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      // ToDo: add error handling
+      LogPrint (eLogError, "SMTPsession: Can't recieve data, exit");
+      finish ();
+    }
 }
 
 void
@@ -245,15 +283,58 @@ SMTP::respond (char *request)
 void
 SMTP::reply (const char *data)
 {
-  if (!data)
+  if (!data || !processing)
     return;
 
-  send (client_sockfd, data, strlen (data), 0);
-
   std::string str_data (data);
-  str_data = str_data.substr (0, str_data.size () - 2);
+  out_buf.append (str_data);
 
+  str_data = str_data.substr (0, str_data.size () - 2);
   LogPrint (eLogDebug, "SMTPsession: reply: Reply stream: ", str_data);
+
+  if (!write_pending)
+    flush ();
+}
+
+void
+SMTP::flush ()
+{
+  while (!out_buf.empty ())
+    {
+      ssize_t sent = send (client_sockfd, out_buf.data (), out_buf.size (),
+                           MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (sent == -1)
+        {
+          if (errno == EINTR)
+            continue;
+
+          if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+              if (!write_pending)
+                pbote::network::reactor.modify (client_sockfd, EPOLLOUT);
+              write_pending = true;
+              return;
+            }
+
+          LogPrint (eLogError, "SMTPsession: Can't send data, exit");
+          finish ();
+          return;
+        }
+
+      out_buf.erase (0, (size_t)sent);
+    }
+
+  if (closing)
+    {
+      finish ();
+      return;
+    }
+
+  if (write_pending)
+    {
+      write_pending = false;
+      pbote::network::reactor.modify (client_sockfd, EPOLLIN);
+    }
 }
 
 /// SMTP
@@ -422,25 +503,90 @@ SMTP::DATA ()
 
   reply (reply_3XX[CODE_354]);
 
-  memset (buf, 0, sizeof (buf));
+  /// Content comes with next readable events
+  mail_data.clear ();
+  data_pending = true;
+}
 
-  ssize_t recv_len = recv (client_sockfd, buf, sizeof (buf), 0);
-  if (recv_len == -1)
+void
+SMTP::receive_data (ssize_t recv_len)
+{
+  /// End mark can be split between chunks
+  size_t search_from = mail_data.size () > SMTP_DATA_END_LEN
+                           ? mail_data.size () - SMTP_DATA_END_LEN
+                           : 0;
+  mail_data.insert (mail_data.end (), buf, buf + recv_len);
+
+  const char *end_mark = SMTP_DATA_END;
+  size_t content_len = 0, rest = 0;
+
+  /// Empty content, end mark without leading <CRLF>
+  if (mail_data.size () >= SMTP_DATA_END_LEN - 2
+      && memcmp (mail_data.data (), end_mark + 2, SMTP_DATA_END_LEN - 2) == 0)
     {
-      LogPrint (eLogError, "SMTPsession: DATA: Receive: ", strerror (errno));
-      reply (reply_4XX[CODE_451]);
-      return;
+      rest = SMTP_DATA_END_LEN - 2;
+    }
+  else
+    {
+      auto found = std::search (mail_data.begin () + search_from,
+                                mail_data.end (), end_mark,
+                                end_mark + SMTP_DATA_END_LEN);
+      if (found == mail_data.end ())
+        {
+          if (mail_data.size () > BUF_SIZE)
+            {
+              LogPrint (eLogWarning, "SMTPsession: DATA: Mail is too big: ",
+                        mail_data.size ());
+              data_pending = false;
+              mail_data.clear ();
+              closing = true;
+              reply (reply_5XX[CODE_552]);
+            }
+          return;
+        }
+
+      /// Last <CRLF> belongs to content
+      content_len = found - mail_data.begin () + 2;
+      rest = content_len + SMTP_DATA_END_LEN - 2;
     }
 
-  LogPrint (eLogDebug, "SMTPsession: DATA: Mail content:\n", buf);
+  data_pending = false;
+
+  /// Remove leading dot of lines, RFC 5321 4.5.2
+  std::vector<uint8_t> content;
+  content.reserve (content_len);
+  for (size_t i = 0; i < content_len; i++)
+    {
+      bool line_start = i == 0
+                        || (mail_data[i - 1] == '\n' && i > 1
+                            && mail_data[i - 2] == '\r');
+      if (line_start && mail_data[i] == '.')
+        continue;
+
+      content.push_back (mail_data[i]);
+    }
 
-  std::vector<uint8_t> mail_data (buf, buf + recv_len);
-  mail.fromMIME (mail_data);
+  /// Client could send next command right after content
+  std::string next_command (mail_data.begin () + rest, mail_data.end ());
+  mail_data.clear ();
+
+  LogPrint (eLogDebug, "SMTPsession: DATA: Mail content, size: ",
+            content.size ());
+
+  mail.fromMIME (content);
   mail.save ("outbox");
 
   session_state = STATE_DATA;
 
   reply (reply_2XX[CODE_250]);
+
+  if (!next_command.empty () && processing)
+    {
+      size_t len = std::min (next_command.size (), sizeof (buf) - 1);
+      memcpy (buf, next_command.data (), len);
+      buf[len] = 0;
+      respond (buf);
+    }
 }
 
 void
@@ -466,8 +612,9 @@ void
 SMTP::QUIT ()
 {
   session_state = STATE_QUIT;
+  /// Session is finished when client got the reply
+  closing = true;
   reply (reply_2XX[CODE_221]);
-  finish ();
 }
 
 /// Extension
@@ -25,9 +25,12 @@ namespace smtp
 #define MAX_CLIENTS 5
 #define MAX_RCPT_USR 1
 #define BUF_SIZE 10485760 // 10MB
-// Timeout in milliseconds
-#define SMTP_WAIT_TIMEOUT 200
+// Idle session timeout in milliseconds, RFC 5321 4.5.3.2.7
+#define SMTP_SESSION_TIMEOUT 300000
 #define SMTP_COMMAND_LEN 4
+/// Mail content ends with <CRLF>.<CRLF>, RFC 5321 4.1.1.4
+#define SMTP_DATA_END "\r\n.\r\n"
+#define SMTP_DATA_END_LEN 5
 
 const char reply_info[][100]
     = { { "250-pboted.i2p is pleased to meet you\n" },
@@ -136,14 +139,18 @@ public:
   void stop ();
 
 private:
-  void run ();
+  /// Called on reactor thread
+  void accept_client ();
+  void receive ();
 
   void handle ();
-  void process ();
   void finish ();
+  void receive_data (ssize_t len);
 
   void respond (char *request);
+  /// Queues data for client, what socket doesn't take now waits for EPOLLOUT
   void reply (const char *data);
+  void flush ();
 
   /// SMTP https://datatracker.ietf.org/doc/html/rfc5321#section-4.5.1
   void HELO ();
@@ -166,7 +173,13 @@ private:
   void cmd_to_upper(char *request, int len = SMTP_COMMAND_LEN);
 
   bool started, processing;
-  std::thread *smtp_thread;
+  /// Reply is waiting for EPOLLOUT, client input is paused meanwhile
+  bool write_pending;
+  /// Session ends when reply is written, after QUIT
+  bool closing;
+  /// Received chunks are mail content after DATA command
+  bool data_pending;
+  int session_timer;
 
   int server_sockfd, client_sockfd;
   socklen_t sin_size;
@@ -175,6 +188,9 @@ private:
   /// Session
   int session_state;
   char buf[BUF_SIZE];
+  std::string out_buf;
+  /// Mail content collected until end mark
+  std::vector<uint8_t> mail_data;
 
   int rcpt_user_num;
   char from_user[512];
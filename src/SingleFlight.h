@@ -0,0 +1,138 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_SINGLE_FLIGHT_H_
+#define PBOTED_SRC_SINGLE_FLIGHT_H_
+
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace pbote {
+namespace util {
+
+/**
+ * @brief Coalesces concurrent calls with the same key into one
+ *
+ * First caller for a key runs the task, callers which come while it's
+ * in flight wait and get the same result. Result is not cached after
+ * the task finished, next call starts new task.
+ */
+template<typename Key, typename Result>
+class SingleFlight {
+ public:
+  /**
+   * @brief Run task or join the one already running for the key
+   *
+   * @param key Operation key
+   * @param task Task to run if there is no call in flight
+   * @param joined Set to true if result was shared from other caller
+   * @return Result of task
+   */
+  Result run(const Key &key, const std::function<Result()> &task,
+             bool *joined = nullptr) {
+    std::unique_lock<std::mutex> l(m_FlightsMutex);
+    auto it = m_Flights.find(key);
+    if (it != m_Flights.end()) {
+      auto flight = it->second;
+      l.unlock();
+      if (joined)
+        *joined = true;
+      return flight.get();
+    }
+
+    std::promise<Result> promise;
+    m_Flights.emplace(key, promise.get_future().share());
+    l.unlock();
+
+    if (joined)
+      *joined = false;
+
+    try {
+      Result result = task();
+      finish(key);
+      promise.set_value(result);
+      return result;
+    } catch (...) {
+      finish(key);
+      promise.set_exception(std::current_exception());
+      throw;
+    }
+  }
+
+  using handler_type = std::function<void(Result)>;
+
+  /**
+   * @brief Continuation version of run
+   *
+   * Task gets handler which it must call once with result. Callers
+   * which come while task is in flight get the same result through own
+   * handlers, in the thread which finished the task.
+   *
+   * @param key Operation key
+   * @param task Task to start if there is no call in flight
+   * @param handler Gets result
+   * @return true if caller joined task already in flight
+   */
+  bool run_async(const Key &key,
+                 const std::function<void(handler_type)> &task,
+                 handler_type handler) {
+    {
+      std::unique_lock<std::mutex> l(m_FlightsMutex);
+      auto it = m_Waiters.find(key);
+      if (it != m_Waiters.end()) {
+        it->second.push_back(std::move(handler));
+        return true;
+      }
+
+      m_Waiters[key].push_back(std::move(handler));
+    }
+
+    task([this, key](Result result) {
+      std::vector<handler_type> waiters;
+      {
+        std::unique_lock<std::mutex> l(m_FlightsMutex);
+        auto it = m_Waiters.find(key);
+        if (it != m_Waiters.end()) {
+          waiters.swap(it->second);
+          m_Waiters.erase(it);
+        }
+      }
+
+      for (const auto &waiter : waiters)
+        waiter(result);
+    });
+
+    return false;
+  }
+
+  size_t InFlight() const {
+    std::unique_lock<std::mutex> l(m_FlightsMutex);
+    return m_Flights.size() + m_Waiters.size();
+  }
+
+ private:
+  void finish(const Key &key) {
+    std::unique_lock<std::mutex> l(m_FlightsMutex);
+    m_Flights.erase(key);
+  }
+
+  mutable std::mutex m_FlightsMutex;
+  std::map<Key, std::shared_future<Result>> m_Flights;
+  /// Handlers of callers of run_async, by key of task in flight
+  std::map<Key, std::vector<handler_type>> m_Waiters;
+};
+
+} // namespace util
+} // namespace pbote
+
+#endif // PBOTED_SRC_SINGLE_FLIGHT_H_
@@ -0,0 +1,417 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <unordered_map>
+
+#include "BoteContext.h"
+#include "BufferPool.h"
+#include "ByteStream.h"
+#include "Logging.h"
+#include "Trace.h"
+
+namespace pbote
+{
+namespace network
+{
+
+TraceRecorder trace_recorder;
+TraceReplayer trace_replayer;
+
+/// kind[1] time[8] handle[4] length[4]
+#define TRACE_DATAGRAM_HEADER_LEN 17
+/// kind[1] handle[4] length[2]
+#define TRACE_DEST_HEADER_LEN 7
+
+TraceRecorder::TraceRecorder ()
+  : m_enabled (false), m_file (nullptr), m_records (0)
+{
+}
+
+TraceRecorder::~TraceRecorder ()
+{
+  close ();
+}
+
+bool
+TraceRecorder::open (const std::string &path)
+{
+  close ();
+
+  std::unique_lock<std::mutex> l (m_mutex);
+  m_file = fopen (path.c_str (), "wb");
+  if (!m_file)
+    {
+      LogPrint (eLogError, "Trace: Can't open ", path, ": ", strerror (errno));
+      return false;
+    }
+
+  m_buffer.clear ();
+  m_buffer.reserve (TRACE_BUFFER_SIZE);
+  m_buffer.insert (m_buffer.end (), TRACE_MAGIC, TRACE_MAGIC + 4);
+  m_buffer.push_back (TRACE_VERSION);
+
+  m_known.clear ();
+  m_records = 0;
+  m_start = std::chrono::steady_clock::now ();
+  m_enabled = true;
+
+  LogPrint (eLogInfo, "Trace: Recording datagrams to ", path);
+  return true;
+}
+
+void
+TraceRecorder::close ()
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+  if (!m_file)
+    return;
+
+  m_enabled = false;
+  flush ();
+  fclose (m_file);
+  m_file = nullptr;
+
+  LogPrint (eLogInfo, "Trace: Recorded ", m_records, " datagrams");
+}
+
+void
+TraceRecorder::record (uint8_t kind, dest_handle destination,
+                       const uint8_t *data, size_t len)
+{
+  if (!enabled ())
+    return;
+
+  std::unique_lock<std::mutex> l (m_mutex);
+  if (!m_file)
+    return;
+
+  /// Taken under lock, so records of all threads are in time order
+  uint64_t time = std::chrono::duration_cast<std::chrono::microseconds> (
+                      std::chrono::steady_clock::now () - m_start)
+                      .count ();
+
+  /// Destination is written once, next records refer to it by handle
+  if (m_known.insert (destination).second)
+    {
+      std::string base64 = dest_table.base64 (destination);
+      size_t offset = m_buffer.size ();
+      m_buffer.resize (offset + TRACE_DEST_HEADER_LEN + base64.size ());
+
+      ByteWriter writer (m_buffer.data () + offset,
+                         m_buffer.size () - offset);
+      writer.u8 (TRACE_RECORD_DEST);
+      writer.u32 (destination);
+      writer.u16 (static_cast<uint16_t> (base64.size ()));
+      writer.bytes ((const uint8_t *)base64.data (), base64.size ());
+    }
+
+  size_t offset = m_buffer.size ();
+  m_buffer.resize (offset + TRACE_DATAGRAM_HEADER_LEN + len);
+
+  ByteWriter writer (m_buffer.data () + offset, m_buffer.size () - offset);
+  writer.u8 (kind);
+  writer.u32 (static_cast<uint32_t> (time >> 32));
+  writer.u32 (static_cast<uint32_t> (time));
+  writer.u32 (destination);
+  writer.u32 (static_cast<uint32_t> (len));
+  writer.bytes (data, len);
+
+  m_records++;
+
+  if (m_buffer.size () >= TRACE_BUFFER_SIZE)
+    flush ();
+}
+
+void
+TraceRecorder::flush ()
+{
+  if (m_buffer.empty ())
+    return;
+
+  if (fwrite (m_buffer.data (), 1, m_buffer.size (), m_file)
+      != m_buffer.size ())
+    {
+      LogPrint (eLogError, "Trace: Write failed, recording stopped: ",
+                strerror (errno));
+      m_enabled = false;
+    }
+
+  m_buffer.clear ();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+TraceReplayer::TraceReplayer ()
+  : m_running (false), m_speed (0), m_sent (0), m_handled (0),
+    m_replay_thread (nullptr), m_drain_thread (nullptr)
+{
+}
+
+TraceReplayer::~TraceReplayer ()
+{
+  stop ();
+}
+
+bool
+TraceReplayer::start (const std::string &path, double speed)
+{
+  if (m_running)
+    return true;
+
+  /// Whole trace is loaded first, so disk reads are not measured
+  std::ifstream f (path, std::ios::binary);
+  if (!f.is_open ())
+    {
+      LogPrint (eLogError, "Trace: Can't open ", path);
+      return false;
+    }
+
+  m_trace.assign (std::istreambuf_iterator<char> (f),
+                  std::istreambuf_iterator<char> ());
+
+  if (m_trace.size () < 5 || memcmp (m_trace.data (), TRACE_MAGIC, 4) != 0
+      || m_trace[4] != TRACE_VERSION)
+    {
+      LogPrint (eLogError, "Trace: Not a trace file or unknown version: ",
+                path);
+      m_trace.clear ();
+      return false;
+    }
+
+  m_speed = speed > 0 ? speed : 0;
+  m_sent = 0;
+  m_handled = 0;
+  {
+    std::unique_lock<std::mutex> l (m_latency_mutex);
+    m_latency.clear ();
+  }
+  m_running = true;
+
+  LogPrint (eLogInfo, "Trace: Replaying ", path, ", speed: ",
+            m_speed > 0 ? std::to_string (m_speed) : "max");
+
+  m_drain_thread
+      = std::make_unique<std::thread> ([this] { drain (); });
+  m_replay_thread
+      = std::make_unique<std::thread> ([this] { run (); });
+
+  return true;
+}
+
+void
+TraceReplayer::stop ()
+{
+  if (!m_running && !m_replay_thread)
+    return;
+
+  m_running = false;
+
+  if (m_replay_thread)
+    {
+      m_replay_thread->join ();
+      m_replay_thread = nullptr;
+    }
+
+  if (m_drain_thread)
+    {
+      m_drain_thread->join ();
+      m_drain_thread = nullptr;
+    }
+
+  m_trace.clear ();
+  LogPrint (eLogInfo, "Trace: Replay stopped");
+}
+
+void
+TraceReplayer::run ()
+{
+  auto recv_queue = context.getRecvQueue ();
+  ByteReader reader (m_trace.data () + 5, m_trace.size () - 5);
+  /// Handles from recording mapped to handles of this run
+  std::unordered_map<uint32_t, dest_handle> handles;
+
+  uint64_t inbound = 0, outbound = 0, first_time = 0;
+  bool first = true;
+  auto started = std::chrono::steady_clock::now ();
+
+  while (m_running && reader.remaining () > 0)
+    {
+      uint8_t kind = 0;
+      uint32_t handle = 0;
+      reader.u8 (kind);
+
+      if (kind == TRACE_RECORD_DEST)
+        {
+          uint16_t len = 0;
+          reader.u32 (handle);
+          reader.u16 (len);
+          const uint8_t *base64 = reader.take (len);
+          if (!base64)
+            break;
+
+          handles[handle]
+              = dest_table.intern (std::string_view ((const char *)base64, len));
+          continue;
+        }
+
+      uint32_t time_high = 0, time_low = 0, len = 0;
+      reader.u32 (time_high);
+      reader.u32 (time_low);
+      reader.u32 (handle);
+      reader.u32 (len);
+      const uint8_t *payload = reader.take (len);
+      if (!payload)
+        break;
+
+      if (kind == TRACE_RECORD_OUT)
+        {
+          outbound++;
+          continue;
+        }
+
+      if (kind != TRACE_RECORD_IN)
+        {
+          LogPrint (eLogError, "Trace: Unknown record type: ", (int)kind);
+          break;
+        }
+
+      auto destination = handles.find (handle);
+      if (destination == handles.end ()
+          || destination->second == DEST_HANDLE_NONE)
+        continue;
+
+      uint64_t time = ((uint64_t)time_high << 32) | time_low;
+      if (first)
+        {
+          first_time = time;
+          first = false;
+        }
+
+      if (m_speed > 0)
+        {
+          auto offset = std::chrono::microseconds (
+              (int64_t)((time - first_time) / m_speed));
+          std::this_thread::sleep_until (started + offset);
+        }
+
+      /// Recorded datagrams must not be dropped by full queue
+      while (m_running && recv_queue->GetSize () >= TRACE_REPLAY_BACKLOG)
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+      auto packet = util::make_pooled<PacketForQueue> (destination->second,
+                                                       payload, (size_t)len);
+      packet->queued_at = std::chrono::steady_clock::now ();
+      recv_queue->Put (std::move (packet));
+      inbound++;
+    }
+
+  if (!reader.ok ())
+    LogPrint (eLogWarning, "Trace: Trace is truncated");
+
+  settle (inbound);
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds> (
+                     std::chrono::steady_clock::now () - started)
+                     .count ();
+
+  LogPrint (eLogInfo, "Trace: Replayed ", inbound, " datagrams in ", elapsed,
+            " ms, ", elapsed > 0 ? inbound * 1000 / elapsed : inbound,
+            " datagrams/s");
+  LogPrint (eLogInfo, "Trace: Outbound datagrams recorded: ", outbound,
+            ", produced by replay: ", m_sent.load ());
+  report_latency ();
+}
+
+void
+TraceReplayer::handled (std::chrono::steady_clock::time_point queued_at)
+{
+  if (queued_at == std::chrono::steady_clock::time_point ())
+    return;
+
+  auto latency = std::chrono::duration_cast<std::chrono::microseconds> (
+                     std::chrono::steady_clock::now () - queued_at)
+                     .count ();
+
+  {
+    std::unique_lock<std::mutex> l (m_latency_mutex);
+    m_latency.push_back (static_cast<uint32_t> (
+        std::min<int64_t> (latency, UINT32_MAX)));
+  }
+
+  m_handled++;
+}
+
+void
+TraceReplayer::settle (uint64_t count)
+{
+  uint64_t last = m_handled;
+  auto progress = std::chrono::steady_clock::now ();
+
+  while (m_running && m_handled < count)
+    {
+      std::this_thread::sleep_for (std::chrono::milliseconds (1));
+
+      auto now = std::chrono::steady_clock::now ();
+      if (m_handled != last)
+        {
+          last = m_handled;
+          progress = now;
+        }
+      else if (now - progress
+               > std::chrono::milliseconds (TRACE_REPLAY_SETTLE_TIMEOUT))
+        {
+          LogPrint (eLogWarning, "Trace: Handlers of ", count - last,
+                    " datagrams didn't finish");
+          return;
+        }
+    }
+}
+
+void
+TraceReplayer::report_latency ()
+{
+  std::vector<uint32_t> latency;
+  {
+    std::unique_lock<std::mutex> l (m_latency_mutex);
+    latency.swap (m_latency);
+  }
+
+  if (latency.empty ())
+    return;
+
+  std::sort (latency.begin (), latency.end ());
+  auto percentile = [&latency] (double p)
+    { return latency[(size_t)(p * (latency.size () - 1))]; };
+
+  LogPrint (eLogInfo, "Trace: Handler latency, usec: p50: ", percentile (0.5),
+            ", p90: ", percentile (0.9), ", p99: ", percentile (0.99),
+            ", max: ", latency.back (), ", datagrams: ", latency.size ());
+}
+
+void
+TraceReplayer::drain ()
+{
+  auto send_queue = context.getSendQueue ();
+  std::vector<sp_queue_pkt> packets;
+
+  while (m_running)
+    {
+      packets.clear ();
+      size_t taken = send_queue->GetBatch (packets, TRACE_REPLAY_DRAIN_BATCH,
+                                           TRACE_REPLAY_DRAIN_TIMEOUT);
+      m_sent += taken;
+    }
+}
+
+} // namespace network
+} // namespace pbote
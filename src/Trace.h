@@ -0,0 +1,153 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_TRACE_H_
+#define PBOTED_SRC_TRACE_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "DestinationTable.h"
+
+namespace pbote
+{
+namespace network
+{
+
+/**
+ * Trace file is "PBTR" magic, version byte and records, all integers are
+ * in network byte order:
+ *
+ *   'D' handle[4] length[2] destination       first use of destination
+ *   'I' time[8] handle[4] length[4] payload   received datagram
+ *   'O' time[8] handle[4] length[4] payload   sent datagram
+ *
+ * Time is in microseconds from start of recording.
+ */
+#define TRACE_MAGIC "PBTR"
+#define TRACE_VERSION 1
+
+#define TRACE_RECORD_DEST 'D'
+#define TRACE_RECORD_IN 'I'
+#define TRACE_RECORD_OUT 'O'
+
+/// Records are written to file when buffer grows over 1 MiB
+#define TRACE_BUFFER_SIZE (1024 * 1024)
+/// Replay waits while inbound queue has more packets
+#define TRACE_REPLAY_BACKLOG 1024
+/// Timeout in msec for draining of outbound queue during replay
+#define TRACE_REPLAY_DRAIN_TIMEOUT 100
+/// Max packets dropped from outbound queue per wakeup
+#define TRACE_REPLAY_DRAIN_BATCH 64
+/// Msec without finished handlers after which replay stops waiting
+#define TRACE_REPLAY_SETTLE_TIMEOUT 5000
+
+/**
+ * @brief Writes received and sent datagrams to trace file
+ *
+ * Disabled recorder costs one atomic load per datagram. Records are
+ * collected in memory and written by whoever fills the buffer.
+ */
+class TraceRecorder
+{
+public:
+  TraceRecorder ();
+  ~TraceRecorder ();
+
+  bool open (const std::string &path);
+  void close ();
+
+  bool
+  enabled () const
+  {
+    return m_enabled.load (std::memory_order_relaxed);
+  }
+
+  /// Kind is TRACE_RECORD_IN or TRACE_RECORD_OUT
+  void record (uint8_t kind, dest_handle destination, const uint8_t *data,
+               size_t len);
+
+private:
+  void flush ();
+
+  std::atomic<bool> m_enabled;
+  std::mutex m_mutex;
+  FILE *m_file;
+  std::vector<uint8_t> m_buffer;
+  std::unordered_set<dest_handle> m_known;
+  std::chrono::steady_clock::time_point m_start;
+  uint64_t m_records;
+};
+
+/**
+ * @brief Feeds recorded inbound datagrams to packet handlers
+ *
+ * Used instead of network worker, so nothing is sent to I2P: packets
+ * queued for send are counted and dropped. With speed 0 datagrams are
+ * replayed as fast as handlers take them, otherwise with recorded
+ * intervals divided by speed.
+ *
+ * Latency of every datagram is measured from queueing to the end of
+ * its handler and reported as percentiles when replay is finished.
+ */
+class TraceReplayer
+{
+public:
+  TraceReplayer ();
+  ~TraceReplayer ();
+
+  bool start (const std::string &path, double speed);
+  void stop ();
+
+  bool
+  running () const
+  {
+    return m_running;
+  }
+
+  /**
+   * @brief Called when handling of datagram is finished
+   *
+   * @param queued_at Time datagram was queued, not replayed if empty
+   */
+  void handled (std::chrono::steady_clock::time_point queued_at);
+
+private:
+  void run ();
+  void drain ();
+  /// Wait for handlers of count datagrams
+  void settle (uint64_t count);
+  void report_latency ();
+
+  std::atomic<bool> m_running;
+  std::vector<uint8_t> m_trace;
+  double m_speed;
+  std::atomic<uint64_t> m_sent;
+  std::atomic<uint64_t> m_handled;
+  std::mutex m_latency_mutex;
+  /// Handler latency in usec of every replayed datagram
+  std::vector<uint32_t> m_latency;
+  std::unique_ptr<std::thread> m_replay_thread;
+  std::unique_ptr<std::thread> m_drain_thread;
+};
+
+extern TraceRecorder trace_recorder;
+extern TraceReplayer trace_replayer;
+
+} // namespace network
+} // namespace pbote
+
+#endif // PBOTED_SRC_TRACE_H_
@@ -0,0 +1,128 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#include <algorithm>
+#include <exception>
+
+#include "Logging.h"
+#include "WorkerPool.h"
+
+namespace pbote
+{
+namespace util
+{
+
+WorkerPool::WorkerPool () : m_running (false) {}
+
+WorkerPool::~WorkerPool ()
+{
+  stop ();
+}
+
+void
+WorkerPool::start (size_t threads)
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+  if (m_running)
+    return;
+
+  if (threads == 0)
+    threads = std::max (1U, std::thread::hardware_concurrency ());
+  if (threads > WORKER_POOL_THREADS_MAX)
+    threads = WORKER_POOL_THREADS_MAX;
+
+  m_running = true;
+  for (size_t i = 0; i < threads; i++)
+    m_threads.emplace_back ([this] { run (); });
+}
+
+void
+WorkerPool::stop ()
+{
+  {
+    std::unique_lock<std::mutex> l (m_mutex);
+    if (!m_running)
+      return;
+
+    m_running = false;
+  }
+
+  m_not_empty.notify_all ();
+  m_not_full.notify_all ();
+
+  for (auto &thread : m_threads)
+    thread.join ();
+
+  m_threads.clear ();
+}
+
+bool
+WorkerPool::push (std::function<void ()> task)
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+  m_not_full.wait (l, [this] {
+    return !m_running || m_tasks.size () < WORKER_POOL_QUEUE_SIZE;
+  });
+
+  if (!m_running)
+    return false;
+
+  m_tasks.push_back (std::move (task));
+  l.unlock ();
+
+  m_not_empty.notify_one ();
+  return true;
+}
+
+bool
+WorkerPool::try_post (std::function<void ()> task)
+{
+  std::unique_lock<std::mutex> l (m_mutex);
+  if (!m_running || m_tasks.size () >= WORKER_POOL_QUEUE_SIZE)
+    return false;
+
+  m_tasks.push_back (std::move (task));
+  l.unlock ();
+
+  m_not_empty.notify_one ();
+  return true;
+}
+
+void
+WorkerPool::run ()
+{
+  while (true)
+    {
+      std::function<void ()> task;
+      {
+        std::unique_lock<std::mutex> l (m_mutex);
+        m_not_empty.wait (l, [this] { return !m_running || !m_tasks.empty (); });
+
+        /// Queued tasks are finished even on stop, somebody waits for them
+        if (m_tasks.empty ())
+          return;
+
+        task = std::move (m_tasks.front ());
+        m_tasks.pop_front ();
+      }
+
+      m_not_full.notify_one ();
+
+      try
+        {
+          task ();
+        }
+      catch (std::exception &ex)
+        {
+          LogPrint (eLogError, "WorkerPool: Task exception: ", ex.what ());
+        }
+    }
+}
+
+} // namespace util
+} // namespace pbote
@@ -0,0 +1,99 @@
+/**
+ * Copyright (C) 2019-2022, polistern
+ *
+ * This file is part of pboted and licensed under BSD3
+ *
+ * See full license text in LICENSE file at top of project tree
+ */
+
+#ifndef PBOTED_SRC_WORKER_POOL_H_
+#define PBOTED_SRC_WORKER_POOL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace pbote
+{
+namespace util
+{
+
+/// Tasks waiting for worker, submit blocks when there are more
+#define WORKER_POOL_QUEUE_SIZE 256
+/// Upper limit for number of workers
+#define WORKER_POOL_THREADS_MAX 64
+
+/**
+ * @brief Fixed set of threads for CPU-bound tasks
+ *
+ * For work like email encryption which would hold packet handler or
+ * task thread for long. Queue is bounded, so fast producer waits for
+ * workers instead of piling up decrypted data in memory. If pool is not
+ * started, task runs in caller thread.
+ */
+class WorkerPool
+{
+public:
+  WorkerPool ();
+  ~WorkerPool ();
+
+  /// 0 threads - one per CPU core
+  void start (size_t threads);
+  /// Runs tasks which are already queued, then joins workers
+  void stop ();
+
+  template <typename F>
+  std::future<typename std::result_of<F ()>::type>
+  submit (F &&func)
+  {
+    using result_type = typename std::result_of<F ()>::type;
+
+    auto task = std::make_shared<std::packaged_task<result_type ()> > (
+        std::forward<F> (func));
+    auto result = task->get_future ();
+
+    if (!push ([task] { (*task) (); }))
+      (*task) ();
+
+    return result;
+  }
+
+  /**
+   * @brief Queue task without waiting for free place
+   *
+   * For callers which must not block, like handlers on storage strand.
+   * @return false if queue is full or pool is not running
+   */
+  bool try_post (std::function<void ()> task);
+
+  size_t
+  threads () const
+  {
+    return m_threads.size ();
+  }
+
+private:
+  /// False if pool is not running and task was not queued
+  bool push (std::function<void ()> task);
+  void run ();
+
+  std::mutex m_mutex;
+  std::condition_variable m_not_empty;
+  std::condition_variable m_not_full;
+  std::deque<std::function<void ()> > m_tasks;
+  std::vector<std::thread> m_threads;
+  bool m_running;
+};
+
+} // namespace util
+} // namespace pbote
+
+#endif // PBOTED_SRC_WORKER_POOL_H_